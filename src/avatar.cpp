@@ -1,3 +1,4 @@
+#include "avatar.h"
 #include "string_format.h"
 #include <chrono>
 #include <gtest/gtest.h>
@@ -7,22 +8,6 @@
 namespace avatar
 {
 
-const int PORTRAIT_CROP_PERCENTAGE = 30;
-
-class AvatarGenerator
-{
-  public:
-    AvatarGenerator(cv::Mat image);
-    const cv::Mat &transformImage(int size);
-
-  private:
-    void crop();
-    void circle();
-    void resize(int size);
-
-    cv::Mat mat_;
-};
-
 AvatarGenerator::AvatarGenerator(cv::Mat image) : mat_(std::move(image))
 {
     if (mat_.channels() == 3)
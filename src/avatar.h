@@ -0,0 +1,27 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+namespace avatar
+{
+
+const int PORTRAIT_CROP_PERCENTAGE = 30;
+
+// Turns a photo into a round avatar: crops it square (portraits keep their top),
+// fades the outside of a circle to transparent and scales it down. Takes 3 or 4
+// channel 8-bit images and returns CV_8UC4.
+class AvatarGenerator
+{
+  public:
+    AvatarGenerator(cv::Mat image);
+    const cv::Mat &transformImage(int size);
+
+  private:
+    void crop();
+    void circle();
+    void resize(int size);
+
+    cv::Mat mat_;
+};
+
+} // namespace avatar
@@ -0,0 +1,447 @@
+#include "config_store.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+#include <unordered_set>
+
+namespace config
+{
+
+static const char SNAPSHOT_MAGIC[8] = {'H', 'U', 'N', 'T', 'C', 'F', 'G', '\0'};
+static const uint32_t SNAPSHOT_VERSION = 2;
+static const uint32_t ENDIAN_MARK = 0x01020304; // a snapshot from another architecture does not match
+
+namespace
+{
+
+// A string in the strings section, or a run of those in the lists section
+struct Span
+{
+    uint32_t offset;
+    uint32_t size;
+};
+
+uint32_t hashId(std::string_view id)
+{
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (unsigned char c : id)
+    {
+        hash = (hash ^ c) * 16777619u;
+    }
+    return hash;
+}
+
+template <typename T> T read(const char *data)
+{
+    T value;
+    std::memcpy(&value, data, sizeof(T));
+    return value;
+}
+
+template <typename T> void append(std::string &out, const T *values, size_t count)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "written as it is in memory");
+    out.append(reinterpret_cast<const char *>(values), count * sizeof(T));
+}
+
+} // namespace
+
+struct ConfigStore::Stamp
+{
+    uint64_t size = 0;
+    int64_t time = 0; // modification, in nanoseconds
+    uint64_t inode = 0;
+    int64_t change = 0; // status change, in nanoseconds: an edit that keeps the size and the mtime still moves it
+
+    static Stamp of(const struct stat &status)
+    {
+        Stamp stamp;
+        stamp.size = uint64_t(status.st_size);
+        stamp.inode = uint64_t(status.st_ino);
+#ifdef __APPLE__
+        stamp.time = int64_t(status.st_mtimespec.tv_sec) * 1000000000 + status.st_mtimespec.tv_nsec;
+        stamp.change = int64_t(status.st_ctimespec.tv_sec) * 1000000000 + status.st_ctimespec.tv_nsec;
+#else
+        stamp.time = int64_t(status.st_mtim.tv_sec) * 1000000000 + status.st_mtim.tv_nsec;
+        stamp.change = int64_t(status.st_ctim.tv_sec) * 1000000000 + status.st_ctim.tv_nsec;
+#endif
+        return stamp;
+    }
+
+    bool operator==(const Stamp &other) const
+    {
+        return size == other.size && time == other.time && inode == other.inode && change == other.change;
+    }
+};
+
+struct ConfigStore::Header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    Stamp source;
+    uint32_t entries;
+    uint32_t tableSize; // slots, a power of two; each holds a record index + 1, 0 when empty
+    uint32_t table;     // offsets of the sections from the start
+    uint32_t records;
+    uint32_t lists;
+    uint32_t listCount;
+    uint32_t strings;
+    uint32_t total;
+};
+
+struct ConfigStore::Record
+{
+    Span id;
+    Span primaryServer;
+    Span searchBase;
+    Span username;
+    Span password;
+    Span filter;
+    Span attributes; // runs in the lists section
+    Span secondaryServers;
+    Span filters;
+    uint32_t useSsl;
+};
+
+std::shared_ptr<const ConfigStore> ConfigStore::open(const std::string &path)
+{
+    return open(path, path + ".bin");
+}
+
+std::shared_ptr<const ConfigStore> ConfigStore::open(const std::string &path, const std::string &snapshot, bool parse)
+{
+    // Stamped before parsing: a YAML changed meanwhile leaves a stale stamp, and
+    // the next start parses again
+    std::shared_ptr<ConfigStore> store(new ConfigStore());
+    struct stat status;
+    Stamp source;
+    if (stat(path.c_str(), &status) == 0)
+    {
+        source = Stamp::of(status);
+        if (!parse && !snapshot.empty() && store->map(snapshot, source))
+        {
+            return store;
+        }
+    }
+
+    YAML::Node doc = YAML::LoadFile(path);
+    std::vector<ServiceConfig> configs;
+    std::unordered_set<std::string> seen;
+    for (const auto &node : doc)
+    {
+        if (!node["id"])
+        {
+            continue;
+        }
+        ServiceConfig config = node.as<ServiceConfig>();
+        if (seen.insert(config.id).second)
+        {
+            configs.push_back(std::move(config));
+        }
+    }
+    store->mOwned = serialize(configs, source);
+    store->adopt(store->mOwned.data(), store->mOwned.size(), source);
+
+    // Renamed over the old one, so a start that has it mapped keeps reading it.
+    // It holds the passwords, so only the owner may read it.
+    if (!snapshot.empty())
+    {
+        std::string temporary = snapshot + "." + std::to_string(getpid()) + ".tmp";
+        std::remove(temporary.c_str()); // left by a crashed process of the same pid
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd >= 0)
+        {
+            const char *data = store->mOwned.data();
+            size_t left = store->mOwned.size();
+            while (left > 0)
+            {
+                ssize_t count = ::write(fd, data, left);
+                if (count < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (count <= 0)
+                {
+                    break;
+                }
+                data += count;
+                left -= size_t(count);
+            }
+            bool written = close(fd) == 0 && left == 0;
+            if (!written || std::rename(temporary.c_str(), snapshot.c_str()) != 0)
+            {
+                std::remove(temporary.c_str());
+            }
+        }
+    }
+    return store;
+}
+
+ConfigStore::~ConfigStore()
+{
+    if (mMap)
+    {
+        munmap(mMap, mMapSize);
+    }
+}
+
+std::string ConfigStore::serialize(const std::vector<ServiceConfig> &configs, const Stamp &source)
+{
+    std::string strings;
+    std::vector<Span> lists;
+    std::vector<Record> records;
+    auto string = [&strings](const std::string &value) {
+        Span span{uint32_t(strings.size()), uint32_t(value.size())};
+        strings += value;
+        return span;
+    };
+    auto run = [&lists, &string](const std::vector<std::string> &values) {
+        Span span{uint32_t(lists.size()), uint32_t(values.size())};
+        for (const std::string &value : values)
+        {
+            lists.push_back(string(value));
+        }
+        return span;
+    };
+    for (const ServiceConfig &config : configs)
+    {
+        Record record;
+        record.id = string(config.id);
+        record.primaryServer = string(config.ldap.mPrimaryServer);
+        record.searchBase = string(config.ldap.mSearchBase);
+        record.username = string(config.ldap.mUsername);
+        record.password = string(config.ldap.mPassword);
+        record.filter = string(config.ldap.mFilter);
+        record.attributes = run(config.ldap.mAttributes);
+        record.secondaryServers = run(config.ldap.mSecondaryServers);
+        record.filters = run(config.filters);
+        record.useSsl = config.ldap.mUseSSL;
+        records.push_back(record);
+    }
+
+    // At most half full, so probes stay short
+    uint32_t tableSize = 1;
+    while (tableSize < 2 * records.size())
+    {
+        tableSize *= 2;
+    }
+    std::vector<uint32_t> table(tableSize, 0);
+    for (uint32_t i = 0; i < records.size(); ++i)
+    {
+        uint32_t slot = hashId(configs[i].id) & (tableSize - 1);
+        while (table[slot])
+        {
+            slot = (slot + 1) & (tableSize - 1);
+        }
+        table[slot] = i + 1;
+    }
+
+    Header header{};
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = ENDIAN_MARK;
+    header.source = source;
+    header.entries = uint32_t(records.size());
+    header.tableSize = tableSize;
+    uint64_t tableAt = sizeof(Header);
+    uint64_t recordsAt = tableAt + uint64_t(tableSize) * sizeof(uint32_t);
+    uint64_t listsAt = recordsAt + records.size() * sizeof(Record);
+    uint64_t stringsAt = listsAt + lists.size() * sizeof(Span);
+    uint64_t total = stringsAt + strings.size();
+    if (total > UINT32_MAX)
+    {
+        throw std::length_error("config too large for a snapshot");
+    }
+    header.table = uint32_t(tableAt);
+    header.records = uint32_t(recordsAt);
+    header.lists = uint32_t(listsAt);
+    header.listCount = uint32_t(lists.size());
+    header.strings = uint32_t(stringsAt);
+    header.total = uint32_t(total);
+
+    std::string data;
+    data.reserve(total);
+    append(data, &header, 1);
+    append(data, table.data(), table.size());
+    append(data, records.data(), records.size());
+    append(data, lists.data(), lists.size());
+    data += strings;
+    return data;
+}
+
+bool ConfigStore::map(const std::string &snapshot, const Stamp &source)
+{
+    int fd = ::open(snapshot.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat status;
+    void *mapping = MAP_FAILED;
+    size_t size = 0;
+    if (fstat(fd, &status) == 0 && status.st_size > 0)
+    {
+        size = size_t(status.st_size);
+        mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        return false;
+    }
+    if (!adopt(static_cast<const char *>(mapping), size, source))
+    {
+        munmap(mapping, size);
+        return false;
+    }
+    mMap = mapping;
+    mMapSize = size;
+    return true;
+}
+
+bool ConfigStore::adopt(const char *data, size_t size, const Stamp &source)
+{
+    if (size < sizeof(Header))
+    {
+        return false;
+    }
+    Header header = read<Header>(data);
+    if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version != SNAPSHOT_VERSION ||
+        header.byteOrder != ENDIAN_MARK || !(header.source == source) ||
+        header.total != size)
+    {
+        return false;
+    }
+    uint64_t tableEnd = uint64_t(header.table) + uint64_t(header.tableSize) * sizeof(uint32_t);
+    uint64_t recordsEnd = uint64_t(header.records) + uint64_t(header.entries) * sizeof(Record);
+    uint64_t listsEnd = uint64_t(header.lists) + uint64_t(header.listCount) * sizeof(Span);
+    if (header.tableSize == 0 || (header.tableSize & (header.tableSize - 1)) != 0 || header.tableSize <= header.entries ||
+        header.table < sizeof(Header) || tableEnd > header.records || recordsEnd > header.lists ||
+        listsEnd > header.strings || header.strings > size)
+    {
+        return false;
+    }
+
+    uint64_t stringsSize = size - header.strings;
+    auto inStrings = [stringsSize](Span span) { return uint64_t(span.offset) + span.size <= stringsSize; };
+    auto inLists = [&header](Span span) { return uint64_t(span.offset) + span.size <= header.listCount; };
+    for (uint32_t i = 0; i < header.tableSize; ++i)
+    {
+        if (read<uint32_t>(data + header.table + i * sizeof(uint32_t)) > header.entries)
+        {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < header.entries; ++i)
+    {
+        Record r = read<Record>(data + header.records + i * sizeof(Record));
+        if (!inStrings(r.id) || !inStrings(r.primaryServer) || !inStrings(r.searchBase) || !inStrings(r.username) ||
+            !inStrings(r.password) || !inStrings(r.filter) || !inLists(r.attributes) || !inLists(r.secondaryServers) ||
+            !inLists(r.filters))
+        {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < header.listCount; ++i)
+    {
+        if (!inStrings(read<Span>(data + header.lists + i * sizeof(Span))))
+        {
+            return false;
+        }
+    }
+
+    mData = data;
+    mSize = size;
+    mEntries = header.entries;
+    mTableSize = header.tableSize;
+    mTable = header.table;
+    mRecords = header.records;
+    mLists = header.lists;
+    mListCount = header.listCount;
+    mStrings = header.strings;
+    return true;
+}
+
+ConfigStore::Record ConfigStore::record(uint32_t index) const
+{
+    return read<Record>(mData + mRecords + index * sizeof(Record));
+}
+
+std::string_view ConfigStore::text(uint32_t offset, uint32_t size) const
+{
+    return std::string_view(mData + mStrings + offset, size);
+}
+
+std::vector<std::string> ConfigStore::list(uint32_t first, uint32_t count) const
+{
+    std::vector<std::string> values;
+    values.reserve(count);
+    for (uint32_t i = first; i < first + count; ++i)
+    {
+        Span span = read<Span>(mData + mLists + i * sizeof(Span));
+        values.emplace_back(text(span.offset, span.size));
+    }
+    return values;
+}
+
+ServiceConfig ConfigStore::decode(const Record &record) const
+{
+    ServiceConfig config;
+    config.id = std::string(text(record.id.offset, record.id.size));
+    config.ldap.mPrimaryServer = std::string(text(record.primaryServer.offset, record.primaryServer.size));
+    config.ldap.mSearchBase = std::string(text(record.searchBase.offset, record.searchBase.size));
+    config.ldap.mUsername = std::string(text(record.username.offset, record.username.size));
+    config.ldap.mPassword = std::string(text(record.password.offset, record.password.size));
+    config.ldap.mFilter = std::string(text(record.filter.offset, record.filter.size));
+    config.ldap.mAttributes = list(record.attributes.offset, record.attributes.size);
+    config.ldap.mUseSSL = record.useSsl != 0;
+    config.ldap.mSecondaryServers = list(record.secondaryServers.offset, record.secondaryServers.size);
+    config.filters = list(record.filters.offset, record.filters.size);
+    return config;
+}
+
+std::optional<ServiceConfig> ConfigStore::find(std::string_view id) const
+{
+    uint32_t mask = mTableSize - 1;
+    uint32_t slot = hashId(id) & mask;
+    for (uint32_t probes = 0; probes < mTableSize; ++probes, slot = (slot + 1) & mask)
+    {
+        uint32_t index = read<uint32_t>(mData + mTable + slot * sizeof(uint32_t));
+        if (index == 0)
+        {
+            break;
+        }
+        Record r = record(index - 1);
+        if (text(r.id.offset, r.id.size) == id)
+        {
+            return decode(r);
+        }
+    }
+    return std::nullopt;
+}
+
+std::vector<std::string> ConfigStore::ids() const
+{
+    std::vector<std::string> ids;
+    ids.reserve(mEntries);
+    for (uint32_t i = 0; i < mEntries; ++i)
+    {
+        Record r = record(i);
+        ids.emplace_back(text(r.id.offset, r.id.size));
+    }
+    return ids;
+}
+
+size_t ConfigStore::size() const
+{
+    return mEntries;
+}
+
+} // namespace config
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "../ldap/ldap_config.h"
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace config
+{
+
+// One entry of hunter.yaml
+struct ServiceConfig
+{
+    std::string id;
+    LdapConfiguration ldap;
+    std::vector<std::string> filters; // "Filters", the searches a test runs
+};
+
+// The entries of a YAML config, by id. The YAML is parsed once into
+// ServiceConfigs and laid out as a binary snapshot: a header, a hash table of
+// ids, fixed-size records, and the strings they point into. The snapshot is
+// written next to the YAML, readable by its owner only, and later starts map it
+// instead of parsing as long as the YAML keeps the size, inode, modification
+// and status change times it was written from.
+// find() hashes the id into the table and decodes that one record, so a start
+// costs a mapping and a pass over the records however large the config is.
+//
+//     auto store = config::ConfigStore::open("./data/hunter.yaml");
+//     LdapConfiguration ldap = store->find("ldap.config")->ldap;
+class ConfigStore
+{
+  public:
+    // Maps snapshot when it was written from path as it is now, and otherwise
+    // parses path and rewrites snapshot for the next start; no snapshot is
+    // written when it is empty, or when it cannot be. parse skips the mapping
+    // for a caller that knows the file changed. Of entries sharing an id the
+    // first counts. Throws YAML::Exception for a bad config.
+    static std::shared_ptr<const ConfigStore> open(const std::string &path, const std::string &snapshot,
+                                                   bool parse = false);
+    // With the snapshot at path + ".bin"
+    static std::shared_ptr<const ConfigStore> open(const std::string &path);
+
+    ~ConfigStore();
+    ConfigStore(const ConfigStore &) = delete;
+    ConfigStore &operator=(const ConfigStore &) = delete;
+
+    std::optional<ServiceConfig> find(std::string_view id) const;
+    // In the order of the YAML
+    std::vector<std::string> ids() const;
+    size_t size() const;
+
+    // Whether open() mapped the snapshot rather than parsing the YAML
+    bool fromSnapshot() const { return mMap != nullptr; }
+
+  private:
+    struct Header;
+    struct Record;
+    struct Stamp; // what the YAML was when the snapshot was written
+
+    ConfigStore() = default;
+    static std::string serialize(const std::vector<ServiceConfig> &configs, const Stamp &source);
+    bool map(const std::string &snapshot, const Stamp &source);
+    // Checks the stamp, and that every offset in data stays inside it
+    bool adopt(const char *data, size_t size, const Stamp &source);
+    Record record(uint32_t index) const;
+    ServiceConfig decode(const Record &record) const;
+    std::string_view text(uint32_t offset, uint32_t size) const;
+    std::vector<std::string> list(uint32_t first, uint32_t count) const;
+
+    std::string mOwned; // the snapshot when it was parsed here
+    void *mMap = nullptr;
+    size_t mMapSize = 0;
+    const char *mData = nullptr;
+    size_t mSize = 0;
+    uint32_t mEntries = 0;
+    uint32_t mTableSize = 0;
+    uint32_t mTable = 0; // offsets of the sections
+    uint32_t mRecords = 0;
+    uint32_t mLists = 0;
+    uint32_t mListCount = 0;
+    uint32_t mStrings = 0;
+};
+
+} // namespace config
+
+namespace YAML
+{
+template <> struct convert<config::ServiceConfig>
+{
+    static bool decode(const Node &node, config::ServiceConfig &rhs)
+    {
+        rhs.id = node["id"].as<std::string>();
+        rhs.ldap = node.as<LdapConfiguration>();
+        if (node["Filters"])
+        {
+            rhs.filters = node["Filters"].as<std::vector<std::string>>();
+        }
+        return true;
+    }
+};
+} // namespace YAML
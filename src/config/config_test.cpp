@@ -0,0 +1,231 @@
+#include "config_store.h"
+#include "config_watcher.h"
+#include "gtest/gtest.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <queue>
+#include <sys/stat.h>
+
+namespace config
+{
+
+static void writeFile(const std::string &path, const std::string &text)
+{
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << text;
+}
+
+static std::string service(const std::string &id, const std::string &server,
+                           const std::string &password = "secret")
+{
+    return "- id: " + id + "\n"
+           "  PrimaryServerName: " + server + "\n"
+           "  SecondaryServerNames: [backup1, backup2]\n"
+           "  UseSSL: true\n"
+           "  SearchBase: dc=example,dc=com\n"
+           "  Username: cn=admin,dc=example,dc=com\n"
+           "  Password: " + password + "\n"
+           "  Filter: \"(objectClass=person)\"\n"
+           "  Attributes: [mail, cn]\n";
+}
+
+TEST(config, snapshot)
+{
+    std::string path = testing::TempDir() + "config_snapshot.yaml";
+    std::string snapshot = path + ".bin";
+    std::remove(snapshot.c_str());
+    writeFile(path, service("ldap.a", "a.example.com") + service("ldap.b", "b.example.com") +
+                        service("ldap.a", "shadowed.example.com") + service("ldap.c", "c.example.com") +
+                        "  Filters: [\"(uid=ada)\", \"(uid=alan)\"]\n");
+
+    auto parsed = ConfigStore::open(path);
+    EXPECT_FALSE(parsed->fromSnapshot());
+    EXPECT_EQ((std::vector<std::string>{"ldap.a", "ldap.b", "ldap.c"}), parsed->ids());
+    struct stat status;
+    ASSERT_EQ(0, stat(snapshot.c_str(), &status));
+    EXPECT_EQ(0600u, status.st_mode & 0777u); // it holds the passwords
+
+    auto mapped = ConfigStore::open(path);
+    EXPECT_TRUE(mapped->fromSnapshot());
+    ASSERT_EQ(3u, mapped->size());
+    std::optional<ServiceConfig> a = mapped->find("ldap.a");
+    ASSERT_TRUE(a);
+    EXPECT_EQ("a.example.com", a->ldap.mPrimaryServer); // the first of the same id
+    EXPECT_EQ((std::vector<std::string>{"backup1", "backup2"}), a->ldap.mSecondaryServers);
+    EXPECT_EQ((std::vector<std::string>{"mail", "cn"}), a->ldap.mAttributes);
+    EXPECT_TRUE(a->ldap.mUseSSL);
+    EXPECT_EQ("dc=example,dc=com", a->ldap.mSearchBase);
+    EXPECT_EQ("cn=admin,dc=example,dc=com", a->ldap.mUsername);
+    EXPECT_EQ("secret", a->ldap.mPassword);
+    EXPECT_EQ("(objectClass=person)", a->ldap.mFilter);
+    EXPECT_TRUE(a->filters.empty());
+    EXPECT_EQ((std::vector<std::string>{"(uid=ada)", "(uid=alan)"}), mapped->find("ldap.c")->filters);
+    EXPECT_FALSE(mapped->find("ldap.d"));
+    EXPECT_FALSE(mapped->find(""));
+
+    // A changed YAML is parsed again, while the old snapshot stays mapped
+    writeFile(path, service("ldap.b", "changed.example.com"));
+    auto changed = ConfigStore::open(path);
+    EXPECT_FALSE(changed->fromSnapshot());
+    EXPECT_EQ("changed.example.com", changed->find("ldap.b")->ldap.mPrimaryServer);
+    EXPECT_EQ("b.example.com", mapped->find("ldap.b")->ldap.mPrimaryServer);
+    EXPECT_TRUE(ConfigStore::open(path)->fromSnapshot());
+
+    // So is one whose snapshot is cut short
+    std::string whole;
+    {
+        std::ifstream in(snapshot, std::ios::binary);
+        whole.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    writeFile(snapshot, whole.substr(0, whole.size() - 3));
+    auto repaired = ConfigStore::open(path);
+    EXPECT_FALSE(repaired->fromSnapshot());
+    EXPECT_EQ("changed.example.com", repaired->find("ldap.b")->ldap.mPrimaryServer);
+    EXPECT_TRUE(ConfigStore::open(path)->fromSnapshot());
+
+    std::remove(path.c_str());
+    std::remove(snapshot.c_str());
+}
+
+TEST(config, large)
+{
+    std::string path = testing::TempDir() + "config_large.yaml";
+    std::string snapshot = path + ".bin";
+    std::remove(snapshot.c_str());
+    std::string yaml;
+    for (int i = 0; i < 5000; ++i)
+    {
+        yaml += service("service" + std::to_string(i), "ldap" + std::to_string(i) + ".example.com");
+    }
+    writeFile(path, yaml);
+
+    auto start = std::chrono::steady_clock::now();
+    auto parsed = ConfigStore::open(path);
+    auto parsing = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+    start = std::chrono::steady_clock::now();
+    auto mapped = ConfigStore::open(path);
+    auto mapping = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+    std::cout << "5000 entries: " << parsing.count() << " seconds parsed, " << mapping.count() << " mapped\n";
+
+    ASSERT_TRUE(mapped->fromSnapshot());
+    EXPECT_EQ(5000u, mapped->size());
+    for (int i = 0; i < 5000; i += 7)
+    {
+        std::optional<ServiceConfig> found = mapped->find("service" + std::to_string(i));
+        ASSERT_TRUE(found);
+        EXPECT_EQ("ldap" + std::to_string(i) + ".example.com", found->ldap.mPrimaryServer);
+    }
+    EXPECT_FALSE(mapped->find("service5000"));
+
+    std::remove(path.c_str());
+    std::remove(snapshot.c_str());
+}
+
+TEST(config, diff)
+{
+    std::string path = testing::TempDir() + "config_diff.yaml";
+    writeFile(path, service("ldap.a", "a.example.com") + service("ldap.b", "b.example.com") +
+                        service("ldap.c", "c.example.com"));
+    auto before = ConfigStore::open(path, "");
+    writeFile(path, service("ldap.d", "d.example.com") + service("ldap.b", "b.example.com") +
+                        service("ldap.a", "a2.example.com", "changed"));
+    auto after = ConfigStore::open(path, "");
+    std::remove(path.c_str());
+
+    std::vector<ConfigChange> changes = diffConfigs(*before, *after);
+    ASSERT_EQ(3u, changes.size());
+    EXPECT_EQ("ldap.d", changes[0].id);
+    EXPECT_FALSE(changes[0].before);
+    EXPECT_EQ(9u, changes[0].keys.size());
+    EXPECT_EQ("ldap.a", changes[1].id);
+    EXPECT_EQ((std::vector<std::string>{"PrimaryServerName", "Password"}), changes[1].keys);
+    EXPECT_EQ("a.example.com", changes[1].before->ldap.mPrimaryServer);
+    EXPECT_EQ("a2.example.com", changes[1].after->ldap.mPrimaryServer);
+    EXPECT_EQ("ldap.c", changes[2].id);
+    EXPECT_FALSE(changes[2].after);
+    EXPECT_TRUE(diffConfigs(*after, *after).empty());
+}
+
+TEST(config, watcher)
+{
+    std::string path = testing::TempDir() + "config_watcher.yaml";
+    writeFile(path, service("ldap.a", "a.example.com") + service("ldap.b", "b.example.com"));
+
+    // Handlers run where the test drains the queue, as on an event loop
+    std::mutex mutex;
+    std::condition_variable posted;
+    std::queue<std::function<void()>> loop;
+    ConfigWatcherOptions options;
+    options.settle = std::chrono::milliseconds(20);
+    options.post = [&](std::function<void()> task) {
+        std::lock_guard<std::mutex> lock(mutex);
+        loop.push(std::move(task));
+        posted.notify_one();
+    };
+    auto runPosted = [&] {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!posted.wait_for(lock, std::chrono::seconds(5), [&loop] { return !loop.empty(); }))
+        {
+            return false;
+        }
+        std::function<void()> task = std::move(loop.front());
+        loop.pop();
+        lock.unlock();
+        task();
+        return true;
+    };
+
+    ConfigWatcher watcher(path, options);
+    std::vector<std::string> fired;
+    std::thread::id handlerThread;
+    auto record = [&](const std::string &what) {
+        return [&fired, &handlerThread, what](const ConfigChange &) {
+            fired.push_back(what);
+            handlerThread = std::this_thread::get_id();
+        };
+    };
+    watcher.signal("ldap.a", "Password").connect(record("a.Password"));
+    watcher.signal("ldap.a", "PrimaryServerName").connect(record("a.PrimaryServerName"));
+    watcher.signal("ldap.b", "Password").connect(record("b.Password"));
+    watcher.signal("ldap.b").connect(record("b"));
+    watcher.start();
+
+    writeFile(path, service("ldap.a", "a.example.com", "rotated") + service("ldap.b", "b.example.com"));
+    ASSERT_TRUE(runPosted());
+    EXPECT_EQ(std::vector<std::string>{"a.Password"}, fired);
+    EXPECT_EQ(std::this_thread::get_id(), handlerThread);
+    EXPECT_EQ("rotated", watcher.current()->find("ldap.a")->ldap.mPassword);
+
+    // An edit that keeps the size is seen however soon it follows
+    fired.clear();
+    writeFile(path, service("ldap.a", "a.example.com", "rotate2") + service("ldap.b", "b.example.com"));
+    ASSERT_TRUE(runPosted());
+    EXPECT_EQ(std::vector<std::string>{"a.Password"}, fired);
+    EXPECT_EQ("rotate2", watcher.current()->find("ldap.a")->ldap.mPassword);
+
+    // Replaced the way editors save, by renaming over it
+    fired.clear();
+    writeFile(path + ".new", service("ldap.a", "a.example.com", "rotate2"));
+    ASSERT_EQ(0, std::rename((path + ".new").c_str(), path.c_str()));
+    ASSERT_TRUE(runPosted());
+    EXPECT_EQ((std::vector<std::string>{"b.Password", "b"}), fired); // every key of a removed entry
+
+    // A file that does not parse leaves the config in use
+    writeFile(path, "- id: [broken\n");
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (watcher.stats().errors == 0 && std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(1u, watcher.stats().errors);
+    EXPECT_EQ(1u, watcher.current()->size());
+    watcher.stop();
+    EXPECT_EQ(3u, watcher.stats().changes);
+    std::remove(path.c_str());
+    std::remove((path + ".bin").c_str());
+}
+
+} // namespace config
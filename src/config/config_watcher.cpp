@@ -0,0 +1,245 @@
+#include "config_watcher.h"
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+namespace config
+{
+
+static const std::vector<std::string> &allKeys()
+{
+    static const std::vector<std::string> keys{"PrimaryServerName", "SecondaryServerNames", "UseSSL",
+                                               "SearchBase",        "Username",             "Password",
+                                               "Filter",            "Attributes",           "Filters"};
+    return keys;
+}
+
+static std::vector<std::string> changedKeys(const ServiceConfig &before, const ServiceConfig &after)
+{
+    std::vector<std::string> keys;
+    auto compare = [&keys](bool differ, const char *key) {
+        if (differ)
+        {
+            keys.push_back(key);
+        }
+    };
+    compare(before.ldap.mPrimaryServer != after.ldap.mPrimaryServer, "PrimaryServerName");
+    compare(before.ldap.mSecondaryServers != after.ldap.mSecondaryServers, "SecondaryServerNames");
+    compare(before.ldap.mUseSSL != after.ldap.mUseSSL, "UseSSL");
+    compare(before.ldap.mSearchBase != after.ldap.mSearchBase, "SearchBase");
+    compare(before.ldap.mUsername != after.ldap.mUsername, "Username");
+    compare(before.ldap.mPassword != after.ldap.mPassword, "Password");
+    compare(before.ldap.mFilter != after.ldap.mFilter, "Filter");
+    compare(before.ldap.mAttributes != after.ldap.mAttributes, "Attributes");
+    compare(before.filters != after.filters, "Filters");
+    return keys;
+}
+
+std::vector<ConfigChange> diffConfigs(const ConfigStore &before, const ConfigStore &after)
+{
+    std::vector<ConfigChange> changes;
+    for (const std::string &id : after.ids())
+    {
+        ConfigChange change;
+        change.id = id;
+        change.before = before.find(id);
+        change.after = after.find(id);
+        change.keys = change.before ? changedKeys(*change.before, *change.after) : allKeys();
+        if (!change.keys.empty())
+        {
+            changes.push_back(std::move(change));
+        }
+    }
+    for (const std::string &id : before.ids())
+    {
+        if (!after.find(id))
+        {
+            changes.push_back(ConfigChange{id, allKeys(), before.find(id), std::nullopt});
+        }
+    }
+    return changes;
+}
+
+ConfigWatcher::ConfigWatcher(std::string path, ConfigWatcherOptions options)
+    : mPath(std::move(path)), mOptions(std::move(options)),
+      mSnapshot(mOptions.snapshotPath.empty() ? mPath + ".bin" : mOptions.snapshotPath),
+      mCurrent(ConfigStore::open(mPath, mSnapshot))
+{
+}
+
+ConfigWatcher::~ConfigWatcher()
+{
+    stop();
+}
+
+ConfigWatcher::Signal &ConfigWatcher::signal(const std::string &id, const std::string &key)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    std::unique_ptr<Signal> &signal = mSignals[std::make_pair(id, key)];
+    if (!signal)
+    {
+        signal.reset(new Signal());
+    }
+    return *signal;
+}
+
+ConfigWatcher::Signal *ConfigWatcher::existing(const std::string &id, const std::string &key) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mSignals.find(std::make_pair(id, key));
+    return it == mSignals.end() ? nullptr : it->second.get();
+}
+
+size_t ConfigWatcher::reload(bool parse)
+{
+    std::lock_guard<std::mutex> reloading(mReloading);
+    std::shared_ptr<const ConfigStore> next;
+    try
+    {
+        next = ConfigStore::open(mPath, mSnapshot, parse);
+    }
+    catch (const std::exception &)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        ++mStats.reloads;
+        ++mStats.errors;
+        return 0;
+    }
+
+    std::vector<ConfigChange> changes = diffConfigs(*current(), *next);
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mCurrent = next;
+        ++mStats.reloads;
+        mStats.changes += changes.size();
+    }
+    dispatch(changes);
+    return changes.size();
+}
+
+void ConfigWatcher::dispatch(const std::vector<ConfigChange> &changes)
+{
+    if (changes.empty())
+    {
+        return;
+    }
+    auto batch = std::make_shared<const std::vector<ConfigChange>>(changes);
+    auto fire = [this, batch] {
+        for (const ConfigChange &change : *batch)
+        {
+            for (const std::string &key : change.keys)
+            {
+                if (Signal *signal = existing(change.id, key))
+                {
+                    (*signal)(change);
+                }
+            }
+            if (Signal *signal = existing(change.id, std::string()))
+            {
+                (*signal)(change);
+            }
+        }
+    };
+    if (mOptions.post)
+    {
+        mOptions.post(fire);
+    }
+    else
+    {
+        fire();
+    }
+}
+
+void ConfigWatcher::start()
+{
+    if (mFollower.joinable())
+    {
+        return;
+    }
+    // Watched before start() returns, so no change made after it is missed
+    int watch = -1;
+#ifdef __linux__
+    watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    size_t slash = mPath.rfind('/');
+    std::string directory = slash == std::string::npos ? "." : mPath.substr(0, slash + 1);
+    if (watch >= 0 && inotify_add_watch(watch, directory.c_str(), IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO) < 0)
+    {
+        close(watch);
+        watch = -1;
+    }
+#endif
+    mStopping = false;
+    mFollower = std::thread([this, watch] { follow(watch); });
+}
+
+void ConfigWatcher::stop()
+{
+    mStopping = true;
+    if (mFollower.joinable())
+    {
+        mFollower.join();
+    }
+}
+
+void ConfigWatcher::follow(int watch)
+{
+    if (watch < 0)
+    {
+        auto due = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        while (!mStopping)
+        {
+            std::this_thread::sleep_for(mOptions.settle);
+            if (std::chrono::steady_clock::now() >= due)
+            {
+                reload(false);
+                due = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+            }
+        }
+        return;
+    }
+
+#ifdef __linux__
+    size_t slash = mPath.rfind('/');
+    std::string name = slash == std::string::npos ? mPath : mPath.substr(slash + 1);
+    bool pending = false;
+    alignas(struct inotify_event) char buffer[4096];
+    while (!mStopping)
+    {
+        struct pollfd ready = {watch, POLLIN, 0};
+        if (poll(&ready, 1, int(mOptions.settle.count())) > 0)
+        {
+            ssize_t length = read(watch, buffer, sizeof(buffer));
+            for (ssize_t at = 0; at < length;)
+            {
+                const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(buffer + at);
+                pending = pending || (event->len > 0 && name == event->name);
+                at += sizeof(struct inotify_event) + event->len;
+            }
+            continue;
+        }
+        if (pending)
+        {
+            // Written to, so parsed even when it keeps its size and times
+            pending = false;
+            reload();
+        }
+    }
+    close(watch);
+#endif
+}
+
+std::shared_ptr<const ConfigStore> ConfigWatcher::current() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mCurrent;
+}
+
+ConfigWatcherStats ConfigWatcher::stats() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mStats;
+}
+
+} // namespace config
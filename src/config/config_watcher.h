@@ -0,0 +1,109 @@
+#pragma once
+
+#include "config_store.h"
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <sigslot/signal.hpp>
+#include <thread>
+
+namespace config
+{
+
+// What a reload changed in one entry
+struct ConfigChange
+{
+    std::string id;
+    // The YAML keys whose values differ, e.g. "PrimaryServerName"; every key of
+    // an entry that was added or removed
+    std::vector<std::string> keys;
+    std::optional<ServiceConfig> before; // none when added
+    std::optional<ServiceConfig> after;  // none when removed
+};
+
+// Entries that differ between two versions of a config, in the order of after
+// and then of the removed ones in before
+std::vector<ConfigChange> diffConfigs(const ConfigStore &before, const ConfigStore &after);
+
+struct ConfigWatcherOptions
+{
+    // Empty for path + ".bin"; see ConfigStore::open()
+    std::string snapshotPath;
+    // Editors write a file in several steps, so a reload waits until it has been
+    // quiet this long
+    std::chrono::milliseconds settle{100};
+    // Runs the handlers of one reload, e.g. by queueing them on an event loop.
+    // Without it they run on the thread that reloaded.
+    std::function<void(std::function<void()>)> post;
+};
+
+struct ConfigWatcherStats
+{
+    uint64_t reloads = 0;
+    uint64_t changes = 0; // entries that differed
+    uint64_t errors = 0;  // reloads that could not parse the file; the config in use stays
+};
+
+// Follows a YAML config and tells the parts of a service what changed in it,
+// so that a new server name reconnects the LDAP pool and nothing else.
+// Handlers are connected per entry and key; a reload parses the file again,
+// diffs it against the config in use, and fires the signals of the keys that
+// differ.
+//
+//     ConfigWatcher watcher("./data/hunter.yaml");
+//     watcher.signal("ldap.config", "PrimaryServerName").connect([&](const ConfigChange &change) {
+//         reconnect(change.after->ldap);
+//     });
+//     watcher.start();
+//
+// start() follows the file with inotify, watching its directory so that an
+// editor replacing the file is seen too; without inotify it reloads every
+// second.
+class ConfigWatcher
+{
+  public:
+    using Signal = sigslot::signal<const ConfigChange &>;
+
+    // Loads path, so current() is there from the start. Throws like ConfigStore::open().
+    explicit ConfigWatcher(std::string path, ConfigWatcherOptions options = ConfigWatcherOptions());
+    ~ConfigWatcher(); // stops following
+    ConfigWatcher(const ConfigWatcher &) = delete;
+    ConfigWatcher &operator=(const ConfigWatcher &) = delete;
+
+    // Fires when key changes in the entry id; an empty key fires once for any
+    // change to the entry, including it coming or going. Posted handlers may run
+    // until the watcher is destroyed.
+    Signal &signal(const std::string &id, const std::string &key = std::string());
+
+    // Parses the file on the calling thread and dispatches what changed; returns
+    // how many entries did. Without parse it maps the snapshot when the file
+    // looks as it was, as the once-a-second poll does.
+    size_t reload(bool parse = true);
+    // Follows the file on a background thread until stop()
+    void start();
+    void stop();
+
+    std::shared_ptr<const ConfigStore> current() const;
+    ConfigWatcherStats stats() const;
+
+  private:
+    // inotify descriptor watching the directory, or -1
+    void follow(int watch);
+    Signal *existing(const std::string &id, const std::string &key) const;
+    void dispatch(const std::vector<ConfigChange> &changes);
+
+    const std::string mPath;
+    const ConfigWatcherOptions mOptions;
+    const std::string mSnapshot;
+    mutable std::mutex mMutex;
+    std::shared_ptr<const ConfigStore> mCurrent;
+    std::map<std::pair<std::string, std::string>, std::unique_ptr<Signal>> mSignals;
+    ConfigWatcherStats mStats;
+    std::mutex mReloading; // one reload at a time, so each diffs against the last
+    std::atomic<bool> mStopping{false};
+    std::thread mFollower;
+};
+
+} // namespace config
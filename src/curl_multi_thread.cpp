@@ -6,6 +6,8 @@
 #include <thread>
 #include "curl/curl.h"
 #include "gtest/gtest.h"
+#include "http/http_engine.h"
+#include "http/transfer_metrics.h"
 #include "string_format.h"
 
 static size_t WriteCallback(void *contents, size_t size, size_t nmemb, void *stream)
@@ -15,7 +17,7 @@ static size_t WriteCallback(void *contents, size_t size, size_t nmemb, void *str
 }
 
 struct myprogress {
-    double lastruntime;
+    http::ProgressThrottle throttle;
     CURL *curl;
 };
 
@@ -24,7 +26,9 @@ static int xferinfo(void *p,
                     curl_off_t ultotal, curl_off_t ulnow)
 {
     struct myprogress *myp = (struct myprogress *)p;
-    CURL *curl = myp->curl;
+    if (!myp->throttle.shouldReport(dlnow, dltotal)) {
+        return 0;
+    }
 
     fprintf(stderr, "UP: %" CURL_FORMAT_CURL_OFF_T " of %" CURL_FORMAT_CURL_OFF_T
             "  DOWN: %" CURL_FORMAT_CURL_OFF_T " of %" CURL_FORMAT_CURL_OFF_T
@@ -42,10 +46,12 @@ void curl_thread_simple(){
     const char* url = "http://downloads.bbc.co.uk/learningenglish/features/6min/170427_6min_engl_miraculous_survival_download.mp3";
     FILE* file = fopen(filename, "wb");
     myprogress prog;
+    http::TransferMetrics metrics;
 
     std::unique_ptr<CURL, void(*)(CURL*)> eh_ptr(curl_easy_init(), curl_easy_cleanup);
     if (eh_ptr) {
         CURL* eh = eh_ptr.get();
+        prog.curl = eh;
         curl_easy_setopt(eh, CURLOPT_URL, url);
         curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, WriteCallback);
         curl_easy_setopt(eh, CURLOPT_WRITEDATA, file);
@@ -55,6 +61,7 @@ void curl_thread_simple(){
         curl_easy_setopt(eh, CURLOPT_XFERINFODATA, &prog);
         CURLcode res = curl_easy_perform(eh);
         fclose(file);
+        metrics.record(eh, res);
 
         int httpCode = 0;
         curl_easy_getinfo(eh, CURLINFO_RESPONSE_CODE, &httpCode);
@@ -65,6 +72,12 @@ void curl_thread_simple(){
             remove(filename);
             printf("Failed to download the file: httpCode=%d\n", httpCode);
         }
+
+        http::HostMetrics m = metrics.host(http::hostOf(url));
+        printf("\nDNS: %lldus  connect: %lldus  TTFB: %lldus  total: %lldus  bytes: %llu\n",
+               (long long)m.dns.percentile(50), (long long)m.connect.percentile(50),
+               (long long)m.ttfb.percentile(50), (long long)m.total.percentile(50),
+               (unsigned long long)m.bytesDown);
     }
 }
 
@@ -72,3 +85,25 @@ TEST(curl, thread_simple) {
 	std::thread trd(curl_thread_simple);
 	trd.join();
 }
+
+TEST(curl, engine) {
+    static std::array<const char*, 5> names = {"chaowei", "cheluo", "huiluo", "jizh", "xumei"};
+
+    http::HttpEngineOptions options;
+    options.workers = 4;
+    http::HttpEngine engine(options);
+
+    std::vector<std::future<http::HttpResponse>> futures;
+    for (const char* name : names) {
+        futures.push_back(engine.submit(http::HttpRequest{string_format("http://cmbu-ad.cisco.com/photo/%s.jpg", name)}));
+    }
+
+    for (size_t i = 0; i < futures.size(); ++i) {
+        http::HttpResponse response = futures[i].get();
+        printf("%s: curlCode=%d, httpCode=%ld, %zu bytes\n", names[i], response.curlCode, response.status,
+               response.body.size());
+    }
+
+    http::HostMetrics m = engine.metrics("cmbu-ad.cisco.com");
+    printf("transfers: %llu, p95 total: %lldus\n", (unsigned long long)m.transfers, (long long)m.total.percentile(95));
+}
@@ -1,10 +1,14 @@
 #include <stdio.h>
+#include <algorithm>
 #include <array>
 #include <string>
 #include <memory>
 #include <map>
 #include "curl/curl.h"
 #include "gtest/gtest.h"
+#include "http/http_cache.h"
+#include "http/http_client.h"
+#include "http/negative_cache.h"
 #include "string_format.h"
 
 static size_t WriteCallback(void *contents, size_t size, size_t nmemb, void *stream)
@@ -205,3 +209,52 @@ TEST(curl, multi) {
 
     curl_multi_cleanup(cm);
 }
+
+TEST(curl, client) {
+    http::HedgePolicy hedge;
+    hedge.enabled = true;
+    http::HttpClient client(http::RetryPolicy(), hedge);
+    client.setCache(std::make_shared<http::HttpCache>("./photo_cache"));
+
+    // Most of the numbered variants do not exist; remember the 404s between runs
+    const char* missingFile = "./photo_cache/missing.txt";
+    auto missing = std::make_shared<http::NegativeCache>(std::chrono::hours(24));
+    missing->load(missingFile);
+    client.setNegativeCache(missing);
+
+    std::vector<http::HttpRequest> requests;
+    std::vector<std::string> filenames;
+    for (const char* name : names) {
+        requests.push_back(http::HttpRequest{string_format("http://cmbu-ad.cisco.com/photo/%s.jpg", name)});
+        filenames.push_back(string_format("%s.jpg", name));
+        for (int j = 1; j < 10; ++j) {
+            requests.push_back(http::HttpRequest{string_format("http://cmbu-ad.cisco.com/photo/%s%d.jpg", name, j)});
+            filenames.push_back(string_format("%s%d.jpg", name, j));
+        }
+    }
+
+    std::vector<http::HttpResponse> responses = client.perform(requests);
+    for (size_t i = 0; i < responses.size(); ++i) {
+        const http::HttpResponse& response = responses[i];
+        if (!response.ok()) {
+            if (response.status != 404) {
+                fprintf(stderr, "GET of %s failed after %d attempts: curlCode=%d, httpCode=%ld\n",
+                        requests[i].url.c_str(), response.attempts, response.curlCode, response.status);
+            }
+            continue;
+        }
+
+        FILE* file = fopen(filenames[i].c_str(), "wb");
+        fwrite(response.body.data(), 1, response.body.size(), file);
+        fclose(file);
+    }
+
+    missing->save(missingFile);
+    size_t cached = std::count_if(responses.begin(), responses.end(),
+                                  [](const http::HttpResponse& r) { return r.fromCache; });
+    printf("answered locally: %zu of %zu\n", cached, responses.size());
+
+    const http::HedgeStats& stats = client.hedgeStats();
+    printf("hedges fired: %llu, won: %llu (%.0f%%)\n", (unsigned long long)stats.fired,
+           (unsigned long long)stats.won, stats.winRate() * 100);
+}
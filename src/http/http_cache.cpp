@@ -0,0 +1,248 @@
+#include "http_cache.h"
+#include <atomic>
+#include <boost/filesystem.hpp>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+namespace http
+{
+
+static int64_t unixNow()
+{
+    return int64_t(std::time(nullptr));
+}
+
+// FNV-1a, stable across runs and builds unlike std::hash
+static uint64_t fnv1a(const std::string &text)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : text)
+    {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static bool writeAtomically(const std::string &path, const std::string &content)
+{
+    // Unique per call, several clients may share one cache
+    static std::atomic<uint64_t> sequence{0};
+    std::string temp = path + ".tmp" + std::to_string(sequence++);
+    FILE *file = fopen(temp.c_str(), "wb");
+    if (!file)
+    {
+        return false;
+    }
+
+    bool ok = fwrite(content.data(), 1, content.size(), file) == content.size();
+    ok = (fclose(file) == 0) && ok;
+    if (!ok)
+    {
+        std::remove(temp.c_str());
+        return false;
+    }
+
+    boost::system::error_code ec;
+    boost::filesystem::rename(temp, path, ec);
+    return !ec;
+}
+
+HttpCache::HttpCache(std::string directory) : mDirectory(std::move(directory))
+{
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(mDirectory, ec);
+}
+
+std::string HttpCache::pathOf(const std::string &url, const char *suffix) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx%s", (unsigned long long)fnv1a(url), suffix);
+    return (boost::filesystem::path(mDirectory) / name).string();
+}
+
+std::shared_ptr<const CacheEntry> HttpCache::lookup(const std::string &url)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto iter = mEntries.find(url);
+    if (iter != mEntries.end())
+    {
+        return iter->second;
+    }
+
+    std::shared_ptr<CacheEntry> entry;
+    std::ifstream meta(pathOf(url, ".meta"));
+    std::string line;
+    while (std::getline(meta, line))
+    {
+        size_t space = line.find(' ');
+        std::string key = line.substr(0, space);
+        std::string value = (space == std::string::npos) ? std::string() : line.substr(space + 1);
+        if (!entry)
+        {
+            entry = std::make_shared<CacheEntry>();
+        }
+
+        if (key == "url")
+        {
+            entry->url = value;
+        }
+        else if (key == "etag")
+        {
+            entry->etag = value;
+        }
+        else if (key == "last-modified")
+        {
+            entry->lastModified = value;
+        }
+        else if (key == "stored-at")
+        {
+            entry->storedAt = std::strtoll(value.c_str(), nullptr, 10);
+        }
+        else if (key == "max-age")
+        {
+            entry->maxAge = std::strtoll(value.c_str(), nullptr, 10);
+        }
+    }
+
+    // A different URL with the same hash is treated as a miss
+    if (entry && (entry->url != url || !boost::filesystem::exists(pathOf(url, ".body"))))
+    {
+        entry.reset();
+    }
+
+    // Misses are not remembered: every URL ever asked about would stay in memory,
+    // and asking again costs a failed open
+    if (entry)
+    {
+        mEntries[url] = entry;
+    }
+    return entry;
+}
+
+std::string HttpCache::body(const CacheEntry &entry) const
+{
+    std::ifstream file(pathOf(entry.url, ".body"), std::ios::binary);
+    std::ostringstream content;
+    content << file.rdbuf();
+    return content.str();
+}
+
+void HttpCache::save(const CacheEntry &entry) const
+{
+    std::ostringstream meta;
+    meta << "url " << entry.url << '\n'
+         << "etag " << entry.etag << '\n'
+         << "last-modified " << entry.lastModified << '\n'
+         << "stored-at " << entry.storedAt << '\n'
+         << "max-age " << entry.maxAge << '\n';
+    writeAtomically(pathOf(entry.url, ".meta"), meta.str());
+}
+
+int64_t HttpCache::maxAgeOf(const HttpResponse &response)
+{
+    std::string control = response.header("Cache-Control");
+    for (auto &c : control)
+    {
+        c = char(std::tolower((unsigned char)c));
+    }
+
+    if (control.find("no-store") != std::string::npos)
+    {
+        return -2;
+    }
+    if (control.find("no-cache") != std::string::npos)
+    {
+        return 0;
+    }
+
+    size_t pos = control.find("max-age=");
+    if (pos == std::string::npos)
+    {
+        return -1;
+    }
+
+    int64_t maxAge = std::strtoll(control.c_str() + pos + 8, nullptr, 10);
+    std::string age = response.header("Age");
+    if (!age.empty())
+    {
+        maxAge -= std::strtoll(age.c_str(), nullptr, 10);
+    }
+    return std::max<int64_t>(0, maxAge);
+}
+
+void HttpCache::store(const std::string &url, const HttpResponse &response)
+{
+    std::shared_ptr<CacheEntry> entry = std::make_shared<CacheEntry>();
+    entry->url = url;
+    entry->etag = response.header("ETag");
+    entry->lastModified = response.header("Last-Modified");
+    entry->storedAt = unixNow();
+    entry->maxAge = maxAgeOf(response);
+
+    if (entry->maxAge == -2 || (!entry->validatable() && entry->maxAge <= 0))
+    {
+        remove(url);
+        return;
+    }
+
+    // Drop the old metadata first so a crash in between leaves a miss, never a stale pair
+    std::remove(pathOf(url, ".meta").c_str());
+    if (!writeAtomically(pathOf(url, ".body"), response.body))
+    {
+        return;
+    }
+    save(*entry);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    mEntries[url] = entry;
+}
+
+void HttpCache::revalidated(const std::string &url, const HttpResponse &response)
+{
+    std::shared_ptr<const CacheEntry> current = lookup(url);
+    if (!current)
+    {
+        return;
+    }
+
+    std::shared_ptr<CacheEntry> entry = std::make_shared<CacheEntry>(*current);
+    entry->storedAt = unixNow();
+    int64_t maxAge = maxAgeOf(response);
+    if (maxAge != -1)
+    {
+        entry->maxAge = maxAge;
+    }
+    std::string etag = response.header("ETag");
+    if (!etag.empty())
+    {
+        entry->etag = etag;
+    }
+    save(*entry);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    mEntries[url] = entry;
+}
+
+void HttpCache::remove(const std::string &url)
+{
+    std::remove(pathOf(url, ".meta").c_str());
+    std::remove(pathOf(url, ".body").c_str());
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    mEntries.erase(url);
+}
+
+void HttpCache::addValidators(const CacheEntry &entry, HttpRequest &request)
+{
+    if (!entry.etag.empty())
+    {
+        request.headers.push_back("If-None-Match: " + entry.etag);
+    }
+    if (!entry.lastModified.empty())
+    {
+        request.headers.push_back("If-Modified-Since: " + entry.lastModified);
+    }
+}
+
+} // namespace http
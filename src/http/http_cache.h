@@ -0,0 +1,55 @@
+#pragma once
+
+#include "http_client.h"
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace http
+{
+
+struct CacheEntry
+{
+    std::string url;
+    std::string etag;
+    std::string lastModified;
+    int64_t storedAt = 0; // unix time of the last 200 or 304
+    int64_t maxAge = -1;  // seconds from Cache-Control, -1 if absent
+
+    bool fresh(int64_t now) const { return maxAge >= 0 && now < storedAt + maxAge; }
+    bool validatable() const { return !etag.empty() || !lastModified.empty(); }
+};
+
+// Persistent cache of GET responses, one metadata file and one body file per URL.
+// Files are replaced with rename() so a crash never leaves a torn entry behind.
+class HttpCache
+{
+  public:
+    explicit HttpCache(std::string directory);
+
+    std::shared_ptr<const CacheEntry> lookup(const std::string &url);
+    std::string body(const CacheEntry &entry) const;
+
+    // Stores a 200 response if it carries validators or a max-age and allows storing
+    void store(const std::string &url, const HttpResponse &response);
+    // Restarts the freshness window after a 304
+    void revalidated(const std::string &url, const HttpResponse &response);
+    void remove(const std::string &url);
+
+    // Adds If-None-Match / If-Modified-Since for a stale entry
+    static void addValidators(const CacheEntry &entry, HttpRequest &request);
+    // max-age from Cache-Control (minus Age), 0 for no-cache, -2 for no-store, -1 if absent
+    static int64_t maxAgeOf(const HttpResponse &response);
+
+  private:
+    std::string pathOf(const std::string &url, const char *suffix) const;
+    void save(const CacheEntry &entry) const;
+
+    std::string mDirectory;
+    std::mutex mMutex;
+    std::unordered_map<std::string, std::shared_ptr<const CacheEntry>> mEntries; // hits, loaded lazily
+};
+
+} // namespace http
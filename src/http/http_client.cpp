@@ -0,0 +1,508 @@
+#include "http_client.h"
+#include "http_cache.h"
+#include "negative_cache.h"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <thread>
+
+namespace http
+{
+
+struct HttpClient::Request
+{
+    uint64_t id = 0;
+    HttpRequest request;
+    Callback callback;
+    std::string host;
+    Clock::time_point started;
+    int rounds = 0;   // retry rounds started
+    int attempts = 0; // transfers started, hedges included
+    bool hedged = false;
+    std::vector<Attempt *> live;
+    std::shared_ptr<const CacheEntry> cached;
+    HttpResponse ready; // answer for a DELIVER timer
+};
+
+struct HttpClient::Attempt
+{
+    uint64_t requestId = 0;
+    bool hedge = false;
+    CURL *eh = nullptr;
+    curl_slist *headers = nullptr;
+    HttpResponse response;
+
+    ~Attempt()
+    {
+        curl_slist_free_all(headers);
+        curl_easy_cleanup(eh);
+    }
+};
+
+bool HttpRequest::idempotent() const
+{
+    return method == "GET" || method == "HEAD" || method == "PUT" || method == "DELETE" || method == "OPTIONS";
+}
+
+std::string HttpResponse::header(const std::string &name) const
+{
+    for (const auto &line : headers)
+    {
+        if (line.size() > name.size() && line[name.size()] == ':' &&
+            std::equal(name.begin(), name.end(), line.begin(),
+                       [](char a, char b) { return std::tolower((unsigned char)a) == std::tolower((unsigned char)b); }))
+        {
+            size_t begin = line.find_first_not_of(" \t", name.size() + 1);
+            return begin == std::string::npos ? std::string() : line.substr(begin);
+        }
+    }
+    return std::string();
+}
+
+bool RetryPolicy::shouldRetry(const HttpRequest &request, const HttpResponse &response) const
+{
+    if (idempotentOnly && !request.idempotent())
+    {
+        return false;
+    }
+
+    switch (response.curlCode)
+    {
+    case CURLE_OK:
+        break;
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_PARTIAL_FILE:
+        return true;
+    default:
+        return false;
+    }
+
+    switch (response.status)
+    {
+    case 408:
+    case 429:
+    case 500:
+    case 502:
+    case 503:
+    case 504:
+        return true;
+    default:
+        return false;
+    }
+}
+
+std::chrono::milliseconds RetryPolicy::backoff(int attempt, std::mt19937 &rng) const
+{
+    long long cap = baseDelay.count() << std::min(attempt, 30);
+    cap = std::min<long long>(std::max<long long>(cap, 0), maxDelay.count());
+    std::uniform_int_distribution<long long> jitter(0, cap);
+    return std::chrono::milliseconds(jitter(rng));
+}
+
+std::chrono::milliseconds RetryPolicy::retryAfter(const std::string &value) const
+{
+    long long seconds = 0;
+    auto parsed = std::from_chars(value.data(), value.data() + value.size(), seconds);
+    if (parsed.ec == std::errc::result_out_of_range && !value.empty() && std::isdigit((unsigned char)value[0]))
+    {
+        return maxDelay;
+    }
+    if (parsed.ec != std::errc() || parsed.ptr == value.data() || seconds < 0)
+    {
+        return std::chrono::milliseconds(0);
+    }
+    // Clamped in seconds first, so the conversion cannot overflow
+    long long capSeconds = maxDelay.count() / 1000 + 1;
+    return std::min(maxDelay, std::chrono::milliseconds(std::min(seconds, capSeconds) * 1000));
+}
+
+HttpClient::HttpClient(RetryPolicy retry, HedgePolicy hedge)
+    : mRetry(retry), mHedge(hedge), mRng(std::random_device()())
+{
+    curl_global_init(CURL_GLOBAL_ALL);
+    mMulti = curl_multi_init();
+}
+
+HttpClient::~HttpClient()
+{
+    // Pending callbacks are dropped, not invoked
+    for (auto &item : mRequests)
+    {
+        for (Attempt *attempt : item.second->live)
+        {
+            cancel(attempt);
+        }
+    }
+    curl_multi_cleanup(mMulti);
+    curl_global_cleanup();
+}
+
+void HttpClient::submit(HttpRequest request, Callback callback)
+{
+    std::unique_ptr<Request> r(new Request);
+    r->id = mNextId++;
+    r->host = hostOf(request.url);
+    r->request = std::move(request);
+    r->callback = std::move(callback);
+    r->started = Clock::now();
+
+    Request &ref = *r;
+    mRequests.emplace(ref.id, std::move(r));
+
+    const std::string &method = ref.request.method;
+    if (mNegativeCache && (method == "GET" || method == "HEAD") && mNegativeCache->contains(ref.request.url))
+    {
+        ref.ready.status = 404;
+        ref.ready.fromCache = true;
+        mTimers.push(Timer{Clock::now(), ref.id, 0, DELIVER});
+        return;
+    }
+
+    if (mCache && method == "GET")
+    {
+        ref.cached = mCache->lookup(ref.request.url);
+        if (ref.cached && ref.cached->fresh(int64_t(std::time(nullptr))))
+        {
+            ref.ready.status = 200;
+            ref.ready.body = mCache->body(*ref.cached);
+            ref.ready.fromCache = true;
+            mTimers.push(Timer{Clock::now(), ref.id, 0, DELIVER});
+            return;
+        }
+        if (ref.cached && ref.cached->validatable())
+        {
+            HttpCache::addValidators(*ref.cached, ref.request);
+        }
+    }
+
+    start(ref, false);
+}
+
+size_t HttpClient::onWrite(char *data, size_t size, size_t nmemb, void *user)
+{
+    Attempt *attempt = reinterpret_cast<Attempt *>(user);
+    attempt->response.body.append(data, size * nmemb);
+    return size * nmemb;
+}
+
+size_t HttpClient::onHeader(char *data, size_t size, size_t nmemb, void *user)
+{
+    Attempt *attempt = reinterpret_cast<Attempt *>(user);
+    std::string line(data, size * nmemb);
+    while (!line.empty() && (line.back() == '\r' || line.back() == '\n'))
+    {
+        line.pop_back();
+    }
+
+    if (line.compare(0, 5, "HTTP/") == 0) // a new response after a redirect or 100-continue
+    {
+        attempt->response.headers.clear();
+    }
+    else if (!line.empty())
+    {
+        attempt->response.headers.push_back(std::move(line));
+    }
+    return size * nmemb;
+}
+
+void HttpClient::start(Request &r, bool hedge)
+{
+    Attempt *attempt = new Attempt;
+    attempt->requestId = r.id;
+    attempt->hedge = hedge;
+    attempt->eh = curl_easy_init();
+
+    CURL *eh = attempt->eh;
+    const HttpRequest &request = r.request;
+    curl_easy_setopt(eh, CURLOPT_URL, request.url.c_str());
+    curl_easy_setopt(eh, CURLOPT_PRIVATE, attempt);
+    curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, onWrite);
+    curl_easy_setopt(eh, CURLOPT_WRITEDATA, attempt);
+    curl_easy_setopt(eh, CURLOPT_HEADERFUNCTION, onHeader);
+    curl_easy_setopt(eh, CURLOPT_HEADERDATA, attempt);
+    curl_easy_setopt(eh, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(eh, CURLOPT_CONNECTTIMEOUT_MS, request.connectTimeoutMs);
+    curl_easy_setopt(eh, CURLOPT_TIMEOUT_MS, request.timeoutMs);
+    curl_easy_setopt(eh, CURLOPT_NOSIGNAL, 1L);
+
+    if (request.method == "HEAD")
+    {
+        curl_easy_setopt(eh, CURLOPT_NOBODY, 1L);
+    }
+    else if (request.method != "GET")
+    {
+        curl_easy_setopt(eh, CURLOPT_CUSTOMREQUEST, request.method.c_str());
+    }
+    if (!request.body.empty())
+    {
+        curl_easy_setopt(eh, CURLOPT_POSTFIELDSIZE, long(request.body.size()));
+        curl_easy_setopt(eh, CURLOPT_COPYPOSTFIELDS, request.body.c_str());
+    }
+
+    for (const auto &header : request.headers)
+    {
+        attempt->headers = curl_slist_append(attempt->headers, header.c_str());
+    }
+    curl_easy_setopt(eh, CURLOPT_HTTPHEADER, attempt->headers);
+
+    curl_multi_add_handle(mMulti, eh);
+    ++mLive;
+    r.live.push_back(attempt);
+    ++r.attempts;
+
+    if (!hedge)
+    {
+        ++r.rounds;
+        r.hedged = false;
+        if (mHedge.enabled && request.idempotent())
+        {
+            mTimers.push(Timer{Clock::now() + hedgeDelay(r.host), r.id, r.rounds, HEDGE});
+        }
+    }
+}
+
+void HttpClient::cancel(Attempt *attempt)
+{
+    // Removing the handle aborts the transfer and closes its connection if needed
+    curl_multi_remove_handle(mMulti, attempt->eh);
+    --mLive;
+    delete attempt;
+}
+
+std::chrono::milliseconds HttpClient::hedgeDelay(const std::string &host)
+{
+    HostHedge &h = mHedgeDelays[host];
+    if (h.completed < mHedge.minSamples)
+    {
+        return mHedge.initialDelay;
+    }
+
+    // Merging the histograms is cheap but not free; refresh every 16 completions
+    if (h.delay.count() == 0 || h.completed - h.computedAt >= 16)
+    {
+        int64_t us = mMetrics.host(host).total.percentile(mHedge.percentile);
+        h.delay = std::max(mHedge.minDelay, std::chrono::milliseconds(us / 1000));
+        h.computedAt = h.completed;
+    }
+    return h.delay;
+}
+
+void HttpClient::onDone(Attempt *attempt, CURLcode result)
+{
+    auto iter = mRequests.find(attempt->requestId);
+    Request &r = *iter->second;
+
+    attempt->response.curlCode = result;
+    curl_easy_getinfo(attempt->eh, CURLINFO_RESPONSE_CODE, &attempt->response.status);
+    mMetrics.record(attempt->eh, result);
+    if (result == CURLE_OK)
+    {
+        ++mHedgeDelays[r.host].completed;
+    }
+
+    bool fromHedge = attempt->hedge;
+    HttpResponse response = std::move(attempt->response);
+    r.live.erase(std::find(r.live.begin(), r.live.end(), attempt));
+    cancel(attempt);
+
+    bool retryable = mRetry.shouldRetry(r.request, response);
+    if (retryable && !r.live.empty())
+    {
+        return; // the other copy may still succeed
+    }
+
+    for (Attempt *loser : r.live)
+    {
+        cancel(loser);
+    }
+    r.live.clear();
+
+    if (r.hedged && !retryable)
+    {
+        ++(fromHedge ? mHedgeStats.won : mHedgeStats.lost);
+    }
+
+    if (retryable && r.rounds < mRetry.maxAttempts)
+    {
+        std::chrono::milliseconds delay = mRetry.backoff(r.rounds - 1, mRng);
+        delay = std::max(delay, mRetry.retryAfter(response.header("Retry-After")));
+        mTimers.push(Timer{Clock::now() + delay, r.id, r.rounds, RETRY});
+        return;
+    }
+
+    if (mCache && r.request.method == "GET")
+    {
+        if (response.status == 304 && r.cached)
+        {
+            mCache->revalidated(r.request.url, response);
+            response.status = 200;
+            response.body = mCache->body(*r.cached);
+            response.fromCache = true;
+        }
+        else if (response.status == 200)
+        {
+            mCache->store(r.request.url, response);
+        }
+    }
+
+    if (mNegativeCache && response.curlCode == CURLE_OK)
+    {
+        if (response.status == 404 || response.status == 410)
+        {
+            mNegativeCache->add(r.request.url);
+        }
+        else if (response.status < 400)
+        {
+            mNegativeCache->remove(r.request.url);
+        }
+    }
+
+    response.attempts = r.attempts;
+    response.hedgeWon = fromHedge;
+    response.seconds = std::chrono::duration<double>(Clock::now() - r.started).count();
+    finish(r.id, std::move(response));
+}
+
+void HttpClient::finish(uint64_t requestId, HttpResponse response)
+{
+    auto iter = mRequests.find(requestId);
+    Callback callback = std::move(iter->second->callback);
+    mRequests.erase(iter);
+
+    // The callback may submit more work, so it runs after the bookkeeping
+    if (callback)
+    {
+        callback(std::move(response));
+    }
+}
+
+void HttpClient::fireTimers()
+{
+    auto now = Clock::now();
+    while (!mTimers.empty() && mTimers.top().when <= now)
+    {
+        Timer timer = mTimers.top();
+        mTimers.pop();
+
+        auto iter = mRequests.find(timer.requestId);
+        if (iter == mRequests.end() || iter->second->rounds != timer.round)
+        {
+            continue;
+        }
+
+        Request &r = *iter->second;
+        if (timer.kind == DELIVER)
+        {
+            finish(r.id, std::move(r.ready));
+        }
+        else if (timer.kind == RETRY)
+        {
+            start(r, false);
+        }
+        else if (!r.hedged && r.live.size() == 1)
+        {
+            r.hedged = true;
+            ++mHedgeStats.fired;
+            start(r, true);
+        }
+    }
+}
+
+size_t HttpClient::poll(std::chrono::milliseconds timeout)
+{
+    auto deadline = Clock::now() + timeout;
+    do
+    {
+        fireTimers();
+
+        int running = 0;
+        curl_multi_perform(mMulti, &running);
+
+        int msgsLeft = 0;
+        while (CURLMsg *msg = curl_multi_info_read(mMulti, &msgsLeft))
+        {
+            if (msg->msg == CURLMSG_DONE)
+            {
+                Attempt *attempt = nullptr;
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &attempt);
+                onDone(attempt, msg->data.result);
+            }
+        }
+
+        if (mRequests.empty())
+        {
+            break;
+        }
+
+        auto now = Clock::now();
+        auto wake = deadline;
+        if (!mTimers.empty())
+        {
+            wake = std::min(wake, mTimers.top().when);
+        }
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(wake - now);
+        wait = std::max(wait, std::chrono::milliseconds(0));
+
+        int numfds = 0;
+#if LIBCURL_VERSION_NUM >= 0x074400 // 7.68.0: curl_multi_poll() sleeps without handles and can be woken up
+        curl_multi_poll(mMulti, NULL, 0, int(wait.count()), &numfds);
+#else
+        wait = std::min(wait, std::chrono::milliseconds(10)); // so that wakeup() is noticed
+        if (mLive == 0)
+        {
+            // curl_multi_wait() returns at once without handles; only timers are left
+            std::this_thread::sleep_for(wait);
+        }
+        else
+        {
+            curl_multi_wait(mMulti, NULL, 0, int(wait.count()), &numfds);
+        }
+#endif
+
+        if (mWoken.exchange(false))
+        {
+            break;
+        }
+    } while (Clock::now() < deadline);
+
+    return mRequests.size();
+}
+
+void HttpClient::wakeup()
+{
+    mWoken = true;
+#if LIBCURL_VERSION_NUM >= 0x074400
+    curl_multi_wakeup(mMulti);
+#endif
+}
+
+void HttpClient::run()
+{
+    while (poll(std::chrono::milliseconds(1000)) > 0)
+    {
+    }
+}
+
+HttpResponse HttpClient::perform(const HttpRequest &request)
+{
+    return perform(std::vector<HttpRequest>{request}).front();
+}
+
+std::vector<HttpResponse> HttpClient::perform(const std::vector<HttpRequest> &requests)
+{
+    std::vector<HttpResponse> responses(requests.size());
+    for (size_t i = 0; i < requests.size(); ++i)
+    {
+        submit(requests[i], [&responses, i](HttpResponse response) { responses[i] = std::move(response); });
+    }
+    run();
+    return responses;
+}
+
+} // namespace http
@@ -0,0 +1,168 @@
+#pragma once
+
+#include "curl/curl.h"
+#include "transfer_metrics.h"
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace http
+{
+
+class HttpCache;
+class NegativeCache;
+
+struct HttpRequest
+{
+    std::string url;
+    std::string method = "GET";
+    std::vector<std::string> headers; // "Name: value"
+    std::string body;
+    long connectTimeoutMs = 6000;
+    long timeoutMs = 0; // 0 means no limit
+
+    bool idempotent() const;
+};
+
+struct HttpResponse
+{
+    CURLcode curlCode = CURLE_OK;
+    long status = 0;
+    std::string body;
+    std::vector<std::string> headers; // header lines of the final response, without CRLF
+    int attempts = 0;
+    bool hedgeWon = false;  // the body came from the hedged duplicate
+    bool fromCache = false; // answered locally: HttpCache (fresh or after a 304) or NegativeCache
+    double seconds = 0;    // first attempt to completion, including backoff
+
+    bool ok() const { return curlCode == CURLE_OK && status >= 200 && status < 300; }
+    std::string header(const std::string &name) const; // case-insensitive, empty if absent
+};
+
+struct RetryPolicy
+{
+    int maxAttempts = 3; // including the first one
+    std::chrono::milliseconds baseDelay{100};
+    std::chrono::milliseconds maxDelay{5000};
+    bool idempotentOnly = true;
+
+    bool shouldRetry(const HttpRequest &request, const HttpResponse &response) const;
+    // "Full jitter" exponential backoff: uniform in [0, min(maxDelay, baseDelay * 2^attempt)]
+    std::chrono::milliseconds backoff(int attempt, std::mt19937 &rng) const;
+    // The delay a Retry-After of delay-seconds asks for, at most maxDelay; 0 when
+    // absent or unparseable, as for the HTTP-date form
+    std::chrono::milliseconds retryAfter(const std::string &value) const;
+};
+
+struct HedgePolicy
+{
+    bool enabled = false;
+    double percentile = 95; // a duplicate fires once the request is slower than this
+    uint64_t minSamples = 20; // per host, before that initialDelay is used
+    std::chrono::milliseconds initialDelay{1000};
+    std::chrono::milliseconds minDelay{20};
+};
+
+struct HedgeStats
+{
+    uint64_t fired = 0;
+    uint64_t won = 0;  // the hedge answered first
+    uint64_t lost = 0; // the original answered first
+
+    double winRate() const { return fired ? double(won) / fired : 0.0; }
+};
+
+// Runs transfers on one curl multi handle. Not thread-safe: apart from wakeup(), all
+// members must be called from the thread that owns the client.
+class HttpClient
+{
+  public:
+    using Callback = std::function<void(HttpResponse)>;
+
+    explicit HttpClient(RetryPolicy retry = RetryPolicy(), HedgePolicy hedge = HedgePolicy());
+    ~HttpClient();
+    HttpClient(const HttpClient &) = delete;
+    HttpClient &operator=(const HttpClient &) = delete;
+
+    void submit(HttpRequest request, Callback callback);
+
+    // Drives the transfers for at most `timeout` and returns the number of requests
+    // still pending. Callbacks run on the calling thread.
+    size_t poll(std::chrono::milliseconds timeout);
+    void run(); // until nothing is pending
+    // Makes a concurrent poll() return early
+    void wakeup();
+    size_t pending() const { return mRequests.size(); }
+
+    HttpResponse perform(const HttpRequest &request);
+    std::vector<HttpResponse> perform(const std::vector<HttpRequest> &requests);
+
+    // GET requests are answered from the cache while fresh and revalidated when stale
+    void setCache(std::shared_ptr<HttpCache> cache) { mCache = std::move(cache); }
+    // GET/HEAD requests for URLs that recently answered 404/410 fail without a transfer
+    void setNegativeCache(std::shared_ptr<NegativeCache> cache) { mNegativeCache = std::move(cache); }
+
+    TransferMetrics &metrics() { return mMetrics; }
+    const HedgeStats &hedgeStats() const { return mHedgeStats; }
+
+  private:
+    using Clock = std::chrono::steady_clock;
+    struct Request;
+    struct Attempt;
+
+    enum TimerKind
+    {
+        RETRY,
+        HEDGE,
+        DELIVER // answer from a cache without a transfer
+    };
+
+    struct Timer
+    {
+        Clock::time_point when;
+        uint64_t requestId;
+        int round; // stale once the request moved on to another retry round
+        TimerKind kind;
+        bool operator>(const Timer &other) const { return when > other.when; }
+    };
+
+    void start(Request &request, bool hedge);
+    void cancel(Attempt *attempt);
+    void onDone(Attempt *attempt, CURLcode result);
+    void finish(uint64_t requestId, HttpResponse response);
+    void fireTimers();
+    std::chrono::milliseconds hedgeDelay(const std::string &host);
+
+    static size_t onWrite(char *data, size_t size, size_t nmemb, void *user);
+    static size_t onHeader(char *data, size_t size, size_t nmemb, void *user);
+
+    CURLM *mMulti;
+    RetryPolicy mRetry;
+    HedgePolicy mHedge;
+    HedgeStats mHedgeStats;
+    TransferMetrics mMetrics;
+    std::shared_ptr<HttpCache> mCache;
+    std::shared_ptr<NegativeCache> mNegativeCache;
+    std::mt19937 mRng;
+    uint64_t mNextId = 1;
+    size_t mLive = 0; // easy handles attached to mMulti
+    std::atomic<bool> mWoken{false};
+    std::unordered_map<uint64_t, std::unique_ptr<Request>> mRequests;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> mTimers;
+
+    struct HostHedge
+    {
+        uint64_t completed = 0;
+        uint64_t computedAt = 0;
+        std::chrono::milliseconds delay{0};
+    };
+    std::unordered_map<std::string, HostHedge> mHedgeDelays;
+};
+
+} // namespace http
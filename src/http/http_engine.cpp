@@ -0,0 +1,138 @@
+#include "http_engine.h"
+#include <functional>
+
+namespace http
+{
+
+HttpEngine::HttpEngine(HttpEngineOptions options) : mOptions(std::move(options))
+{
+    for (size_t i = 0; i < std::max<size_t>(1, mOptions.workers); ++i)
+    {
+        std::unique_ptr<Worker> worker(new Worker);
+        worker->client.reset(new HttpClient(mOptions.retry, mOptions.hedge));
+        worker->client->setCache(mOptions.cache);
+        worker->client->setNegativeCache(mOptions.negativeCache);
+        mWorkers.push_back(std::move(worker));
+    }
+
+    for (auto &worker : mWorkers)
+    {
+        Worker *w = worker.get();
+        w->thread = std::thread([w] { workerLoop(*w); });
+    }
+}
+
+HttpEngine::~HttpEngine()
+{
+    for (auto &worker : mWorkers)
+    {
+        {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            worker->stopping = true;
+        }
+        worker->ready.notify_one();
+        worker->client->wakeup();
+    }
+
+    for (auto &worker : mWorkers)
+    {
+        worker->thread.join();
+    }
+}
+
+size_t HttpEngine::pickShard(const std::string &host) const
+{
+    size_t home = std::hash<std::string>()(host) % mWorkers.size();
+    size_t least = home;
+    for (size_t i = 0; i < mWorkers.size(); ++i)
+    {
+        if (mWorkers[i]->inFlight.load() < mWorkers[least]->inFlight.load())
+        {
+            least = i;
+        }
+    }
+
+    return (mWorkers[home]->inFlight.load() > mWorkers[least]->inFlight.load() + mOptions.spillThreshold) ? least : home;
+}
+
+std::future<HttpResponse> HttpEngine::submit(HttpRequest request)
+{
+    Worker &worker = *mWorkers[pickShard(hostOf(request.url))];
+    ++worker.inFlight;
+
+    std::promise<HttpResponse> promise;
+    std::future<HttpResponse> future = promise.get_future();
+    {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.inbox.emplace_back(std::move(request), std::move(promise));
+    }
+    worker.ready.notify_one();
+    worker.client->wakeup();
+    return future;
+}
+
+void HttpEngine::workerLoop(Worker &worker)
+{
+    HttpClient &client = *worker.client;
+    std::vector<std::pair<HttpRequest, std::promise<HttpResponse>>> batch;
+
+    while (true)
+    {
+        bool stopping = false;
+        {
+            std::unique_lock<std::mutex> lock(worker.mutex);
+            if (client.pending() == 0)
+            {
+                worker.ready.wait(lock, [&worker] { return !worker.inbox.empty() || worker.stopping; });
+            }
+            batch.swap(worker.inbox);
+            stopping = worker.stopping;
+        }
+
+        for (auto &item : batch)
+        {
+            // std::function needs a copyable callable, hence the shared promise
+            auto promise = std::make_shared<std::promise<HttpResponse>>(std::move(item.second));
+            client.submit(std::move(item.first), [promise, &worker](HttpResponse response) {
+                --worker.inFlight;
+                promise->set_value(std::move(response));
+            });
+        }
+        batch.clear();
+
+        if (stopping && client.pending() == 0)
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            if (worker.inbox.empty())
+            {
+                return;
+            }
+            continue;
+        }
+
+        client.poll(std::chrono::milliseconds(1000));
+    }
+}
+
+std::vector<size_t> HttpEngine::inFlight() const
+{
+    std::vector<size_t> result;
+    for (const auto &worker : mWorkers)
+    {
+        result.push_back(worker->inFlight.load());
+    }
+    return result;
+}
+
+HostMetrics HttpEngine::metrics(const std::string &host) const
+{
+    HostMetrics result;
+    result.host = host;
+    for (const auto &worker : mWorkers)
+    {
+        result.merge(worker->client->metrics().host(host));
+    }
+    return result;
+}
+
+} // namespace http
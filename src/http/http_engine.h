@@ -0,0 +1,63 @@
+#pragma once
+
+#include "http_client.h"
+#include <algorithm>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace http
+{
+
+struct HttpEngineOptions
+{
+    size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    // A request leaves its host's home shard when that shard has this many more
+    // transfers in flight than the least loaded one
+    size_t spillThreshold = 32;
+    RetryPolicy retry;
+    HedgePolicy hedge;
+    std::shared_ptr<HttpCache> cache; // shared by all workers
+    std::shared_ptr<NegativeCache> negativeCache;
+};
+
+// Runs one HttpClient, and so one multi handle and event loop, per worker thread.
+// Requests for a host stay on one shard to reuse its connections unless that shard
+// falls too far behind the others.
+class HttpEngine
+{
+  public:
+    explicit HttpEngine(HttpEngineOptions options = HttpEngineOptions());
+    ~HttpEngine(); // waits for every submitted request to finish
+    HttpEngine(const HttpEngine &) = delete;
+    HttpEngine &operator=(const HttpEngine &) = delete;
+
+    // Thread-safe
+    std::future<HttpResponse> submit(HttpRequest request);
+
+    size_t workers() const { return mWorkers.size(); }
+    std::vector<size_t> inFlight() const;
+    HostMetrics metrics(const std::string &host) const;
+
+  private:
+    struct Worker
+    {
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::vector<std::pair<HttpRequest, std::promise<HttpResponse>>> inbox;
+        bool stopping = false;
+        std::atomic<size_t> inFlight{0};
+        std::unique_ptr<HttpClient> client;
+        std::thread thread;
+    };
+
+    size_t pickShard(const std::string &host) const;
+    static void workerLoop(Worker &worker);
+
+    HttpEngineOptions mOptions;
+    std::vector<std::unique_ptr<Worker>> mWorkers;
+};
+
+} // namespace http
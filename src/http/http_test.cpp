@@ -0,0 +1,702 @@
+#include "http_cache.h"
+#include "http_client.h"
+#include "http_engine.h"
+#include "negative_cache.h"
+#include "transfer_metrics.h"
+#include "gtest/gtest.h"
+#include <atomic>
+#include <boost/filesystem.hpp>
+#include <condition_variable>
+#include <thread>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace http
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// TransferMetrics
+///////////////////////////////////////////////////////////////////////////////
+
+TEST(http, histogram_buckets)
+{
+    for (int64_t v : {0, 1, 3, 4, 7, 8, 9, 100, 12345, 999999, 60000000})
+    {
+        int bucket = LatencyHistogram::bucketOf(v);
+        ASSERT_LE(LatencyHistogram::lowerBound(bucket), v);
+        ASSERT_GE(LatencyHistogram::upperBound(bucket), v);
+    }
+}
+
+TEST(http, histogram_percentile)
+{
+    LatencyHistogram histogram;
+    for (int i = 1; i <= 1000; ++i)
+    {
+        histogram.record(i * 1000);
+    }
+
+    HistogramSnapshot snapshot;
+    snapshot.add(histogram);
+    ASSERT_EQ(1000u, snapshot.total);
+    ASSERT_NEAR(500000, snapshot.percentile(50), 500000 * 0.25);
+    ASSERT_NEAR(990000, snapshot.percentile(99), 990000 * 0.25);
+    ASSERT_LE(snapshot.percentile(50), snapshot.percentile(95));
+}
+
+TEST(http, host_of)
+{
+    ASSERT_EQ("cmbu-ad.cisco.com", hostOf("http://cmbu-ad.cisco.com/photo/huiluo2.jpg"));
+    ASSERT_EQ("example.com", hostOf("https://user:pw@example.com:8443?x=1"));
+    ASSERT_EQ("[::1]", hostOf("http://[::1]:8080/"));
+}
+
+TEST(http, metrics_by_host)
+{
+    TransferMetrics metrics;
+    const int THREADS = 4;
+    const int PER_THREAD = 1000;
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; ++t)
+    {
+        threads.emplace_back([&metrics, t] {
+            for (int i = 0; i < PER_THREAD; ++i)
+            {
+                TransferSample sample;
+                sample.host = (i % 2) ? "a.example.com" : "b.example.com";
+                sample.status = (i % 10 == 0) ? 404 : 200;
+                sample.dnsUs = 100;
+                sample.totalUs = 1000 * (t + 1);
+                sample.bytesDown = 10;
+                metrics.record(sample);
+            }
+        });
+    }
+
+    // Queries are allowed while the writers are running
+    HostMetrics partial = metrics.overall();
+    ASSERT_LE(partial.transfers, uint64_t(THREADS * PER_THREAD));
+
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+
+    HostMetrics a = metrics.host("a.example.com");
+    ASSERT_EQ(uint64_t(THREADS * PER_THREAD / 2), a.transfers);
+    ASSERT_EQ(uint64_t(THREADS * PER_THREAD / 2 * 10), a.bytesDown);
+
+    HostMetrics all = metrics.overall();
+    ASSERT_EQ(uint64_t(THREADS * PER_THREAD), all.transfers);
+    ASSERT_EQ(uint64_t(THREADS * PER_THREAD / 10), all.failures);
+    ASSERT_EQ(all.failures, all.statusClasses[4]);
+    ASSERT_EQ(2u, metrics.hosts().size());
+    ASSERT_EQ(LatencyHistogram::upperBound(LatencyHistogram::bucketOf(100)), all.dns.percentile(50));
+}
+
+TEST(http, metrics_instances_come_and_go)
+{
+    // Each instance gets a shard on this thread; the destroyed ones are forgotten
+    for (int i = 0; i < 2000; ++i)
+    {
+        TransferMetrics metrics;
+        TransferSample sample;
+        sample.host = "example.com";
+        sample.status = 200;
+        metrics.record(sample);
+        ASSERT_EQ(1u, metrics.overall().transfers);
+        ASSERT_EQ(std::vector<std::string>{"example.com"}, metrics.hosts());
+    }
+}
+
+TEST(http, progress_throttle)
+{
+    ProgressThrottle throttle(std::chrono::milliseconds(50));
+    int reports = 0;
+    for (int i = 0; i < 10000; ++i)
+    {
+        reports += throttle.shouldReport(i, 10000);
+    }
+    ASSERT_LE(reports, 2);
+
+    ASSERT_TRUE(throttle.shouldReport(10000, 10000));  // completion is always reported
+    ASSERT_FALSE(throttle.shouldReport(10000, 10000)); // but only once
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// NegativeCache
+///////////////////////////////////////////////////////////////////////////////
+
+TEST(http, counting_bloom_filter)
+{
+    CountingBloomFilter bloom(10000, 7);
+    for (int i = 0; i < 1000; ++i)
+    {
+        bloom.add("huiluo" + std::to_string(i));
+    }
+
+    int falsePositives = 0;
+    for (int i = 0; i < 1000; ++i)
+    {
+        ASSERT_TRUE(bloom.mayContain("huiluo" + std::to_string(i)));
+        falsePositives += bloom.mayContain("jizh" + std::to_string(i));
+    }
+    ASSERT_LT(falsePositives, 50);
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        bloom.remove("huiluo" + std::to_string(i));
+    }
+    ASSERT_FALSE(bloom.mayContain("huiluo1"));
+}
+
+TEST(http, negative_cache_ttl_and_persistence)
+{
+    NegativeCache cache(std::chrono::seconds(60), 1000);
+    cache.add("http://cmbu-ad.cisco.com/photo/huiluo9.jpg", 1000);
+    cache.add("http://cmbu-ad.cisco.com/photo/jizh9.jpg", 1030);
+
+    ASSERT_TRUE(cache.contains("http://cmbu-ad.cisco.com/photo/huiluo9.jpg", 1059));
+    ASSERT_FALSE(cache.contains("http://cmbu-ad.cisco.com/photo/huiluo9.jpg", 1060));
+    ASSERT_FALSE(cache.contains("http://cmbu-ad.cisco.com/photo/huiluo.jpg", 1000));
+
+    std::string path = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()).string();
+    ASSERT_TRUE(cache.save(path));
+
+    NegativeCache restored(std::chrono::seconds(60), 1000);
+    ASSERT_TRUE(restored.load(path, 1070));
+    ASSERT_EQ(1u, restored.size()); // huiluo9 had expired
+    ASSERT_TRUE(restored.contains("http://cmbu-ad.cisco.com/photo/jizh9.jpg", 1070));
+
+    ASSERT_EQ(1u, restored.expire(1090));
+    ASSERT_EQ(0u, restored.size());
+    boost::filesystem::remove(path);
+}
+
+TEST(http, negative_cache_drops_expired_entries)
+{
+    NegativeCache cache(std::chrono::seconds(60), 1000);
+    cache.add("http://cmbu-ad.cisco.com/photo/huiluo9.jpg", 1000);
+    ASSERT_FALSE(cache.contains("http://cmbu-ad.cisco.com/photo/huiluo9.jpg", 1060));
+    ASSERT_EQ(0u, cache.size()); // the lookup dropped it
+
+    // Adding sweeps out what expired meanwhile, without expire() being called
+    for (int i = 0; i < 2048; ++i)
+    {
+        cache.add("http://cmbu-ad.cisco.com/photo/huiluo" + std::to_string(i) + ".jpg", 1000);
+    }
+    for (int i = 0; i < 2048; ++i)
+    {
+        cache.add("http://cmbu-ad.cisco.com/photo/jizh" + std::to_string(i) + ".jpg", 2000);
+    }
+    ASSERT_EQ(2048u, cache.size());
+    ASSERT_FALSE(cache.contains("http://cmbu-ad.cisco.com/photo/huiluo1.jpg", 2000));
+    ASSERT_TRUE(cache.contains("http://cmbu-ad.cisco.com/photo/jizh1.jpg", 2000));
+}
+
+#ifndef _WIN32
+
+///////////////////////////////////////////////////////////////////////////////
+// A loopback HTTP/1.1 server so the client tests do not need the network
+///////////////////////////////////////////////////////////////////////////////
+
+struct TestReply
+{
+    int status = 200;
+    std::vector<std::string> headers;
+    std::string body;
+    std::chrono::milliseconds delay{0};
+};
+
+class TestServer
+{
+  public:
+    using Handler = std::function<TestReply(const std::string &path, const std::vector<std::string> &headers)>;
+
+    explicit TestServer(Handler handler) : mHandler(std::move(handler))
+    {
+        mListen = socket(AF_INET, SOCK_STREAM, 0);
+        int yes = 1;
+        setsockopt(mListen, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bind(mListen, (sockaddr *)&addr, sizeof(addr));
+        listen(mListen, SOMAXCONN);
+
+        socklen_t len = sizeof(addr);
+        getsockname(mListen, (sockaddr *)&addr, &len);
+        mPort = ntohs(addr.sin_port);
+        mAcceptor = std::thread([this] { acceptLoop(); });
+    }
+
+    ~TestServer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStopped = true;
+        }
+        mStop.notify_all();
+        mAcceptor.join();
+        for (auto &t : mConnections)
+        {
+            t.join();
+        }
+        close(mListen);
+    }
+
+    std::string url(const std::string &path) const { return "http://127.0.0.1:" + std::to_string(mPort) + path; }
+    int requests() const { return mRequests; }
+
+  private:
+    void acceptLoop()
+    {
+        while (true)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                if (mStopped)
+                {
+                    return;
+                }
+            }
+
+            pollfd pfd = {mListen, POLLIN, 0};
+            if (::poll(&pfd, 1, 20) > 0)
+            {
+                int fd = accept(mListen, NULL, NULL);
+                if (fd >= 0)
+                {
+                    mConnections.emplace_back([this, fd] { serve(fd); });
+                }
+            }
+        }
+    }
+
+    void serve(int fd)
+    {
+        std::string request;
+        char buffer[4096];
+        while (request.find("\r\n\r\n") == std::string::npos)
+        {
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n <= 0)
+            {
+                close(fd);
+                return;
+            }
+            request.append(buffer, n);
+        }
+        ++mRequests;
+
+        std::vector<std::string> headers;
+        size_t lineEnd = request.find("\r\n");
+        std::string requestLine = request.substr(0, lineEnd);
+        for (size_t pos = lineEnd + 2, next; (next = request.find("\r\n", pos)) != pos; pos = next + 2)
+        {
+            headers.push_back(request.substr(pos, next - pos));
+        }
+
+        size_t pathBegin = requestLine.find(' ') + 1;
+        std::string path = requestLine.substr(pathBegin, requestLine.find(' ', pathBegin) - pathBegin);
+        TestReply reply = mHandler(path, headers);
+
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mStop.wait_for(lock, reply.delay, [this] { return mStopped; });
+        }
+
+        std::string response = "HTTP/1.1 " + std::to_string(reply.status) + " Test\r\n";
+        for (const auto &header : reply.headers)
+        {
+            response += header + "\r\n";
+        }
+        response += "Content-Length: " + std::to_string(reply.body.size()) + "\r\nConnection: close\r\n\r\n";
+        response += reply.body;
+        send(fd, response.data(), response.size(), MSG_NOSIGNAL);
+        close(fd);
+    }
+
+    Handler mHandler;
+    int mListen = -1;
+    int mPort = 0;
+    std::atomic<int> mRequests{0};
+    std::mutex mMutex;
+    std::condition_variable mStop;
+    bool mStopped = false;
+    std::thread mAcceptor;
+    std::vector<std::thread> mConnections; // only touched by the acceptor and the destructor
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// HttpClient: retries and hedged requests
+///////////////////////////////////////////////////////////////////////////////
+
+TEST(http, backoff_is_capped_and_jittered)
+{
+    RetryPolicy policy;
+    policy.baseDelay = std::chrono::milliseconds(100);
+    policy.maxDelay = std::chrono::milliseconds(1000);
+
+    std::mt19937 rng(42);
+    bool varies = false;
+    for (int attempt = 0; attempt < 40; ++attempt)
+    {
+        auto delay = policy.backoff(attempt, rng);
+        ASSERT_GE(delay.count(), 0);
+        ASSERT_LE(delay.count(), std::min<long long>(1000, 100LL << std::min(attempt, 30)));
+        varies = varies || delay != policy.backoff(attempt, rng);
+    }
+    ASSERT_TRUE(varies);
+}
+
+TEST(http, retry_after_is_clamped)
+{
+    RetryPolicy policy;
+    policy.maxDelay = std::chrono::milliseconds(5000);
+    EXPECT_EQ(2000, policy.retryAfter("2").count());
+    EXPECT_EQ(5000, policy.retryAfter("120").count());
+    EXPECT_EQ(5000, policy.retryAfter("9223372036854775").count()); // would overflow in milliseconds
+    EXPECT_EQ(5000, policy.retryAfter("99999999999999999999").count());
+    EXPECT_EQ(0, policy.retryAfter("").count());
+    EXPECT_EQ(0, policy.retryAfter("-5").count());
+    EXPECT_EQ(0, policy.retryAfter("Wed, 21 Oct 2015 07:28:00 GMT").count());
+}
+
+TEST(http, retry_until_success)
+{
+    std::atomic<int> calls{0};
+    TestServer server([&calls](const std::string &, const std::vector<std::string> &) {
+        TestReply reply;
+        reply.status = (calls++ < 2) ? 503 : 200;
+        reply.body = "photo";
+        return reply;
+    });
+
+    RetryPolicy retry;
+    retry.baseDelay = std::chrono::milliseconds(10);
+    HttpClient client(retry);
+    HttpResponse response = client.perform(HttpRequest{server.url("/photo/huiluo.jpg")});
+
+    ASSERT_TRUE(response.ok());
+    ASSERT_EQ("photo", response.body);
+    ASSERT_EQ(3, response.attempts);
+    ASSERT_EQ(3u, client.metrics().host("127.0.0.1").transfers);
+}
+
+TEST(http, retry_gives_up)
+{
+    TestServer server([](const std::string &, const std::vector<std::string> &) {
+        TestReply reply;
+        reply.status = 503;
+        return reply;
+    });
+
+    RetryPolicy retry;
+    retry.maxAttempts = 2;
+    retry.baseDelay = std::chrono::milliseconds(10);
+    HttpClient client(retry);
+
+    HttpResponse get = client.perform(HttpRequest{server.url("/")});
+    ASSERT_EQ(503, get.status);
+    ASSERT_EQ(2, get.attempts);
+
+    HttpRequest post{server.url("/")};
+    post.method = "POST";
+    post.body = "x";
+    HttpResponse response = client.perform(post);
+    ASSERT_EQ(503, response.status);
+    ASSERT_EQ(1, response.attempts); // not idempotent
+}
+
+TEST(http, no_retry_on_404)
+{
+    TestServer server([](const std::string &, const std::vector<std::string> &) {
+        TestReply reply;
+        reply.status = 404;
+        return reply;
+    });
+
+    HttpClient client;
+    HttpResponse response = client.perform(HttpRequest{server.url("/photo/huiluo9.jpg")});
+    ASSERT_EQ(404, response.status);
+    ASSERT_EQ(1, response.attempts);
+    ASSERT_EQ(1, server.requests());
+}
+
+TEST(http, hedge_beats_stall)
+{
+    std::atomic<int> calls{0};
+    TestServer server([&calls](const std::string &, const std::vector<std::string> &) {
+        TestReply reply;
+        reply.body = "photo";
+        if (calls++ == 0)
+        {
+            reply.delay = std::chrono::milliseconds(3000); // the rare multi-second stall
+        }
+        return reply;
+    });
+
+    HedgePolicy hedge;
+    hedge.enabled = true;
+    hedge.initialDelay = std::chrono::milliseconds(100);
+    HttpClient client(RetryPolicy(), hedge);
+
+    HttpResponse response = client.perform(HttpRequest{server.url("/photo/huiluo.jpg")});
+    ASSERT_TRUE(response.ok());
+    ASSERT_TRUE(response.hedgeWon);
+    ASSERT_EQ(2, response.attempts);
+    ASSERT_LT(response.seconds, 2.0);
+    ASSERT_EQ(1u, client.hedgeStats().fired);
+    ASSERT_EQ(1.0, client.hedgeStats().winRate());
+}
+
+TEST(http, hedge_not_needed)
+{
+    TestServer server([](const std::string &, const std::vector<std::string> &) { return TestReply(); });
+
+    HedgePolicy hedge;
+    hedge.enabled = true;
+    hedge.initialDelay = std::chrono::milliseconds(2000);
+    HttpClient client(RetryPolicy(), hedge);
+
+    std::vector<HttpRequest> requests(20, HttpRequest{server.url("/")});
+    for (const auto &response : client.perform(requests))
+    {
+        ASSERT_TRUE(response.ok());
+        ASSERT_EQ(1, response.attempts);
+    }
+    ASSERT_EQ(0u, client.hedgeStats().fired);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HttpCache: conditional GET
+///////////////////////////////////////////////////////////////////////////////
+
+static std::string tempCacheDirectory()
+{
+    return (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("http-cache-%%%%-%%%%")).string();
+}
+
+TEST(http, cache_revalidates_with_etag)
+{
+    std::atomic<int> notModified{0};
+    TestServer server([&notModified](const std::string &, const std::vector<std::string> &headers) {
+        TestReply reply;
+        reply.headers = {"ETag: \"v1\"", "Cache-Control: max-age=0"};
+        if (std::find(headers.begin(), headers.end(), "If-None-Match: \"v1\"") != headers.end())
+        {
+            ++notModified;
+            reply.status = 304;
+        }
+        else
+        {
+            reply.body = "jpeg bytes";
+        }
+        return reply;
+    });
+
+    std::string directory = tempCacheDirectory();
+    HttpClient client;
+    client.setCache(std::make_shared<HttpCache>(directory));
+
+    HttpResponse first = client.perform(HttpRequest{server.url("/photo/huiluo.jpg")});
+    ASSERT_TRUE(first.ok());
+    ASSERT_FALSE(first.fromCache);
+
+    HttpResponse second = client.perform(HttpRequest{server.url("/photo/huiluo.jpg")});
+    ASSERT_EQ(200, second.status);
+    ASSERT_TRUE(second.fromCache);
+    ASSERT_EQ("jpeg bytes", second.body);
+    ASSERT_EQ(1, notModified.load());
+
+    boost::filesystem::remove_all(directory);
+}
+
+TEST(http, cache_skips_fresh_entries_across_runs)
+{
+    TestServer server([](const std::string &, const std::vector<std::string> &) {
+        TestReply reply;
+        reply.headers = {"Last-Modified: Tue, 01 Jan 2019 00:00:00 GMT", "Cache-Control: public, max-age=3600"};
+        reply.body = "jpeg bytes";
+        return reply;
+    });
+
+    std::string directory = tempCacheDirectory();
+    {
+        HttpClient client;
+        client.setCache(std::make_shared<HttpCache>(directory));
+        ASSERT_FALSE(client.perform(HttpRequest{server.url("/photo/jizh.jpg")}).fromCache);
+    }
+
+    // A new cache over the same directory, as on the next run of the job
+    HttpClient client;
+    client.setCache(std::make_shared<HttpCache>(directory));
+    HttpResponse response = client.perform(HttpRequest{server.url("/photo/jizh.jpg")});
+    ASSERT_TRUE(response.ok());
+    ASSERT_TRUE(response.fromCache);
+    ASSERT_EQ("jpeg bytes", response.body);
+    ASSERT_EQ(1, server.requests());
+
+    boost::filesystem::remove_all(directory);
+}
+
+TEST(http, cache_honours_no_store)
+{
+    TestServer server([](const std::string &, const std::vector<std::string> &) {
+        TestReply reply;
+        reply.headers = {"ETag: \"v1\"", "Cache-Control: no-store"};
+        return reply;
+    });
+
+    std::string directory = tempCacheDirectory();
+    auto cache = std::make_shared<HttpCache>(directory);
+    HttpClient client;
+    client.setCache(cache);
+    client.perform(HttpRequest{server.url("/")});
+    ASSERT_EQ(nullptr, cache->lookup(server.url("/")));
+
+    boost::filesystem::remove_all(directory);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HttpEngine: one multi handle per worker thread
+///////////////////////////////////////////////////////////////////////////////
+
+TEST(http, engine_many_submitters)
+{
+    TestServer server([](const std::string &path, const std::vector<std::string> &) {
+        TestReply reply;
+        reply.body = path;
+        return reply;
+    });
+
+    HttpEngineOptions options;
+    options.workers = 4;
+    HttpEngine engine(options);
+
+    const int THREADS = 4;
+    const int PER_THREAD = 50;
+    std::vector<std::thread> submitters;
+    std::atomic<int> ok{0};
+    for (int t = 0; t < THREADS; ++t)
+    {
+        submitters.emplace_back([&, t] {
+            std::vector<std::future<HttpResponse>> futures;
+            for (int i = 0; i < PER_THREAD; ++i)
+            {
+                // Two host names for the same server, so two home shards are used
+                std::string url = server.url("/photo/" + std::to_string(t) + "-" + std::to_string(i) + ".jpg");
+                if (i % 2)
+                {
+                    url.replace(url.find("127.0.0.1"), 9, "localhost");
+                }
+                futures.push_back(engine.submit(HttpRequest{url}));
+            }
+            for (int i = 0; i < PER_THREAD; ++i)
+            {
+                HttpResponse response = futures[i].get();
+                if (response.ok() && response.body == "/photo/" + std::to_string(t) + "-" + std::to_string(i) + ".jpg")
+                {
+                    ++ok;
+                }
+            }
+        });
+    }
+
+    for (auto &t : submitters)
+    {
+        t.join();
+    }
+
+    ASSERT_EQ(THREADS * PER_THREAD, ok.load());
+    for (size_t n : engine.inFlight())
+    {
+        ASSERT_EQ(0u, n);
+    }
+    ASSERT_EQ(uint64_t(THREADS * PER_THREAD / 2), engine.metrics("127.0.0.1").transfers);
+}
+
+TEST(http, engine_spills_to_idle_shards)
+{
+    TestServer server([](const std::string &, const std::vector<std::string> &) {
+        TestReply reply;
+        reply.delay = std::chrono::milliseconds(200);
+        return reply;
+    });
+
+    HttpEngineOptions options;
+    options.workers = 4;
+    options.spillThreshold = 1;
+    HttpEngine engine(options);
+
+    std::vector<std::future<HttpResponse>> futures;
+    for (int i = 0; i < 8; ++i)
+    {
+        futures.push_back(engine.submit(HttpRequest{server.url("/")}));
+    }
+
+    std::vector<size_t> inFlight = engine.inFlight();
+    ASSERT_EQ(4, std::count_if(inFlight.begin(), inFlight.end(), [](size_t n) { return n > 0; }));
+
+    for (auto &future : futures)
+    {
+        ASSERT_TRUE(future.get().ok());
+    }
+}
+
+TEST(http, negative_cache_skips_known_404)
+{
+    TestServer server([](const std::string &path, const std::vector<std::string> &) {
+        TestReply reply;
+        reply.status = (path == "/photo/huiluo.jpg") ? 200 : 404;
+        return reply;
+    });
+
+    auto missing = std::make_shared<NegativeCache>();
+    HttpClient client;
+    client.setNegativeCache(missing);
+
+    std::vector<HttpRequest> requests;
+    for (int j = 0; j < 10; ++j)
+    {
+        requests.push_back(HttpRequest{server.url(j ? "/photo/huiluo" + std::to_string(j) + ".jpg" : "/photo/huiluo.jpg")});
+    }
+
+    client.perform(requests);
+    ASSERT_EQ(10, server.requests());
+    ASSERT_EQ(9u, missing->size());
+
+    std::vector<HttpResponse> responses = client.perform(requests);
+    ASSERT_EQ(11, server.requests()); // only the photo that exists was fetched again
+    ASSERT_TRUE(responses[0].ok());
+    ASSERT_EQ(404, responses[1].status);
+    ASSERT_TRUE(responses[1].fromCache);
+}
+
+TEST(http, negative_cache_entries_expire)
+{
+    TestServer server([](const std::string &, const std::vector<std::string> &) {
+        TestReply reply;
+        reply.status = 404;
+        return reply;
+    });
+
+    HttpClient client;
+    client.setNegativeCache(std::make_shared<NegativeCache>(std::chrono::seconds(0)));
+    client.perform(HttpRequest{server.url("/photo/huiluo1.jpg")});
+    client.perform(HttpRequest{server.url("/photo/huiluo1.jpg")});
+    ASSERT_EQ(2, server.requests());
+}
+
+#endif
+
+} // namespace http
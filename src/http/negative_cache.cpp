@@ -0,0 +1,219 @@
+#include "negative_cache.h"
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <mutex>
+
+namespace http
+{
+
+static uint64_t fnv1a(const std::string &text, uint64_t seed)
+{
+    uint64_t hash = 14695981039346656037ull ^ seed;
+    for (unsigned char c : text)
+    {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+CountingBloomFilter::CountingBloomFilter(size_t counters, int hashes)
+    : mCounters(std::max<size_t>(counters, 64), 0), mHashes(std::max(hashes, 1))
+{
+}
+
+// Double hashing: h1 + i * h2 behaves like k independent hash functions
+template <typename F> void CountingBloomFilter::forEachCounter(const std::string &key, F f) const
+{
+    uint64_t h1 = fnv1a(key, 0);
+    uint64_t h2 = fnv1a(key, 0x9e3779b97f4a7c15ull) | 1;
+    for (int i = 0; i < mHashes; ++i)
+    {
+        f((h1 + i * h2) % mCounters.size());
+    }
+}
+
+void CountingBloomFilter::add(const std::string &key)
+{
+    forEachCounter(key, [this](size_t i) {
+        if (mCounters[i] < 255)
+        {
+            ++mCounters[i];
+        }
+    });
+}
+
+void CountingBloomFilter::remove(const std::string &key)
+{
+    forEachCounter(key, [this](size_t i) {
+        if (mCounters[i] > 0 && mCounters[i] < 255)
+        {
+            --mCounters[i];
+        }
+    });
+}
+
+bool CountingBloomFilter::mayContain(const std::string &key) const
+{
+    bool result = true;
+    forEachCounter(key, [this, &result](size_t i) { result = result && mCounters[i] > 0; });
+    return result;
+}
+
+void CountingBloomFilter::clear()
+{
+    std::fill(mCounters.begin(), mCounters.end(), 0);
+}
+
+// About 10 counters per entry and 7 hashes give a false positive rate near 1%
+NegativeCache::NegativeCache(std::chrono::seconds ttl, size_t expectedEntries)
+    : mTtl(ttl), mBloom(expectedEntries * 10, 7)
+{
+}
+
+// Sweeps at least this far apart, so a small cache is not scanned on every add
+static const size_t MIN_SWEEP_INTERVAL = 1024;
+
+bool NegativeCache::contains(const std::string &url, int64_t now)
+{
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(mMutex);
+        if (!mBloom.mayContain(url))
+        {
+            return false;
+        }
+
+        auto iter = mExpiresAt.find(url);
+        if (iter == mExpiresAt.end())
+        {
+            return false;
+        }
+        if (now < iter->second)
+        {
+            return true;
+        }
+    }
+
+    // Expired: dropped now, so that its counters stop answering for other URLs
+    std::lock_guard<std::shared_timed_mutex> lock(mMutex);
+    auto iter = mExpiresAt.find(url);
+    if (iter == mExpiresAt.end())
+    {
+        return false;
+    }
+    if (now < iter->second)
+    {
+        return true; // added again meanwhile
+    }
+    mBloom.remove(url);
+    mExpiresAt.erase(iter);
+    return false;
+}
+
+void NegativeCache::add(const std::string &url, int64_t now)
+{
+    std::lock_guard<std::shared_timed_mutex> lock(mMutex);
+    auto result = mExpiresAt.emplace(url, now + mTtl.count());
+    if (result.second)
+    {
+        mBloom.add(url);
+        // Inserted as many as the last sweep left: at most twice those, and amortized O(1)
+        if (++mAddedSinceSweep >= std::max(MIN_SWEEP_INTERVAL, mExpiresAt.size() / 2))
+        {
+            sweep(now);
+        }
+    }
+    else
+    {
+        result.first->second = now + mTtl.count();
+    }
+}
+
+void NegativeCache::remove(const std::string &url)
+{
+    std::lock_guard<std::shared_timed_mutex> lock(mMutex);
+    if (mExpiresAt.erase(url))
+    {
+        mBloom.remove(url);
+    }
+}
+
+size_t NegativeCache::expire(int64_t now)
+{
+    std::lock_guard<std::shared_timed_mutex> lock(mMutex);
+    return sweep(now);
+}
+
+size_t NegativeCache::sweep(int64_t now)
+{
+    mAddedSinceSweep = 0;
+    size_t dropped = 0;
+    for (auto iter = mExpiresAt.begin(); iter != mExpiresAt.end();)
+    {
+        if (iter->second <= now)
+        {
+            mBloom.remove(iter->first);
+            iter = mExpiresAt.erase(iter);
+            ++dropped;
+        }
+        else
+        {
+            ++iter;
+        }
+    }
+    return dropped;
+}
+
+size_t NegativeCache::size() const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(mMutex);
+    return mExpiresAt.size();
+}
+
+bool NegativeCache::save(const std::string &path) const
+{
+    std::string temp = path + ".tmp";
+    {
+        std::ofstream out(temp, std::ios::trunc);
+        std::shared_lock<std::shared_timed_mutex> lock(mMutex);
+        for (const auto &item : mExpiresAt)
+        {
+            out << item.second << ' ' << item.first << '\n';
+        }
+        if (!out.flush())
+        {
+            return false;
+        }
+    }
+
+    boost::system::error_code ec;
+    boost::filesystem::rename(temp, path, ec);
+    return !ec;
+}
+
+bool NegativeCache::load(const std::string &path, int64_t now)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::shared_timed_mutex> lock(mMutex);
+    mExpiresAt.clear();
+    mBloom.clear();
+    mAddedSinceSweep = 0;
+
+    int64_t expiresAt = 0;
+    std::string url;
+    while (in >> expiresAt && in.get() == ' ' && std::getline(in, url))
+    {
+        if (expiresAt > now && mExpiresAt.emplace(url, expiresAt).second)
+        {
+            mBloom.add(url);
+        }
+    }
+    return true;
+}
+
+} // namespace http
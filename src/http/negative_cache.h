@@ -0,0 +1,62 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace http
+{
+
+// Bloom filter with 8-bit counters so that keys can be removed again. A counter that
+// saturates at 255 is never decremented, which keeps false negatives impossible.
+class CountingBloomFilter
+{
+  public:
+    CountingBloomFilter(size_t counters, int hashes);
+
+    void add(const std::string &key);
+    void remove(const std::string &key);
+    bool mayContain(const std::string &key) const;
+    void clear();
+
+  private:
+    template <typename F> void forEachCounter(const std::string &key, F f) const;
+
+    std::vector<uint8_t> mCounters;
+    int mHashes;
+};
+
+// Remembers URLs that answered 404/410 for a limited time. Most lookups are for URLs
+// that exist and are rejected by the Bloom filter without touching the exact map.
+// An expired entry is dropped when a lookup finds it, and the rest by a sweep
+// that add() runs once it has inserted as many entries as the last sweep left.
+class NegativeCache
+{
+  public:
+    explicit NegativeCache(std::chrono::seconds ttl = std::chrono::hours(1), size_t expectedEntries = 100000);
+
+    bool contains(const std::string &url, int64_t now = int64_t(std::time(nullptr)));
+    void add(const std::string &url, int64_t now = int64_t(std::time(nullptr)));
+    void remove(const std::string &url);
+    size_t expire(int64_t now = int64_t(std::time(nullptr))); // returns the number of entries dropped
+    size_t size() const;
+
+    // One "<expires-at> <url>" line per entry; expired entries are skipped on load
+    bool save(const std::string &path) const;
+    bool load(const std::string &path, int64_t now = int64_t(std::time(nullptr)));
+
+  private:
+    size_t sweep(int64_t now); // expire() with the lock held
+
+    std::chrono::seconds mTtl;
+    mutable std::shared_timed_mutex mMutex;
+    CountingBloomFilter mBloom;
+    std::unordered_map<std::string, int64_t> mExpiresAt;
+    size_t mAddedSinceSweep = 0;
+};
+
+} // namespace http
@@ -0,0 +1,464 @@
+#include "transfer_metrics.h"
+#include <algorithm>
+#include <functional>
+#include <unordered_set>
+
+namespace http
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// LatencyHistogram
+///////////////////////////////////////////////////////////////////////////////
+
+int LatencyHistogram::bucketOf(int64_t value)
+{
+    if (value < 4)
+    {
+        return value < 0 ? 0 : int(value);
+    }
+
+    int msb = 63;
+    while (!(uint64_t(value) >> msb))
+    {
+        --msb;
+    }
+
+    int bucket = 4 + (msb - 2) * 4 + int((uint64_t(value) >> (msb - 2)) & 3);
+    return std::min(bucket, BUCKETS - 1);
+}
+
+int64_t LatencyHistogram::lowerBound(int bucket)
+{
+    if (bucket < 4)
+    {
+        return bucket;
+    }
+
+    int shift = (bucket - 4) / 4;
+    int sub = (bucket - 4) % 4;
+    return int64_t(4 + sub) << shift;
+}
+
+int64_t LatencyHistogram::upperBound(int bucket)
+{
+    if (bucket < 4)
+    {
+        return bucket;
+    }
+
+    int shift = (bucket - 4) / 4;
+    return lowerBound(bucket) + (int64_t(1) << shift) - 1;
+}
+
+void LatencyHistogram::record(int64_t value)
+{
+    mCounts[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+    mSum.fetch_add(value, std::memory_order_relaxed);
+}
+
+void HistogramSnapshot::add(const LatencyHistogram &histogram)
+{
+    for (int i = 0; i < LatencyHistogram::BUCKETS; ++i)
+    {
+        uint64_t n = histogram.count(i);
+        counts[i] += n;
+        total += n;
+    }
+    sum += histogram.sum();
+}
+
+void HistogramSnapshot::merge(const HistogramSnapshot &other)
+{
+    for (int i = 0; i < LatencyHistogram::BUCKETS; ++i)
+    {
+        counts[i] += other.counts[i];
+    }
+    total += other.total;
+    sum += other.sum;
+}
+
+int64_t HistogramSnapshot::percentile(double p) const
+{
+    if (total == 0)
+    {
+        return 0;
+    }
+
+    uint64_t rank = uint64_t(std::max(1.0, p / 100.0 * total + 0.5));
+    uint64_t seen = 0;
+    for (int i = 0; i < LatencyHistogram::BUCKETS; ++i)
+    {
+        seen += counts[i];
+        if (seen >= rank)
+        {
+            return LatencyHistogram::upperBound(i);
+        }
+    }
+
+    return LatencyHistogram::upperBound(LatencyHistogram::BUCKETS - 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// TransferSample
+///////////////////////////////////////////////////////////////////////////////
+
+std::string hostOf(const std::string &url)
+{
+    size_t begin = url.find("://");
+    begin = (begin == std::string::npos) ? 0 : begin + 3;
+    size_t end = url.find_first_of("/?#", begin);
+    std::string authority = url.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+
+    size_t at = authority.rfind('@');
+    if (at != std::string::npos)
+    {
+        authority.erase(0, at + 1);
+    }
+
+    if (!authority.empty() && authority[0] == '[') // IPv6 literal
+    {
+        size_t close = authority.find(']');
+        return authority.substr(0, close == std::string::npos ? std::string::npos : close + 1);
+    }
+
+    return authority.substr(0, authority.find(':'));
+}
+
+#if LIBCURL_VERSION_NUM >= 0x073d00 // 7.61.0 added the CURLINFO_*_TIME_T family
+static int64_t timeOf(CURL *eh, CURLINFO info)
+{
+    curl_off_t us = 0;
+    curl_easy_getinfo(eh, info, &us);
+    return int64_t(us);
+}
+#define HTTP_TIME(eh, name) timeOf(eh, CURLINFO_##name##_TIME_T)
+#else
+static int64_t timeOf(CURL *eh, CURLINFO info)
+{
+    double seconds = 0;
+    curl_easy_getinfo(eh, info, &seconds);
+    return int64_t(seconds * 1e6);
+}
+#define HTTP_TIME(eh, name) timeOf(eh, CURLINFO_##name##_TIME)
+#endif
+
+TransferSample sampleTransfer(CURL *eh, CURLcode result)
+{
+    TransferSample sample;
+    sample.result = result;
+
+    char *url = NULL;
+    curl_easy_getinfo(eh, CURLINFO_EFFECTIVE_URL, &url);
+    if (url)
+    {
+        sample.host = hostOf(url);
+    }
+
+    curl_easy_getinfo(eh, CURLINFO_RESPONSE_CODE, &sample.status);
+
+    // All curl timings are measured from the start of the transfer
+    int64_t nameLookup = HTTP_TIME(eh, NAMELOOKUP);
+    int64_t connect = HTTP_TIME(eh, CONNECT);
+    int64_t appConnect = HTTP_TIME(eh, APPCONNECT);
+    sample.dnsUs = nameLookup;
+    sample.connectUs = std::max<int64_t>(0, connect - nameLookup);
+    sample.tlsUs = appConnect > 0 ? std::max<int64_t>(0, appConnect - connect) : 0;
+    sample.ttfbUs = HTTP_TIME(eh, STARTTRANSFER);
+    sample.totalUs = HTTP_TIME(eh, TOTAL);
+
+#if LIBCURL_VERSION_NUM >= 0x073700 // 7.55.0
+    curl_off_t down = 0, up = 0;
+    curl_easy_getinfo(eh, CURLINFO_SIZE_DOWNLOAD_T, &down);
+    curl_easy_getinfo(eh, CURLINFO_SIZE_UPLOAD_T, &up);
+#else
+    double down = 0, up = 0;
+    curl_easy_getinfo(eh, CURLINFO_SIZE_DOWNLOAD, &down);
+    curl_easy_getinfo(eh, CURLINFO_SIZE_UPLOAD, &up);
+#endif
+    sample.bytesDown = int64_t(down);
+    sample.bytesUp = int64_t(up);
+    return sample;
+}
+
+#undef HTTP_TIME
+
+///////////////////////////////////////////////////////////////////////////////
+// TransferMetrics
+///////////////////////////////////////////////////////////////////////////////
+
+struct TransferMetrics::HostSlot
+{
+    HostSlot(size_t key, std::string host) : key(key), host(std::move(host)) {}
+
+    const size_t key;
+    const std::string host;
+
+    std::atomic<uint64_t> transfers{0};
+    std::atomic<uint64_t> failures{0};
+    std::atomic<uint64_t> bytesDown{0};
+    std::atomic<uint64_t> bytesUp{0};
+    std::array<std::atomic<uint64_t>, 6> statusClasses{};
+    LatencyHistogram dns;
+    LatencyHistogram connect;
+    LatencyHistogram tls;
+    LatencyHistogram ttfb;
+    LatencyHistogram total;
+
+    void snapshot(HostMetrics &out) const
+    {
+        out.transfers += transfers.load(std::memory_order_relaxed);
+        out.failures += failures.load(std::memory_order_relaxed);
+        out.bytesDown += bytesDown.load(std::memory_order_relaxed);
+        out.bytesUp += bytesUp.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < statusClasses.size(); ++i)
+        {
+            out.statusClasses[i] += statusClasses[i].load(std::memory_order_relaxed);
+        }
+        out.dns.add(dns);
+        out.connect.add(connect);
+        out.tls.add(tls);
+        out.ttfb.add(ttfb);
+        out.total.add(total);
+    }
+};
+
+struct TransferMetrics::Shard
+{
+    // Open addressing; the last slot collects every host that no longer fits. A slot
+    // holds five histograms, so it is allocated when its host first shows up and a
+    // thread that talks to a few hosts costs a few slots.
+    static const size_t SLOTS = 64;
+    std::array<std::atomic<HostSlot *>, SLOTS + 1> slots{}; // published with release; null means free
+
+    ~Shard()
+    {
+        for (auto &slot : slots)
+        {
+            delete slot.load(std::memory_order_relaxed);
+        }
+    }
+
+    // Only the owning thread fills slots, so its own loads can be relaxed
+    HostSlot &find(const std::string &host)
+    {
+        size_t key = std::hash<std::string>()(host) | 1;
+        for (size_t i = 0; i < SLOTS; ++i)
+        {
+            std::atomic<HostSlot *> &slot = slots[(key + i) % SLOTS];
+            HostSlot *current = slot.load(std::memory_order_relaxed);
+            if (current == nullptr)
+            {
+                current = new HostSlot(key, host);
+                slot.store(current, std::memory_order_release);
+                return *current;
+            }
+            if (current->key == key && current->host == host)
+            {
+                return *current;
+            }
+        }
+
+        HostSlot *overflow = slots[SLOTS].load(std::memory_order_relaxed);
+        if (overflow == nullptr)
+        {
+            overflow = new HostSlot(1, "*");
+            slots[SLOTS].store(overflow, std::memory_order_release);
+        }
+        return *overflow;
+    }
+};
+
+static std::atomic<uint64_t> gNextMetricsId{1};
+
+// Ids of the instances alive, so a thread can drop what it cached for the others
+struct LiveMetrics
+{
+    std::mutex mutex;
+    std::unordered_set<uint64_t> ids;
+};
+
+static LiveMetrics &liveMetrics()
+{
+    static LiveMetrics live;
+    return live;
+}
+
+TransferMetrics::TransferMetrics() : mId(gNextMetricsId++)
+{
+    LiveMetrics &live = liveMetrics();
+    std::lock_guard<std::mutex> lock(live.mutex);
+    live.ids.insert(mId);
+}
+
+TransferMetrics::~TransferMetrics()
+{
+    LiveMetrics &live = liveMetrics();
+    std::lock_guard<std::mutex> lock(live.mutex);
+    live.ids.erase(mId);
+}
+
+TransferMetrics::Shard &TransferMetrics::localShard()
+{
+    // Keyed by id rather than address so a destroyed instance is never matched again
+    thread_local std::vector<std::pair<uint64_t, Shard *>> cache;
+    for (auto &entry : cache)
+    {
+        if (entry.first == mId)
+        {
+            return *entry.second;
+        }
+    }
+
+    // A miss comes once per thread and instance: forget the instances destroyed
+    // since, so the cache stays as long as the live ones
+    {
+        LiveMetrics &live = liveMetrics();
+        std::lock_guard<std::mutex> lock(live.mutex);
+        cache.erase(std::remove_if(cache.begin(), cache.end(),
+                                   [&live](const std::pair<uint64_t, Shard *> &entry) {
+                                       return live.ids.count(entry.first) == 0;
+                                   }),
+                    cache.end());
+    }
+
+    std::lock_guard<std::mutex> lock(mShardsMutex);
+    mShards.emplace_back(new Shard);
+    cache.emplace_back(mId, mShards.back().get());
+    return *mShards.back();
+}
+
+void TransferMetrics::record(CURL *eh, CURLcode result)
+{
+    record(sampleTransfer(eh, result));
+}
+
+void TransferMetrics::record(const TransferSample &sample)
+{
+    HostSlot &slot = localShard().find(sample.host);
+    const auto relaxed = std::memory_order_relaxed;
+
+    slot.transfers.fetch_add(1, relaxed);
+    if (sample.result != CURLE_OK || sample.status >= 400)
+    {
+        slot.failures.fetch_add(1, relaxed);
+    }
+    slot.bytesDown.fetch_add(uint64_t(std::max<int64_t>(0, sample.bytesDown)), relaxed);
+    slot.bytesUp.fetch_add(uint64_t(std::max<int64_t>(0, sample.bytesUp)), relaxed);
+
+    size_t statusClass = (sample.status >= 100 && sample.status < 600) ? size_t(sample.status / 100) : 0;
+    slot.statusClasses[statusClass].fetch_add(1, relaxed);
+
+    slot.dns.record(sample.dnsUs);
+    slot.connect.record(sample.connectUs);
+    if (sample.tlsUs > 0)
+    {
+        slot.tls.record(sample.tlsUs);
+    }
+    slot.ttfb.record(sample.ttfbUs);
+    slot.total.record(sample.totalUs);
+}
+
+std::vector<std::string> TransferMetrics::hosts() const
+{
+    std::vector<std::string> result;
+    std::lock_guard<std::mutex> lock(mShardsMutex);
+    for (const auto &shard : mShards)
+    {
+        for (const auto &entry : shard->slots)
+        {
+            const HostSlot *slot = entry.load(std::memory_order_acquire);
+            if (slot != nullptr && std::find(result.begin(), result.end(), slot->host) == result.end())
+            {
+                result.push_back(slot->host);
+            }
+        }
+    }
+    return result;
+}
+
+HostMetrics TransferMetrics::host(const std::string &host) const
+{
+    HostMetrics result;
+    result.host = host;
+
+    std::lock_guard<std::mutex> lock(mShardsMutex);
+    for (const auto &shard : mShards)
+    {
+        for (const auto &entry : shard->slots)
+        {
+            const HostSlot *slot = entry.load(std::memory_order_acquire);
+            if (slot != nullptr && slot->host == host)
+            {
+                slot->snapshot(result);
+            }
+        }
+    }
+    return result;
+}
+
+HostMetrics TransferMetrics::overall() const
+{
+    HostMetrics result;
+    result.host = "*";
+
+    std::lock_guard<std::mutex> lock(mShardsMutex);
+    for (const auto &shard : mShards)
+    {
+        for (const auto &entry : shard->slots)
+        {
+            const HostSlot *slot = entry.load(std::memory_order_acquire);
+            if (slot != nullptr)
+            {
+                slot->snapshot(result);
+            }
+        }
+    }
+    return result;
+}
+
+void HostMetrics::merge(const HostMetrics &other)
+{
+    transfers += other.transfers;
+    failures += other.failures;
+    bytesDown += other.bytesDown;
+    bytesUp += other.bytesUp;
+    for (size_t i = 0; i < statusClasses.size(); ++i)
+    {
+        statusClasses[i] += other.statusClasses[i];
+    }
+    dns.merge(other.dns);
+    connect.merge(other.connect);
+    tls.merge(other.tls);
+    ttfb.merge(other.ttfb);
+    total.merge(other.total);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ProgressThrottle
+///////////////////////////////////////////////////////////////////////////////
+
+ProgressThrottle::ProgressThrottle(std::chrono::milliseconds interval)
+    : mInterval(interval), mLast(std::chrono::steady_clock::now())
+{
+}
+
+bool ProgressThrottle::shouldReport(curl_off_t now, curl_off_t total)
+{
+    if (total > 0 && now >= total)
+    {
+        bool first = !mCompleted;
+        mCompleted = true;
+        return first;
+    }
+
+    auto current = std::chrono::steady_clock::now();
+    if (current - mLast < mInterval)
+    {
+        return false;
+    }
+
+    mLast = current;
+    return true;
+}
+
+} // namespace http
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "curl/curl.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace http
+{
+
+// Values are microseconds. Buckets are log-linear: four sub-buckets per power of two,
+// so every bucket is within 25% of the values it holds.
+class LatencyHistogram
+{
+  public:
+    static const int BUCKETS = 160;
+
+    static int bucketOf(int64_t value);
+    static int64_t lowerBound(int bucket);
+    static int64_t upperBound(int bucket);
+
+    // Only the owning thread calls record(), so relaxed increments are enough.
+    void record(int64_t value);
+
+    uint64_t count(int bucket) const { return mCounts[bucket].load(std::memory_order_relaxed); }
+    int64_t sum() const { return mSum.load(std::memory_order_relaxed); }
+
+  private:
+    std::array<std::atomic<uint64_t>, BUCKETS> mCounts{};
+    std::atomic<int64_t> mSum{0};
+};
+
+struct HistogramSnapshot
+{
+    std::vector<uint64_t> counts = std::vector<uint64_t>(LatencyHistogram::BUCKETS, 0);
+    uint64_t total = 0;
+    int64_t sum = 0;
+
+    void add(const LatencyHistogram &histogram);
+    void merge(const HistogramSnapshot &other);
+    int64_t percentile(double p) const; // p in [0, 100], upper bound of the matching bucket
+    double mean() const { return total ? double(sum) / total : 0.0; }
+};
+
+// One finished transfer, as reported by curl_easy_getinfo.
+struct TransferSample
+{
+    std::string host;
+    CURLcode result = CURLE_OK;
+    long status = 0;
+    int64_t dnsUs = 0;
+    int64_t connectUs = 0; // TCP connect, excluding DNS
+    int64_t tlsUs = 0;     // TLS handshake, zero for plain http
+    int64_t ttfbUs = 0;    // start of the request to the first byte
+    int64_t totalUs = 0;
+    int64_t bytesDown = 0;
+    int64_t bytesUp = 0;
+};
+
+TransferSample sampleTransfer(CURL *eh, CURLcode result);
+std::string hostOf(const std::string &url);
+
+struct HostMetrics
+{
+    std::string host;
+    uint64_t transfers = 0;
+    uint64_t failures = 0; // curl errors and http status >= 400
+    uint64_t bytesDown = 0;
+    uint64_t bytesUp = 0;
+    std::array<uint64_t, 6> statusClasses{}; // [0] no response, [1..5] 1xx..5xx
+    HistogramSnapshot dns;
+    HistogramSnapshot connect;
+    HistogramSnapshot tls;
+    HistogramSnapshot ttfb;
+    HistogramSnapshot total;
+
+    void merge(const HostMetrics &other);
+};
+
+// Collects per-host transfer metrics without taking a lock on the hot path. Every
+// recording thread gets its own shard; queries merge the shards on demand.
+class TransferMetrics
+{
+  public:
+    TransferMetrics();
+    ~TransferMetrics();
+    TransferMetrics(const TransferMetrics &) = delete;
+    TransferMetrics &operator=(const TransferMetrics &) = delete;
+
+    void record(CURL *eh, CURLcode result);
+    void record(const TransferSample &sample);
+
+    std::vector<std::string> hosts() const;
+    HostMetrics host(const std::string &host) const;
+    HostMetrics overall() const;
+
+  private:
+    struct HostSlot;
+    struct Shard;
+
+    Shard &localShard();
+
+    const uint64_t mId;
+    mutable std::mutex mShardsMutex; // guards the shard list, not the counters
+    std::vector<std::unique_ptr<Shard>> mShards;
+};
+
+// Rate limits progress output from CURLOPT_XFERINFOFUNCTION, which curl calls many
+// times per second per transfer.
+class ProgressThrottle
+{
+  public:
+    explicit ProgressThrottle(std::chrono::milliseconds interval = std::chrono::milliseconds(500));
+
+    // True when a report is due: the interval elapsed or the transfer just completed.
+    bool shouldReport(curl_off_t now, curl_off_t total);
+
+  private:
+    std::chrono::milliseconds mInterval;
+    std::chrono::steady_clock::time_point mLast;
+    bool mCompleted = false;
+};
+
+} // namespace http
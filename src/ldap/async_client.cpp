@@ -0,0 +1,339 @@
+#include "async_client.h"
+#include <algorithm>
+#include <event2/event.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace ldapclient
+{
+
+AsyncLdapClient::AsyncLdapClient(const LdapConfiguration &config, AsyncClientOptions options)
+    : mConnection(config, options.networkTimeout), mOptions(options), mIdentity(config.mUsername)
+{
+    mBase = event_base_new();
+    if (!mBase || socketpair(AF_UNIX, SOCK_STREAM, 0, mWakeFds) != 0)
+    {
+        if (mBase)
+        {
+            event_base_free(mBase);
+        }
+        throw LdapError(LDAP_NO_MEMORY, "AsyncLdapClient event loop");
+    }
+    for (int fd : mWakeFds)
+    {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    mWakeEvent = event_new(mBase, mWakeFds[0], EV_READ | EV_PERSIST, onWakeup, this);
+    event_add(mWakeEvent, NULL);
+    watchSocket();
+
+    // The wakeup event is always pending, so the loop only ends on loopbreak
+    mThread = std::thread([this] { event_base_dispatch(mBase); });
+}
+
+AsyncLdapClient::~AsyncLdapClient()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    wakeup();
+    mThread.join();
+
+    if (mSocketEvent)
+    {
+        event_free(mSocketEvent);
+    }
+    event_free(mWakeEvent);
+    event_base_free(mBase);
+    close(mWakeFds[0]);
+    close(mWakeFds[1]);
+}
+
+void AsyncLdapClient::search(SearchRequest request, Callback callback)
+{
+    SearchResult cached;
+    if (mOptions.cache && mOptions.cache->lookup(mIdentity, request, cached))
+    {
+        cached.fromCache = true;
+        callback(std::move(cached));
+        return;
+    }
+
+    std::unique_ptr<Operation> op(new Operation);
+    op->client = this;
+    op->request = std::move(request);
+    op->callback = std::move(callback);
+    op->started = Clock::now();
+    op->deadline = op->started + op->request.timeout;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mQueue.push_back(std::move(op));
+        ++mPending;
+    }
+    wakeup();
+}
+
+std::future<SearchResult> AsyncLdapClient::search(SearchRequest request)
+{
+    auto promise = std::make_shared<std::promise<SearchResult>>();
+    std::future<SearchResult> future = promise->get_future();
+    search(std::move(request), [promise](SearchResult result) { promise->set_value(std::move(result)); });
+    return future;
+}
+
+std::vector<SearchResult> AsyncLdapClient::searchAll(const std::vector<SearchRequest> &requests)
+{
+    std::vector<std::future<SearchResult>> futures;
+    futures.reserve(requests.size());
+    for (const auto &request : requests)
+    {
+        futures.push_back(search(request));
+    }
+
+    std::vector<SearchResult> results;
+    results.reserve(requests.size());
+    for (auto &future : futures)
+    {
+        results.push_back(future.get());
+    }
+    return results;
+}
+
+size_t AsyncLdapClient::pending() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mPending;
+}
+
+void AsyncLdapClient::wakeup()
+{
+    char c = 0;
+    // When the socket buffer is full a wakeup is already pending
+    (void)!write(mWakeFds[1], &c, 1);
+}
+
+void AsyncLdapClient::onWakeup(int fd, short, void *arg)
+{
+    char buf[256];
+    while (read(fd, buf, sizeof(buf)) > 0)
+    {
+    }
+    static_cast<AsyncLdapClient *>(arg)->drainQueue();
+}
+
+void AsyncLdapClient::onReadable(int, short, void *arg)
+{
+    static_cast<AsyncLdapClient *>(arg)->readResults();
+}
+
+void AsyncLdapClient::onTimeout(int, short, void *arg)
+{
+    Operation *op = static_cast<Operation *>(arg);
+    AsyncLdapClient *client = op->client;
+    int msgid = op->msgid;
+    ldap_abandon_ext(client->mConnection.get(), msgid, NULL, NULL);
+    client->complete(msgid, LDAP_TIMEOUT);
+    client->drainQueue();
+}
+
+// Sends queued searches while there is room, and ends the loop once the
+// client is shutting down and everything has completed
+void AsyncLdapClient::drainQueue()
+{
+    for (;;)
+    {
+        std::unique_ptr<Operation> op;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mQueue.empty())
+            {
+                if (mStopping && mOutstanding.empty())
+                {
+                    event_base_loopbreak(mBase);
+                }
+                return;
+            }
+            if (mOutstanding.size() >= mOptions.maxOutstanding)
+            {
+                return;
+            }
+            op = std::move(mQueue.front());
+            mQueue.pop_front();
+        }
+        issue(std::move(op));
+    }
+}
+
+void AsyncLdapClient::issue(std::unique_ptr<Operation> op)
+{
+    auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(op->deadline - Clock::now());
+    if (remaining.count() <= 0)
+    {
+        finish(*op, LDAP_TIMEOUT); // expired in the queue
+        return;
+    }
+
+    if (!mConnection.get())
+    {
+        reconnect();
+        if (!mConnection.get())
+        {
+            finish(*op, LDAP_SERVER_DOWN);
+            return;
+        }
+    }
+
+    const SearchRequest &request = op->request;
+    AttributeList attrs(request.attributes);
+    // The server-side time limit has a one second resolution; zero would mean none
+    long seconds = std::max<long>(1, long((request.timeout.count() + 999) / 1000));
+    struct timeval timeLimit = {seconds, 0};
+    int rc = ldap_search_ext(mConnection.get(), request.base.c_str(), request.scope,
+                             request.filter.empty() ? NULL : request.filter.c_str(), attrs.get(), 0, NULL, NULL,
+                             &timeLimit, request.sizeLimit, &op->msgid);
+    if (rc != LDAP_SUCCESS)
+    {
+        finish(*op, rc);
+        if (connectionLost(rc))
+        {
+            failAll(rc);
+        }
+        return;
+    }
+
+    struct timeval timeOut = {long(remaining.count() / 1000000), long(remaining.count() % 1000000)};
+    op->timer = evtimer_new(mBase, onTimeout, op.get());
+    evtimer_add(op->timer, &timeOut);
+    mOutstanding[op->msgid] = std::move(op);
+}
+
+void AsyncLdapClient::readResults()
+{
+    // libldap may have read several messages off the socket at once, so take
+    // everything it can hand out without blocking
+    struct timeval zero = {0, 0};
+    for (;;)
+    {
+        LDAPMessage *msg = NULL;
+        int type = ldap_result(mConnection.get(), LDAP_RES_ANY, LDAP_MSG_ONE, &zero, &msg);
+        if (type > 0)
+        {
+            dispatch(msg);
+            ldap_msgfree(msg);
+            continue;
+        }
+
+        ldap_msgfree(msg);
+        if (type < 0)
+        {
+            int rc = LDAP_SERVER_DOWN;
+            ldap_get_option(mConnection.get(), LDAP_OPT_RESULT_CODE, &rc);
+            failAll(rc);
+        }
+        break;
+    }
+    drainQueue();
+}
+
+void AsyncLdapClient::dispatch(LDAPMessage *msg)
+{
+    auto it = mOutstanding.find(ldap_msgid(msg));
+    if (it == mOutstanding.end())
+    {
+        return; // left over from an operation that timed out
+    }
+
+    SearchResult &result = it->second->result;
+    switch (ldap_msgtype(msg))
+    {
+    case LDAP_RES_SEARCH_ENTRY:
+        result.entries.push_back(decodeEntry(mConnection.get(), msg));
+        break;
+
+    case LDAP_RES_SEARCH_REFERENCE:
+        decodeReference(mConnection.get(), msg, result);
+        break;
+
+    case LDAP_RES_SEARCH_RESULT:
+        decodeDone(mConnection.get(), msg, result);
+        complete(it->first, result.rc);
+        break;
+
+    default:
+        break;
+    }
+}
+
+void AsyncLdapClient::complete(int msgid, int rc)
+{
+    auto it = mOutstanding.find(msgid);
+    std::unique_ptr<Operation> op = std::move(it->second);
+    mOutstanding.erase(it);
+    event_free(op->timer);
+    finish(*op, rc);
+}
+
+// ldap_result failed, so the connection is unusable and every search
+// sent on it is lost
+void AsyncLdapClient::failAll(int rc)
+{
+    std::vector<int> msgids;
+    for (const auto &op : mOutstanding)
+    {
+        msgids.push_back(op.first);
+    }
+    for (int msgid : msgids)
+    {
+        complete(msgid, rc);
+    }
+    reconnect();
+}
+
+void AsyncLdapClient::finish(Operation &op, int rc)
+{
+    op.result.rc = rc;
+    op.result.seconds = std::chrono::duration<double>(Clock::now() - op.started).count();
+    if (mOptions.cache && rc == LDAP_SUCCESS)
+    {
+        mOptions.cache->store(mIdentity, op.request, op.result);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        --mPending;
+    }
+    op.callback(std::move(op.result));
+}
+
+void AsyncLdapClient::reconnect()
+{
+    try
+    {
+        mConnection.reconnect();
+    }
+    catch (const LdapError &)
+    {
+        // retried by the next issue()
+    }
+    watchSocket();
+}
+
+void AsyncLdapClient::watchSocket()
+{
+    if (mSocketEvent)
+    {
+        event_free(mSocketEvent);
+        mSocketEvent = nullptr;
+    }
+
+    int fd = -1;
+    if (mConnection.get() && ldap_get_option(mConnection.get(), LDAP_OPT_DESC, &fd) == LDAP_OPT_SUCCESS && fd >= 0)
+    {
+        mSocketEvent = event_new(mBase, fd, EV_READ | EV_PERSIST, onReadable, this);
+        event_add(mSocketEvent, NULL);
+    }
+}
+
+} // namespace ldapclient
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "ldap_connection.h"
+#include "search_cache.h"
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+struct event;
+struct event_base;
+
+namespace ldapclient
+{
+
+struct AsyncClientOptions
+{
+    // Searches sent but not yet answered on the connection; the rest wait in the queue
+    size_t maxOutstanding = 64;
+    std::chrono::seconds networkTimeout{10};
+    // Answers repeated searches without a round trip; may be shared by clients
+    // bound as different users, as results are kept per bind DN
+    std::shared_ptr<SearchCache> cache;
+};
+
+// Pipelines searches over one bound connection. Requests are sent back to back
+// by the owner thread and their replies are routed by msgid, so N lookups cost
+// about one round trip instead of N.
+//
+// The owner thread sleeps in a libevent loop on the connection's socket, a wakeup
+// pipe for new submissions, and one timer per operation, so it uses no CPU while
+// it waits for the server.
+class AsyncLdapClient
+{
+  public:
+    using Callback = std::function<void(SearchResult)>;
+
+    // Throws LdapError when the first bind fails
+    explicit AsyncLdapClient(const LdapConfiguration &config, AsyncClientOptions options = AsyncClientOptions());
+    ~AsyncLdapClient(); // waits for every submitted search to finish
+    AsyncLdapClient(const AsyncLdapClient &) = delete;
+    AsyncLdapClient &operator=(const AsyncLdapClient &) = delete;
+
+    // Thread-safe. The callback runs on the owner thread and must not block;
+    // a cache hit completes it right away on the calling thread.
+    void search(SearchRequest request, Callback callback);
+    std::future<SearchResult> search(SearchRequest request);
+    // Submits all of them at once and waits; results are in request order
+    std::vector<SearchResult> searchAll(const std::vector<SearchRequest> &requests);
+
+    // Submitted and not yet completed
+    size_t pending() const;
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Operation
+    {
+        AsyncLdapClient *client = nullptr;
+        SearchRequest request;
+        Callback callback;
+        SearchResult result;
+        Clock::time_point started;
+        Clock::time_point deadline;
+        int msgid = -1;
+        event *timer = nullptr;
+    };
+
+    static void onWakeup(int fd, short what, void *arg);
+    static void onReadable(int fd, short what, void *arg);
+    static void onTimeout(int fd, short what, void *arg);
+
+    void wakeup();
+    void drainQueue();
+    void issue(std::unique_ptr<Operation> op);
+    void readResults();
+    void dispatch(LDAPMessage *msg);
+    void complete(int msgid, int rc);
+    void failAll(int rc);
+    void finish(Operation &op, int rc);
+    void reconnect();
+    void watchSocket();
+
+    LdapConnection mConnection; // used by the owner thread only
+    AsyncClientOptions mOptions;
+    const std::string mIdentity; // the bind DN, what cached results are kept under
+    std::unordered_map<int, std::unique_ptr<Operation>> mOutstanding; // owner thread only
+
+    event_base *mBase = nullptr;
+    event *mWakeEvent = nullptr;
+    event *mSocketEvent = nullptr;
+    int mWakeFds[2] = {-1, -1};
+
+    mutable std::mutex mMutex;
+    std::deque<std::unique_ptr<Operation>> mQueue;
+    size_t mPending = 0;
+    bool mStopping = false;
+    std::thread mThread;
+};
+
+} // namespace ldapclient
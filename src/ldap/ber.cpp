@@ -0,0 +1,158 @@
+#include "ber.h"
+
+namespace ldapclient
+{
+
+static std::string encodeLength(size_t length)
+{
+    if (length < 0x80)
+    {
+        return std::string(1, char(length));
+    }
+    std::string bytes;
+    for (; length > 0; length >>= 8)
+    {
+        bytes.insert(bytes.begin(), char(length & 0xff));
+    }
+    return std::string(1, char(0x80 | bytes.size())) + bytes;
+}
+
+long ber::frameLength(std::string_view data)
+{
+    if (data.size() < 2)
+    {
+        return 0;
+    }
+    size_t length = uint8_t(data[1]);
+    size_t header = 2;
+    if (length & 0x80)
+    {
+        size_t count = length & 0x7f;
+        if (count == 0 || count > 4)
+        {
+            return -1; // indefinite lengths are not allowed in LDAP
+        }
+        if (data.size() < 2 + count)
+        {
+            return 0;
+        }
+        length = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            length = (length << 8) | uint8_t(data[2 + i]);
+        }
+        header += count;
+    }
+    return data.size() < header + length ? 0 : long(header + length);
+}
+
+void BerWriter::begin(uint8_t tag)
+{
+    mData += char(tag);
+    mOpen.push_back(mData.size());
+}
+
+void BerWriter::end()
+{
+    size_t start = mOpen.back();
+    mOpen.pop_back();
+    mData.insert(start, encodeLength(mData.size() - start));
+}
+
+void BerWriter::integer(int64_t value, uint8_t tag)
+{
+    // Minimal two's complement, big-endian
+    std::string bytes;
+    do
+    {
+        bytes.insert(bytes.begin(), char(value & 0xff));
+        value >>= 8;
+    } while (!((value == 0 && !(bytes[0] & 0x80)) || (value == -1 && (bytes[0] & 0x80))));
+
+    mData += char(tag);
+    mData += encodeLength(bytes.size());
+    mData += bytes;
+}
+
+void BerWriter::boolean(bool value, uint8_t tag)
+{
+    mData += char(tag);
+    mData += char(1);
+    mData += char(value ? 0xff : 0x00);
+}
+
+void BerWriter::octets(std::string_view value, uint8_t tag)
+{
+    mData += char(tag);
+    mData += encodeLength(value.size());
+    mData.append(value.data(), value.size());
+}
+
+std::string BerWriter::take()
+{
+    std::string data;
+    data.swap(mData);
+    mOpen.clear();
+    return data;
+}
+
+std::string_view BerReader::next(uint8_t *tag)
+{
+    if (atEnd())
+    {
+        mOk = false;
+        return std::string_view();
+    }
+    long length = ber::frameLength(mData.substr(mPos));
+    if (length <= 0)
+    {
+        mOk = false;
+        return std::string_view();
+    }
+
+    std::string_view element = mData.substr(mPos, length);
+    mPos += length;
+    if (tag)
+    {
+        *tag = uint8_t(element[0]);
+    }
+    size_t header = (uint8_t(element[1]) & 0x80) ? 2 + (uint8_t(element[1]) & 0x7f) : 2;
+    return element.substr(header);
+}
+
+std::string_view BerReader::expect(uint8_t tag)
+{
+    if (peek() != tag)
+    {
+        mOk = false;
+        return std::string_view();
+    }
+    return next();
+}
+
+int64_t BerReader::decodeInteger(std::string_view contents)
+{
+    if (contents.empty())
+    {
+        return 0;
+    }
+    int64_t value = int8_t(contents[0]); // sign-extends
+    for (size_t i = 1; i < contents.size() && i < 8; ++i)
+    {
+        value = (value << 8) | uint8_t(contents[i]);
+    }
+    return value;
+}
+
+int64_t BerReader::integer(uint8_t tag)
+{
+    return decodeInteger(expect(tag));
+}
+
+bool BerReader::boolean(uint8_t tag)
+{
+    std::string_view contents = expect(tag);
+    return !contents.empty() && contents[0] != 0;
+}
+
+} // namespace ldapclient
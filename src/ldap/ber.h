@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ldapclient
+{
+
+// Just enough BER (X.690) to speak LDAPv3: definite lengths, single-byte tags.
+namespace ber
+{
+enum Tag : uint8_t
+{
+    BOOLEAN = 0x01,
+    INTEGER = 0x02,
+    OCTET_STRING = 0x04,
+    ENUMERATED = 0x0a,
+    SEQUENCE = 0x30,
+    SET = 0x31,
+};
+
+// The size of the complete element at the start of data, 0 when more bytes
+// are needed, -1 when it cannot be BER
+long frameLength(std::string_view data);
+} // namespace ber
+
+class BerWriter
+{
+  public:
+    // Opens a constructed element; its length is filled in by end()
+    void begin(uint8_t tag);
+    void end();
+
+    void integer(int64_t value, uint8_t tag = ber::INTEGER);
+    void enumerated(int64_t value) { integer(value, ber::ENUMERATED); }
+    void boolean(bool value, uint8_t tag = ber::BOOLEAN);
+    void octets(std::string_view value, uint8_t tag = ber::OCTET_STRING);
+    // Appends an already encoded element
+    void raw(std::string_view encoded) { mData.append(encoded.data(), encoded.size()); }
+
+    const std::string &data() const { return mData; }
+    std::string take();
+
+  private:
+    std::string mData;
+    std::vector<size_t> mOpen; // content offsets of the open elements
+};
+
+// Reads elements one after another. Errors are sticky: once ok() is false,
+// every read returns an empty value.
+class BerReader
+{
+  public:
+    explicit BerReader(std::string_view data) : mData(data) {}
+
+    bool ok() const { return mOk; }
+    bool atEnd() const { return !mOk || mPos >= mData.size(); }
+    // 0 at the end
+    uint8_t peek() const { return atEnd() ? 0 : uint8_t(mData[mPos]); }
+
+    // Any element; returns its contents
+    std::string_view next(uint8_t *tag = nullptr);
+    // The next element, which must carry tag
+    std::string_view expect(uint8_t tag);
+    BerReader enter(uint8_t tag) { return BerReader(expect(tag)); }
+
+    int64_t integer(uint8_t tag = ber::INTEGER);
+    int64_t enumerated() { return integer(ber::ENUMERATED); }
+    bool boolean(uint8_t tag = ber::BOOLEAN);
+    std::string_view octets(uint8_t tag = ber::OCTET_STRING) { return expect(tag); }
+
+    static int64_t decodeInteger(std::string_view contents);
+
+  private:
+    std::string_view mData;
+    size_t mPos = 0;
+    bool mOk = true;
+};
+
+} // namespace ldapclient
@@ -0,0 +1,186 @@
+#include "compact_result.h"
+#include <cctype>
+#include <strings.h>
+
+namespace ldapclient
+{
+
+static std::string_view viewOf(const struct berval &bv)
+{
+    return std::string_view(bv.bv_val ? bv.bv_val : "", bv.bv_len);
+}
+
+size_t CompactResult::NameHash::operator()(std::string_view name) const
+{
+    // FNV-1a over the lower-cased name
+    size_t hash = 14695981039346656037ull;
+    for (unsigned char c : name)
+    {
+        hash = (hash ^ size_t(std::tolower(c))) * 1099511628211ull;
+    }
+    return hash;
+}
+
+bool CompactResult::NameEqual::operator()(std::string_view a, std::string_view b) const
+{
+    return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+CompactResult::CompactResult(LDAP *ld, LDAPMessage *chain)
+{
+    append(ld, chain);
+}
+
+CompactResult::~CompactResult()
+{
+    release();
+}
+
+CompactResult::CompactResult(CompactResult &&other) noexcept
+    : mMessages(std::move(other.mMessages)), mEntries(std::move(other.mEntries)),
+      mAttributes(std::move(other.mAttributes)), mValues(std::move(other.mValues)), mNames(std::move(other.mNames)),
+      mNameIds(std::move(other.mNameIds))
+{
+    other.mMessages.clear();
+}
+
+CompactResult &CompactResult::operator=(CompactResult &&other) noexcept
+{
+    if (this != &other)
+    {
+        release();
+        mMessages = std::move(other.mMessages);
+        mEntries = std::move(other.mEntries);
+        mAttributes = std::move(other.mAttributes);
+        mValues = std::move(other.mValues);
+        mNames = std::move(other.mNames);
+        mNameIds = std::move(other.mNameIds);
+        other.mMessages.clear();
+    }
+    return *this;
+}
+
+void CompactResult::release()
+{
+    for (LDAPMessage *msg : mMessages)
+    {
+        ldap_msgfree(msg);
+    }
+    mMessages.clear();
+}
+
+void CompactResult::append(LDAP *ld, LDAPMessage *chain)
+{
+    if (chain == NULL)
+    {
+        return;
+    }
+    mMessages.push_back(chain);
+
+    int count = ldap_count_entries(ld, chain);
+    if (count > 0)
+    {
+        mEntries.reserve(mEntries.size() + count);
+    }
+    for (LDAPMessage *entry = ldap_first_entry(ld, chain); entry != NULL; entry = ldap_next_entry(ld, entry))
+    {
+        decode(ld, entry);
+    }
+}
+
+void CompactResult::decode(LDAP *ld, LDAPMessage *entry)
+{
+    // Both calls parse the entry in place: attr and the value bervals point
+    // into the message, only the array holding the values is allocated
+    BerElement *ber = NULL;
+    struct berval dn;
+    if (ldap_get_dn_ber(ld, entry, &ber, &dn) != LDAP_SUCCESS)
+    {
+        return;
+    }
+
+    Slot slot = {viewOf(dn), uint32_t(mAttributes.size()), 0};
+    struct berval attr;
+    struct berval *vals = NULL;
+    while (ldap_get_attribute_ber(ld, entry, ber, &attr, &vals) == LDAP_SUCCESS && attr.bv_val != NULL)
+    {
+        Attribute attribute = {intern(viewOf(attr)), uint32_t(mValues.size()), 0};
+        for (struct berval *v = vals; v != NULL && v->bv_val != NULL; ++v)
+        {
+            mValues.push_back(viewOf(*v));
+            ++attribute.valueCount;
+        }
+        ber_memfree(vals);
+        vals = NULL;
+
+        mAttributes.push_back(attribute);
+        ++slot.attributeCount;
+    }
+
+    ber_free(ber, 0);
+    mEntries.push_back(slot);
+}
+
+uint32_t CompactResult::intern(std::string_view name)
+{
+    auto it = mNameIds.find(name);
+    if (it != mNameIds.end())
+    {
+        return it->second;
+    }
+    uint32_t id = uint32_t(mNames.size());
+    mNames.push_back(name);
+    mNameIds.emplace(name, id);
+    return id;
+}
+
+uint32_t CompactResult::nameId(std::string_view name) const
+{
+    auto it = mNameIds.find(name);
+    return it == mNameIds.end() ? UINT32_MAX : it->second;
+}
+
+std::string_view CompactResult::Entry::dn() const
+{
+    return mResult->mEntries[mIndex].dn;
+}
+
+size_t CompactResult::Entry::size() const
+{
+    return mResult->mEntries[mIndex].attributeCount;
+}
+
+std::string_view CompactResult::Entry::name(size_t attribute) const
+{
+    const Attribute &a = mResult->mAttributes[mResult->mEntries[mIndex].firstAttribute + attribute];
+    return mResult->mNames[a.name];
+}
+
+CompactResult::Values CompactResult::Entry::values(size_t attribute) const
+{
+    const Attribute &a = mResult->mAttributes[mResult->mEntries[mIndex].firstAttribute + attribute];
+    const std::string_view *first = mResult->mValues.data() + a.firstValue;
+    return Values(first, first + a.valueCount);
+}
+
+CompactResult::Values CompactResult::Entry::values(std::string_view name) const
+{
+    uint32_t id = mResult->nameId(name);
+    const Slot &slot = mResult->mEntries[mIndex];
+    for (uint32_t i = 0; id != UINT32_MAX && i < slot.attributeCount; ++i)
+    {
+        if (mResult->mAttributes[slot.firstAttribute + i].name == id)
+        {
+            return values(i);
+        }
+    }
+    return Values(nullptr, nullptr);
+}
+
+std::string_view CompactResult::Entry::value(std::string_view name) const
+{
+    Values v = values(name);
+    return v.empty() ? std::string_view() : v[0];
+}
+
+} // namespace ldapclient
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstdint>
+#include <ldap.h>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace ldapclient
+{
+
+// A decoded search response that copies nothing. It keeps the LDAPMessages it
+// was given, and the DNs, attribute names and values are string_views into their
+// BER buffers. Each entry is a slice of three flat index arrays, so decoding
+// costs a handful of growing vectors instead of a heap string per value, and
+// the destructor releases the lot at once.
+//
+// Attribute names are interned per response: "mail" and "Mail" share one id,
+// and lookups by name compare ids instead of strings.
+class CompactResult
+{
+  public:
+    class Values
+    {
+      public:
+        Values(const std::string_view *begin, const std::string_view *end) : mBegin(begin), mEnd(end) {}
+        const std::string_view *begin() const { return mBegin; }
+        const std::string_view *end() const { return mEnd; }
+        size_t size() const { return mEnd - mBegin; }
+        bool empty() const { return mBegin == mEnd; }
+        std::string_view operator[](size_t i) const { return mBegin[i]; }
+
+      private:
+        const std::string_view *mBegin;
+        const std::string_view *mEnd;
+    };
+
+    class Entry
+    {
+      public:
+        std::string_view dn() const;
+        size_t size() const; // number of attributes
+        std::string_view name(size_t attribute) const;
+        Values values(size_t attribute) const;
+        // Case-insensitive; empty when the entry does not carry it
+        Values values(std::string_view name) const;
+        // The first value, or an empty view
+        std::string_view value(std::string_view name) const;
+
+      private:
+        friend class CompactResult;
+        Entry(const CompactResult *result, size_t index) : mResult(result), mIndex(index) {}
+
+        const CompactResult *mResult;
+        size_t mIndex;
+    };
+
+    CompactResult() = default;
+    // Takes ownership of chain, as returned by ldap_search_ext_s or ldap_result
+    CompactResult(LDAP *ld, LDAPMessage *chain);
+    ~CompactResult();
+    CompactResult(CompactResult &&other) noexcept;
+    CompactResult &operator=(CompactResult &&other) noexcept;
+    CompactResult(const CompactResult &) = delete;
+    CompactResult &operator=(const CompactResult &) = delete;
+
+    // Takes ownership of chain and decodes every entry in it; use this for
+    // messages collected one at a time with LDAP_MSG_ONE
+    void append(LDAP *ld, LDAPMessage *chain);
+
+    size_t size() const { return mEntries.size(); }
+    bool empty() const { return mEntries.empty(); }
+    Entry operator[](size_t i) const { return Entry(this, i); }
+
+    // Distinct attribute names seen so far
+    size_t names() const { return mNames.size(); }
+    // UINT32_MAX when no entry carries the attribute
+    uint32_t nameId(std::string_view name) const;
+
+  private:
+    struct Slot
+    {
+        std::string_view dn;
+        uint32_t firstAttribute;
+        uint32_t attributeCount;
+    };
+
+    struct Attribute
+    {
+        uint32_t name;
+        uint32_t firstValue;
+        uint32_t valueCount;
+    };
+
+    struct NameHash
+    {
+        size_t operator()(std::string_view name) const;
+    };
+    struct NameEqual
+    {
+        bool operator()(std::string_view a, std::string_view b) const;
+    };
+
+    void decode(LDAP *ld, LDAPMessage *entry);
+    uint32_t intern(std::string_view name);
+    void release();
+
+    std::vector<LDAPMessage *> mMessages; // own the buffers every view points into
+    std::vector<Slot> mEntries;
+    std::vector<Attribute> mAttributes;
+    std::vector<std::string_view> mValues;
+    std::vector<std::string_view> mNames;
+    std::unordered_map<std::string_view, uint32_t, NameHash, NameEqual> mNameIds;
+};
+
+} // namespace ldapclient
@@ -0,0 +1,231 @@
+#include "connection_pool.h"
+#include "server_set.h"
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+namespace ldapclient
+{
+
+LdapConnectionPool::Lease::Lease(LdapConnectionPool *pool, std::unique_ptr<LdapConnection> connection)
+    : mPool(pool), mConnection(std::move(connection))
+{
+}
+
+LdapConnectionPool::Lease::Lease(Lease &&other) noexcept
+    : mPool(other.mPool), mConnection(std::move(other.mConnection))
+{
+}
+
+LdapConnectionPool::Lease &LdapConnectionPool::Lease::operator=(Lease &&other) noexcept
+{
+    if (this != &other)
+    {
+        if (mConnection)
+        {
+            mPool->giveBack(std::move(mConnection));
+        }
+        mPool = other.mPool;
+        mConnection = std::move(other.mConnection);
+    }
+    return *this;
+}
+
+LdapConnectionPool::Lease::~Lease()
+{
+    if (mConnection)
+    {
+        mPool->giveBack(std::move(mConnection));
+    }
+}
+
+LdapConnectionPool::LdapConnectionPool(LdapConfiguration config, LdapPoolOptions options)
+    : mConfig(std::move(config)), mOptions(options)
+{
+    if (!mConfig.mSecondaryServers.empty())
+    {
+        FailoverOptions failover;
+        failover.connectTimeout = mOptions.networkTimeout;
+        mServers = std::make_shared<LdapServerSet>(mConfig, failover);
+    }
+    mHealthChecker = std::thread([this] {
+        warm(mOptions.warmConnections);
+        healthLoop();
+    });
+}
+
+LdapConnectionPool::~LdapConnectionPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mStop.notify_all();
+    mHealthChecker.join();
+}
+
+LdapConnectionPool::Lease LdapConnectionPool::checkout()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    bool available = mAvailable.wait_for(lock, mOptions.checkoutTimeout, [this] {
+        return !mIdle.empty() || mOpen < mOptions.maxConnections;
+    });
+    if (!available)
+    {
+        throw LdapError(LDAP_TIMEOUT, "LdapConnectionPool::checkout");
+    }
+
+    if (!mIdle.empty())
+    {
+        // LIFO: the most recently used connection is the least likely to have been dropped
+        std::unique_ptr<LdapConnection> connection = std::move(mIdle.back().connection);
+        mIdle.pop_back();
+        return Lease(this, std::move(connection));
+    }
+
+    ++mOpen;
+    lock.unlock();
+
+    try
+    {
+        return Lease(this, std::unique_ptr<LdapConnection>(new LdapConnection(mConfig, mOptions.networkTimeout, mServers)));
+    }
+    catch (...)
+    {
+        lock.lock();
+        --mOpen;
+        lock.unlock();
+        mAvailable.notify_one();
+        throw;
+    }
+}
+
+void LdapConnectionPool::giveBack(std::unique_ptr<LdapConnection> connection)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (connection->get())
+        {
+            mIdle.push_back(Idle{std::move(connection), Clock::now()});
+        }
+        else
+        {
+            --mOpen; // a failed reconnect left it without a handle
+        }
+    }
+    mAvailable.notify_one();
+}
+
+size_t LdapConnectionPool::warm(size_t count)
+{
+    if (count == 0 || !openIdle(count))
+    {
+        return 0;
+    }
+
+    std::atomic<size_t> opened{1};
+    std::vector<std::thread> openers;
+    for (size_t i = 1; i < std::min(count, mOptions.maxConnections); ++i)
+    {
+        openers.emplace_back([this, count, &opened] { opened += openIdle(count); });
+    }
+    for (std::thread &opener : openers)
+    {
+        opener.join();
+    }
+    return opened;
+}
+
+bool LdapConnectionPool::openIdle(size_t count)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mStopping || mOpen >= std::min(count, mOptions.maxConnections))
+        {
+            return false;
+        }
+        ++mOpen;
+    }
+
+    try
+    {
+        giveBack(std::unique_ptr<LdapConnection>(new LdapConnection(mConfig, mOptions.networkTimeout, mServers)));
+        return true;
+    }
+    catch (const LdapError &)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            --mOpen;
+        }
+        mAvailable.notify_one();
+        return false;
+    }
+}
+
+void LdapConnectionPool::healthLoop()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (!mStop.wait_for(lock, mOptions.healthCheckInterval, [this] { return mStopping; }))
+    {
+        // Take every stale one out, probe them outside the lock, and return the
+        // survivors at the back as just checked, so the order checkout() relies on holds
+        auto staleBefore = Clock::now() - mOptions.healthCheckInterval;
+        std::vector<std::unique_ptr<LdapConnection>> stale;
+        while (!mIdle.empty() && mIdle.front().since <= staleBefore)
+        {
+            stale.push_back(std::move(mIdle.front().connection));
+            mIdle.pop_front();
+        }
+        if (stale.empty())
+        {
+            continue;
+        }
+        lock.unlock();
+
+        size_t lost = 0;
+        for (std::unique_ptr<LdapConnection> &connection : stale)
+        {
+            if (connection->healthy())
+            {
+                continue;
+            }
+            try
+            {
+                connection->reconnect();
+            }
+            catch (const LdapError &)
+            {
+                connection.reset();
+                ++lost;
+            }
+        }
+
+        lock.lock();
+        for (std::unique_ptr<LdapConnection> &connection : stale)
+        {
+            if (connection)
+            {
+                mIdle.push_back(Idle{std::move(connection), Clock::now()});
+            }
+        }
+        mOpen -= lost;
+        mAvailable.notify_all();
+    }
+
+    mIdle.clear();
+}
+
+size_t LdapConnectionPool::idle() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mIdle.size();
+}
+
+size_t LdapConnectionPool::open() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mOpen;
+}
+
+} // namespace ldapclient
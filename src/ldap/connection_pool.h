@@ -0,0 +1,119 @@
+#pragma once
+
+#include "ldap_connection.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace ldapclient
+{
+
+struct LdapPoolOptions
+{
+    size_t maxConnections = 4;
+    std::chrono::milliseconds checkoutTimeout{5000};
+    // Idle connections unused for this long are probed and rebound if the probe fails
+    std::chrono::seconds healthCheckInterval{30};
+    std::chrono::seconds networkTimeout{10};
+    // Opened in the background as soon as the pool exists, so the first
+    // requests do not wait for binds (and TLS handshakes)
+    size_t warmConnections = 0;
+};
+
+// Keeps bound connections for one LdapConfiguration and lends them to threads.
+// Connections are opened on demand up to maxConnections. With secondary servers
+// configured they all open through one LdapServerSet, so every connection
+// benefits from what the others learned about the servers.
+class LdapConnectionPool
+{
+  public:
+    class Lease
+    {
+      public:
+        Lease(Lease &&other) noexcept;
+        Lease &operator=(Lease &&other) noexcept;
+        ~Lease();
+
+        LDAP *get() const { return mConnection->get(); }
+        LdapConnection &connection() const { return *mConnection; }
+        // Rebinds after connectionLost(); throws LdapError if the server is still gone
+        void reconnect() { mConnection->reconnect(); }
+
+      private:
+        friend class LdapConnectionPool;
+        Lease(LdapConnectionPool *pool, std::unique_ptr<LdapConnection> connection);
+
+        LdapConnectionPool *mPool;
+        std::unique_ptr<LdapConnection> mConnection;
+    };
+
+    explicit LdapConnectionPool(LdapConfiguration config, LdapPoolOptions options = LdapPoolOptions());
+    ~LdapConnectionPool(); // every Lease must have been returned
+    LdapConnectionPool(const LdapConnectionPool &) = delete;
+    LdapConnectionPool &operator=(const LdapConnectionPool &) = delete;
+
+    // Throws LdapError(LDAP_TIMEOUT) when no connection frees up within checkoutTimeout,
+    // or the bind error when a new connection cannot be opened
+    Lease checkout();
+
+    // Opens connections until count are open or the pool is full: one first,
+    // whose TLS session the others then resume, and the rest concurrently.
+    // Returns how many it opened; failures are left to checkout() to report.
+    size_t warm(size_t count);
+
+    // Runs f(LDAP *) -> rc on a pooled connection, rebinding and retrying once when
+    // the connection turns out to be lost
+    template <typename F> int run(F f)
+    {
+        Lease lease = checkout();
+        int rc = f(lease.get());
+        if (connectionLost(rc))
+        {
+            try
+            {
+                lease.reconnect();
+            }
+            catch (const LdapError &e)
+            {
+                return e.code();
+            }
+            rc = f(lease.get());
+        }
+        return rc;
+    }
+
+    size_t idle() const;
+    size_t open() const;
+    const LdapConfiguration &config() const { return mConfig; }
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Idle
+    {
+        std::unique_ptr<LdapConnection> connection;
+        Clock::time_point since;
+    };
+
+    void giveBack(std::unique_ptr<LdapConnection> connection);
+    // Opens one more idle connection unless count are open; false when it did not
+    bool openIdle(size_t count);
+    void healthLoop();
+
+    LdapConfiguration mConfig;
+    LdapPoolOptions mOptions;
+    std::shared_ptr<LdapServerSet> mServers; // one set of scores for every connection; null for a single server
+
+    mutable std::mutex mMutex;
+    std::condition_variable mAvailable;
+    std::condition_variable mStop;
+    std::deque<Idle> mIdle; // most recently returned at the back
+    size_t mOpen = 0;       // idle, lent out, or being opened
+    bool mStopping = false;
+    std::thread mHealthChecker;
+};
+
+} // namespace ldapclient
@@ -0,0 +1,276 @@
+#include "dn_store.h"
+#include "search_cache.h"
+#include <functional>
+
+namespace ldapclient
+{
+
+static const size_t MIN_TABLE = 16;
+
+// Leading blanks, and trailing ones that are not escaped
+static std::string_view trim(std::string_view rdn)
+{
+    while (!rdn.empty() && rdn.front() == ' ')
+    {
+        rdn.remove_prefix(1);
+    }
+    while (!rdn.empty() && rdn.back() == ' ' && (rdn.size() < 2 || rdn[rdn.size() - 2] != '\\'))
+    {
+        rdn.remove_suffix(1);
+    }
+    return rdn;
+}
+
+// The RDNs of dn, leftmost first; none for the empty DN
+static void splitDn(std::string_view dn, std::vector<std::string_view> &rdns)
+{
+    rdns.clear();
+    if (trim(dn).empty())
+    {
+        return;
+    }
+    size_t start = 0;
+    for (size_t i = 0; i <= dn.size(); ++i)
+    {
+        if (i + 1 < dn.size() && dn[i] == '\\')
+        {
+            ++i;
+        }
+        else if (i == dn.size() || dn[i] == ',')
+        {
+            rdns.push_back(trim(dn.substr(start, i - start)));
+            start = i + 1;
+        }
+    }
+}
+
+static std::string normalizeRdn(std::string_view rdn)
+{
+    return SearchCache::normalizeDn(std::string(rdn));
+}
+
+// What a string holds outside of itself
+static size_t heapBytes(const std::string &s)
+{
+    static const size_t inside = std::string().capacity();
+    return s.capacity() > inside ? s.capacity() + 1 : 0;
+}
+
+DnStore::DnStore()
+{
+    clear();
+}
+
+uint32_t DnStore::hash(Id parent, const std::string &normalized)
+{
+    uint64_t h = std::hash<std::string>()(normalized) ^ (uint64_t(parent) * 0x9e3779b97f4a7c15ull);
+    return uint32_t(h ^ (h >> 32));
+}
+
+DnStore::Id DnStore::child(Id parent, std::string_view rdn, const std::string &normalized, uint32_t hash) const
+{
+    size_t mask = mTable.size() - 1;
+    for (size_t i = hash & mask; mTable[i] != NONE; i = (i + 1) & mask)
+    {
+        const Node &node = mNodes[mTable[i]];
+        if (node.hash == hash && node.parent == parent && (node.rdn == rdn || normalizeRdn(node.rdn) == normalized))
+        {
+            return mTable[i];
+        }
+    }
+    return NONE;
+}
+
+DnStore::Id DnStore::intern(std::string_view dn)
+{
+    std::vector<std::string_view> rdns;
+    splitDn(dn, rdns);
+    Id id = ROOT;
+    for (auto it = rdns.rbegin(); it != rdns.rend(); ++it)
+    {
+        std::string normalized = normalizeRdn(*it);
+        uint32_t h = hash(id, normalized);
+        Id next = child(id, *it, normalized, h);
+        id = next != NONE ? next : add(id, *it, h);
+    }
+    ++mNodes[id].references;
+    return id;
+}
+
+DnStore::Id DnStore::find(std::string_view dn) const
+{
+    std::vector<std::string_view> rdns;
+    splitDn(dn, rdns);
+    Id id = ROOT;
+    for (auto it = rdns.rbegin(); it != rdns.rend() && id != NONE; ++it)
+    {
+        std::string normalized = normalizeRdn(*it);
+        id = child(id, *it, normalized, hash(id, normalized));
+    }
+    return id;
+}
+
+void DnStore::release(Id id)
+{
+    --mNodes[id].references;
+    // A leaf nobody refers to goes, and so may its parent then
+    while (id != ROOT && mNodes[id].references == 0 && mNodes[id].firstChild == NONE)
+    {
+        Id parent = mNodes[id].parent;
+        remove(id);
+        id = parent;
+    }
+}
+
+DnStore::Id DnStore::add(Id parent, std::string_view rdn, uint32_t hash)
+{
+    Id id;
+    if (!mFree.empty())
+    {
+        id = mFree.back();
+        mFree.pop_back();
+    }
+    else
+    {
+        id = Id(mNodes.size());
+        mNodes.emplace_back();
+    }
+    Node &node = mNodes[id];
+    node.rdn.assign(rdn.data(), rdn.size());
+    node.parent = parent;
+    node.firstChild = NONE;
+    node.previous = NONE;
+    node.next = mNodes[parent].firstChild;
+    node.references = 0;
+    node.hash = hash;
+    if (node.next != NONE)
+    {
+        mNodes[node.next].previous = id;
+    }
+    mNodes[parent].firstChild = id;
+    mRdnBytes += heapBytes(node.rdn);
+
+    ++mLive;
+    if (mTable.size() < 2 * (mLive + 1))
+    {
+        grow();
+    }
+    else
+    {
+        place(id);
+    }
+    return id;
+}
+
+void DnStore::remove(Id id)
+{
+    unplace(id);
+    Node &node = mNodes[id];
+    if (node.previous != NONE)
+    {
+        mNodes[node.previous].next = node.next;
+    }
+    else
+    {
+        mNodes[node.parent].firstChild = node.next;
+    }
+    if (node.next != NONE)
+    {
+        mNodes[node.next].previous = node.previous;
+    }
+    mRdnBytes -= heapBytes(node.rdn);
+    node = Node();
+    mFree.push_back(id);
+    --mLive;
+}
+
+void DnStore::place(Id id)
+{
+    size_t mask = mTable.size() - 1;
+    size_t i = mNodes[id].hash & mask;
+    while (mTable[i] != NONE)
+    {
+        i = (i + 1) & mask;
+    }
+    mTable[i] = id;
+}
+
+void DnStore::unplace(Id id)
+{
+    size_t mask = mTable.size() - 1;
+    size_t hole = mNodes[id].hash & mask;
+    while (mTable[hole] != id)
+    {
+        hole = (hole + 1) & mask;
+    }
+    // Shift back what follows in the run, so lookups need no tombstones
+    for (size_t i = (hole + 1) & mask; mTable[i] != NONE; i = (i + 1) & mask)
+    {
+        size_t home = mNodes[mTable[i]].hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            mTable[hole] = mTable[i];
+            hole = i;
+        }
+    }
+    mTable[hole] = NONE;
+}
+
+void DnStore::grow()
+{
+    size_t size = MIN_TABLE;
+    while (size < 4 * (mLive + 1))
+    {
+        size *= 2;
+    }
+    mTable.assign(size, NONE);
+    for (Id id = ROOT + 1; id < mNodes.size(); ++id)
+    {
+        if (mNodes[id].parent != NONE)
+        {
+            place(id);
+        }
+    }
+}
+
+std::string DnStore::dn(Id id) const
+{
+    std::string dn;
+    for (Id leaf = id; id != ROOT && id != NONE; id = mNodes[id].parent)
+    {
+        if (id != leaf)
+        {
+            dn += ',';
+        }
+        dn += mNodes[id].rdn;
+    }
+    return dn;
+}
+
+bool DnStore::within(Id id, Id base) const
+{
+    for (; id != NONE; id = mNodes[id].parent)
+    {
+        if (id == base)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t DnStore::bytes() const
+{
+    return mLive * sizeof(Node) + mRdnBytes + mTable.size() * sizeof(Id);
+}
+
+void DnStore::clear()
+{
+    mNodes.assign(1, Node());
+    mFree.clear();
+    mTable.assign(MIN_TABLE, NONE);
+    mLive = 0;
+    mRdnBytes = 0;
+}
+
+} // namespace ldapclient
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ldapclient
+{
+
+// Distinguished names interned as a trie of their RDNs, suffix first, so the
+// "ou=Employees,ou=Cisco Users,dc=cisco,dc=com" that every entry of a company
+// directory ends with is held once, and each DN is one node naming its last RDN
+// and its parent. A DN is then known by a 32-bit id: equal DNs have equal ids,
+// and the parent, the children and whether one DN lies under another are found
+// by following links instead of comparing strings.
+//
+// RDNs compare as SearchCache::normalizeDn() has it; a node keeps the spelling
+// it was first interned with. Ids are reference counted, and a node goes when
+// its last reference and child do, so a store following a directory does not
+// grow with the changes. Not thread-safe.
+class DnStore
+{
+  public:
+    using Id = uint32_t;
+    static constexpr Id ROOT = 0; // the empty DN
+    static constexpr Id NONE = std::numeric_limits<Id>::max();
+
+    DnStore();
+
+    // Takes a reference to dn, adding the nodes it lacks
+    Id intern(std::string_view dn);
+    // Drops a reference taken by intern()
+    void release(Id id);
+    // NONE when dn is not interned
+    Id find(std::string_view dn) const;
+
+    std::string dn(Id id) const;
+    std::string_view rdn(Id id) const { return mNodes[id].rdn; }
+    Id parent(Id id) const { return mNodes[id].parent; }
+    // Children come in no particular order; NONE after the last
+    Id firstChild(Id id) const { return mNodes[id].firstChild; }
+    Id nextSibling(Id id) const { return mNodes[id].next; }
+    // id is base or lies below it
+    bool within(Id id, Id base) const;
+
+    size_t size() const { return mLive; } // nodes, the root excepted
+    // One past the largest id, for tables indexed by id
+    size_t capacity() const { return mNodes.size(); }
+    // About what the nodes and the lookup table take
+    size_t bytes() const;
+    void clear();
+
+  private:
+    struct Node
+    {
+        std::string rdn;
+        Id parent = NONE; // NONE for a free node
+        Id firstChild = NONE;
+        Id previous = NONE; // siblings
+        Id next = NONE;
+        uint32_t references = 0;
+        uint32_t hash = 0; // of the parent and the normalised RDN
+    };
+
+    static uint32_t hash(Id parent, const std::string &normalized);
+    Id child(Id parent, std::string_view rdn, const std::string &normalized, uint32_t hash) const;
+    Id add(Id parent, std::string_view rdn, uint32_t hash);
+    void remove(Id id);
+    // The lookup table is open addressed with linear probing
+    void place(Id id);
+    void unplace(Id id);
+    void grow();
+
+    std::vector<Node> mNodes;
+    std::vector<Id> mFree;
+    std::vector<Id> mTable; // node ids, NONE for empty slots; the size is a power of two
+    size_t mLive = 0;
+    size_t mRdnBytes = 0; // RDNs too long to stay inside their string
+};
+
+} // namespace ldapclient
@@ -0,0 +1,1237 @@
+#include "fake_server.h"
+#include "ber.h"
+#include "filter.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cctype>
+#include <ldap.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace ldapclient
+{
+
+using Clock = std::chrono::steady_clock;
+
+static const char *const GIVEN_NAMES[] = {"Ada",  "Alan", "Barbara", "Claude",   "Donald",  "Edsger", "Frances", "Grace",
+                                          "John", "Ken",  "Leslie",  "Margaret", "Niklaus", "Radia",  "Tim",     "Whitfield"};
+static const char *const SURNAMES[] = {"Allen",    "Dijkstra", "Engelbart", "Hamilton", "Hoare",   "Hopper",
+                                       "Kernighan", "Knuth",   "Lamport",   "Liskov",   "Lovelace", "McCarthy",
+                                       "Perlman",  "Ritchie",  "Shannon",   "Turing",   "Wirth"};
+
+static bool equalsIgnoreCase(std::string_view a, std::string_view b)
+{
+    return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+static std::string lower(std::string_view s)
+{
+    std::string out(s);
+    for (char &c : out)
+    {
+        c = char(std::tolower((unsigned char)c));
+    }
+    return out;
+}
+
+static std::string normalizeDn(std::string_view dn)
+{
+    std::string out;
+    out.reserve(dn.size());
+    for (size_t i = 0; i < dn.size(); ++i)
+    {
+        char c = dn[i];
+        if (c == ' ' && (out.empty() || out.back() == ',' || out.back() == '=' || i + 1 == dn.size() ||
+                         dn[i + 1] == ',' || dn[i + 1] == '='))
+        {
+            continue;
+        }
+        out += char(std::tolower((unsigned char)c));
+    }
+    return out;
+}
+
+const std::vector<std::string> *FakeEntry::values(std::string_view name) const
+{
+    for (const auto &attribute : attributes)
+    {
+        if (equalsIgnoreCase(attribute.first, name))
+        {
+            return &attribute.second;
+        }
+    }
+    return nullptr;
+}
+
+std::vector<FakeEntry> generateDirectory(const FakeDirectoryOptions &options)
+{
+    std::string domain;
+    std::string firstDc;
+    for (size_t pos = 0; pos < options.suffix.size();)
+    {
+        size_t end = std::min(options.suffix.find(',', pos), options.suffix.size());
+        std::string rdn = options.suffix.substr(pos, end - pos);
+        if (rdn.size() > 3 && equalsIgnoreCase(rdn.substr(0, 3), "dc="))
+        {
+            domain += (domain.empty() ? "" : ".") + rdn.substr(3);
+            firstDc = firstDc.empty() ? rdn.substr(3) : firstDc;
+        }
+        pos = end + 1;
+    }
+
+    std::vector<FakeEntry> directory;
+    directory.reserve(options.people + 2);
+    directory.push_back({options.suffix, {{"objectClass", {"top", "domain"}}, {"dc", {firstDc}}}});
+    std::string people = "ou=people," + options.suffix;
+    directory.push_back({people, {{"objectClass", {"top", "organizationalUnit"}}, {"ou", {"people"}}}});
+
+    const size_t givenCount = sizeof(GIVEN_NAMES) / sizeof(GIVEN_NAMES[0]);
+    const size_t surnameCount = sizeof(SURNAMES) / sizeof(SURNAMES[0]);
+    for (size_t i = 0; i < options.people; ++i)
+    {
+        std::string uid = "user" + std::to_string(i);
+        std::string given = GIVEN_NAMES[i % givenCount];
+        std::string surname = SURNAMES[i % surnameCount];
+        char phone[32];
+        snprintf(phone, sizeof(phone), "+1 555 %07zu", i % 10000000);
+
+        FakeEntry entry;
+        entry.dn = "uid=" + uid + "," + people;
+        entry.attributes = {
+            {"objectClass", {"top", "person", "organizationalPerson", "inetOrgPerson"}},
+            {"uid", {uid}},
+            {"cn", {given + " " + surname}},
+            {"sn", {surname}},
+            {"givenName", {given}},
+            {"mail", {uid + "@" + domain}},
+            {"telephoneNumber", {phone}},
+            {"departmentNumber", {std::to_string(i % 20)}},
+        };
+        if (options.photoBytes > 0)
+        {
+            std::string photo(options.photoBytes, '\0');
+            for (size_t k = 0; k < photo.size(); ++k)
+            {
+                photo[k] = char((i * 31 + k) & 0xff);
+            }
+            photo[0] = char(0xff); // JPEG SOI marker
+            if (photo.size() > 1)
+            {
+                photo[1] = char(0xd8);
+            }
+            entry.attributes.push_back({"thumbnailPhoto", {std::move(photo)}});
+        }
+        directory.push_back(std::move(entry));
+    }
+    return directory;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Filters, controls and replies
+///////////////////////////////////////////////////////////////////////////////
+
+struct FakeRecord
+{
+    std::string dn; // normalised, like every string here
+    std::string parent;
+    std::vector<std::pair<std::string, std::vector<std::string>>> attributes;
+    std::string uuid; // 16 bytes, the entryUUID content synchronisation names entries by
+    uint64_t usn = 0;
+
+    const std::vector<std::string> *values(const std::string &name) const
+    {
+        for (const auto &attribute : attributes)
+        {
+            if (attribute.first == name)
+            {
+                return &attribute.second;
+            }
+        }
+        return nullptr;
+    }
+};
+
+namespace
+{
+
+// Returned only when asked for by name
+const char *const CHANGE_NUMBER = "uSNChanged";
+
+FakeRecord makeRecord(const FakeEntry &entry)
+{
+    FakeRecord record;
+    record.dn = normalizeDn(entry.dn);
+    size_t comma = record.dn.find(',');
+    record.parent = comma == std::string::npos ? std::string() : record.dn.substr(comma + 1);
+    for (const auto &attribute : entry.attributes)
+    {
+        std::string name = lower(attribute.first);
+        std::vector<std::string> values;
+        for (const std::string &value : attribute.second)
+        {
+            values.push_back(normalizeAttributeValue(name, value));
+        }
+        record.attributes.emplace_back(std::move(name), std::move(values));
+    }
+    return record;
+}
+
+// Replaces the entry's change number, or gives it one
+void setChangeNumber(FakeEntry &entry, uint64_t usn)
+{
+    auto it = std::find_if(entry.attributes.begin(), entry.attributes.end(),
+                           [](const auto &attribute) { return equalsIgnoreCase(attribute.first, CHANGE_NUMBER); });
+    if (it == entry.attributes.end())
+    {
+        it = entry.attributes.insert(it, {CHANGE_NUMBER, {}});
+    }
+    it->second = {std::to_string(usn)};
+}
+
+struct Filter
+{
+    ber_tag_t type = 0;
+    std::string attribute;
+    std::string value;
+    // Substrings: the initial part first and the final part last, when present
+    std::vector<std::string> parts;
+    bool initial = false;
+    bool final = false;
+    std::vector<Filter> children;
+};
+
+struct Control
+{
+    std::string_view oid;
+    bool critical = false;
+    std::string_view value;
+};
+
+struct SortKey
+{
+    std::string attribute;
+    bool reverse = false;
+};
+
+struct ContentSync
+{
+    bool requested = false;
+    int64_t mode = LDAP_SYNC_NONE;
+    std::string cookie;
+};
+
+struct VirtualListView
+{
+    bool requested = false;
+    int64_t before = 0;
+    int64_t after = 0;
+    // byOffset: offset is 1-based within a list the client thinks has contentCount entries
+    int64_t offset = 0;
+    int64_t contentCount = 0;
+    // greaterThanOrEqual
+    bool byValue = false;
+    std::string value;
+};
+
+bool parseFilter(uint8_t tag, std::string_view contents, Filter &filter)
+{
+    filter.type = tag;
+    BerReader reader(contents);
+    switch (tag)
+    {
+    case LDAP_FILTER_AND:
+    case LDAP_FILTER_OR:
+    case LDAP_FILTER_NOT:
+        while (!reader.atEnd())
+        {
+            uint8_t childTag = 0;
+            std::string_view child = reader.next(&childTag);
+            filter.children.emplace_back();
+            if (!reader.ok() || !parseFilter(childTag, child, filter.children.back()))
+            {
+                return false;
+            }
+        }
+        return tag != LDAP_FILTER_NOT || filter.children.size() == 1;
+    case LDAP_FILTER_EQUALITY:
+    case LDAP_FILTER_GE:
+    case LDAP_FILTER_LE:
+    case LDAP_FILTER_APPROX:
+        filter.attribute = lower(reader.octets());
+        filter.value = normalizeAttributeValue(filter.attribute, reader.octets());
+        return reader.ok();
+    case LDAP_FILTER_SUBSTRINGS:
+    {
+        filter.attribute = lower(reader.octets());
+        BerReader parts = reader.enter(ber::SEQUENCE);
+        while (!parts.atEnd())
+        {
+            uint8_t partTag = 0;
+            std::string_view part = parts.next(&partTag);
+            filter.initial = filter.initial || (partTag == LDAP_SUBSTRING_INITIAL && filter.parts.empty());
+            filter.final = partTag == LDAP_SUBSTRING_FINAL;
+            filter.parts.push_back(normalizeAttributeValue(filter.attribute, part));
+        }
+        return reader.ok() && parts.ok() && !filter.parts.empty();
+    }
+    case LDAP_FILTER_PRESENT:
+        filter.attribute = lower(contents);
+        return true;
+    default:
+        return tag == LDAP_FILTER_EXT; // parsed, but never matches
+    }
+}
+
+bool matchSubstrings(const Filter &filter, const std::string &value)
+{
+    const std::vector<std::string> &parts = filter.parts;
+    size_t pos = 0;
+    size_t end = value.size();
+    size_t first = 0;
+    size_t last = parts.size();
+    if (filter.initial)
+    {
+        if (value.compare(0, parts[0].size(), parts[0]) != 0)
+        {
+            return false;
+        }
+        pos = parts[0].size();
+        ++first;
+    }
+    if (filter.final && last > first)
+    {
+        const std::string &tail = parts.back();
+        if (tail.size() > value.size() - pos || value.compare(value.size() - tail.size(), tail.size(), tail) != 0)
+        {
+            return false;
+        }
+        end = value.size() - tail.size();
+        --last;
+    }
+    for (size_t i = first; i < last; ++i)
+    {
+        size_t found = value.find(parts[i], pos);
+        if (found == std::string::npos || found + parts[i].size() > end)
+        {
+            return false;
+        }
+        pos = found + parts[i].size();
+    }
+    return true;
+}
+
+bool matchValues(const Filter &filter, const std::vector<std::string> *values)
+{
+    if (values == nullptr)
+    {
+        return false;
+    }
+    for (const std::string &value : *values)
+    {
+        bool hit = false;
+        switch (filter.type)
+        {
+        case LDAP_FILTER_EQUALITY:
+        case LDAP_FILTER_APPROX:
+            hit = value == filter.value;
+            break;
+        case LDAP_FILTER_GE:
+            hit = compareOrdered(value, filter.value) >= 0;
+            break;
+        case LDAP_FILTER_LE:
+            hit = compareOrdered(value, filter.value) <= 0;
+            break;
+        case LDAP_FILTER_SUBSTRINGS:
+            hit = matchSubstrings(filter, value);
+            break;
+        }
+        if (hit)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool matches(const Filter &filter, const FakeRecord &record)
+{
+    switch (filter.type)
+    {
+    case LDAP_FILTER_AND:
+        return std::all_of(filter.children.begin(), filter.children.end(),
+                           [&record](const Filter &child) { return matches(child, record); });
+    case LDAP_FILTER_OR:
+        return std::any_of(filter.children.begin(), filter.children.end(),
+                           [&record](const Filter &child) { return matches(child, record); });
+    case LDAP_FILTER_NOT:
+        return !matches(filter.children[0], record);
+    case LDAP_FILTER_PRESENT:
+        return record.values(filter.attribute) != nullptr;
+    default:
+        return matchValues(filter, record.values(filter.attribute));
+    }
+}
+
+std::vector<Control> parseControls(std::string_view contents)
+{
+    std::vector<Control> controls;
+    BerReader list(contents);
+    while (!list.atEnd())
+    {
+        BerReader reader = list.enter(ber::SEQUENCE);
+        Control control;
+        control.oid = reader.octets();
+        control.critical = reader.peek() == ber::BOOLEAN ? reader.boolean() : false;
+        control.value = reader.peek() == ber::OCTET_STRING ? reader.octets() : std::string_view();
+        controls.push_back(control);
+    }
+    return controls;
+}
+
+std::string encodeControl(std::string_view oid, std::string_view value)
+{
+    BerWriter writer;
+    writer.begin(ber::SEQUENCE);
+    writer.octets(oid);
+    writer.octets(value);
+    writer.end();
+    return writer.take();
+}
+
+std::string encodeResult(int64_t id, uint8_t tag, int rc, std::string_view diagnostic,
+                         const std::string &controls = std::string())
+{
+    BerWriter writer;
+    writer.begin(ber::SEQUENCE);
+    writer.integer(id);
+    writer.begin(tag);
+    writer.enumerated(rc);
+    writer.octets(""); // matchedDN
+    writer.octets(diagnostic);
+    writer.end();
+    if (!controls.empty())
+    {
+        writer.begin(LDAP_TAG_CONTROLS);
+        writer.raw(controls);
+        writer.end();
+    }
+    writer.end();
+    return writer.take();
+}
+
+// Sends every attribute when all is set, otherwise those named in wanted;
+// the change number only when it is named
+std::string encodeEntry(int64_t id, const FakeEntry &entry, const std::vector<std::string> &wanted, bool all,
+                        bool typesOnly, const std::string &controls = std::string())
+{
+    BerWriter writer;
+    writer.begin(ber::SEQUENCE);
+    writer.integer(id);
+    writer.begin(LDAP_RES_SEARCH_ENTRY);
+    writer.octets(entry.dn);
+    writer.begin(ber::SEQUENCE);
+    for (const auto &attribute : entry.attributes)
+    {
+        bool named = std::any_of(wanted.begin(), wanted.end(), [&attribute](const std::string &name) {
+            return equalsIgnoreCase(name, attribute.first);
+        });
+        if (!named && (!all || equalsIgnoreCase(attribute.first, CHANGE_NUMBER)))
+        {
+            continue;
+        }
+        writer.begin(ber::SEQUENCE);
+        writer.octets(attribute.first);
+        writer.begin(ber::SET);
+        for (size_t i = 0; !typesOnly && i < attribute.second.size(); ++i)
+        {
+            writer.octets(attribute.second[i]);
+        }
+        writer.end();
+        writer.end();
+    }
+    writer.end();
+    writer.end();
+    if (!controls.empty())
+    {
+        writer.begin(LDAP_TAG_CONTROLS);
+        writer.raw(controls);
+        writer.end();
+    }
+    writer.end();
+    return writer.take();
+}
+
+std::string encodeIntermediate(int64_t id, std::string_view name, std::string_view value)
+{
+    BerWriter writer;
+    writer.begin(ber::SEQUENCE);
+    writer.integer(id);
+    writer.begin(LDAP_RES_INTERMEDIATE);
+    writer.octets(name, 0x80);
+    writer.octets(value, 0x81);
+    writer.end();
+    writer.end();
+    return writer.take();
+}
+
+std::string encodeSyncState(int state, const std::string &uuid, const std::string &cookie = std::string())
+{
+    BerWriter value;
+    value.begin(ber::SEQUENCE);
+    value.enumerated(state);
+    value.octets(uuid);
+    if (!cookie.empty())
+    {
+        value.octets(cookie);
+    }
+    value.end();
+    return encodeControl(LDAP_CONTROL_SYNC_STATE, value.data());
+}
+
+// Cookies are "usn=<change number>"
+std::string syncCookie(uint64_t usn)
+{
+    return "usn=" + std::to_string(usn);
+}
+
+bool parseSyncCookie(std::string_view cookie, uint64_t *usn)
+{
+    if (cookie.substr(0, 4) != "usn=" || cookie.size() == 4 ||
+        !std::all_of(cookie.begin() + 4, cookie.end(), [](unsigned char c) { return std::isdigit(c); }))
+    {
+        return false;
+    }
+    *usn = std::stoull(std::string(cookie.substr(4)));
+    return true;
+}
+
+bool inScope(const FakeRecord &record, const std::string &base, int scope)
+{
+    switch (scope)
+    {
+    case LDAP_SCOPE_BASE:
+        return record.dn == base;
+    case LDAP_SCOPE_ONELEVEL:
+        return record.parent == base;
+    default:
+        return base.empty() || record.dn == base ||
+               (record.dn.size() > base.size() && record.dn[record.dn.size() - base.size() - 1] == ',' &&
+                record.dn.compare(record.dn.size() - base.size(), base.size(), base) == 0);
+    }
+}
+
+} // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+// FakeLdapServer
+///////////////////////////////////////////////////////////////////////////////
+
+struct FakeLdapServer::Session
+{
+    int fd = -1;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::pair<Clock::time_point, std::string>> outbox; // replies and when they are due
+    bool closed = false;
+    std::thread reader;
+    std::thread writer;
+};
+
+struct FakeLdapServer::Subscription
+{
+    Session *session;
+    int64_t id;
+    std::string base;
+    int scope;
+    Filter filter;
+    std::vector<std::string> wanted;
+    bool all;
+    bool typesOnly;
+
+    bool selects(const FakeRecord &record) const { return inScope(record, base, scope) && matches(filter, record); }
+};
+
+FakeLdapServer::FakeLdapServer(std::vector<FakeEntry> directory, FakeServerOptions options)
+    : mDirectory(std::move(directory)), mOptions(std::move(options)), mLatency(mOptions.latency.count())
+{
+    mSuffix = mDirectory.empty() ? std::string() : mDirectory[0].dn;
+    mRecords.reserve(mDirectory.size());
+    for (size_t i = 0; i < mDirectory.size(); ++i)
+    {
+        setChangeNumber(mDirectory[i], ++mUsn);
+        FakeRecord record = makeRecord(mDirectory[i]);
+        record.uuid = newUuid();
+        record.usn = mUsn;
+        mByDn.emplace(record.dn, i);
+        mRecords.push_back(std::move(record));
+    }
+
+    mListen = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(mListen, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ::bind(mListen, (sockaddr *)&addr, sizeof(addr));
+    listen(mListen, SOMAXCONN);
+
+    socklen_t len = sizeof(addr);
+    getsockname(mListen, (sockaddr *)&addr, &len);
+    mPort = ntohs(addr.sin_port);
+    mAcceptor = std::thread([this] { acceptLoop(); });
+}
+
+FakeLdapServer::~FakeLdapServer()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopped = true;
+    }
+    mAcceptor.join();
+    for (auto &session : mSessions)
+    {
+        shutdown(session->fd, SHUT_RDWR);
+        session->reader.join();
+        session->writer.join();
+        close(session->fd);
+    }
+    close(mListen);
+}
+
+std::string FakeLdapServer::newUuid()
+{
+    std::string uuid(16, '\0');
+    uint64_t n = ++mNextUuid;
+    for (int i = 15; i >= 8; --i, n >>= 8)
+    {
+        uuid[i] = char(n & 0xff);
+    }
+    return uuid;
+}
+
+LdapConfiguration FakeLdapServer::config() const
+{
+    LdapConfiguration config;
+    config.mPrimaryServer = address();
+    config.mSearchBase = mSuffix;
+    config.mUsername = mOptions.bindDn;
+    config.mPassword = mOptions.password;
+    config.mFilter = "(objectClass=person)";
+    config.mAttributes = {"cn", "mail", "telephoneNumber"};
+    config.mUseSSL = false;
+    return config;
+}
+
+void FakeLdapServer::disconnectAll()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (auto &session : mSessions)
+    {
+        shutdown(session->fd, SHUT_RDWR);
+    }
+}
+
+void FakeLdapServer::put(FakeEntry entry)
+{
+    std::unique_lock<std::shared_mutex> lock(mDirectoryMutex);
+    setChangeNumber(entry, ++mUsn);
+    FakeRecord record = makeRecord(entry);
+    record.usn = mUsn;
+
+    auto it = mByDn.find(record.dn);
+    if (it == mByDn.end())
+    {
+        record.uuid = newUuid();
+        mByDn.emplace(record.dn, mRecords.size());
+        mRecords.push_back(std::move(record));
+        mDirectory.push_back(std::move(entry));
+        notify(nullptr, &mRecords.back(), &mDirectory.back());
+        return;
+    }
+
+    size_t i = it->second;
+    record.uuid = mRecords[i].uuid;
+    FakeRecord before = std::move(mRecords[i]);
+    mRecords[i] = std::move(record);
+    mDirectory[i] = std::move(entry);
+    notify(&before, &mRecords[i], &mDirectory[i]);
+}
+
+bool FakeLdapServer::remove(const std::string &dn)
+{
+    std::unique_lock<std::shared_mutex> lock(mDirectoryMutex);
+    auto it = mByDn.find(normalizeDn(dn));
+    if (it == mByDn.end())
+    {
+        return false;
+    }
+
+    size_t i = it->second;
+    mByDn.erase(it);
+    FakeRecord gone = std::move(mRecords[i]);
+    if (i + 1 < mRecords.size())
+    {
+        mRecords[i] = std::move(mRecords.back());
+        mDirectory[i] = std::move(mDirectory.back());
+        mByDn[mRecords[i].dn] = i;
+    }
+    mRecords.pop_back();
+    mDirectory.pop_back();
+
+    gone.usn = ++mUsn;
+    notify(&gone, nullptr, nullptr);
+    gone.attributes.clear();
+    mDeleted.push_back(std::move(gone));
+    return true;
+}
+
+void FakeLdapServer::notify(const FakeRecord *before, const FakeRecord *after, const FakeEntry *entry)
+{
+    std::lock_guard<std::mutex> lock(mSubscriptionMutex);
+    for (const auto &subscription : mSubscriptions)
+    {
+        bool was = before && subscription->selects(*before);
+        bool is = after && subscription->selects(*after);
+        if (is)
+        {
+            queue(*subscription->session,
+                  encodeEntry(subscription->id, *entry, subscription->wanted, subscription->all, subscription->typesOnly,
+                              encodeSyncState(was ? LDAP_SYNC_MODIFY : LDAP_SYNC_ADD, after->uuid, syncCookie(mUsn))));
+        }
+        else if (was)
+        {
+            FakeEntry gone;
+            gone.dn = before->dn;
+            queue(*subscription->session, encodeEntry(subscription->id, gone, {}, false, false,
+                                                      encodeSyncState(LDAP_SYNC_DELETE, before->uuid, syncCookie(mUsn))));
+        }
+    }
+}
+
+void FakeLdapServer::acceptLoop()
+{
+    while (true)
+    {
+        pollfd pfd = {mListen, POLLIN, 0};
+        int ready = ::poll(&pfd, 1, 20);
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mStopped)
+        {
+            return;
+        }
+        int fd = ready > 0 ? accept(mListen, NULL, NULL) : -1;
+        if (fd < 0)
+        {
+            continue;
+        }
+
+        // Replies are single writes; without this Nagle holds back the next one
+        int yes = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        ++mConnections;
+
+        mSessions.push_back(std::make_unique<Session>());
+        Session &session = *mSessions.back();
+        session.fd = fd;
+        session.reader = std::thread([this, &session] { readLoop(session); });
+        session.writer = std::thread([this, &session] { writeLoop(session); });
+    }
+}
+
+void FakeLdapServer::readLoop(Session &session)
+{
+    std::string buffer;
+    char chunk[16384];
+    bool open = true;
+    while (open)
+    {
+        ssize_t n = recv(session.fd, chunk, sizeof(chunk), 0);
+        if (n <= 0)
+        {
+            break;
+        }
+        buffer.append(chunk, n);
+
+        size_t pos = 0;
+        long length = 0;
+        while (open && (length = ber::frameLength(std::string_view(buffer).substr(pos))) > 0)
+        {
+            open = handle(session, std::string_view(buffer).substr(pos, length));
+            pos += length;
+        }
+        buffer.erase(0, pos);
+        open = open && length >= 0;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mSubscriptionMutex);
+        mSubscriptions.erase(std::remove_if(mSubscriptions.begin(), mSubscriptions.end(),
+                                            [&session](const auto &subscription) {
+                                                return subscription->session == &session;
+                                            }),
+                             mSubscriptions.end());
+    }
+    {
+        std::lock_guard<std::mutex> lock(session.mutex);
+        session.closed = true;
+    }
+    session.changed.notify_all();
+    shutdown(session.fd, SHUT_RDWR);
+}
+
+void FakeLdapServer::writeLoop(Session &session)
+{
+    std::unique_lock<std::mutex> lock(session.mutex);
+    while (!session.closed)
+    {
+        if (session.outbox.empty())
+        {
+            session.changed.wait(lock);
+            continue;
+        }
+        if (Clock::now() < session.outbox.front().first)
+        {
+            session.changed.wait_until(lock, session.outbox.front().first);
+            continue;
+        }
+
+        std::string reply = std::move(session.outbox.front().second);
+        session.outbox.pop_front();
+        lock.unlock();
+        for (size_t sent = 0; sent < reply.size();)
+        {
+            ssize_t n = send(session.fd, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+            {
+                shutdown(session.fd, SHUT_RDWR); // the reader sees it and closes the session
+                break;
+            }
+            sent += n;
+        }
+        lock.lock();
+    }
+}
+
+void FakeLdapServer::queue(Session &session, std::string reply)
+{
+    Clock::time_point due = Clock::now() + std::chrono::microseconds(mLatency.load());
+    {
+        std::lock_guard<std::mutex> lock(session.mutex);
+        session.outbox.emplace_back(due, std::move(reply));
+    }
+    session.changed.notify_all();
+}
+
+bool FakeLdapServer::handle(Session &session, std::string_view message)
+{
+    BerReader envelope = BerReader(message).enter(ber::SEQUENCE);
+    int64_t id = envelope.integer();
+    uint8_t op = 0;
+    std::string_view body = envelope.next(&op);
+    std::string_view controls = envelope.peek() == LDAP_TAG_CONTROLS ? envelope.next() : std::string_view();
+    if (!envelope.ok())
+    {
+        return false; // not LDAP; drop the connection like a real server
+    }
+
+    switch (op)
+    {
+    case LDAP_REQ_BIND:
+        queue(session, bind(id, body));
+        return true;
+    case LDAP_REQ_SEARCH:
+        queue(session, search(session, id, body, controls));
+        return true;
+    case LDAP_REQ_UNBIND:
+        return false;
+    case LDAP_REQ_ABANDON:
+    {
+        // A reply already queued still goes out; the client drops it
+        int64_t abandoned = BerReader::decodeInteger(body);
+        std::lock_guard<std::mutex> lock(mSubscriptionMutex);
+        mSubscriptions.erase(std::remove_if(mSubscriptions.begin(), mSubscriptions.end(),
+                                            [&session, abandoned](const auto &subscription) {
+                                                return subscription->session == &session && subscription->id == abandoned;
+                                            }),
+                             mSubscriptions.end());
+        return true;
+    }
+    case LDAP_REQ_EXTENDED:
+        queue(session, encodeResult(id, LDAP_RES_EXTENDED, LDAP_PROTOCOL_ERROR, "no extended operations"));
+        return true;
+    default:
+        // Every other request's response tag follows it, constructed
+        queue(session, encodeResult(id, uint8_t((op | 0x20) + 1), LDAP_UNWILLING_TO_PERFORM, "read-only server"));
+        return true;
+    }
+}
+
+std::string FakeLdapServer::bind(int64_t id, std::string_view request)
+{
+    ++mBinds;
+    BerReader reader(request);
+    int64_t version = reader.integer();
+    std::string_view name = reader.octets();
+    if (reader.peek() != LDAP_AUTH_SIMPLE)
+    {
+        return encodeResult(id, LDAP_RES_BIND, LDAP_AUTH_METHOD_NOT_SUPPORTED, "simple binds only");
+    }
+    std::string_view password = reader.octets(LDAP_AUTH_SIMPLE);
+    if (!reader.ok() || version != LDAP_VERSION3)
+    {
+        return encodeResult(id, LDAP_RES_BIND, LDAP_PROTOCOL_ERROR, "LDAPv3 only");
+    }
+
+    bool anonymous = name.empty() && password.empty();
+    if (!anonymous && !mOptions.bindDn.empty() &&
+        (normalizeDn(name) != normalizeDn(mOptions.bindDn) || password != mOptions.password))
+    {
+        return encodeResult(id, LDAP_RES_BIND, LDAP_INVALID_CREDENTIALS, "");
+    }
+    return encodeResult(id, LDAP_RES_BIND, LDAP_SUCCESS, "");
+}
+
+std::string FakeLdapServer::search(Session &session, int64_t id, std::string_view request, std::string_view controls)
+{
+    ++mSearches;
+    std::shared_lock<std::shared_mutex> lock(mDirectoryMutex);
+    BerReader reader(request);
+    std::string base = normalizeDn(reader.octets());
+    int scope = int(reader.enumerated());
+    reader.enumerated(); // derefAliases
+    int64_t sizeLimit = reader.integer();
+    reader.integer(); // timeLimit
+    bool typesOnly = reader.boolean();
+    uint8_t filterTag = 0;
+    std::string_view filterContents = reader.next(&filterTag);
+
+    std::vector<std::string> wanted;
+    BerReader attributes = reader.enter(ber::SEQUENCE);
+    bool all = attributes.atEnd(); // no list asks for every user attribute
+    while (!attributes.atEnd())
+    {
+        std::string name = lower(attributes.octets());
+        if (name == "*")
+        {
+            all = true;
+        }
+        else if (name != "1.1" && name != "+")
+        {
+            wanted.push_back(name);
+        }
+    }
+
+    Filter filter;
+    if (!reader.ok() || !attributes.ok() || !parseFilter(filterTag, filterContents, filter))
+    {
+        return encodeResult(id, LDAP_RES_SEARCH_RESULT, LDAP_PROTOCOL_ERROR, "malformed search request");
+    }
+
+    bool paged = false;
+    int64_t pageSize = 0;
+    size_t offset = 0;
+    std::vector<SortKey> sortKeys;
+    bool sortRequested = false;
+    int sortResult = LDAP_SUCCESS;
+    VirtualListView vlv;
+    ContentSync sync;
+    for (const Control &control : parseControls(controls))
+    {
+        if (control.oid == LDAP_CONTROL_PAGEDRESULTS && mOptions.pagedResults)
+        {
+            // The cookie is the offset of the next page, so no state is kept between pages
+            BerReader value = BerReader(control.value).enter(ber::SEQUENCE);
+            pageSize = value.integer();
+            std::string cookie(value.octets());
+            offset = cookie.empty() ? 0 : std::stoul(cookie);
+            paged = true;
+        }
+        else if (control.oid == LDAP_CONTROL_SORTREQUEST && mOptions.serverSideSort)
+        {
+            BerReader keys = BerReader(control.value).enter(ber::SEQUENCE);
+            while (!keys.atEnd())
+            {
+                BerReader key = keys.enter(ber::SEQUENCE);
+                SortKey sortKey;
+                sortKey.attribute = lower(key.octets());
+                if (key.peek() == LDAP_MATCHRULE_IDENTIFIER)
+                {
+                    key.next();
+                }
+                sortKey.reverse =
+                    key.peek() == LDAP_REVERSEORDER_IDENTIFIER && key.boolean(LDAP_REVERSEORDER_IDENTIFIER);
+                sortKeys.push_back(sortKey);
+            }
+            sortRequested = true;
+            for (const SortKey &sortKey : sortKeys)
+            {
+                const std::vector<std::string> &unordered = mOptions.unorderedAttributes;
+                if (std::find(unordered.begin(), unordered.end(), sortKey.attribute) != unordered.end())
+                {
+                    if (control.critical)
+                    {
+                        return encodeResult(id, LDAP_RES_SEARCH_RESULT, LDAP_UNAVAILABLE_CRITICAL_EXTENSION,
+                                            "no ordering rule for " + sortKey.attribute);
+                    }
+                    sortResult = LDAP_INAPPROPRIATE_MATCHING;
+                    sortKeys.clear(); // the entries go out unsorted
+                    break;
+                }
+            }
+        }
+        else if (control.oid == LDAP_CONTROL_VLVREQUEST && mOptions.virtualListView)
+        {
+            BerReader value = BerReader(control.value).enter(ber::SEQUENCE);
+            vlv.before = value.integer();
+            vlv.after = value.integer();
+            if (value.peek() == LDAP_VLVBYINDEX_IDENTIFIER)
+            {
+                BerReader target = value.enter(LDAP_VLVBYINDEX_IDENTIFIER);
+                vlv.offset = target.integer();
+                vlv.contentCount = target.integer();
+            }
+            else
+            {
+                vlv.byValue = true;
+                vlv.value = std::string(value.octets(LDAP_VLVBYVALUE_IDENTIFIER));
+            }
+            vlv.requested = true;
+        }
+        else if (control.oid == LDAP_CONTROL_SYNC && mOptions.contentSync)
+        {
+            BerReader value = BerReader(control.value).enter(ber::SEQUENCE);
+            sync.mode = value.enumerated();
+            sync.cookie = std::string(value.peek() == ber::OCTET_STRING ? value.octets() : std::string_view());
+            sync.requested = value.ok();
+        }
+        else if (control.critical)
+        {
+            return encodeResult(id, LDAP_RES_SEARCH_RESULT, LDAP_UNAVAILABLE_CRITICAL_EXTENSION,
+                                "unsupported control " + std::string(control.oid));
+        }
+    }
+
+    if (base.empty() && scope == LDAP_SCOPE_BASE)
+    {
+        FakeEntry rootDse;
+        rootDse.attributes = {{"objectClass", {"top"}},
+                              {"namingContexts", {mSuffix}},
+                              {"supportedLDAPVersion", {"3"}},
+                              {"highestCommittedUSN", {std::to_string(mUsn)}},
+                              {"supportedControl", {}}};
+        if (mOptions.pagedResults)
+        {
+            rootDse.attributes.back().second.push_back(LDAP_CONTROL_PAGEDRESULTS);
+        }
+        if (mOptions.serverSideSort)
+        {
+            rootDse.attributes.back().second.push_back(LDAP_CONTROL_SORTREQUEST);
+        }
+        if (mOptions.virtualListView)
+        {
+            rootDse.attributes.back().second.push_back(LDAP_CONTROL_VLVREQUEST);
+        }
+        if (mOptions.contentSync)
+        {
+            rootDse.attributes.back().second.push_back(LDAP_CONTROL_SYNC);
+        }
+        return encodeEntry(id, rootDse, wanted, all, typesOnly) +
+               encodeResult(id, LDAP_RES_SEARCH_RESULT, LDAP_SUCCESS, "");
+    }
+    if (!base.empty() && mByDn.find(base) == mByDn.end())
+    {
+        return encodeResult(id, LDAP_RES_SEARCH_RESULT, LDAP_NO_SUCH_OBJECT, "");
+    }
+
+    if (sync.requested)
+    {
+        // Everything on a first refresh; afterwards what changed since the cookie,
+        // with entries that were deleted or stopped matching sent as deletes
+        uint64_t since = 0;
+        if (!sync.cookie.empty() && !parseSyncCookie(sync.cookie, &since))
+        {
+            return encodeResult(id, LDAP_RES_SEARCH_RESULT, LDAP_SYNC_REFRESH_REQUIRED, "unknown cookie");
+        }
+        std::string reply;
+        for (size_t i = 0; i < mRecords.size(); ++i)
+        {
+            if (mRecords[i].usn <= since || !inScope(mRecords[i], base, scope))
+            {
+                continue;
+            }
+            if (matches(filter, mRecords[i]))
+            {
+                reply += encodeEntry(id, mDirectory[i], wanted, all, typesOnly,
+                                     encodeSyncState(since ? LDAP_SYNC_MODIFY : LDAP_SYNC_ADD, mRecords[i].uuid));
+            }
+            else if (since)
+            {
+                FakeEntry gone;
+                gone.dn = mDirectory[i].dn;
+                reply += encodeEntry(id, gone, {}, false, false, encodeSyncState(LDAP_SYNC_DELETE, mRecords[i].uuid));
+            }
+        }
+        for (const FakeRecord &record : mDeleted)
+        {
+            if (since && record.usn > since && inScope(record, base, scope))
+            {
+                FakeEntry gone;
+                gone.dn = record.dn;
+                reply += encodeEntry(id, gone, {}, false, false, encodeSyncState(LDAP_SYNC_DELETE, record.uuid));
+            }
+        }
+
+        // A first refresh is a present phase: the client drops whatever it
+        // holds that was not sent. Later ones are delete phases.
+        if (sync.mode == LDAP_SYNC_REFRESH_AND_PERSIST)
+        {
+            BerWriter info;
+            info.begin(uint8_t(since ? LDAP_TAG_SYNC_REFRESH_DELETE : LDAP_TAG_SYNC_REFRESH_PRESENT));
+            info.octets(syncCookie(mUsn));
+            info.end();
+            reply += encodeIntermediate(id, LDAP_SYNC_INFO, info.data());
+
+            // Registered under the directory lock, so no change slips in between
+            std::lock_guard<std::mutex> subscriptions(mSubscriptionMutex);
+            mSubscriptions.push_back(std::unique_ptr<Subscription>(
+                new Subscription{&session, id, base, scope, std::move(filter), wanted, all, typesOnly}));
+            return reply;
+        }
+        BerWriter done;
+        done.begin(ber::SEQUENCE);
+        done.octets(syncCookie(mUsn));
+        if (since)
+        {
+            done.boolean(true); // refreshDeletes
+        }
+        done.end();
+        return reply + encodeResult(id, LDAP_RES_SEARCH_RESULT, LDAP_SUCCESS, "",
+                                    encodeControl(LDAP_CONTROL_SYNC_DONE, done.data()));
+    }
+
+    std::vector<size_t> found;
+    for (size_t i = 0; i < mRecords.size(); ++i)
+    {
+        if (inScope(mRecords[i], base, scope) && matches(filter, mRecords[i]))
+        {
+            found.push_back(i);
+        }
+    }
+
+    if (!sortKeys.empty())
+    {
+        // Entries without a key sort after those with one, whichever the order
+        std::stable_sort(found.begin(), found.end(), [this, &sortKeys](size_t a, size_t b) {
+            for (const SortKey &key : sortKeys)
+            {
+                const std::vector<std::string> *va = mRecords[a].values(key.attribute);
+                const std::vector<std::string> *vb = mRecords[b].values(key.attribute);
+                if (!va || !vb || va->empty() || vb->empty())
+                {
+                    bool hasA = va && !va->empty();
+                    bool hasB = vb && !vb->empty();
+                    if (hasA != hasB)
+                    {
+                        return hasA;
+                    }
+                    continue;
+                }
+                int order = va->front().compare(vb->front());
+                if (order != 0)
+                {
+                    return key.reverse ? order > 0 : order < 0;
+                }
+            }
+            return false;
+        });
+    }
+
+    size_t total = found.size();
+    size_t begin = 0;
+    size_t end = total;
+    int rc = LDAP_SUCCESS;
+    size_t target = 0;
+    if (vlv.requested)
+    {
+        if (sortKeys.empty())
+        {
+            return encodeResult(id, LDAP_RES_SEARCH_RESULT, LDAP_SORT_CONTROL_MISSING, "VLV needs the sort control");
+        }
+        if (vlv.byValue)
+        {
+            const SortKey &key = sortKeys[0];
+            std::string value = normalizeAttributeValue(key.attribute, vlv.value);
+            auto it = std::find_if(found.begin(), found.end(), [this, &key, &value](size_t i) {
+                const std::vector<std::string> *values = mRecords[i].values(key.attribute);
+                return !values || values->empty() || (key.reverse ? values->front() <= value : values->front() >= value);
+            });
+            target = size_t(it - found.begin());
+        }
+        else
+        {
+            // Scale the offset when the client's idea of the list size is out of date
+            int64_t position = std::max<int64_t>(vlv.offset - 1, 0);
+            if (vlv.contentCount > 0 && size_t(vlv.contentCount) != total)
+            {
+                position = position * int64_t(total) / vlv.contentCount;
+            }
+            target = std::min(size_t(position), total > 0 ? total - 1 : 0);
+        }
+        begin = target - std::min(target, size_t(std::max<int64_t>(vlv.before, 0)));
+        end = std::min(total, target + size_t(std::max<int64_t>(vlv.after, 0)) + 1);
+    }
+    else if (paged)
+    {
+        begin = std::min(offset, total);
+        end = std::min<size_t>(total, begin + size_t(std::max<int64_t>(pageSize, 0)));
+    }
+    else if (sizeLimit > 0 && total > size_t(sizeLimit))
+    {
+        end = size_t(sizeLimit);
+        rc = LDAP_SIZELIMIT_EXCEEDED;
+    }
+
+    std::string reply;
+    for (size_t i = begin; i < end; ++i)
+    {
+        reply += encodeEntry(id, mDirectory[found[i]], wanted, all, typesOnly);
+    }
+
+    std::string responseControls;
+    if (paged)
+    {
+        BerWriter value;
+        value.begin(ber::SEQUENCE);
+        value.integer(int64_t(total));
+        value.octets(end < total && pageSize > 0 ? std::to_string(end) : std::string());
+        value.end();
+        responseControls += encodeControl(LDAP_CONTROL_PAGEDRESULTS, value.data());
+    }
+    if (sortRequested)
+    {
+        BerWriter value;
+        value.begin(ber::SEQUENCE);
+        value.enumerated(sortResult);
+        value.end();
+        responseControls += encodeControl(LDAP_CONTROL_SORTRESPONSE, value.data());
+    }
+    if (vlv.requested)
+    {
+        BerWriter value;
+        value.begin(ber::SEQUENCE);
+        value.integer(int64_t(target + 1));
+        value.integer(int64_t(total));
+        value.enumerated(LDAP_SUCCESS);
+        value.end();
+        responseControls += encodeControl(LDAP_CONTROL_VLVRESPONSE, value.data());
+    }
+    return reply + encodeResult(id, LDAP_RES_SEARCH_RESULT, rc, "", responseControls);
+}
+
+} // namespace ldapclient
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "ldap_config.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace ldapclient
+{
+
+struct FakeEntry
+{
+    std::string dn;
+    std::vector<std::pair<std::string, std::vector<std::string>>> attributes;
+
+    // Case-insensitive; nullptr when the entry does not carry the attribute
+    const std::vector<std::string> *values(std::string_view name) const;
+};
+
+struct FakeRecord; // an entry as the server matches it, in fake_server.cpp
+
+struct FakeDirectoryOptions
+{
+    std::string suffix = "dc=example,dc=com";
+    size_t people = 1000;
+    // Size of each person's thumbnailPhoto; none when 0
+    size_t photoBytes = 0;
+};
+
+// The suffix entry, ou=people under it, then uid=user<i>,ou=people,<suffix> for
+// every person with cn, sn, givenName, mail and telephoneNumber. Names cycle
+// through small fixed lists, so the same options always give the same directory.
+std::vector<FakeEntry> generateDirectory(const FakeDirectoryOptions &options = FakeDirectoryOptions());
+
+struct FakeServerOptions
+{
+    // Added before every response goes out; requests on one connection still overlap
+    std::chrono::microseconds latency{0};
+    // When set, simple binds must use these; anonymous binds are always accepted
+    std::string bindDn;
+    std::string password;
+    bool pagedResults = true;    // 1.2.840.113556.1.4.319
+    bool serverSideSort = true;  // 1.2.840.113556.1.4.473
+    bool virtualListView = true; // 2.16.840.1.113730.3.4.9
+    bool contentSync = true;     // 1.3.6.1.4.1.4203.1.9.1.1, RFC 4533
+    // Sorting on these is declined with inappropriateMatching, as for attributes
+    // without an ordering rule; lower case
+    std::vector<std::string> unorderedAttributes;
+};
+
+// A loopback LDAPv3 server for tests and benchmarks. It speaks just enough of
+// RFC 4511 for this client: simple bind, unbind, abandon, and search with and,
+// or, not, equality, substring, ordering and presence filters, size limits,
+// attribute selection, and the paged-results, sort, virtual list view and
+// content synchronisation controls.
+//
+// Like Active Directory, every entry carries a uSNChanged that put() and remove()
+// advance, returned only when asked for by name. Content synchronisation cookies
+// are that change number, so refreshes send what changed since; deleted entries
+// are remembered for the purpose. Persistent searches stay registered until
+// abandoned and are sent each change as it is made.
+//
+// Each connection has a reader and a writer thread. Replies are queued with a
+// due time so injected latency models the network: pipelined requests overlap
+// instead of queueing behind each other's delay.
+class FakeLdapServer
+{
+  public:
+    explicit FakeLdapServer(std::vector<FakeEntry> directory, FakeServerOptions options = FakeServerOptions());
+    ~FakeLdapServer();
+    FakeLdapServer(const FakeLdapServer &) = delete;
+    FakeLdapServer &operator=(const FakeLdapServer &) = delete;
+
+    int port() const { return mPort; }
+    // host:port, as LdapConfiguration::mPrimaryServer expects
+    std::string address() const { return "127.0.0.1:" + std::to_string(mPort); }
+    // Searches people below the first entry of the directory with the configured credentials
+    LdapConfiguration config() const;
+
+    void setLatency(std::chrono::microseconds latency) { mLatency = latency.count(); }
+    // Drops every open connection, as a restarting server would
+    void disconnectAll();
+
+    // Adds the entry, or replaces the one with its DN
+    void put(FakeEntry entry);
+    // false when there is no such entry
+    bool remove(const std::string &dn);
+
+    size_t connections() const { return mConnections; }
+    size_t binds() const { return mBinds; }
+    size_t searches() const { return mSearches; }
+
+  private:
+    struct Session;
+    struct Subscription; // a persistent search
+
+    void acceptLoop();
+    void readLoop(Session &session);
+    void writeLoop(Session &session);
+    // false when the connection should close
+    bool handle(Session &session, std::string_view message);
+    std::string bind(int64_t id, std::string_view request);
+    std::string search(Session &session, int64_t id, std::string_view request, std::string_view controls);
+    void queue(Session &session, std::string reply);
+    // Sends a change to the persistent searches it concerns
+    void notify(const FakeRecord *before, const FakeRecord *after, const FakeEntry *entry);
+    std::string newUuid();
+
+    // Searches share it; put() and remove() take it alone
+    std::shared_mutex mDirectoryMutex;
+    std::string mSuffix; // the first entry's DN
+    std::vector<FakeEntry> mDirectory;
+    std::vector<FakeRecord> mRecords; // mDirectory with normalised DNs and values
+    std::unordered_map<std::string, size_t> mByDn;
+    std::vector<FakeRecord> mDeleted; // DN, UUID and change number only
+    uint64_t mUsn = 0;                // the highest change number
+    uint64_t mNextUuid = 0;
+
+    std::mutex mSubscriptionMutex;
+    std::vector<std::unique_ptr<Subscription>> mSubscriptions;
+    FakeServerOptions mOptions;
+    std::atomic<int64_t> mLatency;
+
+    int mListen = -1;
+    int mPort = 0;
+    std::atomic<size_t> mConnections{0};
+    std::atomic<size_t> mBinds{0};
+    std::atomic<size_t> mSearches{0};
+
+    std::mutex mMutex;
+    bool mStopped = false;
+    std::vector<std::unique_ptr<Session>> mSessions;
+    std::thread mAcceptor;
+};
+
+} // namespace ldapclient
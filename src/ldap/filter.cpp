@@ -0,0 +1,297 @@
+#include "filter.h"
+#include "ldap_connection.h"
+#include <algorithm>
+#include <cctype>
+
+namespace ldapclient
+{
+
+namespace
+{
+
+class FilterParser
+{
+  public:
+    explicit FilterParser(const std::string &text) : mText(text) {}
+
+    LdapFilter parse()
+    {
+        skipSpaces();
+        LdapFilter filter = mText.compare(mPos, 1, "(") == 0 ? parseFilter() : parseItem(mText.size());
+        skipSpaces();
+        if (mPos != mText.size())
+        {
+            fail("trailing characters");
+        }
+        return filter;
+    }
+
+  private:
+    [[noreturn]] void fail(const char *what)
+    {
+        throw LdapError(LDAP_FILTER_ERROR, std::string(what) + " at " + std::to_string(mPos) + " in " + mText);
+    }
+
+    void skipSpaces()
+    {
+        while (mPos < mText.size() && mText[mPos] == ' ')
+        {
+            ++mPos;
+        }
+    }
+
+    void expect(char c)
+    {
+        if (mPos >= mText.size() || mText[mPos] != c)
+        {
+            fail(c == ')' ? "missing )" : "missing (");
+        }
+        ++mPos;
+    }
+
+    LdapFilter parseFilter()
+    {
+        expect('(');
+        LdapFilter filter;
+        char c = mPos < mText.size() ? mText[mPos] : ')';
+        if (c == '&' || c == '|')
+        {
+            ++mPos;
+            filter.type = c == '&' ? LdapFilter::And : LdapFilter::Or;
+            for (skipSpaces(); mPos < mText.size() && mText[mPos] == '('; skipSpaces())
+            {
+                filter.children.push_back(parseFilter());
+            }
+        }
+        else if (c == '!')
+        {
+            ++mPos;
+            skipSpaces();
+            filter.type = LdapFilter::Not;
+            filter.children.push_back(parseFilter());
+            skipSpaces();
+        }
+        else
+        {
+            size_t end = closing();
+            filter = parseItem(end);
+        }
+        expect(')');
+        return filter;
+    }
+
+    // The ) that ends an item; values escape theirs, so the first one will do
+    size_t closing()
+    {
+        size_t end = mText.find(')', mPos);
+        if (end == std::string::npos)
+        {
+            fail("missing )");
+        }
+        return end;
+    }
+
+    LdapFilter parseItem(size_t end)
+    {
+        size_t equals = mText.find('=', mPos);
+        if (equals == std::string::npos || equals >= end || equals == mPos)
+        {
+            fail("missing attribute or =");
+        }
+
+        LdapFilter filter;
+        size_t nameEnd = equals;
+        char op = mText[equals - 1];
+        if (op == '>' || op == '<' || op == '~')
+        {
+            filter.type = op == '>' ? LdapFilter::GreaterOrEqual
+                                    : op == '<' ? LdapFilter::LessOrEqual : LdapFilter::Approx;
+            --nameEnd;
+        }
+        else if (op == ':')
+        {
+            fail("extensible match is not supported");
+        }
+        else
+        {
+            filter.type = LdapFilter::Equality;
+        }
+        for (size_t i = mPos; i < nameEnd; ++i)
+        {
+            unsigned char c = mText[i];
+            if (!(std::isalnum(c) || c == '-' || c == ';' || c == '.'))
+            {
+                mPos = i;
+                fail("bad attribute description");
+            }
+            filter.attribute += char(std::tolower(c));
+        }
+        if (filter.attribute.empty())
+        {
+            fail("missing attribute");
+        }
+
+        std::string raw = mText.substr(equals + 1, end - equals - 1);
+        mPos = end;
+        if (filter.type != LdapFilter::Equality)
+        {
+            filter.value = unescape(raw, false);
+            return filter;
+        }
+        if (raw == "*")
+        {
+            filter.type = LdapFilter::Present;
+            return filter;
+        }
+        if (raw.find('*') == std::string::npos)
+        {
+            filter.value = unescape(raw, false);
+            return filter;
+        }
+
+        // Stars are never escaped, so they split the value before unescaping
+        filter.type = LdapFilter::Substrings;
+        std::vector<std::string> parts;
+        for (size_t start = 0;;)
+        {
+            size_t star = raw.find('*', start);
+            parts.push_back(unescape(raw.substr(start, star - start), true));
+            if (star == std::string::npos)
+            {
+                break;
+            }
+            start = star + 1;
+        }
+        filter.initial = parts.front();
+        filter.final = parts.back();
+        for (size_t i = 1; i + 1 < parts.size(); ++i)
+        {
+            if (parts[i].empty())
+            {
+                fail("empty substring");
+            }
+            filter.any.push_back(parts[i]);
+        }
+        return filter;
+    }
+
+    std::string unescape(const std::string &raw, bool substring)
+    {
+        std::string value;
+        for (size_t i = 0; i < raw.size(); ++i)
+        {
+            char c = raw[i];
+            if (c == '(' || (c == '*' && !substring))
+            {
+                fail("unescaped character in value");
+            }
+            if (c != '\\')
+            {
+                value += c;
+                continue;
+            }
+            if (i + 2 >= raw.size())
+            {
+                fail("truncated escape");
+            }
+            int hi = hex(raw[i + 1]);
+            int lo = hex(raw[i + 2]);
+            if (hi < 0 || lo < 0)
+            {
+                fail("bad escape");
+            }
+            value += char(hi << 4 | lo);
+            i += 2;
+        }
+        return value;
+    }
+
+    static int hex(char c)
+    {
+        if (c >= '0' && c <= '9')
+        {
+            return c - '0';
+        }
+        c = char(std::tolower((unsigned char)c));
+        return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+    }
+
+    const std::string &mText;
+    size_t mPos = 0;
+};
+
+} // namespace
+
+LdapFilter parseLdapFilter(const std::string &text)
+{
+    return FilterParser(text).parse();
+}
+
+const std::vector<std::string> &telephoneAttributes()
+{
+    static const std::vector<std::string> names{"telephoneNumber", "mobile",  "homePhone",
+                                                "otherTelephone",  "ipPhone", "facsimileTelephoneNumber",
+                                                "pager"};
+    return names;
+}
+
+bool isTelephoneAttribute(std::string_view attribute, const std::vector<std::string> &telephones)
+{
+    auto same = [attribute](const std::string &name) {
+        return name.size() == attribute.size() &&
+               std::equal(name.begin(), name.end(), attribute.begin(), [](unsigned char a, unsigned char b) {
+                   return std::tolower(a) == std::tolower(b);
+               });
+    };
+    return std::any_of(telephones.begin(), telephones.end(), same);
+}
+
+std::string normalizeAttributeValue(std::string_view attribute, std::string_view value)
+{
+    return normalizeValue(value, isTelephoneAttribute(attribute));
+}
+
+std::string normalizeValue(std::string_view value, bool telephone)
+{
+    std::string out;
+    normalizeValue(value, telephone, out);
+    return out;
+}
+
+void normalizeValue(std::string_view value, bool telephone, std::string &out)
+{
+    out.clear();
+    out.reserve(value.size());
+    for (unsigned char c : value)
+    {
+        if (std::isspace(c))
+        {
+            if (!telephone && !out.empty() && out.back() != ' ')
+            {
+                out += ' ';
+            }
+        }
+        else if (!(telephone && c == '-'))
+        {
+            out += char(std::tolower(c));
+        }
+    }
+    if (!out.empty() && out.back() == ' ')
+    {
+        out.pop_back();
+    }
+}
+
+int compareOrdered(std::string_view a, std::string_view b)
+{
+    auto number = [](std::string_view s) {
+        return !s.empty() && std::all_of(s.begin(), s.end(), [](unsigned char c) { return std::isdigit(c); });
+    };
+    if (number(a) && number(b) && a.size() != b.size())
+    {
+        return a.size() < b.size() ? -1 : 1;
+    }
+    return a.compare(b);
+}
+
+} // namespace ldapclient
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ldapclient
+{
+
+// An RFC 4515 search filter as a tree. Attribute descriptions are lower-cased
+// and assertion values unescaped, but otherwise as written.
+struct LdapFilter
+{
+    enum Type
+    {
+        And,
+        Or,
+        Not,
+        Equality,
+        Substrings,
+        GreaterOrEqual,
+        LessOrEqual,
+        Present,
+        Approx,
+    };
+
+    Type type = Present;
+    std::string attribute;
+    std::string value; // Equality, GreaterOrEqual, LessOrEqual and Approx
+    // Substrings: (attribute=initial*any*any*final), each part possibly empty
+    std::string initial;
+    std::vector<std::string> any;
+    std::string final;
+    std::vector<LdapFilter> children; // And, Or and the one of Not
+};
+
+// Accepts a bare "cn=x" as ldap_search does. Extensible matches are not
+// supported. Throws LdapError with LDAP_FILTER_ERROR on anything malformed.
+LdapFilter parseLdapFilter(const std::string &text);
+
+// The form attribute values compare in, standing in for the schema's matching
+// rules: caseIgnoreMatch, which ignores case and folds runs of blanks into one,
+// except that telephone numbers drop blanks and hyphens, as
+// telephoneNumberMatch does. The replica, the fake server and LookupBatcher
+// all compare through these.
+const std::vector<std::string> &telephoneAttributes(); // telephoneNumber, mobile, ...
+bool isTelephoneAttribute(std::string_view attribute,
+                          const std::vector<std::string> &telephones = telephoneAttributes());
+std::string normalizeAttributeValue(std::string_view attribute, std::string_view value);
+std::string normalizeValue(std::string_view value, bool telephone);
+// Into out, reusing its buffer
+void normalizeValue(std::string_view value, bool telephone, std::string &out);
+// Orders normalised values for >= and <=: integerOrderingMatch when both are
+// numbers, so uSNChanged>=10 holds for 9 < 10, byte order otherwise
+int compareOrdered(std::string_view a, std::string_view b);
+
+} // namespace ldapclient
@@ -0,0 +1,148 @@
+#include "lazy_attributes.h"
+#include <algorithm>
+
+namespace ldapclient
+{
+
+static bool sameAttribute(const std::string &a, const std::string &b)
+{
+    return strcasecmp(a.c_str(), b.c_str()) == 0;
+}
+
+const std::vector<std::string> &defaultHeavyAttributes()
+{
+    static const std::vector<std::string> heavy = {"thumbnailPhoto", "jpegPhoto", "photo", "audio",
+                                                   "userCertificate", "userSMIMECertificate", "cACertificate",
+                                                   "userPKCS12"};
+    return heavy;
+}
+
+LazyAttributeLoader::LazyAttributeLoader(AsyncLdapClient &client, std::vector<std::string> heavy)
+    : mClient(client), mHeavy(std::move(heavy))
+{
+}
+
+AttributeSplit splitAttributes(const std::vector<std::string> &attributes, const std::vector<std::string> &heavy)
+{
+    AttributeSplit split;
+    for (const auto &attribute : attributes)
+    {
+        bool isHeavy =
+            std::any_of(heavy.begin(), heavy.end(), [&](const std::string &h) { return sameAttribute(h, attribute); });
+        std::vector<std::string> &part = isHeavy ? split.heavy : split.light;
+        if (std::none_of(part.begin(), part.end(), [&](const std::string &a) { return sameAttribute(a, attribute); }))
+        {
+            part.push_back(attribute);
+        }
+    }
+    return split;
+}
+
+std::vector<LazyEntry> LazyAttributeLoader::search(const SearchRequest &request, int *rc)
+{
+    AttributeSplit parts = splitAttributes(request.attributes, mHeavy);
+    SearchRequest light = request;
+    if (!parts.heavy.empty())
+    {
+        // An empty list would ask for everything, "1.1" asks for no attributes at all
+        light.attributes = parts.light.empty() ? std::vector<std::string>{"1.1"} : parts.light;
+    }
+
+    SearchResult result = mClient.search(light).get();
+    if (rc)
+    {
+        *rc = result.rc;
+    }
+
+    std::vector<LazyEntry> entries;
+    entries.reserve(result.entries.size());
+    for (auto &entry : result.entries)
+    {
+        entries.emplace_back(std::move(entry), this, parts.heavy);
+    }
+    return entries;
+}
+
+int LazyAttributeLoader::load(std::vector<LazyEntry> &entries)
+{
+    std::vector<LazyEntry *> pending;
+    for (auto &entry : entries)
+    {
+        if (!entry.loaded())
+        {
+            pending.push_back(&entry);
+        }
+    }
+    return loadAll(pending);
+}
+
+int LazyAttributeLoader::load(LazyEntry &entry)
+{
+    std::vector<LazyEntry *> pending;
+    if (!entry.loaded())
+    {
+        pending.push_back(&entry);
+    }
+    return loadAll(pending);
+}
+
+int LazyAttributeLoader::loadAll(const std::vector<LazyEntry *> &entries)
+{
+    // One base-scope read per entry, all in flight together
+    std::vector<std::future<SearchResult>> reads;
+    for (LazyEntry *entry : entries)
+    {
+        SearchRequest request;
+        request.base = entry->dn();
+        request.scope = LDAP_SCOPE_BASE;
+        request.filter = "(objectClass=*)";
+        request.attributes = entry->mDeferred;
+        reads.push_back(mClient.search(request));
+    }
+
+    int rc = LDAP_SUCCESS;
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        SearchResult result = reads[i].get();
+        if (result.rc != LDAP_SUCCESS)
+        {
+            // Left deferred so a later access tries again
+            rc = rc == LDAP_SUCCESS ? result.rc : rc;
+            continue;
+        }
+
+        LazyEntry &entry = *entries[i];
+        if (!result.entries.empty())
+        {
+            for (auto &attribute : result.entries.front().attributes)
+            {
+                entry.mEntry.attributes[attribute.first] = std::move(attribute.second);
+            }
+        }
+        entry.mDeferred.clear();
+    }
+    return rc;
+}
+
+LazyEntry::LazyEntry(LdapEntry entry, LazyAttributeLoader *loader, std::vector<std::string> deferred)
+    : mEntry(std::move(entry)), mLoader(loader), mDeferred(std::move(deferred))
+{
+}
+
+const std::vector<std::string> *LazyEntry::values(const std::string &name)
+{
+    if (mLoader && std::any_of(mDeferred.begin(), mDeferred.end(),
+                               [&](const std::string &deferred) { return sameAttribute(deferred, name); }))
+    {
+        mLoader->load(*this);
+    }
+    return mEntry.values(name);
+}
+
+std::string LazyEntry::value(const std::string &name)
+{
+    const std::vector<std::string> *v = values(name);
+    return v && !v->empty() ? v->front() : std::string();
+}
+
+} // namespace ldapclient
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "async_client.h"
+
+namespace ldapclient
+{
+
+// Binary attributes worth a second round trip rather than riding along on every search
+const std::vector<std::string> &defaultHeavyAttributes();
+
+struct AttributeSplit
+{
+    std::vector<std::string> light;
+    std::vector<std::string> heavy;
+};
+
+// Keeps the requested order and drops duplicates; names compare case-insensitively
+AttributeSplit splitAttributes(const std::vector<std::string> &attributes, const std::vector<std::string> &heavy);
+
+class LazyEntry;
+
+// Two-phase fetch: searches ask for the light attributes only, and the heavy
+// ones are read afterwards by DN with base-scope searches, for one entry on
+// first access or for many at once pipelined on the client.
+class LazyAttributeLoader
+{
+  public:
+    explicit LazyAttributeLoader(AsyncLdapClient &client,
+                                 std::vector<std::string> heavy = defaultHeavyAttributes());
+
+    // Runs request without its heavy attributes. A request for all attributes
+    // cannot be split and is sent as it is.
+    std::vector<LazyEntry> search(const SearchRequest &request, int *rc = nullptr);
+
+    // Fetches whatever the entries still defer, in one round trip.
+    // Returns the first failure, or LDAP_SUCCESS.
+    int load(std::vector<LazyEntry> &entries);
+    int load(LazyEntry &entry);
+
+  private:
+    int loadAll(const std::vector<LazyEntry *> &entries);
+
+    AsyncLdapClient &mClient;
+    std::vector<std::string> mHeavy;
+};
+
+// A search entry whose heavy attributes are fetched when first asked for
+class LazyEntry
+{
+  public:
+    LazyEntry(LdapEntry entry, LazyAttributeLoader *loader, std::vector<std::string> deferred);
+
+    const std::string &dn() const { return mEntry.dn; }
+    // Light attributes and whatever has been loaded so far
+    const LdapEntry &entry() const { return mEntry; }
+    const std::vector<std::string> &deferred() const { return mDeferred; }
+    bool loaded() const { return mDeferred.empty(); }
+
+    // Loads the deferred attributes first if name is one of them
+    const std::vector<std::string> *values(const std::string &name);
+    std::string value(const std::string &name);
+
+  private:
+    friend class LazyAttributeLoader;
+
+    LdapEntry mEntry;
+    LazyAttributeLoader *mLoader;
+    std::vector<std::string> mDeferred;
+};
+
+} // namespace ldapclient
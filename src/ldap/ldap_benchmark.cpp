@@ -0,0 +1,207 @@
+#include "async_client.h"
+#include "connection_pool.h"
+#include "fake_server.h"
+#include "replica.h"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <thread>
+
+// Throughput and latency of the ways to search, against FakeLdapServer
+// on loopback so the numbers do not depend on a directory being reachable.
+// LDAP_BENCH_PEOPLE, LDAP_BENCH_SEARCHES and LDAP_BENCH_LATENCY_US override
+// the directory size, the number of searches per path and the injected latency.
+
+namespace ldapclient
+{
+
+using Clock = std::chrono::steady_clock;
+
+static size_t envOr(const char *name, size_t fallback)
+{
+    const char *value = getenv(name);
+    return value ? size_t(strtoul(value, NULL, 10)) : fallback;
+}
+
+struct BenchmarkRun
+{
+    std::string path;
+    double seconds = 0;
+    std::vector<double> latencies; // milliseconds, one per search
+    size_t failures = 0;
+
+    double percentile(double p)
+    {
+        if (latencies.empty())
+        {
+            return 0;
+        }
+        size_t rank = std::min(latencies.size() - 1, size_t(p / 100 * latencies.size()));
+        std::nth_element(latencies.begin(), latencies.begin() + rank, latencies.end());
+        return latencies[rank];
+    }
+
+    void print()
+    {
+        printf("%-8s %6zu searches %9.0f/s  p50 %7.3f  p90 %7.3f  p99 %7.3f  max %7.3f ms\n", path.c_str(),
+               latencies.size(), latencies.size() / seconds, percentile(50), percentile(90), percentile(99),
+               percentile(100));
+    }
+};
+
+static std::vector<SearchRequest> lookups(const LdapConfiguration &config, size_t people, size_t count)
+{
+    std::vector<SearchRequest> requests(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        requests[i].base = config.mSearchBase;
+        requests[i].filter = "(uid=user" + std::to_string(i * 7919 % people) + ")";
+        requests[i].attributes = config.mAttributes;
+    }
+    return requests;
+}
+
+static int searchOnce(LDAP *ld, const SearchRequest &request)
+{
+    AttributeList attrs(request.attributes);
+    struct timeval timeOut = {10, 0};
+    LDAPMessage *res = NULL;
+    int rc = ldap_search_ext_s(ld, request.base.c_str(), request.scope, request.filter.c_str(), attrs.get(), 0, NULL,
+                               NULL, &timeOut, request.sizeLimit, &res);
+    if (rc == LDAP_SUCCESS && ldap_count_entries(ld, res) != 1)
+    {
+        rc = LDAP_NO_RESULTS_RETURNED;
+    }
+    ldap_msgfree(res);
+    return rc;
+}
+
+static double millisecondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// One connection, one search at a time
+static BenchmarkRun runSync(const LdapConfiguration &config, const std::vector<SearchRequest> &requests)
+{
+    BenchmarkRun run;
+    run.path = "sync";
+    LdapConnection connection(config);
+    auto start = Clock::now();
+    for (const SearchRequest &request : requests)
+    {
+        auto sent = Clock::now();
+        run.failures += searchOnce(connection.get(), request) != LDAP_SUCCESS;
+        run.latencies.push_back(millisecondsSince(sent));
+    }
+    run.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    return run;
+}
+
+// One connection, every search pipelined
+static BenchmarkRun runAsync(const LdapConfiguration &config, const std::vector<SearchRequest> &requests)
+{
+    BenchmarkRun run;
+    run.path = "async";
+    AsyncLdapClient client(config);
+    auto start = Clock::now();
+    for (const SearchResult &result : client.searchAll(requests))
+    {
+        run.failures += result.rc != LDAP_SUCCESS || result.entries.size() != 1;
+        run.latencies.push_back(result.seconds * 1000);
+    }
+    run.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    return run;
+}
+
+// A thread per pooled connection, each searching synchronously
+static BenchmarkRun runPooled(const LdapConfiguration &config, const std::vector<SearchRequest> &requests,
+                              size_t threads)
+{
+    BenchmarkRun run;
+    run.path = "pooled";
+    LdapPoolOptions options;
+    options.maxConnections = threads;
+    LdapConnectionPool pool(config, options);
+
+    std::vector<std::vector<double>> latencies(threads);
+    std::atomic<size_t> failures{0};
+    std::atomic<size_t> next{0};
+    auto start = Clock::now();
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; ++t)
+    {
+        workers.emplace_back([&, t] {
+            for (size_t i; (i = next++) < requests.size();)
+            {
+                auto sent = Clock::now();
+                failures += pool.run([&](LDAP *ld) { return searchOnce(ld, requests[i]); }) != LDAP_SUCCESS;
+                latencies[t].push_back(millisecondsSince(sent));
+            }
+        });
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+    run.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    run.failures = failures;
+    for (const auto &own : latencies)
+    {
+        run.latencies.insert(run.latencies.end(), own.begin(), own.end());
+    }
+    return run;
+}
+
+// Every lookup answered locally; the initial load is not counted
+static BenchmarkRun runReplica(const LdapConfiguration &config, const std::vector<SearchRequest> &requests)
+{
+    BenchmarkRun run;
+    run.path = "replica";
+    LdapConfiguration replicated = config;
+    replicated.mAttributes.push_back("uid");
+    DirectoryReplica replica(replicated);
+    run.failures += replica.refresh() != LDAP_SUCCESS;
+
+    auto start = Clock::now();
+    for (const SearchRequest &request : requests)
+    {
+        auto sent = Clock::now();
+        run.failures += replica.search(request.filter).size() != 1; // (uid=...), from the uid index
+        run.latencies.push_back(millisecondsSince(sent));
+    }
+    run.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    return run;
+}
+
+static void benchmark(std::chrono::microseconds latency)
+{
+    FakeDirectoryOptions directory;
+    directory.people = envOr("LDAP_BENCH_PEOPLE", 1000);
+    FakeServerOptions options;
+    options.latency = latency;
+    FakeLdapServer server(generateDirectory(directory), options);
+    LdapConfiguration config = server.config();
+
+    std::vector<SearchRequest> requests = lookups(config, directory.people, envOr("LDAP_BENCH_SEARCHES", 1000));
+    printf("%zu people, %lld us added latency\n", directory.people, (long long)latency.count());
+    for (BenchmarkRun run : {runSync(config, requests), runAsync(config, requests), runPooled(config, requests, 8),
+                             runReplica(config, requests)})
+    {
+        EXPECT_EQ(0u, run.failures) << run.path;
+        run.print();
+    }
+}
+
+TEST(ldap_benchmark, loopback)
+{
+    benchmark(std::chrono::microseconds(0));
+}
+
+TEST(ldap_benchmark, injected_latency)
+{
+    benchmark(std::chrono::microseconds(envOr("LDAP_BENCH_LATENCY_US", 1000)));
+}
+
+} // namespace ldapclient
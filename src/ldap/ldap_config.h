@@ -0,0 +1,57 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <yaml-cpp/yaml.h>
+
+struct LdapConfiguration
+{
+    std::string mPrimaryServer;
+    std::string mSearchBase;
+    std::string mUsername;
+    std::string mPassword;
+    std::string mFilter;
+    std::vector<std::string> mAttributes;
+    bool mUseSSL;
+    std::vector<std::string> mSecondaryServers; // tried after the primary, in this order
+};
+
+namespace YAML
+{
+template <> struct convert<LdapConfiguration>
+{
+    static bool decode(const Node &node, LdapConfiguration &rhs)
+    {
+        rhs.mPrimaryServer = node["PrimaryServerName"].as<std::string>();
+        rhs.mSearchBase = node["SearchBase"].as<std::string>();
+        rhs.mUsername = node["Username"].as<std::string>();
+        rhs.mPassword = node["Password"].as<std::string>();
+        rhs.mFilter = node["Filter"].as<std::string>();
+        rhs.mUseSSL = node["UseSSL"].as<bool>();
+        rhs.mAttributes = node["Attributes"].as<std::vector<std::string>>();
+        if (node["SecondaryServerNames"])
+        {
+            rhs.mSecondaryServers = node["SecondaryServerNames"].as<std::vector<std::string>>();
+        }
+        return true;
+    }
+};
+} // namespace YAML
+
+inline std::string ldapUrl(const LdapConfiguration &config, const std::string &server)
+{
+    return (config.mUseSSL ? "ldaps://" : "ldap://") + server;
+}
+
+inline std::string ldapUrl(const LdapConfiguration &config)
+{
+    return ldapUrl(config, config.mPrimaryServer);
+}
+
+// The primary server first, then the secondaries
+inline std::vector<std::string> ldapServers(const LdapConfiguration &config)
+{
+    std::vector<std::string> servers(1, config.mPrimaryServer);
+    servers.insert(servers.end(), config.mSecondaryServers.begin(), config.mSecondaryServers.end());
+    return servers;
+}
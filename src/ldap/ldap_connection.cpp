@@ -0,0 +1,121 @@
+#include "ldap_connection.h"
+#include "server_set.h"
+#include "tls_session_cache.h"
+
+namespace ldapclient
+{
+
+LDAP *bindServer(const LdapConfiguration &config, const std::string &server, std::chrono::seconds networkTimeout)
+{
+    std::string url = ldapUrl(config, server);
+    LDAP *ld = nullptr;
+    int rc = ldap_initialize(&ld, url.c_str());
+    if (rc != LDAP_SUCCESS)
+    {
+        throw LdapError(rc, "ldap_initialize " + url);
+    }
+
+    int version = LDAP_VERSION3;
+    struct timeval timeOut = {long(networkTimeout.count()), 0};
+    ldap_set_option(ld, LDAP_OPT_PROTOCOL_VERSION, &version);
+    ldap_set_option(ld, LDAP_OPT_NETWORK_TIMEOUT, &timeOut);
+    ldap_set_option(ld, LDAP_OPT_REFERRALS, LDAP_OPT_OFF);
+
+    // Connected apart from the bind so the handshake can be timed and resumed
+    std::unique_ptr<TlsSessionCache::Handshake> tls;
+    if (config.mUseSSL)
+    {
+        tls.reset(new TlsSessionCache::Handshake(TlsSessionCache::global(), ld, url));
+        rc = ldap_connect(ld);
+        if (rc != LDAP_SUCCESS)
+        {
+            ldap_unbind_ext_s(ld, NULL, NULL);
+            throw LdapError(rc, "ldap_connect " + url);
+        }
+        tls->connected();
+    }
+
+    struct berval cred;
+    cred.bv_val = const_cast<char *>(config.mPassword.c_str());
+    cred.bv_len = config.mPassword.length();
+
+    rc = ldap_sasl_bind_s(ld, config.mUsername.c_str(), LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL);
+    if (tls && !connectionLost(rc))
+    {
+        tls->finished();
+    }
+    if (rc != LDAP_SUCCESS)
+    {
+        ldap_unbind_ext_s(ld, NULL, NULL);
+        throw LdapError(rc, "ldap_sasl_bind_s " + url);
+    }
+    return ld;
+}
+
+LdapConnection::LdapConnection(const LdapConfiguration &config, std::chrono::seconds networkTimeout,
+                               std::shared_ptr<LdapServerSet> servers)
+    : mConfig(config), mNetworkTimeout(networkTimeout), mServers(std::move(servers))
+{
+    if (!mServers && !mConfig.mSecondaryServers.empty())
+    {
+        FailoverOptions options;
+        options.connectTimeout = networkTimeout;
+        mServers = std::make_shared<LdapServerSet>(mConfig, options);
+    }
+    connect();
+}
+
+LdapConnection::~LdapConnection()
+{
+    close();
+}
+
+void LdapConnection::connect()
+{
+    if (mServers)
+    {
+        mLd = mServers->open(&mServer);
+    }
+    else
+    {
+        mServer = mConfig.mPrimaryServer;
+        mLd = bindServer(mConfig, mServer, mNetworkTimeout);
+    }
+}
+
+void LdapConnection::close()
+{
+    if (mLd)
+    {
+        ldap_unbind_ext_s(mLd, NULL, NULL);
+        mLd = nullptr;
+    }
+}
+
+void LdapConnection::reconnect()
+{
+    if (mServers && mLd)
+    {
+        mServers->reportLost(mServer); // the next connect tries the others first
+    }
+    close();
+    connect();
+}
+
+bool LdapConnection::healthy(std::chrono::seconds timeout) const
+{
+    if (!mLd)
+    {
+        return false;
+    }
+
+    char noAttributes[] = "1.1";
+    char *attrs[] = {noAttributes, NULL};
+    struct timeval timeOut = {long(timeout.count()), 0};
+    LDAPMessage *res = NULL;
+    int rc = ldap_search_ext_s(mLd, "", LDAP_SCOPE_BASE, "(objectClass=*)", attrs, 0, NULL, NULL, &timeOut, 1, &res);
+    ldap_msgfree(res);
+    return rc == LDAP_SUCCESS;
+}
+
+} // namespace ldapclient
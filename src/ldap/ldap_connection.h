@@ -0,0 +1,72 @@
+#pragma once
+
+#include "ldap_config.h"
+#include <chrono>
+#include <ldap.h>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+namespace ldapclient
+{
+
+class LdapError : public std::runtime_error
+{
+  public:
+    LdapError(int code, const std::string &what) : std::runtime_error(what + ": " + ldap_err2string(code)), mCode(code) {}
+    int code() const { return mCode; }
+
+  private:
+    int mCode;
+};
+
+// The handle is unusable and has to be rebuilt
+inline bool connectionLost(int rc)
+{
+    return rc == LDAP_SERVER_DOWN || rc == LDAP_CONNECT_ERROR;
+}
+
+// Opens a handle to server and binds with the configured credentials. An
+// ldaps:// handshake resumes a session from TlsSessionCache::global() when it
+// can. Throws LdapError on failure.
+LDAP *bindServer(const LdapConfiguration &config, const std::string &server, std::chrono::seconds networkTimeout);
+
+class LdapServerSet;
+
+// A bound LDAP handle. The constructor and reconnect() throw LdapError when the
+// server cannot be reached or rejects the credentials.
+//
+// When the configuration lists secondary servers, connecting goes through an
+// LdapServerSet, which races the servers and prefers the fastest healthy one.
+// Pass one set to every connection that should share what it has learned.
+class LdapConnection
+{
+  public:
+    explicit LdapConnection(const LdapConfiguration &config,
+                            std::chrono::seconds networkTimeout = std::chrono::seconds(10),
+                            std::shared_ptr<LdapServerSet> servers = nullptr);
+    ~LdapConnection();
+    LdapConnection(const LdapConnection &) = delete;
+    LdapConnection &operator=(const LdapConnection &) = delete;
+
+    LDAP *get() const { return mLd; }
+    const LdapConfiguration &config() const { return mConfig; }
+    // The server the handle is bound to
+    const std::string &server() const { return mServer; }
+
+    void reconnect();
+    // Reads the root DSE, the cheapest request every server answers
+    bool healthy(std::chrono::seconds timeout = std::chrono::seconds(5)) const;
+
+  private:
+    void connect();
+    void close();
+
+    LdapConfiguration mConfig;
+    std::chrono::seconds mNetworkTimeout;
+    std::shared_ptr<LdapServerSet> mServers;
+    std::string mServer;
+    LDAP *mLd = nullptr;
+};
+
+} // namespace ldapclient
@@ -0,0 +1,1488 @@
+#include "../config/config_store.h"
+#include "async_client.h"
+#include "ber.h"
+#include "compact_result.h"
+#include "connection_pool.h"
+#include "dn_store.h"
+#include "fake_server.h"
+#include "filter.h"
+#include "lazy_attributes.h"
+#include "lookup_batcher.h"
+#include "paged_search.h"
+#include "replica.h"
+#include "search_cache.h"
+#include "server_set.h"
+#include "sorted_search.h"
+#include "tls_session_cache.h"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <set>
+#include <thread>
+
+namespace ldapclient
+{
+
+static LdapConfiguration loadConfig(const std::string &id)
+{
+    std::optional<config::ServiceConfig> service = config::ConfigStore::open("./data/hunter.yaml")->find(id);
+    if (!service)
+    {
+        throw std::runtime_error("config " + id + " is not found");
+    }
+    return service->ldap;
+}
+
+static int searchPeople(LDAP *ld, const LdapConfiguration &config, int *count)
+{
+    struct timeval timeOut = {10, 0};
+    LDAPMessage *res = NULL;
+    int rc = ldap_search_ext_s(ld, config.mSearchBase.c_str(), LDAP_SCOPE_SUBTREE, config.mFilter.c_str(), NULL, 0,
+                               NULL, NULL, &timeOut, LDAP_NO_LIMIT, &res);
+    if (rc == LDAP_SUCCESS)
+    {
+        *count = ldap_count_entries(ld, res);
+    }
+    ldap_msgfree(res);
+    return rc;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LdapConnectionPool
+///////////////////////////////////////////////////////////////////////////////
+
+TEST(ldap, pool_unreachable)
+{
+    LdapConfiguration config = loadConfig("ldap.config");
+    config.mPrimaryServer = "127.0.0.1:1";
+
+    LdapPoolOptions options;
+    options.networkTimeout = std::chrono::seconds(2);
+    LdapConnectionPool pool(config, options);
+
+    try
+    {
+        pool.checkout();
+        FAIL() << "nothing listens on port 1";
+    }
+    catch (const LdapError &e)
+    {
+        EXPECT_TRUE(connectionLost(e.code())) << e.what();
+    }
+    EXPECT_EQ(0u, pool.open());
+}
+
+TEST(ldap, pool_shared)
+{
+    LdapConfiguration config = loadConfig("ldap.config");
+    LdapPoolOptions options;
+    options.maxConnections = 2;
+    LdapConnectionPool pool(config, options);
+
+    try
+    {
+        pool.checkout();
+    }
+    catch (const LdapError &e)
+    {
+        printf("%s\n", e.what());
+        return;
+    }
+    EXPECT_EQ(1u, pool.idle());
+
+    auto start = std::chrono::steady_clock::now();
+    std::atomic<int> failures{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([&] {
+            for (int i = 0; i < 3; ++i)
+            {
+                int count = 0;
+                int rc = pool.run([&](LDAP *ld) { return searchPeople(ld, config, &count); });
+                if (rc != LDAP_SUCCESS || count == 0)
+                {
+                    ++failures;
+                }
+            }
+        });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    auto delta = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+    std::cout << "12 searches over " << pool.open() << " connections: " << delta.count() << " seconds\n";
+
+    EXPECT_EQ(0, failures.load());
+    EXPECT_LE(pool.open(), 2u);
+    EXPECT_EQ(pool.open(), pool.idle());
+}
+
+TEST(ldap, pool_checkout_timeout)
+{
+    LdapPoolOptions options;
+    options.maxConnections = 1;
+    options.checkoutTimeout = std::chrono::milliseconds(100);
+    LdapConnectionPool pool(loadConfig("ldap.config"), options);
+
+    try
+    {
+        LdapConnectionPool::Lease lease = pool.checkout();
+        try
+        {
+            pool.checkout();
+            FAIL() << "the only connection is lent out";
+        }
+        catch (const LdapError &e)
+        {
+            EXPECT_EQ(LDAP_TIMEOUT, e.code());
+        }
+    }
+    catch (const LdapError &e)
+    {
+        printf("%s\n", e.what());
+        return;
+    }
+
+    // Returned on scope exit, so the next checkout gets it back without binding again
+    LdapConnectionPool::Lease lease = pool.checkout();
+    EXPECT_EQ(1u, pool.open());
+    EXPECT_TRUE(lease.connection().healthy());
+}
+
+TEST(ldap, pool_warm)
+{
+    FakeLdapServer server(generateDirectory(FakeDirectoryOptions()));
+    LdapPoolOptions options;
+    options.maxConnections = 4;
+    options.warmConnections = 3;
+    LdapConnectionPool pool(server.config(), options);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (pool.idle() < 3 && std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(3u, pool.idle());
+    EXPECT_EQ(3u, server.binds());
+
+    // Never past maxConnections, and checkout() finds them bound already
+    EXPECT_EQ(1u, pool.warm(10));
+    EXPECT_EQ(0u, pool.warm(4));
+    LdapConnectionPool::Lease lease = pool.checkout();
+    EXPECT_EQ(4u, server.binds());
+}
+
+TEST(ldap, pool_health_check)
+{
+    FakeLdapServer server(generateDirectory(FakeDirectoryOptions()));
+    LdapPoolOptions options;
+    options.warmConnections = 3;
+    options.healthCheckInterval = std::chrono::seconds(1);
+    LdapConnectionPool pool(server.config(), options);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (pool.idle() < 3 && std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ASSERT_EQ(3u, pool.idle());
+
+    // Every idle connection goes stale at once, and one pass rebinds them all
+    server.disconnectAll();
+    deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(3500);
+    while ((server.binds() < 6 || pool.idle() < 3) && std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(6u, server.binds());
+    EXPECT_EQ(3u, pool.open());
+    EXPECT_EQ(3u, pool.idle());
+    LdapConnectionPool::Lease lease = pool.checkout();
+    EXPECT_TRUE(lease.connection().healthy());
+    EXPECT_EQ(6u, server.binds());
+}
+
+TEST(ldap, tls_handshakes)
+{
+    FakeLdapServer server(generateDirectory(FakeDirectoryOptions()));
+    LdapConfiguration config = server.config();
+    TlsStats before = TlsSessionCache::global().stats();
+    LdapConnection plain(config);
+    EXPECT_EQ(before.handshakes, TlsSessionCache::global().stats().handshakes);
+
+    // The fake server does not speak TLS, so the handshake fails and nothing is cached
+    config.mUseSSL = true;
+    EXPECT_THROW(LdapConnection secure(config, std::chrono::seconds(2)), LdapError);
+    TlsStats after = TlsSessionCache::global().stats();
+    EXPECT_EQ(before.handshakes + 1, after.handshakes);
+    EXPECT_EQ(before.failures + 1, after.failures);
+    EXPECT_EQ(before.resumed, after.resumed);
+    EXPECT_EQ(0u, TlsSessionCache::global().size());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AsyncLdapClient
+///////////////////////////////////////////////////////////////////////////////
+
+TEST(ldap, pipelined)
+{
+    LdapConfiguration config = loadConfig("ldap.config");
+    std::unique_ptr<AsyncLdapClient> client;
+    try
+    {
+        client.reset(new AsyncLdapClient(config));
+    }
+    catch (const LdapError &e)
+    {
+        printf("%s\n", e.what());
+        return;
+    }
+
+    std::vector<SearchRequest> requests;
+    for (const char *uid : {"einstein", "newton", "galieleo", "tesla", "riemann", "gauss", "euler", "euclid", "curie",
+                            "nobel", "boyle", "pasteur", "nobody"})
+    {
+        SearchRequest request;
+        request.base = config.mSearchBase;
+        request.filter = std::string("(uid=") + uid + ")";
+        request.attributes = config.mAttributes;
+        requests.push_back(request);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<SearchResult> results = client->searchAll(requests);
+    auto delta = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+    std::cout << requests.size() << " pipelined searches: " << delta.count() << " seconds\n";
+
+    ASSERT_EQ(requests.size(), results.size());
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        EXPECT_TRUE(results[i].ok()) << requests[i].filter << ": " << ldap_err2string(results[i].rc);
+    }
+    ASSERT_EQ(1u, results[0].entries.size());
+    EXPECT_EQ("uid=einstein,dc=example,dc=com", results[0].entries[0].dn);
+    EXPECT_EQ("einstein@ldap.forumsys.com", results[0].entries[0].value("MAIL"));
+    EXPECT_TRUE(results.back().entries.empty());
+    EXPECT_EQ(0u, client->pending());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PagedSearch
+///////////////////////////////////////////////////////////////////////////////
+
+TEST(ldap, paged)
+{
+    LdapConfiguration config = loadConfig("ldap.config");
+    std::unique_ptr<LdapConnection> connection;
+    try
+    {
+        connection.reset(new LdapConnection(config));
+    }
+    catch (const LdapError &e)
+    {
+        printf("%s\n", e.what());
+        return;
+    }
+
+    SearchRequest request;
+    request.base = config.mSearchBase;
+    request.filter = "(objectClass=person)";
+    request.attributes = {"uid", "mail"};
+
+    LdapConfiguration everyone = config;
+    everyone.mFilter = request.filter;
+    int total = 0;
+    ASSERT_EQ(LDAP_SUCCESS, searchPeople(connection->get(), everyone, &total));
+
+    PagedSearch search(connection->get(), request, 3);
+    std::vector<LdapEntry> page;
+    size_t entries = 0;
+    while (search.next(page))
+    {
+        EXPECT_LE(page.size(), 3u);
+        entries += page.size();
+    }
+    EXPECT_EQ(LDAP_SUCCESS, search.rc()) << ldap_err2string(search.rc());
+    EXPECT_EQ(size_t(total), entries);
+    EXPECT_EQ(entries, search.entries());
+    std::cout << entries << " entries in " << search.pages() << " pages\n";
+
+    // Stopping early abandons the page in flight
+    size_t pages = 0;
+    int rc = pagedSearch(connection->get(), request, 2, [&](std::vector<LdapEntry> &) { return ++pages < 2; });
+    EXPECT_EQ(LDAP_SUCCESS, rc);
+    EXPECT_EQ(2u, pages);
+    EXPECT_TRUE(connection->healthy());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SearchCache
+///////////////////////////////////////////////////////////////////////////////
+
+static SearchRequest lookupRequest(const std::string &filter)
+{
+    SearchRequest request;
+    request.base = "OU=Employees, DC=example,DC=com";
+    request.filter = filter;
+    request.attributes = {"mail", "cn"};
+    return request;
+}
+
+// The identity cached results were read under
+static const std::string READER = "cn=reader,dc=example,dc=com";
+
+static SearchResult foundResult(const std::string &dn)
+{
+    SearchResult result;
+    result.rc = LDAP_SUCCESS;
+    result.entries.resize(1);
+    result.entries[0].dn = dn;
+    result.entries[0].attributes["mail"] = {"someone@example.com"};
+    return result;
+}
+
+TEST(ldap, cache_key)
+{
+    EXPECT_EQ("(&(objectclass=person)(|(telephonenumber=+86 21 2422 4178)(mail=A@b.com)))",
+              SearchCache::normalizeFilter(" (& (objectClass=person) (|(telephoneNumber=+86 21 2422 4178)(MAIL=A@b.com)))"));
+    EXPECT_EQ("(uid=einstein)", SearchCache::normalizeFilter("uid=einstein"));
+    EXPECT_EQ("(objectclass=*)", SearchCache::normalizeFilter(""));
+    EXPECT_EQ("ou=employees,dc=example,dc=com", SearchCache::normalizeDn("OU=Employees, DC = example,DC=com "));
+
+    SearchRequest a = lookupRequest("(Mail=a@b.com)");
+    SearchRequest b = lookupRequest("(mail=a@b.com)");
+    b.base = "ou=employees,dc=example,dc=com";
+    b.attributes = {"CN", "mail", "cn"};
+    EXPECT_EQ(SearchCache::key(READER, a), SearchCache::key(READER, b));
+
+    b.scope = LDAP_SCOPE_ONELEVEL;
+    EXPECT_NE(SearchCache::key(READER, a), SearchCache::key(READER, b));
+    EXPECT_NE(SearchCache::key(READER, a), SearchCache::key(READER, lookupRequest("(mail=A@b.com)")));
+
+    // What one bind read is not what another may
+    EXPECT_EQ(SearchCache::key(READER, a), SearchCache::key("CN=Reader, DC=example,DC=com", a));
+    EXPECT_NE(SearchCache::key(READER, a), SearchCache::key("cn=admin,dc=example,dc=com", a));
+    EXPECT_NE(SearchCache::key(READER, a), SearchCache::key("", a));
+    SearchCache cache;
+    cache.store("cn=admin,dc=example,dc=com", a, foundResult("cn=a"));
+    SearchResult result;
+    EXPECT_FALSE(cache.lookup(READER, a, result));
+    EXPECT_TRUE(cache.lookup("cn=admin,dc=example,dc=com", a, result));
+}
+
+TEST(ldap, cache_ttl)
+{
+    SearchCacheOptions options;
+    options.ttl = std::chrono::milliseconds(200);
+    options.negativeTtl = std::chrono::milliseconds(20);
+    SearchCache cache(options);
+
+    SearchRequest known = lookupRequest("(mail=a@b.com)");
+    SearchRequest unknown = lookupRequest("(mail=nobody@b.com)");
+    SearchResult empty;
+    empty.rc = LDAP_SUCCESS;
+    cache.store(READER, known, foundResult("cn=a"));
+    cache.store(READER, unknown, empty);
+
+    SearchResult failed;
+    failed.rc = LDAP_BUSY;
+    cache.store(READER, lookupRequest("(mail=busy@b.com)"), failed);
+    EXPECT_EQ(2u, cache.stats().entries);
+
+    SearchResult result;
+    ASSERT_TRUE(cache.lookup(READER, known, result));
+    ASSERT_EQ(1u, result.entries.size());
+    EXPECT_EQ("cn=a", result.entries[0].dn);
+    EXPECT_TRUE(cache.lookup(READER, unknown, result));
+    EXPECT_TRUE(result.entries.empty());
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(40));
+    EXPECT_TRUE(cache.lookup(READER, known, result));
+    EXPECT_FALSE(cache.lookup(READER, unknown, result));
+
+    SearchCacheStats stats = cache.stats();
+    EXPECT_EQ(3u, stats.hits);
+    EXPECT_EQ(1u, stats.negativeHits);
+    EXPECT_EQ(1u, stats.misses);
+    EXPECT_EQ(1u, stats.expirations);
+    EXPECT_DOUBLE_EQ(0.75, stats.hitRate());
+}
+
+TEST(ldap, cache_lru)
+{
+    SearchCacheOptions options;
+    options.maxBytes = 4096;
+    SearchCache cache(options);
+
+    std::vector<SearchRequest> requests;
+    for (int i = 0; i < 100; ++i)
+    {
+        requests.push_back(lookupRequest("(mail=user" + std::to_string(i) + "@b.com)"));
+        cache.store(READER, requests.back(), foundResult("cn=user" + std::to_string(i)));
+
+        SearchResult result;
+        EXPECT_TRUE(cache.lookup(READER, requests.front(), result)); // kept warm
+    }
+
+    SearchCacheStats stats = cache.stats();
+    EXPECT_LE(stats.bytes, options.maxBytes);
+    EXPECT_GT(stats.evictions, 0u);
+    EXPECT_EQ(100u, stats.entries + stats.evictions);
+
+    SearchResult result;
+    EXPECT_TRUE(cache.lookup(READER, requests.back(), result));
+    EXPECT_FALSE(cache.lookup(READER, requests[1], result));
+
+    cache.invalidate(READER, requests.back());
+    EXPECT_FALSE(cache.lookup(READER, requests.back(), result));
+    cache.clear();
+    EXPECT_EQ(0u, cache.stats().bytes);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LookupBatcher
+///////////////////////////////////////////////////////////////////////////////
+
+TEST(ldap, batch_filter)
+{
+    LookupBatcherOptions options;
+    options.request.filter = "(&(objectCategory=person)(objectClass=user))";
+    EXPECT_EQ("(&(objectCategory=person)(objectClass=user)(|(telephoneNumber=+86 21 2422 4178)(mail=guhua@cisco.com)))",
+              LookupBatcher::filterFor(options, {{"telephoneNumber", "+86 21 2422 4178"}, {"mail", "guhua@cisco.com"}}));
+    EXPECT_EQ("(&(objectCategory=person)(objectClass=user)(cn=a\\2a\\28b\\29))",
+              LookupBatcher::filterFor(options, {{"cn", "a*(b)"}}));
+
+    options.request.filter = "(objectClass=person)";
+    EXPECT_EQ("(&(objectClass=person)(uid=x))", LookupBatcher::filterFor(options, {{"uid", "x"}}));
+
+    EXPECT_EQ(LookupBatcher::normalizeValue(options, "telephoneNumber", "+86 21 2422-4178"),
+              LookupBatcher::normalizeValue(options, "TELEPHONENUMBER", "+862124224178"));
+    EXPECT_NE(LookupBatcher::normalizeValue(options, "cn", "a-b"), LookupBatcher::normalizeValue(options, "cn", "ab"));
+    EXPECT_EQ("guhua@cisco.com", LookupBatcher::normalizeValue(options, "mail", " GuHua@Cisco.com "));
+    EXPECT_EQ("a b", LookupBatcher::normalizeValue(options, "cn", "A   b"));
+    EXPECT_EQ(normalizeAttributeValue("mobile", "+1 555-0100"),
+              LookupBatcher::normalizeValue(options, "mobile", "+1 555-0100"));
+    EXPECT_TRUE(isTelephoneAttribute("HOMEPHONE"));
+    EXPECT_FALSE(isTelephoneAttribute("phoneticName")); // named like one, matched as caseIgnoreMatch
+}
+
+TEST(ldap, batched)
+{
+    LdapConfiguration config = loadConfig("ldap.config");
+    std::unique_ptr<AsyncLdapClient> client;
+    try
+    {
+        client.reset(new AsyncLdapClient(config));
+    }
+    catch (const LdapError &e)
+    {
+        printf("%s\n", e.what());
+        return;
+    }
+
+    LookupBatcherOptions options;
+    options.request.base = config.mSearchBase;
+    options.request.filter = "(objectClass=person)";
+    options.request.attributes = {"cn"};
+    options.window = std::chrono::milliseconds(20);
+    LookupBatcher batcher(*client, options);
+
+    std::vector<std::vector<LookupKey>> lookups = {
+        {{"uid", "einstein"}, {"mail", "newton@ldap.forumsys.com"}},
+        {{"mail", "TESLA@ldap.forumsys.com"}},
+        {{"uid", "einstein"}},
+        {{"uid", "nobody"}},
+    };
+    std::vector<std::future<SearchResult>> batched;
+    for (const auto &keys : lookups)
+    {
+        batched.push_back(batcher.lookup(keys));
+    }
+
+    for (size_t i = 0; i < lookups.size(); ++i)
+    {
+        SearchResult together = batched[i].get();
+        SearchRequest alone = options.request;
+        alone.filter = LookupBatcher::filterFor(options, lookups[i]);
+        SearchResult separate = client->search(alone).get();
+
+        ASSERT_EQ(LDAP_SUCCESS, together.rc);
+        ASSERT_EQ(separate.entries.size(), together.entries.size()) << alone.filter;
+        for (size_t j = 0; j < separate.entries.size(); ++j)
+        {
+            EXPECT_EQ(separate.entries[j].dn, together.entries[j].dn);
+            EXPECT_EQ(separate.entries[j].attributes, together.entries[j].attributes);
+        }
+    }
+    EXPECT_EQ(1u, batcher.stats().batches);
+    EXPECT_EQ(0u, batcher.stats().fallbacks);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LazyAttributeLoader
+///////////////////////////////////////////////////////////////////////////////
+
+TEST(ldap, attribute_split)
+{
+    AttributeSplit split = splitAttributes({"cn", "thumbnailphoto", "mail", "CN", "jpegPhoto"}, defaultHeavyAttributes());
+    EXPECT_EQ((std::vector<std::string>{"cn", "mail"}), split.light);
+    EXPECT_EQ((std::vector<std::string>{"thumbnailphoto", "jpegPhoto"}), split.heavy);
+}
+
+TEST(ldap, lazy_attributes)
+{
+    LdapConfiguration config = loadConfig("ldap.config");
+    std::unique_ptr<AsyncLdapClient> client;
+    try
+    {
+        client.reset(new AsyncLdapClient(config));
+    }
+    catch (const LdapError &e)
+    {
+        printf("%s\n", e.what());
+        return;
+    }
+
+    // The test server has no photos, so treat mail as the heavy one
+    LazyAttributeLoader loader(*client, {"mail"});
+    SearchRequest request;
+    request.base = config.mSearchBase;
+    request.filter = config.mFilter;
+    request.attributes = config.mAttributes;
+
+    int rc = LDAP_OTHER;
+    std::vector<LazyEntry> entries = loader.search(request, &rc);
+    ASSERT_EQ(LDAP_SUCCESS, rc);
+    ASSERT_GE(entries.size(), 2u);
+    for (const auto &entry : entries)
+    {
+        EXPECT_FALSE(entry.loaded());
+        EXPECT_EQ(nullptr, entry.entry().values("mail"));
+        EXPECT_NE(nullptr, entry.entry().values("cn"));
+    }
+
+    // On first access, for one entry
+    EXPECT_NE("", entries[0].value("mail"));
+    EXPECT_TRUE(entries[0].loaded());
+    EXPECT_FALSE(entries[1].loaded());
+
+    // Or for the rest at once
+    EXPECT_EQ(LDAP_SUCCESS, loader.load(entries));
+    for (auto &entry : entries)
+    {
+        EXPECT_TRUE(entry.loaded());
+        EXPECT_NE(nullptr, entry.entry().values("mail")) << entry.dn();
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CompactResult
+///////////////////////////////////////////////////////////////////////////////
+
+TEST(ldap, compact_result)
+{
+    LdapConfiguration config = loadConfig("ldap.config");
+    std::unique_ptr<LdapConnection> connection;
+    try
+    {
+        connection.reset(new LdapConnection(config));
+    }
+    catch (const LdapError &e)
+    {
+        printf("%s\n", e.what());
+        return;
+    }
+
+    LDAP *ld = connection->get();
+    AttributeList attrs(config.mAttributes);
+    struct timeval timeOut = {10, 0};
+    LDAPMessage *res = NULL;
+    ASSERT_EQ(LDAP_SUCCESS, ldap_search_ext_s(ld, config.mSearchBase.c_str(), LDAP_SCOPE_SUBTREE,
+                                              config.mFilter.c_str(), attrs.get(), 0, NULL, NULL, &timeOut,
+                                              LDAP_NO_LIMIT, &res));
+
+    // The copying decoder, for reference
+    std::vector<LdapEntry> expected;
+    for (LDAPMessage *entry = ldap_first_entry(ld, res); entry != NULL; entry = ldap_next_entry(ld, entry))
+    {
+        expected.push_back(decodeEntry(ld, entry));
+    }
+
+    CompactResult compact(ld, res);
+    ASSERT_EQ(expected.size(), compact.size());
+    ASSERT_FALSE(compact.empty());
+    EXPECT_LE(compact.names(), config.mAttributes.size());
+    for (size_t i = 0; i < compact.size(); ++i)
+    {
+        CompactResult::Entry entry = compact[i];
+        EXPECT_EQ(expected[i].dn, entry.dn());
+        ASSERT_EQ(expected[i].attributes.size(), entry.size());
+        for (size_t a = 0; a < entry.size(); ++a)
+        {
+            const std::vector<std::string> *values = expected[i].values(std::string(entry.name(a)));
+            ASSERT_NE(nullptr, values);
+            ASSERT_EQ(values->size(), entry.values(a).size());
+            for (size_t v = 0; v < values->size(); ++v)
+            {
+                EXPECT_EQ((*values)[v], entry.values(a)[v]);
+            }
+        }
+        EXPECT_EQ(expected[i].value("cn"), entry.value("CN"));
+        EXPECT_TRUE(entry.values("thumbnailPhoto").empty());
+    }
+
+    // Moving keeps the views valid
+    CompactResult moved = std::move(compact);
+    EXPECT_EQ(expected[0].dn, moved[0].dn());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BER and FakeLdapServer
+///////////////////////////////////////////////////////////////////////////////
+
+TEST(ldap, ber)
+{
+    std::string big(70000, 'x');
+    BerWriter writer;
+    writer.begin(ber::SEQUENCE);
+    for (int64_t value : {0LL, 127LL, 128LL, -1LL, -129LL, 1LL << 40})
+    {
+        writer.integer(value);
+    }
+    writer.octets(big);
+    writer.boolean(true);
+    writer.end();
+    std::string encoded = writer.take();
+
+    EXPECT_EQ(0, ber::frameLength(std::string_view(encoded).substr(0, encoded.size() - 1)));
+    ASSERT_EQ(long(encoded.size()), ber::frameLength(encoded + "trailing"));
+
+    BerReader reader = BerReader(encoded).enter(ber::SEQUENCE);
+    for (int64_t value : {0LL, 127LL, 128LL, -1LL, -129LL, 1LL << 40})
+    {
+        EXPECT_EQ(value, reader.integer());
+    }
+    EXPECT_EQ(big, reader.octets());
+    EXPECT_TRUE(reader.boolean());
+    EXPECT_TRUE(reader.atEnd());
+    EXPECT_TRUE(reader.ok());
+
+    reader.integer(); // past the end
+    EXPECT_FALSE(reader.ok());
+}
+
+static int countEntries(LDAP *ld, const std::string &base, const std::string &filter, int sizeLimit = LDAP_NO_LIMIT)
+{
+    struct timeval timeOut = {10, 0};
+    LDAPMessage *res = NULL;
+    int rc = ldap_search_ext_s(ld, base.c_str(), LDAP_SCOPE_SUBTREE, filter.c_str(), NULL, 0, NULL, NULL, &timeOut,
+                               sizeLimit, &res);
+    int count = ldap_count_entries(ld, res);
+    ldap_msgfree(res);
+    return rc == LDAP_SUCCESS ? count : -rc;
+}
+
+TEST(ldap, fake_server_search)
+{
+    FakeDirectoryOptions directory;
+    directory.people = 340; // 20 of each of the 17 surnames
+    FakeServerOptions options;
+    options.bindDn = "cn=admin,dc=example,dc=com";
+    options.password = "secret";
+    FakeLdapServer server(generateDirectory(directory), options);
+    LdapConfiguration config = server.config();
+
+    LdapConnection connection(config);
+    LDAP *ld = connection.get();
+    EXPECT_TRUE(connection.healthy());
+
+    EXPECT_EQ(340, countEntries(ld, config.mSearchBase, "(objectClass=person)"));
+    EXPECT_EQ(342, countEntries(ld, config.mSearchBase, "(objectClass=*)"));
+    EXPECT_EQ(20, countEntries(ld, config.mSearchBase, "(SN=knuth)"));
+    EXPECT_EQ(20, countEntries(ld, config.mSearchBase, "(cn=*ijk*)"));
+    EXPECT_EQ(40, countEntries(ld, config.mSearchBase, "(|(sn=Hopper)(sn=Turing))"));
+    EXPECT_EQ(1, countEntries(ld, config.mSearchBase, "(&(sn=Knuth)(uid=user7))"));
+    EXPECT_EQ(1, countEntries(ld, config.mSearchBase, "(telephoneNumber=+1-555-000-0042)"));
+    EXPECT_EQ(323, countEntries(ld, config.mSearchBase, "(&(objectClass=person)(!(departmentNumber=3)))"));
+    EXPECT_EQ(5, countEntries(ld, config.mSearchBase, "(uid=user3*3)")); // not user3: the parts cannot overlap
+    EXPECT_EQ(-LDAP_SIZELIMIT_EXCEEDED, countEntries(ld, config.mSearchBase, "(objectClass=person)", 5));
+    EXPECT_EQ(-LDAP_NO_SUCH_OBJECT, countEntries(ld, "ou=nobody,dc=example,dc=com", "(objectClass=*)"));
+
+    // Only the requested attributes come back
+    SearchRequest request;
+    request.base = "uid=user7,ou=people,dc=example,dc=com";
+    request.scope = LDAP_SCOPE_BASE;
+    request.filter = "(objectClass=*)";
+    request.attributes = {"mail", "CN"};
+    AttributeList attrs(request.attributes);
+    struct timeval timeOut = {10, 0};
+    LDAPMessage *res = NULL;
+    ASSERT_EQ(LDAP_SUCCESS, ldap_search_ext_s(ld, request.base.c_str(), request.scope, request.filter.c_str(),
+                                              attrs.get(), 0, NULL, NULL, &timeOut, LDAP_NO_LIMIT, &res));
+    CompactResult result(ld, res);
+    ASSERT_EQ(1u, result.size());
+    EXPECT_EQ(2u, result[0].size());
+    EXPECT_EQ("user7@example.com", result[0].value("mail"));
+    EXPECT_EQ("Grace Knuth", result[0].value("cn"));
+
+    config.mPassword = "wrong";
+    try
+    {
+        LdapConnection refused(config);
+        FAIL() << "the password is wrong";
+    }
+    catch (const LdapError &e)
+    {
+        EXPECT_EQ(LDAP_INVALID_CREDENTIALS, e.code());
+    }
+}
+
+TEST(ldap, fake_server_controls)
+{
+    FakeDirectoryOptions directory;
+    directory.people = 250;
+    FakeLdapServer server(generateDirectory(directory));
+    LdapConnection connection(server.config());
+
+    SearchRequest request;
+    request.base = server.config().mSearchBase;
+    request.filter = "(objectClass=person)";
+    request.attributes = {"uid"};
+    PagedSearch paged(connection.get(), request, 100);
+    std::vector<LdapEntry> page;
+    std::vector<size_t> sizes;
+    while (paged.next(page))
+    {
+        sizes.push_back(page.size());
+    }
+    EXPECT_EQ(LDAP_SUCCESS, paged.rc());
+    EXPECT_EQ((std::vector<size_t>{100, 100, 50}), sizes);
+    EXPECT_EQ(250, paged.estimate());
+
+    // Stopping early releases the search on the server with a page of size 0
+    size_t searches = server.searches();
+    size_t consumed = 0;
+    EXPECT_EQ(LDAP_SUCCESS, pagedSearch(connection.get(), request, 100, [&consumed](std::vector<LdapEntry> &page) {
+                  consumed += page.size();
+                  return false;
+              }));
+    EXPECT_EQ(100u, consumed);
+    EXPECT_EQ(searches + 3, server.searches()); // the first page, the one in flight, the release
+
+    LDAPSortKey **keys = NULL;
+    char keyString[] = "-sn uid";
+    ASSERT_EQ(LDAP_SUCCESS, ldap_create_sort_keylist(&keys, keyString));
+    LDAPControl *sort = NULL;
+    ASSERT_EQ(LDAP_SUCCESS, ldap_create_sort_control(connection.get(), keys, 1, &sort));
+    ldap_free_sort_keylist(keys);
+
+    LDAPControl *controls[] = {sort, NULL};
+    struct timeval timeOut = {10, 0};
+    LDAPMessage *res = NULL;
+    int rc = ldap_search_ext_s(connection.get(), request.base.c_str(), LDAP_SCOPE_SUBTREE, "(|(sn=Wirth)(sn=Turing))", NULL, 0,
+                               controls, NULL, &timeOut, LDAP_NO_LIMIT, &res);
+    ldap_control_free(sort);
+    ASSERT_EQ(LDAP_SUCCESS, rc);
+    CompactResult sorted(connection.get(), res);
+    ASSERT_EQ(28u, sorted.size());
+    EXPECT_EQ("Wirth", sorted[0].value("sn"));
+    EXPECT_EQ("user101", sorted[0].value("uid")); // uids compare as strings
+    EXPECT_EQ("Turing", sorted[sorted.size() - 1].value("sn"));
+    EXPECT_EQ("user83", sorted[sorted.size() - 1].value("uid"));
+}
+
+TEST(ldap, fake_server_latency)
+{
+    FakeServerOptions options;
+    options.latency = std::chrono::milliseconds(50);
+    FakeLdapServer server(generateDirectory(), options);
+    AsyncLdapClient client(server.config());
+
+    std::vector<SearchRequest> requests;
+    for (int i = 0; i < 20; ++i)
+    {
+        SearchRequest request;
+        request.base = server.config().mSearchBase;
+        request.filter = "(uid=user" + std::to_string(i) + ")";
+        requests.push_back(request);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<SearchResult> results = client.searchAll(requests);
+    std::chrono::duration<double> delta = std::chrono::steady_clock::now() - start;
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        ASSERT_EQ(LDAP_SUCCESS, results[i].rc);
+        ASSERT_EQ(1u, results[i].entries.size());
+        EXPECT_EQ(requests[i].filter, "(uid=" + results[i].entries[0].value("uid") + ")");
+        EXPECT_GE(results[i].seconds, 0.05);
+    }
+    EXPECT_LT(delta.count(), 0.5); // overlapped, not 20 x 50 ms
+
+    // A dropped connection is noticed and rebound
+    server.disconnectAll();
+    SearchResult again = client.search(requests[0]).get();
+    EXPECT_EQ(LDAP_SUCCESS, again.rc) << ldap_err2string(again.rc);
+    EXPECT_EQ(2u, server.connections());
+}
+
+TEST(ldap, async_timeout)
+{
+    FakeServerOptions options;
+    options.latency = std::chrono::milliseconds(300);
+    FakeLdapServer server(generateDirectory(), options);
+    AsyncLdapClient client(server.config());
+
+    SearchRequest request;
+    request.base = server.config().mSearchBase;
+    request.filter = "(uid=user1)";
+    request.timeout = std::chrono::milliseconds(50);
+    SearchResult late = client.search(request).get();
+    EXPECT_EQ(LDAP_TIMEOUT, late.rc);
+    EXPECT_TRUE(late.entries.empty());
+    EXPECT_LT(late.seconds, 0.25);
+    EXPECT_EQ(0u, client.pending());
+
+    // Its answer arrives after it was given up, and is dropped
+    std::this_thread::sleep_for(std::chrono::milliseconds(400));
+    server.setLatency(std::chrono::microseconds(0));
+    request.filter = "(uid=user2)";
+    request.timeout = std::chrono::seconds(5);
+    SearchResult next = client.search(request).get();
+    ASSERT_EQ(LDAP_SUCCESS, next.rc) << ldap_err2string(next.rc);
+    ASSERT_EQ(1u, next.entries.size());
+    EXPECT_EQ("user2", next.entries[0].value("uid"));
+    EXPECT_EQ(1u, server.connections());
+
+    // A connection dropped under an outstanding search fails it, and the next rebinds
+    server.setLatency(std::chrono::milliseconds(300));
+    std::future<SearchResult> lost = client.search(request);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    server.disconnectAll();
+    EXPECT_EQ(LDAP_SERVER_DOWN, lost.get().rc);
+    EXPECT_EQ(0u, client.pending());
+    server.setLatency(std::chrono::microseconds(0));
+    EXPECT_EQ(LDAP_SUCCESS, client.search(request).get().rc);
+    EXPECT_EQ(2u, server.connections());
+}
+
+TEST(ldap, async_max_outstanding)
+{
+    FakeServerOptions options;
+    options.latency = std::chrono::milliseconds(200);
+    FakeLdapServer server(generateDirectory(), options);
+    AsyncClientOptions clientOptions;
+    clientOptions.maxOutstanding = 1;
+    AsyncLdapClient client(server.config(), clientOptions);
+
+    // One at a time: the first two fit in the deadline, the third times out on
+    // the wire and the fourth in the queue
+    std::vector<SearchRequest> requests;
+    for (int i = 0; i < 4; ++i)
+    {
+        SearchRequest request;
+        request.base = server.config().mSearchBase;
+        request.filter = "(uid=user" + std::to_string(i) + ")";
+        request.timeout = std::chrono::milliseconds(500);
+        requests.push_back(request);
+    }
+    std::vector<SearchResult> results = client.searchAll(requests);
+    ASSERT_EQ(4u, results.size());
+    EXPECT_EQ(LDAP_SUCCESS, results[0].rc);
+    EXPECT_EQ(LDAP_SUCCESS, results[1].rc);
+    EXPECT_GE(results[1].seconds, 0.4);
+    EXPECT_EQ(LDAP_TIMEOUT, results[2].rc);
+    EXPECT_EQ(LDAP_TIMEOUT, results[3].rc);
+    EXPECT_EQ(3u, server.searches()); // the last was never sent
+    EXPECT_EQ(0u, client.pending());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SortedSearch
+///////////////////////////////////////////////////////////////////////////////
+
+TEST(ldap, sort_keys)
+{
+    std::vector<SortKey> keys = parseSortKeys(" sn  -givenName uid:caseExactOrderingMatch ");
+    ASSERT_EQ(3u, keys.size());
+    EXPECT_EQ("sn", keys[0].attribute);
+    EXPECT_FALSE(keys[0].reverse);
+    EXPECT_EQ("givenName", keys[1].attribute);
+    EXPECT_TRUE(keys[1].reverse);
+    EXPECT_EQ("uid", keys[2].attribute);
+}
+
+TEST(ldap, sorted_search)
+{
+    FakeDirectoryOptions directory;
+    directory.people = 300;
+    std::vector<FakeEntry> entries = generateDirectory(directory);
+
+    // By surname, then by uid as a string, descending
+    std::vector<std::pair<std::string, std::string>> people;
+    for (const FakeEntry &entry : entries)
+    {
+        if (const std::vector<std::string> *uid = entry.values("uid"))
+        {
+            people.emplace_back(entry.values("sn")->front(), uid->front());
+        }
+    }
+    std::sort(people.begin(), people.end(), [](const auto &a, const auto &b) {
+        return a.first != b.first ? a.first < b.first : a.second > b.second;
+    });
+    size_t firstKnuth = std::find_if(people.begin(), people.end(), [](const auto &p) { return p.first == "Knuth"; }) -
+                        people.begin();
+
+    std::vector<SortKey> keys = parseSortKeys("sn -uid");
+    for (int mode = 0; mode < 3; ++mode)
+    {
+        // Nothing, then sorting, then sorting and VLV on the server
+        FakeServerOptions options;
+        options.serverSideSort = mode > 0;
+        options.virtualListView = mode > 1;
+        FakeLdapServer server(entries, options);
+        LdapConnection connection(server.config());
+        SortedSearch search(connection.get());
+        EXPECT_EQ(mode > 0, search.support().sort);
+        EXPECT_EQ(mode > 1, search.support().virtualListView);
+
+        SearchRequest request;
+        request.base = server.config().mSearchBase;
+        request.filter = "(objectClass=person)";
+        request.attributes = {"cn"};
+        ListWindow window;
+        window.offset = 40;
+        window.count = 10;
+        SortedWindow page = search.search(request, keys, window);
+        ASSERT_EQ(LDAP_SUCCESS, page.result.rc) << mode;
+        EXPECT_EQ(mode > 0, page.serverSorted);
+        EXPECT_EQ(40u, page.offset);
+        EXPECT_EQ(mode == 1 ? 0u : people.size(), page.total) << mode; // a size-limited search cannot count
+        ASSERT_EQ(10u, page.result.entries.size()) << mode;
+        for (size_t i = 0; i < page.result.entries.size(); ++i)
+        {
+            EXPECT_EQ(people[40 + i].second, page.result.entries[i].value("uid")) << mode;
+            EXPECT_FALSE(page.result.entries[i].value("cn").empty());
+        }
+
+        window.from = "kN";
+        page = search.search(request, keys, window);
+        ASSERT_EQ(LDAP_SUCCESS, page.result.rc);
+        EXPECT_EQ(firstKnuth, page.offset) << mode;
+        ASSERT_EQ(10u, page.result.entries.size());
+        EXPECT_EQ(people[firstKnuth].second, page.result.entries[0].value("uid"));
+        EXPECT_EQ("Knuth", page.result.entries[0].value("sn"));
+
+        // The whole list
+        page = search.search(request, keys);
+        ASSERT_EQ(people.size(), page.result.entries.size());
+        EXPECT_EQ(people.back().second, page.result.entries.back().value("uid"));
+    }
+}
+
+TEST(ldap, sorted_search_declined)
+{
+    FakeDirectoryOptions directory;
+    directory.people = 300;
+    std::vector<FakeEntry> entries = generateDirectory(directory);
+    std::vector<std::pair<std::string, std::string>> people;
+    for (const FakeEntry &entry : entries)
+    {
+        if (const std::vector<std::string> *uid = entry.values("uid"))
+        {
+            people.emplace_back(entry.values("sn")->front(), uid->front());
+        }
+    }
+    std::sort(people.begin(), people.end(), [](const auto &a, const auto &b) {
+        return a.first != b.first ? a.first < b.first : a.second > b.second;
+    });
+
+    // The server advertises sorting but has no ordering rule for sn. Without
+    // VLV the first entries it stops after are not the window; with VLV it
+    // fails the search. Either way the list is fetched again and ordered here.
+    for (bool vlv : {false, true})
+    {
+        FakeServerOptions options;
+        options.virtualListView = vlv;
+        options.unorderedAttributes = {"sn"};
+        FakeLdapServer server(entries, options);
+        LdapConnection connection(server.config());
+        SortedSearch search(connection.get());
+        ASSERT_TRUE(search.support().sort);
+        EXPECT_EQ(vlv, search.support().virtualListView);
+
+        SearchRequest request;
+        request.base = server.config().mSearchBase;
+        request.filter = "(objectClass=person)";
+        request.attributes = {"cn"};
+        ListWindow window;
+        window.offset = 40;
+        window.count = 10;
+        SortedWindow page = search.search(request, parseSortKeys("sn -uid"), window);
+        ASSERT_EQ(LDAP_SUCCESS, page.result.rc) << vlv;
+        EXPECT_FALSE(page.serverSorted);
+        EXPECT_EQ(40u, page.offset);
+        EXPECT_EQ(people.size(), page.total);
+        ASSERT_EQ(10u, page.result.entries.size()) << vlv;
+        for (size_t i = 0; i < page.result.entries.size(); ++i)
+        {
+            EXPECT_EQ(people[40 + i].second, page.result.entries[i].value("uid")) << vlv;
+        }
+        EXPECT_EQ(3u, server.searches()); // the root DSE, the declined search, and the whole one
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LdapServerSet
+///////////////////////////////////////////////////////////////////////////////
+
+TEST(ldap, failover_refused)
+{
+    FakeLdapServer secondary(generateDirectory());
+    LdapConfiguration config = secondary.config();
+    config.mPrimaryServer = "127.0.0.1:1";
+    config.mSecondaryServers = {secondary.address()};
+
+    LdapServerSet servers(config);
+    std::string server;
+    auto start = std::chrono::steady_clock::now();
+    LDAP *ld = servers.open(&server);
+    ldap_unbind_ext_s(ld, NULL, NULL);
+    EXPECT_EQ(secondary.address(), server);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(200)); // no stagger to sit out
+
+    std::vector<ServerHealth> health = servers.health();
+    ASSERT_EQ(2u, health.size());
+    EXPECT_EQ(1u, health[0].failures);
+    EXPECT_GE(health[1].latencyMs, 0);
+    EXPECT_EQ((std::vector<std::string>{secondary.address(), "127.0.0.1:1"}), servers.ranked());
+
+    // Connections pick the failover up from the configuration
+    LdapConnection connection(config);
+    EXPECT_EQ(secondary.address(), connection.server());
+    EXPECT_TRUE(connection.healthy());
+
+    config.mSecondaryServers.clear();
+    EXPECT_THROW(LdapServerSet(config).open(), LdapError);
+}
+
+TEST(ldap, failover_stagger)
+{
+    FakeServerOptions slow;
+    slow.latency = std::chrono::seconds(1);
+    FakeLdapServer primary(generateDirectory(), slow);
+    FakeLdapServer secondary(generateDirectory());
+    LdapConfiguration config = primary.config();
+    config.mSecondaryServers = {secondary.address()};
+
+    FailoverOptions options;
+    options.stagger = std::chrono::milliseconds(50);
+    auto servers = std::make_shared<LdapServerSet>(config, options);
+    auto start = std::chrono::steady_clock::now();
+    LdapConnection connection(config, std::chrono::seconds(10), servers);
+    std::chrono::duration<double> delta = std::chrono::steady_clock::now() - start;
+    EXPECT_EQ(secondary.address(), connection.server());
+    EXPECT_LT(delta.count(), 0.5); // the secondary started after one stagger and won
+
+    // The primary finishes its bind later, is measured, and its handle closed
+    std::this_thread::sleep_for(std::chrono::milliseconds(1200));
+    std::vector<ServerHealth> health = servers->health();
+    EXPECT_GT(health[0].latencyMs, 900);
+    EXPECT_LT(health[1].latencyMs, health[0].latencyMs);
+    EXPECT_EQ(secondary.address(), servers->ranked().front());
+    EXPECT_EQ(1u, primary.binds());
+
+    // Losing the connection demotes its server, but a slow primary still
+    // loses the race to it, which clears the penalty again
+    servers->reportLost(secondary.address());
+    EXPECT_EQ(primary.address(), servers->ranked().front());
+    connection.reconnect();
+    EXPECT_EQ(secondary.address(), connection.server());
+    EXPECT_EQ(0u, servers->health()[1].failures);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DirectoryReplica
+///////////////////////////////////////////////////////////////////////////////
+
+static LdapConfiguration replicaConfig(const FakeLdapServer &server)
+{
+    LdapConfiguration config = server.config();
+    config.mAttributes = {"uid", "cn", "mail"};
+    return config;
+}
+
+static FakeEntry person(const std::string &uid, const std::string &mail)
+{
+    FakeEntry entry;
+    entry.dn = "uid=" + uid + ",ou=people,dc=example,dc=com";
+    entry.attributes = {{"objectClass", {"top", "person", "inetOrgPerson"}},
+                        {"uid", {uid}},
+                        {"cn", {uid}},
+                        {"sn", {uid}},
+                        {"mail", {mail}}};
+    return entry;
+}
+
+static bool eventually(const std::function<bool()> &condition)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!condition() && std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return condition();
+}
+
+TEST(ldap, dn_store)
+{
+    DnStore dns;
+    DnStore::Id ada = dns.intern("uid=ada,ou=People,dc=example,dc=com");
+    DnStore::Id alan = dns.intern("UID=alan, ou=people,DC=Example,dc=com");
+    EXPECT_EQ(5u, dns.size()); // the suffix is shared
+    EXPECT_EQ(dns.parent(ada), dns.parent(alan));
+    EXPECT_EQ("uid=ada,ou=People,dc=example,dc=com", dns.dn(ada));
+    EXPECT_EQ("UID=alan,ou=People,dc=example,dc=com", dns.dn(alan)); // as the suffix was first spelled
+    EXPECT_EQ(ada, dns.find("UID=ADA , OU=people,DC=example,DC=com"));
+    EXPECT_EQ(DnStore::NONE, dns.find("uid=ada,dc=example,dc=com"));
+    EXPECT_EQ(DnStore::ROOT, dns.find(""));
+
+    DnStore::Id people = dns.find("ou=people,dc=example,dc=com");
+    EXPECT_TRUE(dns.within(ada, people));
+    EXPECT_TRUE(dns.within(people, people));
+    EXPECT_FALSE(dns.within(people, ada));
+    EXPECT_FALSE(dns.within(ada, alan));
+    std::set<std::string> children;
+    for (DnStore::Id child = dns.firstChild(people); child != DnStore::NONE; child = dns.nextSibling(child))
+    {
+        children.emplace(dns.rdn(child));
+    }
+    EXPECT_EQ((std::set<std::string>{"UID=alan", "uid=ada"}), children);
+
+    // An escaped comma is part of the RDN
+    DnStore::Id lovelace = dns.intern("cn=Lovelace\\, Ada,ou=people,dc=example,dc=com");
+    EXPECT_EQ(people, dns.parent(lovelace));
+    EXPECT_EQ("cn=Lovelace\\, Ada", dns.rdn(lovelace));
+
+    // A node goes with its last reference, and the suffix with its last child
+    EXPECT_EQ(ada, dns.intern("uid=ada,ou=people,dc=example,dc=com"));
+    dns.release(ada);
+    EXPECT_EQ(ada, dns.find("uid=ada,ou=people,dc=example,dc=com"));
+    dns.release(ada);
+    EXPECT_EQ(DnStore::NONE, dns.find("uid=ada,ou=people,dc=example,dc=com"));
+    dns.release(alan);
+    dns.release(lovelace);
+    EXPECT_EQ(0u, dns.size());
+    EXPECT_EQ(DnStore::NONE, dns.firstChild(DnStore::ROOT));
+
+    // Enough siblings to grow the lookup table, then take every other out of it
+    std::vector<DnStore::Id> ids;
+    for (int i = 0; i < 2000; ++i)
+    {
+        ids.push_back(dns.intern("uid=user" + std::to_string(i) + ",ou=people,dc=example,dc=com"));
+    }
+    EXPECT_EQ(2003u, dns.size());
+    for (int i = 0; i < 2000; i += 2)
+    {
+        dns.release(ids[i]);
+    }
+    EXPECT_EQ(1003u, dns.size());
+    for (int i = 0; i < 2000; ++i)
+    {
+        EXPECT_EQ(i % 2 ? ids[i] : DnStore::NONE, dns.find("uid=user" + std::to_string(i) + ",ou=people,dc=example,dc=com"));
+    }
+}
+
+TEST(ldap, replica_store)
+{
+    ReplicaStore store({"uid"});
+    LdapEntry ada;
+    ada.dn = "uid=ada,ou=people,dc=example,dc=com";
+    ada.attributes["uid"] = {"ada"};
+    ada.attributes["mail"] = {"Ada@example.com"};
+    ada.attributes["cn"] = {"Ada  Lovelace"};
+    ada.attributes["telephoneNumber"] = {"+44 20-7946 0001"};
+    ada.attributes["jpegPhoto"] = {std::string("\xff\xd8\0\x01", 4)};
+    LdapEntry alan;
+    alan.dn = "uid=alan,ou=people,dc=example,dc=com";
+    alan.attributes["UID"] = {"alan"};
+    store.put("1", ada);
+    store.put("2", alan);
+    EXPECT_EQ(2u, store.size());
+
+    std::optional<LdapEntry> found = store.find("UID=Ada, ou=People,dc=example,dc=com");
+    ASSERT_TRUE(found);
+    EXPECT_EQ(ada.attributes, found->attributes);
+    EXPECT_EQ(1u, store.lookup("Uid", "ADA").size());
+    EXPECT_EQ(1u, store.lookup("mail", "ada@EXAMPLE.com").size()); // not indexed, so scanned
+    EXPECT_EQ(1u, store.lookup("cn", " ada lovelace").size()); // blanks fold as caseIgnoreMatch has it
+    EXPECT_EQ(1u, store.lookup("telephoneNumber", "+442079460001").size());
+    EXPECT_EQ("alan", store.lookup("uid", "alan").at(0).value("uid"));
+
+    // Replacing an entry moves it in the indexes
+    ada.attributes["uid"] = {"countess"};
+    store.put("1", ada);
+    EXPECT_TRUE(store.lookup("uid", "ada").empty());
+    EXPECT_EQ(1u, store.lookup("uid", "countess").size());
+    EXPECT_TRUE(store.erase("2"));
+    EXPECT_FALSE(store.find(alan.dn));
+    EXPECT_TRUE(store.lookup("uid", "alan").empty());
+
+    store.setCookie("resume here");
+    std::string path = testing::TempDir() + "replica_store.snapshot";
+    ASSERT_TRUE(store.save(path, "people"));
+    ReplicaStore loaded({"uid"});
+    EXPECT_FALSE(loaded.load(path, "groups"));
+    EXPECT_EQ(0u, loaded.size());
+    ASSERT_TRUE(loaded.load(path, "people"));
+    EXPECT_EQ(1u, loaded.size());
+    EXPECT_EQ(store.bytes(), loaded.bytes());
+    EXPECT_EQ("resume here", loaded.cookie());
+    ASSERT_EQ(1u, loaded.lookup("uid", "countess").size());
+    EXPECT_EQ(ada.attributes, loaded.lookup("uid", "countess")[0].attributes);
+    std::remove(path.c_str());
+}
+
+TEST(ldap, filter_parse)
+{
+    LdapFilter filter = parseLdapFilter("(&(objectClass=person)(|(CN=Ada*ce*)(!(mail>=m)))(sn~=x))");
+    ASSERT_EQ(LdapFilter::And, filter.type);
+    ASSERT_EQ(3u, filter.children.size());
+    EXPECT_EQ(LdapFilter::Equality, filter.children[0].type);
+    EXPECT_EQ("objectclass", filter.children[0].attribute);
+    EXPECT_EQ("person", filter.children[0].value);
+    const LdapFilter &either = filter.children[1];
+    ASSERT_EQ(LdapFilter::Or, either.type);
+    ASSERT_EQ(2u, either.children.size());
+    EXPECT_EQ(LdapFilter::Substrings, either.children[0].type);
+    EXPECT_EQ("cn", either.children[0].attribute);
+    EXPECT_EQ("Ada", either.children[0].initial);
+    EXPECT_EQ(std::vector<std::string>{"ce"}, either.children[0].any);
+    EXPECT_EQ("", either.children[0].final);
+    EXPECT_EQ(LdapFilter::Not, either.children[1].type);
+    EXPECT_EQ(LdapFilter::GreaterOrEqual, either.children[1].children.at(0).type);
+    EXPECT_EQ(LdapFilter::Approx, filter.children[2].type);
+
+    EXPECT_EQ(LdapFilter::Present, parseLdapFilter("(uid=*)").type);
+    EXPECT_EQ("a*b(c)", parseLdapFilter("cn=a\\2ab\\28c\\29").value); // bare, as ldap_search takes it
+    LdapFilter tail = parseLdapFilter("(mail=*@example.com)");
+    EXPECT_EQ("", tail.initial);
+    EXPECT_EQ("@example.com", tail.final);
+
+    for (const char *bad : {"", "(cn=x", "(=x)", "(cn=a(b)", "(cn=\\4)", "(cn:dn:=x)", "(cn=x))", "(c n=x)", "(cn=a**b)"})
+    {
+        try
+        {
+            parseLdapFilter(bad);
+            ADD_FAILURE() << bad;
+        }
+        catch (const LdapError &e)
+        {
+            EXPECT_EQ(LDAP_FILTER_ERROR, e.code()) << bad;
+        }
+    }
+}
+
+TEST(ldap, replica_filter)
+{
+    FakeDirectoryOptions directory;
+    directory.people = 200;
+    FakeLdapServer server(generateDirectory(directory));
+    LdapConfiguration config = server.config();
+    config.mAttributes = {"objectClass", "uid", "cn", "sn", "mail", "telephoneNumber", "departmentNumber"};
+    ReplicaOptions options;
+    options.indexed = {"uid", "sn", "cn"};
+    DirectoryReplica replica(config, options);
+    ASSERT_EQ(LDAP_SUCCESS, replica.refresh());
+    ASSERT_EQ(200u, replica.store().size());
+
+    // The same answers as the server gives
+    LdapConnection connection(config);
+    for (const char *filter : {"(sn=knuth)", "(cn=*ijk*)", "(|(sn=Hopper)(sn=Turing))", "(&(sn=Knuth)(uid=user7))",
+                               "(telephoneNumber=+1 555 000 0042)", "(&(objectClass=person)(!(departmentNumber=3)))",
+                               "(uid=user3*3)", "(departmentNumber>=15)", "(departmentNumber<=2)", "(uid<=user15)",
+                               "(&(departmentNumber=4)(|(sn=k*)(cn=*er)))", "(mail=*)", "(description=x)",
+                               "(!(description=x))", "(|(uid=user1)(description=x))"})
+    {
+        std::vector<LdapEntry> found = replica.search(filter);
+        std::string both = "(&" + config.mFilter + filter + ")";
+        EXPECT_EQ(countEntries(connection.get(), config.mSearchBase, both), int(found.size())) << filter;
+    }
+
+    FilterStats stats;
+    std::vector<LdapEntry> found = replica.search("(&(departmentNumber=4)(SN=Knuth))", &stats);
+    EXPECT_TRUE(stats.indexed);
+    EXPECT_EQ(replica.search("(sn=knuth)").size(), stats.examined); // not everyone in department 4
+    EXPECT_EQ(found.size(), stats.matched);
+    replica.search("(|(uid=user1)(cn=grace*))", &stats);
+    EXPECT_TRUE(stats.indexed);
+    EXPECT_LT(stats.examined, 200u);
+    replica.search("(|(uid=user1)(mail=user1@*))", &stats); // mail is not indexed
+    EXPECT_FALSE(stats.indexed);
+    EXPECT_EQ(200u, stats.examined);
+    replica.search("(description=x)", &stats);
+    EXPECT_TRUE(stats.indexed);
+    EXPECT_EQ(0u, stats.examined);
+
+    EXPECT_THROW(replica.search("(uid=user1"), LdapError);
+}
+
+TEST(ldap, replica_content_sync)
+{
+    FakeDirectoryOptions directory;
+    directory.people = 50;
+    FakeLdapServer server(generateDirectory(directory));
+    LdapConfiguration config = replicaConfig(server);
+    ReplicaOptions options;
+    options.snapshotPath = testing::TempDir() + "replica_content_sync.snapshot";
+    std::remove(options.snapshotPath.c_str());
+
+    {
+        DirectoryReplica replica(config, options);
+        EXPECT_FALSE(replica.ready());
+        ASSERT_EQ(LDAP_SUCCESS, replica.refresh());
+        EXPECT_EQ(ReplicaMode::ContentSync, replica.mode());
+        EXPECT_TRUE(replica.ready());
+        EXPECT_EQ(50u, replica.store().size());
+        ASSERT_EQ(1u, replica.lookup("uid", "user7").size());
+        EXPECT_EQ("user7@example.com", replica.lookup("uid", "user7")[0].value("mail"));
+
+        // Only what changed comes back
+        server.put(person("user5", "moved@example.com"));
+        server.remove("uid=user7,ou=people,dc=example,dc=com");
+        server.put(person("user50", "user50@example.com"));
+        ReplicaStats before = replica.stats();
+        ASSERT_EQ(LDAP_SUCCESS, replica.refresh());
+        ReplicaStats after = replica.stats();
+        EXPECT_EQ(2u, after.updates - before.updates);
+        EXPECT_EQ(1u, after.deletes - before.deletes);
+        EXPECT_EQ(1u, after.fullLoads);
+        EXPECT_EQ(50u, replica.store().size());
+        EXPECT_TRUE(replica.lookup("uid", "user7").empty());
+        EXPECT_EQ("moved@example.com", replica.find("uid=user5,ou=people,dc=example,dc=com")->value("mail"));
+        EXPECT_EQ(2u, after.snapshots);
+    }
+
+    // A restart answers from the snapshot at once and resumes from its cookie
+    server.remove("uid=user8,ou=people,dc=example,dc=com");
+    DirectoryReplica restarted(config, options);
+    EXPECT_TRUE(restarted.ready());
+    EXPECT_TRUE(restarted.stats().snapshotLoaded);
+    EXPECT_EQ(1u, restarted.lookup("uid", "user8").size());
+    ASSERT_EQ(LDAP_SUCCESS, restarted.refresh());
+    EXPECT_EQ(0u, restarted.stats().fullLoads);
+    EXPECT_EQ(1u, restarted.stats().deletes);
+    EXPECT_EQ(49u, restarted.store().size());
+    std::remove(options.snapshotPath.c_str());
+}
+
+TEST(ldap, replica_persist)
+{
+    FakeDirectoryOptions directory;
+    directory.people = 20;
+    FakeLdapServer server(generateDirectory(directory));
+    ReplicaOptions options;
+    options.retryInterval = std::chrono::seconds(1);
+    DirectoryReplica replica(replicaConfig(server), options);
+    replica.start();
+    ASSERT_TRUE(eventually([&] { return replica.ready(); }));
+    EXPECT_EQ(20u, replica.store().size());
+
+    // Changes are pushed without asking
+    server.put(person("user3", "pushed@example.com"));
+    EXPECT_TRUE(eventually([&] {
+        std::vector<LdapEntry> found = replica.lookup("uid", "user3");
+        return found.size() == 1 && found[0].value("mail") == "pushed@example.com";
+    }));
+    server.remove("uid=user4,ou=people,dc=example,dc=com");
+    EXPECT_TRUE(eventually([&] { return replica.lookup("uid", "user4").empty(); }));
+    size_t searches = server.searches();
+
+    // After a dropped connection it resumes from the cookie instead of reloading
+    server.disconnectAll();
+    server.put(person("user20", "user20@example.com"));
+    EXPECT_TRUE(eventually([&] { return replica.lookup("uid", "user20").size() == 1; }));
+    EXPECT_GT(server.searches(), searches);
+    EXPECT_EQ(1u, replica.stats().fullLoads);
+    EXPECT_EQ(20u, replica.store().size());
+    replica.stop();
+}
+
+TEST(ldap, replica_polling)
+{
+    FakeServerOptions activeDirectory;
+    activeDirectory.contentSync = false;
+    FakeDirectoryOptions directory;
+    directory.people = 30;
+    FakeLdapServer server(generateDirectory(directory), activeDirectory);
+    ReplicaOptions options;
+    options.reconcileEvery = 2;
+    DirectoryReplica replica(replicaConfig(server), options);
+
+    ASSERT_EQ(LDAP_SUCCESS, replica.refresh());
+    EXPECT_EQ(ReplicaMode::UsnPolling, replica.mode());
+    EXPECT_EQ(30u, replica.store().size());
+    EXPECT_EQ(nullptr, replica.lookup("uid", "user1").at(0).values("uSNChanged")); // fetched but not kept
+
+    server.put(person("user1", "polled@example.com"));
+    server.remove("uid=user2,ou=people,dc=example,dc=com");
+    ASSERT_EQ(LDAP_SUCCESS, replica.refresh());
+    EXPECT_EQ(31u, replica.stats().updates);
+    EXPECT_EQ("polled@example.com", replica.lookup("uid", "user1").at(0).value("mail"));
+    EXPECT_EQ(1u, replica.lookup("uid", "user2").size()); // polling cannot see deletions...
+
+    ASSERT_EQ(LDAP_SUCCESS, replica.refresh());
+    EXPECT_EQ(2u, replica.stats().fullLoads); // ...until the next full reload
+    EXPECT_TRUE(replica.lookup("uid", "user2").empty());
+    EXPECT_EQ(29u, replica.store().size());
+}
+
+TEST(ldap, replica_damaged_mark)
+{
+    FakeServerOptions activeDirectory;
+    activeDirectory.contentSync = false;
+    FakeDirectoryOptions directory;
+    directory.people = 10;
+    FakeLdapServer server(generateDirectory(directory), activeDirectory);
+    LdapConfiguration config = replicaConfig(server);
+    ReplicaOptions options;
+    options.snapshotPath = testing::TempDir() + "replica_damaged_mark.snapshot";
+    std::remove(options.snapshotPath.c_str());
+    {
+        DirectoryReplica replica(config, options);
+        ASSERT_EQ(LDAP_SUCCESS, replica.refresh());
+    }
+
+    // The uSNChanged the snapshot resumes from is no longer a number
+    std::string snapshot;
+    {
+        std::ifstream in(options.snapshotPath, std::ios::binary);
+        snapshot.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    std::string prefix = "usn\n" + server.address() + "\n";
+    size_t mark = snapshot.find(prefix);
+    ASSERT_NE(std::string::npos, mark);
+    for (size_t i = mark + prefix.size(); i < snapshot.size() && std::isdigit((unsigned char)snapshot[i]); ++i)
+    {
+        snapshot[i] = 'x';
+    }
+    {
+        std::ofstream out(options.snapshotPath, std::ios::binary | std::ios::trunc);
+        out << snapshot;
+    }
+
+    // It loads everything again instead of throwing
+    DirectoryReplica restarted(config, options);
+    ASSERT_TRUE(restarted.stats().snapshotLoaded);
+    ASSERT_EQ(LDAP_SUCCESS, restarted.refresh());
+    EXPECT_EQ(1u, restarted.stats().fullLoads);
+    EXPECT_EQ(10u, restarted.store().size());
+    std::remove(options.snapshotPath.c_str());
+}
+
+} // namespace ldapclient
@@ -0,0 +1,286 @@
+#include "lookup_batcher.h"
+#include <algorithm>
+#include <cctype>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace ldapclient
+{
+
+static std::string lower(std::string s)
+{
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return char(std::tolower(c)); });
+    return s;
+}
+
+LookupBatcher::LookupBatcher(AsyncLdapClient &client, LookupBatcherOptions options)
+    : mClient(client), mOptions(std::move(options))
+{
+    mFlusher = std::thread([this] { flushLoop(); });
+}
+
+LookupBatcher::~LookupBatcher()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mWake.notify_all();
+    mFlusher.join();
+
+    // Routing callbacks still refer to this object
+    std::unique_lock<std::mutex> lock(mMutex);
+    mWake.wait(lock, [this] { return mInFlight == 0; });
+}
+
+void LookupBatcher::lookup(std::vector<LookupKey> keys, Callback callback)
+{
+    if (keys.empty())
+    {
+        SearchResult nothing;
+        nothing.rc = LDAP_SUCCESS;
+        callback(std::move(nothing));
+        return;
+    }
+
+    auto pending = std::make_shared<Lookup>();
+    pending->keys = std::move(keys);
+    pending->callback = std::move(callback);
+
+    Batch full;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        ++mStats.lookups;
+        if (mPending.empty())
+        {
+            mWindowEnd = Clock::now() + mOptions.window;
+            mWake.notify_all();
+        }
+        mPendingKeys += pending->keys.size();
+        mPending.push_back(std::move(pending));
+        if (mPendingKeys >= mOptions.maxKeys)
+        {
+            full.swap(mPending);
+            mPendingKeys = 0;
+        }
+    }
+
+    if (!full.empty())
+    {
+        send(std::move(full));
+    }
+}
+
+std::future<SearchResult> LookupBatcher::lookup(std::vector<LookupKey> keys)
+{
+    auto promise = std::make_shared<std::promise<SearchResult>>();
+    std::future<SearchResult> future = promise->get_future();
+    lookup(std::move(keys), [promise](SearchResult result) { promise->set_value(std::move(result)); });
+    return future;
+}
+
+std::string LookupBatcher::filterFor(const LookupBatcherOptions &options, const std::vector<LookupKey> &keys)
+{
+    std::string any;
+    for (const auto &key : keys)
+    {
+        any += "(" + key.attribute + "=" + escapeFilterValue(key.value) + ")";
+    }
+    if (keys.size() != 1)
+    {
+        any = "(|" + any + ")";
+    }
+
+    const std::string &constraint = options.request.filter;
+    if (constraint.empty())
+    {
+        return any;
+    }
+    // Splice into an existing AND rather than nesting one
+    if (constraint.compare(0, 2, "(&") == 0 && constraint.back() == ')')
+    {
+        return constraint.substr(0, constraint.size() - 1) + any + ")";
+    }
+    return "(&" + constraint + any + ")";
+}
+
+std::string LookupBatcher::normalizeValue(const LookupBatcherOptions &options, const std::string &attribute,
+                                          const std::string &value)
+{
+    return ldapclient::normalizeValue(value, isTelephoneAttribute(attribute, options.phoneAttributes));
+}
+
+LookupBatcherStats LookupBatcher::stats() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mStats;
+}
+
+void LookupBatcher::flushLoop()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    for (;;)
+    {
+        if (mPending.empty())
+        {
+            if (mStopping)
+            {
+                return;
+            }
+            mWake.wait(lock);
+            continue;
+        }
+
+        if (!mStopping && Clock::now() < mWindowEnd)
+        {
+            mWake.wait_until(lock, mWindowEnd);
+            continue;
+        }
+
+        Batch batch;
+        batch.swap(mPending);
+        mPendingKeys = 0;
+        lock.unlock();
+        send(std::move(batch));
+        lock.lock();
+    }
+}
+
+void LookupBatcher::send(Batch batch)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        ++mStats.batches;
+        ++mInFlight;
+    }
+
+    // The same key asked for twice only goes into the filter once
+    std::vector<LookupKey> keys;
+    std::unordered_set<std::string> seen;
+    for (const auto &pending : batch)
+    {
+        for (const auto &key : pending->keys)
+        {
+            if (seen.insert(lower(key.attribute) + '\0' + normalizeValue(mOptions, key.attribute, key.value)).second)
+            {
+                keys.push_back(key);
+            }
+        }
+    }
+
+    SearchRequest request = mOptions.request;
+    request.filter = filterFor(mOptions, keys);
+
+    // Routing needs the key attributes even when the caller did not ask for them
+    std::vector<std::string> added;
+    if (!request.attributes.empty())
+    {
+        for (const auto &key : keys)
+        {
+            auto same = [&](const std::string &name) { return strcasecmp(name.c_str(), key.attribute.c_str()) == 0; };
+            if (std::none_of(request.attributes.begin(), request.attributes.end(), same))
+            {
+                request.attributes.push_back(key.attribute);
+                added.push_back(key.attribute);
+            }
+        }
+    }
+
+    mClient.search(std::move(request), [this, batch, added](SearchResult result) {
+        if (batch.size() == 1)
+        {
+            for (auto &entry : result.entries)
+            {
+                for (const auto &name : added)
+                {
+                    entry.attributes.erase(name);
+                }
+            }
+            batch.front()->callback(std::move(result));
+        }
+        else if (result.rc == LDAP_SUCCESS)
+        {
+            route(batch, added, result);
+        }
+        else
+        {
+            fallback(batch);
+        }
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        --mInFlight;
+        mWake.notify_all();
+    });
+}
+
+void LookupBatcher::route(const Batch &batch, const std::vector<std::string> &added, SearchResult &result)
+{
+    // normalised attribute and value -> the lookups asking for it
+    std::unordered_map<std::string, std::vector<size_t>> wanted;
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        for (const auto &key : batch[i]->keys)
+        {
+            wanted[lower(key.attribute) + '\0' + normalizeValue(mOptions, key.attribute, key.value)].push_back(i);
+        }
+    }
+
+    std::vector<SearchResult> results(batch.size());
+    for (auto &routed : results)
+    {
+        routed.rc = result.rc;
+        routed.error = result.error;
+        routed.referrals = result.referrals;
+        routed.seconds = result.seconds;
+        routed.fromCache = result.fromCache;
+    }
+
+    for (const auto &entry : result.entries)
+    {
+        std::vector<size_t> owners;
+        for (const auto &attribute : entry.attributes)
+        {
+            for (const auto &value : attribute.second)
+            {
+                auto it = wanted.find(lower(attribute.first) + '\0' + normalizeValue(mOptions, attribute.first, value));
+                if (it != wanted.end())
+                {
+                    owners.insert(owners.end(), it->second.begin(), it->second.end());
+                }
+            }
+        }
+        std::sort(owners.begin(), owners.end());
+        owners.erase(std::unique(owners.begin(), owners.end()), owners.end());
+
+        for (size_t owner : owners)
+        {
+            results[owner].entries.push_back(entry);
+            for (const auto &name : added)
+            {
+                results[owner].entries.back().attributes.erase(name);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        batch[i]->callback(std::move(results[i]));
+    }
+}
+
+void LookupBatcher::fallback(const Batch &batch)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        ++mStats.fallbacks;
+    }
+
+    for (const auto &pending : batch)
+    {
+        SearchRequest request = mOptions.request;
+        request.filter = filterFor(mOptions, pending->keys);
+        mClient.search(std::move(request), pending->callback);
+    }
+}
+
+} // namespace ldapclient
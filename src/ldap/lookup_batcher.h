@@ -0,0 +1,96 @@
+#pragma once
+
+#include "async_client.h"
+#include "filter.h"
+#include <condition_variable>
+
+namespace ldapclient
+{
+
+// One equality assertion, e.g. {"telephoneNumber", "+86 21 2422 4178"}
+struct LookupKey
+{
+    std::string attribute;
+    std::string value;
+};
+
+struct LookupBatcherOptions
+{
+    // Base, scope, attributes and timeout for every lookup. The filter is the
+    // constraint each lookup shares, e.g. "(&(objectCategory=person)(objectClass=user))",
+    // and may be empty.
+    SearchRequest request;
+    // How long the first lookup of a batch waits for company
+    std::chrono::milliseconds window{5};
+    // A batch is sent right away once it holds this many keys
+    size_t maxKeys = 100;
+    // Matched the way telephoneNumberMatch does, ignoring spaces and hyphens;
+    // all other attributes as caseIgnoreMatch. See normalizeValue().
+    std::vector<std::string> phoneAttributes = telephoneAttributes();
+};
+
+struct LookupBatcherStats
+{
+    uint64_t lookups = 0;
+    uint64_t batches = 0;
+    uint64_t fallbacks = 0; // batches re-run one lookup at a time
+};
+
+// Coalesces point lookups into one search. Each lookup asks for the entries
+// matching any of its keys; the lookups pending within a window are sent as a
+// single (&constraint(|key1 key2 ...)) filter, and every entry that comes back
+// is routed to the lookups whose keys it carries. When the combined search
+// fails or hits a size limit, each lookup of that batch is re-run on its own, so
+// callers see the same result as with one search per lookup.
+class LookupBatcher
+{
+  public:
+    using Callback = AsyncLdapClient::Callback;
+
+    LookupBatcher(AsyncLdapClient &client, LookupBatcherOptions options);
+    ~LookupBatcher(); // sends what is still pending; the client must outlive the results
+    LookupBatcher(const LookupBatcher &) = delete;
+    LookupBatcher &operator=(const LookupBatcher &) = delete;
+
+    // Thread-safe. The callback runs on the client's owner thread.
+    void lookup(std::vector<LookupKey> keys, Callback callback);
+    std::future<SearchResult> lookup(std::vector<LookupKey> keys);
+
+    // The filter the lookup would use on its own
+    static std::string filterFor(const LookupBatcherOptions &options, const std::vector<LookupKey> &keys);
+    // The form two values are compared in when routing entries
+    static std::string normalizeValue(const LookupBatcherOptions &options, const std::string &attribute,
+                                      const std::string &value);
+
+    LookupBatcherStats stats() const;
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Lookup
+    {
+        std::vector<LookupKey> keys;
+        Callback callback;
+    };
+    using Batch = std::vector<std::shared_ptr<Lookup>>;
+
+    void flushLoop();
+    void send(Batch batch);
+    void route(const Batch &batch, const std::vector<std::string> &added, SearchResult &result);
+    void fallback(const Batch &batch);
+
+    AsyncLdapClient &mClient;
+    LookupBatcherOptions mOptions;
+
+    mutable std::mutex mMutex;
+    std::condition_variable mWake;
+    Batch mPending;
+    size_t mPendingKeys = 0;
+    Clock::time_point mWindowEnd;
+    bool mStopping = false;
+    size_t mInFlight = 0; // batches sent whose callback has not finished
+    LookupBatcherStats mStats;
+    std::thread mFlusher;
+};
+
+} // namespace ldapclient
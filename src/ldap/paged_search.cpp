@@ -0,0 +1,197 @@
+#include "paged_search.h"
+#include "ber.h"
+#include <algorithm>
+
+namespace ldapclient
+{
+
+PagedSearch::PagedSearch(LDAP *ld, SearchRequest request, int pageSize)
+    : mLd(ld), mRequest(std::move(request)), mAttributes(mRequest.attributes), mPageSize(pageSize)
+{
+    send(NULL);
+}
+
+PagedSearch::~PagedSearch()
+{
+    if (mMsgid < 0)
+    {
+        return;
+    }
+    // Stopped early. A page of size 0 with the last cookie tells the server to
+    // drop the search's state (RFC 2696) rather than keep it until the
+    // connection closes; abandoning only stops the page in flight.
+    int inFlight = mMsgid;
+    int release = -1;
+    if (!mCookie.empty())
+    {
+        // Encoded here: ldap_create_page_control() refuses a size of 0
+        BerWriter value;
+        value.begin(ber::SEQUENCE);
+        value.integer(0);
+        value.octets(mCookie);
+        value.end();
+        LDAPControl control;
+        control.ldctl_oid = const_cast<char *>(LDAP_CONTROL_PAGEDRESULTS);
+        control.ldctl_value.bv_val = const_cast<char *>(value.data().data());
+        control.ldctl_value.bv_len = value.data().size();
+        control.ldctl_iscritical = 0;
+        LDAPControl *serverControls[] = {&control, NULL};
+        if (ldap_search_ext(mLd, mRequest.base.c_str(), mRequest.scope,
+                            mRequest.filter.empty() ? NULL : mRequest.filter.c_str(), mAttributes.get(), 0,
+                            serverControls, NULL, NULL, mRequest.sizeLimit, &release) != LDAP_SUCCESS)
+        {
+            release = -1;
+        }
+    }
+    ldap_abandon_ext(mLd, inFlight, NULL, NULL);
+    if (release >= 0)
+    {
+        struct timeval timeOut = {long(mRequest.timeout.count() / 1000), long(mRequest.timeout.count() % 1000) * 1000};
+        LDAPMessage *res = NULL;
+        if (ldap_result(mLd, release, LDAP_MSG_ALL, &timeOut, &res) == 0)
+        {
+            ldap_abandon_ext(mLd, release, NULL, NULL);
+        }
+        ldap_msgfree(res);
+    }
+}
+
+void PagedSearch::send(struct berval *cookie)
+{
+    // Not critical: a server that cannot page simply returns everything
+    LDAPControl *pageControl = NULL;
+    mRc = ldap_create_page_control(mLd, mPageSize, cookie, 0, &pageControl);
+    if (mRc != LDAP_SUCCESS)
+    {
+        return;
+    }
+    mCookie = cookie ? std::string(cookie->bv_val, cookie->bv_len) : std::string();
+
+    LDAPControl *serverControls[] = {pageControl, NULL};
+    long seconds = std::max<long>(1, long((mRequest.timeout.count() + 999) / 1000));
+    struct timeval timeLimit = {seconds, 0};
+    mRc = ldap_search_ext(mLd, mRequest.base.c_str(), mRequest.scope,
+                          mRequest.filter.empty() ? NULL : mRequest.filter.c_str(), mAttributes.get(), 0,
+                          serverControls, NULL, &timeLimit, mRequest.sizeLimit, &mMsgid);
+    ldap_control_free(pageControl);
+    if (mRc != LDAP_SUCCESS)
+    {
+        mMsgid = -1;
+    }
+}
+
+LDAPMessage *PagedSearch::receive()
+{
+    if (mMsgid < 0)
+    {
+        return NULL;
+    }
+
+    // The time limit applies per page
+    struct timeval timeOut = {long(mRequest.timeout.count() / 1000), long(mRequest.timeout.count() % 1000) * 1000};
+    LDAPMessage *res = NULL;
+    int type = ldap_result(mLd, mMsgid, LDAP_MSG_ALL, &timeOut, &res);
+    if (type <= 0)
+    {
+        if (type == 0)
+        {
+            mRc = LDAP_TIMEOUT;
+            ldap_abandon_ext(mLd, mMsgid, NULL, NULL);
+        }
+        else
+        {
+            mRc = LDAP_SERVER_DOWN;
+            ldap_get_option(mLd, LDAP_OPT_RESULT_CODE, &mRc);
+        }
+        ldap_msgfree(res);
+        mMsgid = -1;
+        return NULL;
+    }
+    mMsgid = -1;
+
+    LDAPMessage *done = NULL;
+    for (LDAPMessage *msg = ldap_first_message(mLd, res); msg != NULL; msg = ldap_next_message(mLd, msg))
+    {
+        if (ldap_msgtype(msg) == LDAP_RES_SEARCH_RESULT)
+        {
+            done = msg;
+        }
+    }
+
+    int rc = LDAP_OTHER;
+    char *errorMessage = NULL;
+    LDAPControl **controls = NULL;
+    if (done)
+    {
+        int parseRc = ldap_parse_result(mLd, done, &rc, NULL, &errorMessage, NULL, &controls, 0);
+        rc = parseRc == LDAP_SUCCESS ? rc : parseRc;
+    }
+    mRc = rc;
+    if (errorMessage)
+    {
+        mError = errorMessage;
+        ldap_memfree(errorMessage);
+    }
+
+    // Ask for the next page before decoding this one
+    if (rc == LDAP_SUCCESS && controls)
+    {
+        LDAPControl *response = ldap_control_find(LDAP_CONTROL_PAGEDRESULTS, controls, NULL);
+        struct berval cookie = {0, NULL};
+        ber_int_t estimate = 0;
+        if (response && ldap_parse_pageresponse_control(mLd, response, &estimate, &cookie) == LDAP_SUCCESS)
+        {
+            mEstimate = estimate;
+            if (cookie.bv_len > 0)
+            {
+                send(&cookie);
+            }
+            ber_memfree(cookie.bv_val);
+        }
+    }
+    ldap_controls_free(controls);
+    ++mPages;
+    return res;
+}
+
+bool PagedSearch::next(std::vector<LdapEntry> &page)
+{
+    page.clear();
+    LDAPMessage *res = receive();
+    if (!res)
+    {
+        return false;
+    }
+    for (LDAPMessage *entry = ldap_first_entry(mLd, res); entry != NULL; entry = ldap_next_entry(mLd, entry))
+    {
+        page.push_back(decodeEntry(mLd, entry));
+    }
+    ldap_msgfree(res);
+    mEntries += page.size();
+    return true;
+}
+
+bool PagedSearch::next(CompactResult &page)
+{
+    LDAPMessage *res = receive();
+    page = res ? CompactResult(mLd, res) : CompactResult();
+    mEntries += page.size();
+    return res != NULL;
+}
+
+int pagedSearch(LDAP *ld, const SearchRequest &request, int pageSize,
+                const std::function<bool(std::vector<LdapEntry> &page)> &consumer)
+{
+    PagedSearch search(ld, request, pageSize);
+    std::vector<LdapEntry> page;
+    while (search.next(page))
+    {
+        if (!consumer(page))
+        {
+            break;
+        }
+    }
+    return search.rc();
+}
+
+} // namespace ldapclient
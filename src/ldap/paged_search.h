@@ -0,0 +1,65 @@
+#pragma once
+
+#include "compact_result.h"
+#include "search.h"
+#include <functional>
+
+namespace ldapclient
+{
+
+// Walks a search result with the simple paged results control (RFC 2696), so
+// memory stays bounded by the page size however large the subtree is. The
+// request for the next page is sent as soon as the current one has arrived,
+// so the server works on it while the caller processes this one.
+//
+//     PagedSearch search(ld, request, 500);
+//     std::vector<LdapEntry> page;
+//     while (search.next(page)) { ... }
+//     if (search.rc() != LDAP_SUCCESS) { ... }
+//
+// Servers without paging support answer in one go, which shows up as a single page.
+class PagedSearch
+{
+  public:
+    PagedSearch(LDAP *ld, SearchRequest request, int pageSize = 500);
+    ~PagedSearch(); // abandons a page still in flight, and releases the search on the server
+    PagedSearch(const PagedSearch &) = delete;
+    PagedSearch &operator=(const PagedSearch &) = delete;
+
+    // Replaces page with the next page of entries. Returns false once the
+    // search is complete or has failed; see rc().
+    bool next(std::vector<LdapEntry> &page);
+    // The same without copying: the page keeps the messages its views point into
+    bool next(CompactResult &page);
+
+    int rc() const { return mRc; }
+    const std::string &error() const { return mError; }
+    size_t pages() const { return mPages; }
+    size_t entries() const { return mEntries; }
+    // The server's estimate of the total result size, 0 when it does not say
+    int estimate() const { return mEstimate; }
+
+  private:
+    void send(struct berval *cookie);
+    // The messages of the next page, requesting the one after; NULL at the end
+    LDAPMessage *receive();
+
+    LDAP *mLd;
+    SearchRequest mRequest;
+    AttributeList mAttributes;
+    int mPageSize;
+    int mMsgid = -1; // the page in flight, -1 when there is none
+    std::string mCookie; // the one it was requested with
+    int mRc = LDAP_SUCCESS;
+    std::string mError;
+    size_t mPages = 0;
+    size_t mEntries = 0;
+    int mEstimate = 0;
+};
+
+// Hands each page to consumer until it returns false or the search ends.
+// Returns the final result code.
+int pagedSearch(LDAP *ld, const SearchRequest &request, int pageSize,
+                const std::function<bool(std::vector<LdapEntry> &page)> &consumer);
+
+} // namespace ldapclient
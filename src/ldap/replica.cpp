@@ -0,0 +1,560 @@
+#include "replica.h"
+#include "ber.h"
+#include "paged_search.h"
+#include "search_cache.h"
+#include <algorithm>
+#include <cstring>
+
+namespace ldapclient
+{
+
+using Clock = std::chrono::steady_clock;
+
+// Stored cookies say which mode wrote them, so a server that changes mode
+// starts over instead of misreading the other's cookie. Polling cookies also
+// name the server, since uSNChanged is local to each domain controller.
+static const std::string SYNC_COOKIE = "sync\n";
+
+static std::string pollPrefix(ReplicaMode mode, const std::string &server)
+{
+    return (mode == ReplicaMode::UsnPolling ? "usn\n" : "when\n") + server + "\n";
+}
+
+static bool startsWith(const std::string &s, const std::string &prefix)
+{
+    return s.compare(0, prefix.size(), prefix) == 0;
+}
+
+// uSNChanged as a number, whenChanged as a generalised time in a fixed format
+static bool laterMark(const std::string &a, const std::string &b)
+{
+    return a.size() != b.size() ? a.size() > b.size() : a > b;
+}
+
+// A mark read back from a snapshot may be damaged: a uSNChanged must be
+// digits that leave room for the + 1, a whenChanged a generalized time
+static bool validMark(ReplicaMode mode, const std::string &mark)
+{
+    if (mark.empty())
+    {
+        return false;
+    }
+    if (mode == ReplicaMode::UsnPolling)
+    {
+        return mark.size() < 20 && std::all_of(mark.begin(), mark.end(), [](char c) { return c >= '0' && c <= '9'; });
+    }
+    return mark.find_first_not_of("0123456789.,Z+-") == std::string::npos;
+}
+
+static std::string_view view(const struct berval &value)
+{
+    return std::string_view(value.bv_val, value.bv_len);
+}
+
+ReplicaMode probeReplicaMode(LDAP *ld)
+{
+    char supportedControl[] = "supportedControl";
+    char highestCommittedUSN[] = "highestCommittedUSN";
+    char *attrs[] = {supportedControl, highestCommittedUSN, NULL};
+    struct timeval timeOut = {10, 0};
+    LDAPMessage *res = NULL;
+    ReplicaMode mode = ReplicaMode::Unknown;
+    if (ldap_search_ext_s(ld, "", LDAP_SCOPE_BASE, "(objectClass=*)", attrs, 0, NULL, NULL, &timeOut, 1, &res) ==
+        LDAP_SUCCESS)
+    {
+        mode = ReplicaMode::TimestampPolling;
+        LDAPMessage *entry = ldap_first_entry(ld, res);
+        struct berval **vals = entry ? ldap_get_values_len(ld, entry, supportedControl) : NULL;
+        for (int i = 0; vals != NULL && vals[i] != NULL; i++)
+        {
+            if (view(*vals[i]) == LDAP_CONTROL_SYNC)
+            {
+                mode = ReplicaMode::ContentSync;
+            }
+        }
+        if (vals != NULL)
+        {
+            ldap_value_free_len(vals);
+        }
+        vals = entry && mode != ReplicaMode::ContentSync ? ldap_get_values_len(ld, entry, highestCommittedUSN) : NULL;
+        if (vals != NULL)
+        {
+            mode = ReplicaMode::UsnPolling;
+            ldap_value_free_len(vals);
+        }
+    }
+    ldap_msgfree(res);
+    return mode;
+}
+
+DirectoryReplica::DirectoryReplica(const LdapConfiguration &config, ReplicaOptions options)
+    : mConfig(config), mOptions(std::move(options)), mStore(mOptions.indexed)
+{
+    if (!mOptions.snapshotPath.empty() && mStore.load(mOptions.snapshotPath, fingerprint()))
+    {
+        mStats.snapshotLoaded = true;
+        mReady = true;
+    }
+}
+
+DirectoryReplica::~DirectoryReplica()
+{
+    stop();
+}
+
+std::string DirectoryReplica::fingerprint() const
+{
+    std::string fingerprint = mConfig.mSearchBase + "\n" + mConfig.mFilter + "\n";
+    for (const std::string &attribute : mConfig.mAttributes)
+    {
+        fingerprint += attribute + ",";
+    }
+    return fingerprint;
+}
+
+ReplicaStats DirectoryReplica::stats() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mStats;
+}
+
+bool DirectoryReplica::save()
+{
+    if (mOptions.snapshotPath.empty() || !mStore.save(mOptions.snapshotPath, fingerprint()))
+    {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mMutex);
+    ++mStats.snapshots;
+    return true;
+}
+
+void DirectoryReplica::checkpoint(bool force)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mOptions.snapshotPath.empty() || !mDirty ||
+            (!force && Clock::now() - mSaved < mOptions.snapshotInterval))
+        {
+            return;
+        }
+        mDirty = false;
+        mSaved = Clock::now();
+    }
+    save();
+}
+
+int DirectoryReplica::refresh()
+{
+    try
+    {
+        if (!mConnection)
+        {
+            mConnection.reset(new LdapConnection(mConfig));
+        }
+        int rc = pass(*mConnection, false);
+        if (connectionLost(rc))
+        {
+            mConnection.reset(); // the next refresh reconnects
+        }
+        return rc;
+    }
+    catch (const LdapError &e)
+    {
+        return e.code();
+    }
+}
+
+void DirectoryReplica::start()
+{
+    if (mFollower.joinable())
+    {
+        return;
+    }
+    mStopping = false;
+    mFollower = std::thread([this] { follow(); });
+}
+
+void DirectoryReplica::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mWake.notify_all();
+    if (mFollower.joinable())
+    {
+        mFollower.join();
+    }
+    checkpoint(true);
+}
+
+void DirectoryReplica::follow()
+{
+    std::unique_ptr<LdapConnection> connection;
+    while (!mStopping)
+    {
+        int rc = LDAP_SUCCESS;
+        try
+        {
+            if (!connection)
+            {
+                connection.reset(new LdapConnection(mConfig));
+            }
+            rc = pass(*connection, true); // returns only when a persistent search ends
+        }
+        catch (const LdapError &e)
+        {
+            rc = e.code();
+        }
+        if (connectionLost(rc))
+        {
+            connection.reset();
+        }
+        checkpoint(false);
+
+        bool polling = rc == LDAP_SUCCESS && mMode != ReplicaMode::ContentSync;
+        std::unique_lock<std::mutex> lock(mMutex);
+        mWake.wait_for(lock, polling ? mOptions.pollInterval : mOptions.retryInterval,
+                       [this] { return mStopping.load(); });
+    }
+}
+
+int DirectoryReplica::pass(LdapConnection &connection, bool persist)
+{
+    if (mMode == ReplicaMode::Unknown)
+    {
+        mMode = probeReplicaMode(connection.get());
+        if (mMode == ReplicaMode::Unknown)
+        {
+            int rc = LDAP_OTHER;
+            ldap_get_option(connection.get(), LDAP_OPT_RESULT_CODE, &rc);
+            return rc;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        ++mStats.passes;
+    }
+
+    if (mMode != ReplicaMode::ContentSync)
+    {
+        return poll(connection);
+    }
+    int rc = contentSync(connection.get(), persist);
+    if (rc == LDAP_SYNC_REFRESH_REQUIRED)
+    {
+        rc = contentSync(connection.get(), persist); // the cookie has been dropped, so this is a full refresh
+    }
+    return rc;
+}
+
+int DirectoryReplica::contentSync(LDAP *ld, bool persist)
+{
+    std::string stored = mStore.cookie();
+    std::string cookie = startsWith(stored, SYNC_COOKIE) ? stored.substr(SYNC_COOKIE.size()) : std::string();
+
+    BerWriter value;
+    value.begin(ber::SEQUENCE);
+    value.enumerated(persist ? LDAP_SYNC_REFRESH_AND_PERSIST : LDAP_SYNC_REFRESH_ONLY);
+    if (!cookie.empty())
+    {
+        value.octets(cookie);
+    }
+    value.end();
+    LDAPControl control;
+    control.ldctl_oid = const_cast<char *>(LDAP_CONTROL_SYNC);
+    control.ldctl_value.bv_val = const_cast<char *>(value.data().data());
+    control.ldctl_value.bv_len = value.data().size();
+    control.ldctl_iscritical = 1;
+    LDAPControl *controls[] = {&control, NULL};
+
+    AttributeList attrs(mConfig.mAttributes);
+    int msgid = -1;
+    int rc = ldap_search_ext(ld, mConfig.mSearchBase.c_str(), LDAP_SCOPE_SUBTREE,
+                             mConfig.mFilter.empty() ? NULL : mConfig.mFilter.c_str(), attrs.get(), 0, controls, NULL,
+                             NULL, LDAP_NO_LIMIT, &msgid);
+    if (rc != LDAP_SUCCESS)
+    {
+        return rc;
+    }
+
+    // Keys the server says are still there during a present phase of the
+    // refresh; whatever else the store holds was deleted. Persisted changes
+    // name their deletes, so it stays empty after the refresh.
+    std::unordered_set<std::string> present;
+    bool refreshing = true;
+    uint64_t updates = 0;
+    uint64_t deletes = 0;
+    auto setCookie = [this](std::string_view cookie) {
+        mStore.setCookie(SYNC_COOKIE + std::string(cookie));
+    };
+    auto record = [&](bool finished) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStats.fullLoads += finished && cookie.empty();
+        mStats.updates += updates;
+        mStats.deletes += deletes;
+        mDirty = mDirty || finished || updates || deletes;
+        updates = deletes = 0;
+    };
+    auto endPresentPhase = [&] {
+        deletes += mStore.retain(present);
+        present.clear();
+    };
+    auto endRefresh = [&] {
+        refreshing = false;
+        present = std::unordered_set<std::string>(); // a refreshDelete phase leaves it filled
+        record(true);
+        mReady = true;
+        checkpoint(true);
+    };
+
+    while (true)
+    {
+        struct timeval timeOut = {0, 200000};
+        LDAPMessage *msg = NULL;
+        int type = ldap_result(ld, msgid, LDAP_MSG_ONE, &timeOut, &msg);
+        if (type == 0)
+        {
+            if (mStopping)
+            {
+                ldap_abandon_ext(ld, msgid, NULL, NULL);
+                return LDAP_SUCCESS;
+            }
+            if (!refreshing && (updates || deletes))
+            {
+                record(false);
+                checkpoint(false);
+            }
+            continue;
+        }
+        if (type < 0)
+        {
+            rc = LDAP_OTHER;
+            ldap_get_option(ld, LDAP_OPT_RESULT_CODE, &rc);
+            return rc;
+        }
+
+        if (type == LDAP_RES_SEARCH_ENTRY)
+        {
+            LDAPControl **entryControls = NULL;
+            ldap_get_entry_controls(ld, msg, &entryControls);
+            LDAPControl *state = ldap_control_find(LDAP_CONTROL_SYNC_STATE, entryControls, NULL);
+            BerReader reader = BerReader(state ? view(state->ldctl_value) : std::string_view()).enter(ber::SEQUENCE);
+            int64_t kind = reader.enumerated();
+            std::string uuid(reader.octets());
+            std::string_view entryCookie = reader.peek() == ber::OCTET_STRING ? reader.octets() : std::string_view();
+            if (reader.ok())
+            {
+                switch (kind)
+                {
+                case LDAP_SYNC_PRESENT:
+                    if (refreshing)
+                    {
+                        present.insert(uuid);
+                    }
+                    break;
+                case LDAP_SYNC_ADD:
+                case LDAP_SYNC_MODIFY:
+                    mStore.put(uuid, decodeEntry(ld, msg));
+                    if (refreshing)
+                    {
+                        present.insert(uuid);
+                    }
+                    ++updates;
+                    break;
+                case LDAP_SYNC_DELETE:
+                    deletes += mStore.erase(uuid);
+                    break;
+                }
+                if (!entryCookie.empty())
+                {
+                    setCookie(entryCookie);
+                }
+            }
+            ldap_controls_free(entryControls);
+        }
+        else if (type == LDAP_RES_INTERMEDIATE)
+        {
+            char *oid = NULL;
+            struct berval *data = NULL;
+            ldap_parse_intermediate(ld, msg, &oid, &data, NULL, 0);
+            uint8_t tag = 0;
+            BerReader info(oid && data && strcmp(oid, LDAP_SYNC_INFO) == 0 ? view(*data) : std::string_view());
+            std::string_view body = info.next(&tag);
+            BerReader contents(body);
+            switch (tag)
+            {
+            case LDAP_TAG_SYNC_NEW_COOKIE:
+                setCookie(body);
+                break;
+            case LDAP_TAG_SYNC_REFRESH_PRESENT:
+            case LDAP_TAG_SYNC_REFRESH_DELETE:
+            {
+                if (contents.peek() == ber::OCTET_STRING)
+                {
+                    setCookie(contents.octets());
+                }
+                bool done = contents.peek() == ber::BOOLEAN ? contents.boolean() : true;
+                if (tag == LDAP_TAG_SYNC_REFRESH_PRESENT)
+                {
+                    endPresentPhase();
+                }
+                if (done && refreshing)
+                {
+                    endRefresh();
+                }
+                break;
+            }
+            case LDAP_TAG_SYNC_ID_SET:
+            {
+                if (contents.peek() == ber::OCTET_STRING)
+                {
+                    setCookie(contents.octets());
+                }
+                bool refreshDeletes = contents.peek() == ber::BOOLEAN && contents.boolean();
+                BerReader uuids = contents.enter(ber::SET);
+                while (!uuids.atEnd())
+                {
+                    std::string uuid(uuids.octets());
+                    if (refreshDeletes)
+                    {
+                        deletes += mStore.erase(uuid);
+                    }
+                    else if (refreshing)
+                    {
+                        present.insert(uuid);
+                    }
+                }
+                break;
+            }
+            }
+            ldap_memfree(oid);
+            ber_bvfree(data);
+        }
+        else if (type == LDAP_RES_SEARCH_RESULT)
+        {
+            LDAPControl **resultControls = NULL;
+            rc = LDAP_OTHER;
+            ldap_parse_result(ld, msg, &rc, NULL, NULL, NULL, &resultControls, 1);
+            if (rc == LDAP_SYNC_REFRESH_REQUIRED)
+            {
+                mStore.setCookie(std::string()); // the server no longer knows our cookie
+            }
+            LDAPControl *done = ldap_control_find(LDAP_CONTROL_SYNC_DONE, resultControls, NULL);
+            BerReader reader = BerReader(done ? view(done->ldctl_value) : std::string_view()).enter(ber::SEQUENCE);
+            if (rc == LDAP_SUCCESS && reader.ok())
+            {
+                if (reader.peek() == ber::OCTET_STRING)
+                {
+                    setCookie(reader.octets());
+                }
+                bool refreshDeletes = reader.peek() == ber::BOOLEAN && reader.boolean();
+                if (refreshing && !refreshDeletes)
+                {
+                    endPresentPhase();
+                }
+            }
+            if (refreshing && rc == LDAP_SUCCESS)
+            {
+                endRefresh();
+            }
+            else
+            {
+                record(false);
+            }
+            ldap_controls_free(resultControls);
+            return rc;
+        }
+        ldap_msgfree(msg);
+    }
+}
+
+int DirectoryReplica::poll(LdapConnection &connection)
+{
+    const char *attribute = mMode == ReplicaMode::UsnPolling ? "uSNChanged" : "whenChanged";
+    std::string prefix = pollPrefix(mMode, connection.server());
+    std::string stored = mStore.cookie();
+    std::string mark = startsWith(stored, prefix) ? stored.substr(prefix.size()) : std::string();
+    if (!validMark(mMode, mark))
+    {
+        mark.clear(); // load everything again
+    }
+    bool full;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        full = mark.empty() || (mOptions.reconcileEvery > 0 && ++mPolls % mOptions.reconcileEvery == 0);
+    }
+
+    SearchRequest request;
+    request.base = mConfig.mSearchBase;
+    request.filter = mConfig.mFilter.empty() ? "(objectClass=*)" : mConfig.mFilter;
+    if (request.filter[0] != '(')
+    {
+        request.filter = "(" + request.filter + ")";
+    }
+    request.attributes = mConfig.mAttributes;
+    bool requested = request.attributes.empty() ||
+                     std::any_of(request.attributes.begin(), request.attributes.end(), [attribute](const std::string &name) {
+                         return strcasecmp(name.c_str(), attribute) == 0;
+                     });
+    if (!requested)
+    {
+        request.attributes.push_back(attribute);
+    }
+    if (!full)
+    {
+        // Entries at the mark were seen already; whenChanged has only seconds, so it repeats them
+        std::string from = mMode == ReplicaMode::UsnPolling ? std::to_string(std::stoull(mark) + 1) : mark;
+        request.filter = "(&" + request.filter + "(" + attribute + ">=" + from + "))";
+    }
+
+    std::unordered_set<std::string> seen;
+    std::string highest = mark;
+    uint64_t updates = 0;
+    int rc = pagedSearch(connection.get(), request, mOptions.pageSize, [&](std::vector<LdapEntry> &page) {
+        for (LdapEntry &entry : page)
+        {
+            std::string changed = entry.value(attribute);
+            if (laterMark(changed, highest))
+            {
+                highest = changed;
+            }
+            if (!requested)
+            {
+                entry.attributes.erase(attribute);
+            }
+            std::string key = SearchCache::normalizeDn(entry.dn);
+            mStore.put(key, entry);
+            if (full)
+            {
+                seen.insert(key);
+            }
+            ++updates;
+        }
+        return !mStopping;
+    });
+    if (rc != LDAP_SUCCESS || mStopping)
+    {
+        return rc;
+    }
+
+    uint64_t deletes = full ? mStore.retain(seen) : 0;
+    mStore.setCookie(prefix + highest);
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStats.fullLoads += full;
+        mStats.updates += updates;
+        mStats.deletes += deletes;
+        mDirty = mDirty || updates || deletes;
+        if (full)
+        {
+            mPolls = 0;
+        }
+    }
+    mReady = true;
+    checkpoint(true);
+    return rc;
+}
+
+} // namespace ldapclient
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "ldap_connection.h"
+#include "replica_store.h"
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+
+namespace ldapclient
+{
+
+enum class ReplicaMode
+{
+    Unknown,          // not probed yet
+    ContentSync,      // RFC 4533, as OpenLDAP's syncprov offers
+    UsnPolling,       // Active Directory: entries changed since the highest uSNChanged seen
+    TimestampPolling, // anything else, with whenChanged
+};
+
+// Reads the root DSE: content synchronisation when supportedControl lists it,
+// uSNChanged when there is a highestCommittedUSN, whenChanged otherwise
+ReplicaMode probeReplicaMode(LDAP *ld);
+
+struct ReplicaOptions
+{
+    // Attributes lookup() finds by hash instead of a scan
+    std::vector<std::string> indexed{"uid", "mail"};
+    // Empty for no snapshot
+    std::string snapshotPath;
+    // Between polls when the server cannot push changes
+    std::chrono::seconds pollInterval{60};
+    // Polling cannot see deletions; every this many polls is a full reload that can
+    std::size_t reconcileEvery = 10;
+    // Before reconnecting once following has failed
+    std::chrono::seconds retryInterval{5};
+    // The most often a snapshot is written while changes keep arriving
+    std::chrono::seconds snapshotInterval{60};
+    int pageSize = 500;
+};
+
+struct ReplicaStats
+{
+    uint64_t passes = 0;    // refreshes and polls
+    uint64_t fullLoads = 0; // passes that fetched everything
+    uint64_t updates = 0;   // entries added or changed
+    uint64_t deletes = 0;
+    uint64_t snapshots = 0; // written
+    bool snapshotLoaded = false;
+};
+
+// A local copy of the configured subtree (mSearchBase, mFilter, mAttributes)
+// for lookups that cannot afford a round trip each. It loads everything once,
+// then follows changes:
+//
+// - With content synchronisation it asks for what changed since its cookie;
+//   start() keeps the search open (refreshAndPersist) and applies changes as
+//   the server pushes them.
+// - Against Active Directory it polls for entries whose uSNChanged is past the
+//   highest one seen, and reloads everything every reconcileEvery polls to
+//   drop deleted entries. uSNChanged counts per domain controller, so failing
+//   over to another one starts again with a full load.
+//
+// With a snapshotPath the store is saved after each refresh and loaded by the
+// constructor, so a restart serves lookups at once and resumes from the cookie.
+//
+//     DirectoryReplica replica(config, options);
+//     replica.start();
+//     auto people = replica.lookup("uid", "jdoe");
+//     auto admins = replica.search("(&(objectClass=person)(cn=adm*))");
+class DirectoryReplica
+{
+  public:
+    explicit DirectoryReplica(const LdapConfiguration &config, ReplicaOptions options = ReplicaOptions());
+    ~DirectoryReplica(); // stops following
+    DirectoryReplica(const DirectoryReplica &) = delete;
+    DirectoryReplica &operator=(const DirectoryReplica &) = delete;
+
+    // One refresh or poll on the calling thread; returns its result code.
+    // Not to be mixed with start().
+    int refresh();
+
+    // Follows changes on a background thread until stop()
+    void start();
+    // Saves a snapshot once the thread is gone
+    void stop();
+
+    std::optional<LdapEntry> find(const std::string &dn) const { return mStore.find(dn); }
+    std::vector<LdapEntry> lookup(const std::string &attribute, const std::string &value) const
+    {
+        return mStore.lookup(attribute, value);
+    }
+    // The filter's attributes must be among the replicated ones; see ReplicaStore
+    std::vector<LdapEntry> search(const std::string &filter, FilterStats *stats = nullptr) const
+    {
+        return mStore.search(filter, stats);
+    }
+    const ReplicaStore &store() const { return mStore; }
+
+    // Once a refresh has completed or a snapshot was loaded
+    bool ready() const { return mReady; }
+    ReplicaMode mode() const { return mMode; }
+    ReplicaStats stats() const;
+    bool save();
+
+  private:
+    // Probes the mode if need be, then syncs; persist keeps following
+    int pass(LdapConnection &connection, bool persist);
+    int contentSync(LDAP *ld, bool persist);
+    int poll(LdapConnection &connection);
+    void follow();
+    // Saves when something changed, at most every snapshotInterval unless forced
+    void checkpoint(bool force);
+    std::string fingerprint() const;
+
+    LdapConfiguration mConfig;
+    ReplicaOptions mOptions;
+    ReplicaStore mStore;
+    std::atomic<ReplicaMode> mMode{ReplicaMode::Unknown};
+    std::atomic<bool> mReady{false};
+    std::unique_ptr<LdapConnection> mConnection; // for refresh()
+
+    mutable std::mutex mMutex;
+    ReplicaStats mStats;
+    size_t mPolls = 0;
+    bool mDirty = false;
+    std::chrono::steady_clock::time_point mSaved;
+
+    std::atomic<bool> mStopping{false};
+    std::condition_variable mWake;
+    std::thread mFollower;
+};
+
+} // namespace ldapclient
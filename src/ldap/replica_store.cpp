@@ -0,0 +1,780 @@
+#include "replica_store.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <mutex>
+
+namespace ldapclient
+{
+
+static const char SNAPSHOT_MAGIC[] = "LDAPREPL";
+static const uint64_t SNAPSHOT_VERSION = 2;
+static const uint32_t NO_NAME = std::numeric_limits<uint32_t>::max();
+static const uint32_t NO_SLOT = std::numeric_limits<uint32_t>::max();
+
+static std::string lower(std::string s)
+{
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return char(std::tolower(c)); });
+    return s;
+}
+
+static void putVarint(std::string &out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out += char(value | 0x80);
+        value >>= 7;
+    }
+    out += char(value);
+}
+
+static void putString(std::string &out, const std::string &value)
+{
+    putVarint(out, value.size());
+    out += value;
+}
+
+namespace
+{
+
+// Reads what putVarint and putString wrote. Running off the end is sticky.
+class Cursor
+{
+  public:
+    explicit Cursor(std::string_view data) : mData(data) {}
+
+    bool ok() const { return mOk; }
+    bool atEnd() const { return mPos >= mData.size(); }
+
+    uint64_t varint()
+    {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            if (mPos >= mData.size())
+            {
+                break;
+            }
+            unsigned char c = mData[mPos++];
+            value |= uint64_t(c & 0x7f) << shift;
+            if (!(c & 0x80))
+            {
+                return value;
+            }
+        }
+        mOk = false;
+        return 0;
+    }
+
+    std::string string() { return std::string(view()); }
+
+    // Valid for as long as the data
+    std::string_view view()
+    {
+        uint64_t size = varint();
+        if (!mOk || size > mData.size() - mPos)
+        {
+            mOk = false;
+            return std::string_view();
+        }
+        mPos += size;
+        return mData.substr(mPos - size, size);
+    }
+
+  private:
+    std::string_view mData;
+    size_t mPos = 0;
+    bool mOk = true;
+};
+
+// A packed entry that only names attributes among the first names ids
+bool validPacked(const std::string &packed, size_t names)
+{
+    Cursor cursor(packed);
+    for (uint64_t attributes = cursor.varint(); cursor.ok() && attributes > 0; --attributes)
+    {
+        if (cursor.varint() >= names)
+        {
+            return false;
+        }
+        for (uint64_t values = cursor.varint(); cursor.ok() && values > 0; --values)
+        {
+            cursor.string();
+        }
+    }
+    return cursor.ok() && cursor.atEnd();
+}
+
+bool allDigits(const std::string &value)
+{
+    return !value.empty() && std::all_of(value.begin(), value.end(), [](unsigned char c) { return std::isdigit(c); });
+}
+
+} // namespace
+
+struct ReplicaStore::Plan
+{
+    LdapFilter::Type type = LdapFilter::Present;
+    uint32_t name = NO_NAME; // for a leaf; none when no entry has the attribute
+    int index = -1;          // into mIndexes
+    bool phone = false;
+    // Normalised
+    std::string value;
+    std::string initial;
+    std::vector<std::string> any;
+    std::string final;
+    std::vector<Plan> children; // in the order to test them
+    double cost = 0;            // expected per entry
+    double selectivity = 1;     // share of the entries that match
+    bool indexable = false;     // candidates() can answer it
+};
+
+ReplicaStore::ReplicaStore(std::vector<std::string> indexed) : mIndexes(indexed.size())
+{
+    for (const std::string &name : indexed)
+    {
+        mIndexed.push_back(lower(name));
+    }
+}
+
+uint32_t ReplicaStore::intern(const std::string &name)
+{
+    std::string key = lower(name);
+    auto it = mNameIds.emplace(key, uint32_t(mNames.size())).first;
+    if (it->second == mNames.size())
+    {
+        mNames.push_back(name);
+        auto indexed = std::find(mIndexed.begin(), mIndexed.end(), key);
+        mIndexOf.push_back(indexed == mIndexed.end() ? -1 : int(indexed - mIndexed.begin()));
+    }
+    return it->second;
+}
+
+std::string ReplicaStore::pack(const LdapEntry &entry)
+{
+    std::string packed;
+    putVarint(packed, entry.attributes.size());
+    for (const auto &attribute : entry.attributes)
+    {
+        putVarint(packed, intern(attribute.first));
+        putVarint(packed, attribute.second.size());
+        for (const std::string &value : attribute.second)
+        {
+            putString(packed, value);
+        }
+    }
+    return packed;
+}
+
+LdapEntry ReplicaStore::unpack(const Slot &slot) const
+{
+    LdapEntry entry;
+    entry.dn = mDns.dn(slot.dn);
+    Cursor cursor(slot.packed);
+    for (uint64_t attributes = cursor.varint(); cursor.ok() && attributes > 0; --attributes)
+    {
+        std::vector<std::string> &values = entry.attributes[mNames[cursor.varint()]];
+        for (uint64_t count = cursor.varint(); cursor.ok() && count > 0; --count)
+        {
+            values.push_back(cursor.string());
+        }
+    }
+    return entry;
+}
+
+void ReplicaStore::index(uint32_t slot, bool add)
+{
+    DnStore::Id dn = mSlots[slot].dn;
+    if (add)
+    {
+        if (dn >= mByDn.size())
+        {
+            mByDn.resize(mDns.capacity(), NO_SLOT);
+        }
+        mByDn[dn] = slot;
+    }
+    else if (mByDn[dn] == slot)
+    {
+        mByDn[dn] = NO_SLOT;
+    }
+
+    Cursor cursor(mSlots[slot].packed);
+
+    for (uint64_t attributes = cursor.varint(); cursor.ok() && attributes > 0; --attributes)
+    {
+        uint64_t name = cursor.varint();
+        int position = mIndexOf[name];
+        for (uint64_t count = cursor.varint(); cursor.ok() && count > 0; --count)
+        {
+            std::string_view raw = cursor.view();
+            if (position < 0)
+            {
+                continue;
+            }
+            Index &index = mIndexes[position];
+            std::string value = normalizeValue(raw, isTelephoneAttribute(mNames[name]));
+            if (add)
+            {
+                index.equal.emplace(value, slot);
+                index.sorted.emplace(std::move(value), slot);
+                continue;
+            }
+            auto range = index.equal.equal_range(value);
+            for (auto it = range.first; it != range.second; ++it)
+            {
+                if (it->second == slot)
+                {
+                    index.equal.erase(it);
+                    break;
+                }
+            }
+            index.sorted.erase(std::make_pair(std::move(value), slot));
+        }
+    }
+}
+
+void ReplicaStore::put(const std::string &key, const LdapEntry &entry)
+{
+    std::unique_lock<std::shared_mutex> lock(mMutex);
+    std::string packed = pack(entry);
+    DnStore::Id dn = mDns.intern(entry.dn);
+    auto it = mByKey.find(key);
+    uint32_t slot;
+    if (it != mByKey.end())
+    {
+        slot = it->second;
+        index(slot, false);
+        mDns.release(mSlots[slot].dn);
+        mBytes -= mSlots[slot].packed.size();
+    }
+    else if (!mFree.empty())
+    {
+        slot = mFree.back();
+        mFree.pop_back();
+        mByKey.emplace(key, slot);
+    }
+    else
+    {
+        slot = uint32_t(mSlots.size());
+        mSlots.emplace_back();
+        mByKey.emplace(key, slot);
+    }
+    mSlots[slot].key = key;
+    mSlots[slot].dn = dn;
+    mSlots[slot].packed = std::move(packed);
+    mBytes += mSlots[slot].packed.size();
+    index(slot, true);
+}
+
+bool ReplicaStore::erase(const std::string &key)
+{
+    std::unique_lock<std::shared_mutex> lock(mMutex);
+    auto it = mByKey.find(key);
+    if (it == mByKey.end())
+    {
+        return false;
+    }
+    uint32_t slot = it->second;
+    index(slot, false);
+    mDns.release(mSlots[slot].dn);
+    mBytes -= mSlots[slot].packed.size();
+    mSlots[slot] = Slot();
+    mFree.push_back(slot);
+    mByKey.erase(it);
+    return true;
+}
+
+bool ReplicaStore::contains(const std::string &key) const
+{
+    std::shared_lock<std::shared_mutex> lock(mMutex);
+    return mByKey.count(key) > 0;
+}
+
+void ReplicaStore::clear()
+{
+    std::unique_lock<std::shared_mutex> lock(mMutex);
+    mSlots.clear();
+    mFree.clear();
+    mByKey.clear();
+    mDns.clear();
+    mByDn.clear();
+    for (Index &index : mIndexes)
+    {
+        index = Index();
+    }
+    mBytes = 0;
+    mCookie.clear();
+}
+
+size_t ReplicaStore::retain(const std::unordered_set<std::string> &keep)
+{
+    std::vector<std::string> gone;
+    {
+        std::shared_lock<std::shared_mutex> lock(mMutex);
+        for (const auto &key : mByKey)
+        {
+            if (!keep.count(key.first))
+            {
+                gone.push_back(key.first);
+            }
+        }
+    }
+    for (const std::string &key : gone)
+    {
+        erase(key);
+    }
+    return gone.size();
+}
+
+std::optional<LdapEntry> ReplicaStore::find(const std::string &dn) const
+{
+    std::shared_lock<std::shared_mutex> lock(mMutex);
+    DnStore::Id id = mDns.find(dn);
+    if (id >= mByDn.size() || mByDn[id] == NO_SLOT)
+    {
+        return std::nullopt;
+    }
+    return unpack(mSlots[mByDn[id]]);
+}
+
+std::vector<LdapEntry> ReplicaStore::lookup(const std::string &attribute, const std::string &value) const
+{
+    LdapFilter filter;
+    filter.type = LdapFilter::Equality;
+    filter.attribute = lower(attribute);
+    filter.value = value;
+    return search(filter);
+}
+
+std::vector<LdapEntry> ReplicaStore::search(const std::string &filter, FilterStats *stats) const
+{
+    return search(parseLdapFilter(filter), stats);
+}
+
+std::vector<LdapEntry> ReplicaStore::search(const LdapFilter &filter, FilterStats *stats) const
+{
+    FilterStats local;
+    FilterStats &counts = stats ? *stats : local;
+    counts = FilterStats();
+    std::vector<LdapEntry> found;
+    std::string scratch;
+    std::shared_lock<std::shared_mutex> lock(mMutex);
+    Plan plan = compile(filter);
+    auto test = [&](const Slot &slot) {
+        ++counts.examined;
+        if (matches(plan, slot.packed, scratch))
+        {
+            found.push_back(unpack(slot));
+        }
+    };
+
+    std::vector<uint32_t> slots;
+    counts.indexed = plan.indexable && candidates(plan, slots);
+    if (counts.indexed)
+    {
+        // An entry comes up once per value in range, and once per arm of an or
+        std::sort(slots.begin(), slots.end());
+        slots.erase(std::unique(slots.begin(), slots.end()), slots.end());
+        for (uint32_t slot : slots)
+        {
+            test(mSlots[slot]);
+        }
+    }
+    else
+    {
+        for (const Slot &slot : mSlots)
+        {
+            if (!slot.packed.empty())
+            {
+                test(slot);
+            }
+        }
+    }
+    counts.matched = found.size();
+    return found;
+}
+
+ReplicaStore::Plan ReplicaStore::compile(const LdapFilter &filter) const
+{
+    Plan plan;
+    plan.type = filter.type;
+    double entries = double(std::max<size_t>(mByKey.size(), 1));
+
+    if (filter.type == LdapFilter::And || filter.type == LdapFilter::Or)
+    {
+        bool all = filter.type == LdapFilter::And;
+        for (const LdapFilter &child : filter.children)
+        {
+            plan.children.push_back(compile(child));
+        }
+        // An and stops at the first part that fails, an or at the first that
+        // holds: first the parts that decide most for the least work
+        auto rank = [all](const Plan &part) {
+            double decides = all ? 1 - part.selectivity : part.selectivity;
+            return decides > 0 ? part.cost / decides : std::numeric_limits<double>::infinity();
+        };
+        std::stable_sort(plan.children.begin(), plan.children.end(),
+                         [&rank](const Plan &a, const Plan &b) { return rank(a) < rank(b); });
+
+        double reached = 1; // chance of getting as far as the next part
+        plan.indexable = !all && !plan.children.empty();
+        for (const Plan &part : plan.children)
+        {
+            plan.cost += reached * part.cost;
+            reached *= all ? part.selectivity : 1 - part.selectivity;
+            plan.indexable = all ? plan.indexable || part.indexable : plan.indexable && part.indexable;
+        }
+        plan.selectivity = all ? reached : 1 - reached;
+        return plan;
+    }
+    if (filter.type == LdapFilter::Not)
+    {
+        plan.children.push_back(compile(filter.children.at(0)));
+        plan.cost = plan.children[0].cost;
+        plan.selectivity = 1 - plan.children[0].selectivity;
+        return plan;
+    }
+
+    auto id = mNameIds.find(filter.attribute);
+    if (id == mNameIds.end())
+    {
+        plan.selectivity = 0;
+        plan.indexable = true; // to nothing
+        return plan;
+    }
+    plan.name = id->second;
+    plan.index = mIndexOf[plan.name];
+    plan.phone = isTelephoneAttribute(filter.attribute);
+    plan.value = normalizeValue(filter.value, plan.phone);
+    plan.initial = normalizeValue(filter.initial, plan.phone);
+    for (const std::string &part : filter.any)
+    {
+        plan.any.push_back(normalizeValue(part, plan.phone));
+    }
+    plan.final = normalizeValue(filter.final, plan.phone);
+
+    bool indexed = plan.index >= 0;
+    switch (filter.type)
+    {
+    case LdapFilter::Present:
+        plan.cost = 1;
+        plan.selectivity = 0.9;
+        break;
+    case LdapFilter::Equality:
+    case LdapFilter::Approx:
+        plan.cost = 2;
+        plan.selectivity = indexed ? double(mIndexes[plan.index].equal.count(plan.value)) / entries : 0.05;
+        plan.indexable = indexed;
+        break;
+    case LdapFilter::Substrings:
+        plan.cost = 3 + double(plan.any.size()) + !plan.initial.empty() + !plan.final.empty();
+        plan.indexable = indexed && !plan.initial.empty();
+        plan.selectivity = plan.indexable ? 0.1 : 0.2;
+        break;
+    default:
+        // Numbers order by length first, which the sorted index does not
+        plan.cost = 3;
+        plan.selectivity = 0.3;
+        plan.indexable = indexed && !allDigits(plan.value);
+        break;
+    }
+    return plan;
+}
+
+bool ReplicaStore::candidates(const Plan &plan, std::vector<uint32_t> &slots) const
+{
+    if (!plan.indexable)
+    {
+        return false;
+    }
+    switch (plan.type)
+    {
+    case LdapFilter::And:
+    {
+        // The part that narrows down the most; the others are tested per entry
+        const Plan *best = nullptr;
+        for (const Plan &part : plan.children)
+        {
+            if (part.indexable && (!best || part.selectivity < best->selectivity))
+            {
+                best = &part;
+            }
+        }
+        return candidates(*best, slots);
+    }
+    case LdapFilter::Or:
+        for (const Plan &part : plan.children)
+        {
+            candidates(part, slots);
+        }
+        return true;
+    default:
+        break;
+    }
+
+    if (plan.name == NO_NAME)
+    {
+        return true;
+    }
+    const Index &index = mIndexes[plan.index];
+    switch (plan.type)
+    {
+    case LdapFilter::Equality:
+    case LdapFilter::Approx:
+    {
+        auto range = index.equal.equal_range(plan.value);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            slots.push_back(it->second);
+        }
+        return true;
+    }
+    case LdapFilter::Substrings:
+        for (auto it = index.sorted.lower_bound(std::make_pair(plan.initial, 0u));
+             it != index.sorted.end() && it->first.compare(0, plan.initial.size(), plan.initial) == 0; ++it)
+        {
+            slots.push_back(it->second);
+        }
+        return true;
+    case LdapFilter::GreaterOrEqual:
+        for (auto it = index.sorted.lower_bound(std::make_pair(plan.value, 0u)); it != index.sorted.end(); ++it)
+        {
+            slots.push_back(it->second);
+        }
+        return true;
+    case LdapFilter::LessOrEqual:
+        for (auto it = index.sorted.begin(); it != index.sorted.end() && it->first <= plan.value; ++it)
+        {
+            slots.push_back(it->second);
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool matchSubstrings(const std::string &value, const std::string &initial, const std::vector<std::string> &any,
+                            const std::string &final)
+{
+    if (value.size() < initial.size() + final.size() || value.compare(0, initial.size(), initial) != 0 ||
+        value.compare(value.size() - final.size(), final.size(), final) != 0)
+    {
+        return false;
+    }
+    size_t pos = initial.size();
+    size_t end = value.size() - final.size();
+    for (const std::string &part : any)
+    {
+        size_t found = value.find(part, pos);
+        if (found == std::string::npos || found + part.size() > end)
+        {
+            return false;
+        }
+        pos = found + part.size();
+    }
+    return true;
+}
+
+bool ReplicaStore::matches(const Plan &plan, std::string_view packed, std::string &scratch) const
+{
+    switch (plan.type)
+    {
+    case LdapFilter::And:
+        return std::all_of(plan.children.begin(), plan.children.end(),
+                           [&](const Plan &part) { return matches(part, packed, scratch); });
+    case LdapFilter::Or:
+        return std::any_of(plan.children.begin(), plan.children.end(),
+                           [&](const Plan &part) { return matches(part, packed, scratch); });
+    case LdapFilter::Not:
+        return !matches(plan.children[0], packed, scratch);
+    default:
+        break;
+    }
+    if (plan.name == NO_NAME)
+    {
+        return false;
+    }
+
+    Cursor cursor(packed);
+    for (uint64_t attributes = cursor.varint(); cursor.ok() && attributes > 0; --attributes)
+    {
+        bool wanted = cursor.varint() == plan.name;
+        for (uint64_t count = cursor.varint(); cursor.ok() && count > 0; --count)
+        {
+            std::string_view raw = cursor.view();
+            if (!wanted)
+            {
+                continue;
+            }
+            if (plan.type == LdapFilter::Present)
+            {
+                return true;
+            }
+            normalizeValue(raw, plan.phone, scratch);
+            bool hit = false;
+            switch (plan.type)
+            {
+            case LdapFilter::Equality:
+            case LdapFilter::Approx:
+                hit = scratch == plan.value;
+                break;
+            case LdapFilter::GreaterOrEqual:
+                hit = compareOrdered(scratch, plan.value) >= 0;
+                break;
+            case LdapFilter::LessOrEqual:
+                hit = compareOrdered(scratch, plan.value) <= 0;
+                break;
+            case LdapFilter::Substrings:
+                hit = matchSubstrings(scratch, plan.initial, plan.any, plan.final);
+                break;
+            default:
+                break;
+            }
+            if (hit)
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+size_t ReplicaStore::size() const
+{
+    std::shared_lock<std::shared_mutex> lock(mMutex);
+    return mByKey.size();
+}
+
+size_t ReplicaStore::bytes() const
+{
+    std::shared_lock<std::shared_mutex> lock(mMutex);
+    return mBytes + mDns.bytes();
+}
+
+std::string ReplicaStore::cookie() const
+{
+    std::shared_lock<std::shared_mutex> lock(mMutex);
+    return mCookie;
+}
+
+void ReplicaStore::setCookie(const std::string &cookie)
+{
+    std::unique_lock<std::shared_mutex> lock(mMutex);
+    mCookie = cookie;
+}
+
+bool ReplicaStore::save(const std::string &path, const std::string &fingerprint) const
+{
+    std::string data(SNAPSHOT_MAGIC);
+    {
+        std::shared_lock<std::shared_mutex> lock(mMutex);
+        data.reserve(mBytes + 64 * mByKey.size() + 256);
+        putVarint(data, SNAPSHOT_VERSION);
+        putString(data, fingerprint);
+        putString(data, mCookie);
+        putVarint(data, mNames.size());
+        for (const std::string &name : mNames)
+        {
+            putString(data, name);
+        }
+        putVarint(data, mByKey.size());
+        for (const Slot &slot : mSlots)
+        {
+            if (!slot.packed.empty())
+            {
+                putString(data, slot.key);
+                putString(data, mDns.dn(slot.dn));
+                putString(data, slot.packed);
+            }
+        }
+    }
+
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        if (!out.write(data.data(), std::streamsize(data.size())) || !out.flush())
+        {
+            return false;
+        }
+    }
+    return std::rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+bool ReplicaStore::load(const std::string &path, const std::string &fingerprint)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    size_t magic = sizeof(SNAPSHOT_MAGIC) - 1;
+    if (!in || data.compare(0, magic, SNAPSHOT_MAGIC) != 0)
+    {
+        return false;
+    }
+
+    data.erase(0, magic);
+    Cursor cursor(data);
+    if (cursor.varint() != SNAPSHOT_VERSION || cursor.string() != fingerprint)
+    {
+        return false;
+    }
+    std::string cookie = cursor.string();
+    std::vector<std::string> names(cursor.ok() ? size_t(cursor.varint()) : 0);
+    std::unordered_set<std::string> distinct;
+    for (std::string &name : names)
+    {
+        name = cursor.string();
+        if (!distinct.insert(lower(name)).second)
+        {
+            return false;
+        }
+    }
+    std::vector<Slot> slots;
+    DnStore dns;
+    for (uint64_t count = cursor.varint(); cursor.ok() && count > 0; --count)
+    {
+        Slot slot;
+        slot.key = cursor.string();
+        slot.dn = dns.intern(cursor.view());
+        slot.packed = cursor.string();
+        if (!validPacked(slot.packed, names.size()))
+        {
+            return false;
+        }
+        slots.push_back(std::move(slot));
+    }
+    if (!cursor.ok() || !cursor.atEnd())
+    {
+        return false;
+    }
+
+    std::unique_lock<std::shared_mutex> lock(mMutex);
+    mNames.clear();
+    mNameIds.clear();
+    mIndexOf.clear();
+    for (const std::string &name : names)
+    {
+        intern(name);
+    }
+    mSlots = std::move(slots);
+    mFree.clear();
+    mByKey.clear();
+    mDns = std::move(dns);
+    mByDn.clear();
+    for (Index &index : mIndexes)
+    {
+        index = Index();
+    }
+    mBytes = 0;
+    for (uint32_t slot = 0; slot < mSlots.size(); ++slot)
+    {
+        mByKey[mSlots[slot].key] = slot;
+        mBytes += mSlots[slot].packed.size();
+        index(slot, true);
+    }
+    mCookie = std::move(cookie);
+    return true;
+}
+
+} // namespace ldapclient
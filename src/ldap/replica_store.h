@@ -0,0 +1,123 @@
+#pragma once
+
+#include "dn_store.h"
+#include "filter.h"
+#include "search.h"
+#include <optional>
+#include <set>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace ldapclient
+{
+
+// What ReplicaStore::search() did
+struct FilterStats
+{
+    bool indexed = false; // candidates came from an index rather than a scan
+    size_t examined = 0;  // entries the filter was tested on
+    size_t matched = 0;
+};
+
+// The entries of a replicated subtree, held compactly: each entry is packed
+// into one string of varint-framed attribute ids and values, with the
+// attribute names interned once for the whole store, and its DN is an id in a
+// DnStore, which holds the suffix the entries share once. That is one
+// allocation per entry instead of one per value, and it is also the snapshot
+// format, so a restart reads the file back without decoding anything but the
+// indexes.
+//
+// Entries are known by a key: the entryUUID under content synchronisation, the
+// normalised DN otherwise. Lookups by DN and by the indexed attributes are hash
+// lookups; other attributes are scanned. Values compare as normalizeValue() has
+// it. Thread-safe: lookups share a lock, changes take it alone.
+//
+// search() answers RFC 4515 filters here instead of on the server. The filter
+// is compiled against the store: attribute names become the ids the packed
+// entries carry, and the parts of every and/or are ordered by their expected
+// cost per entry and by how often they decide the outcome, so each entry is
+// rejected or accepted as cheaply as it can be. Candidates come from an index
+// when the filter allows it: the hash index for equality, the sorted one for
+// initial substrings and ranges. Otherwise every entry is tested.
+class ReplicaStore
+{
+  public:
+    explicit ReplicaStore(std::vector<std::string> indexed = std::vector<std::string>());
+    ReplicaStore(const ReplicaStore &) = delete;
+    ReplicaStore &operator=(const ReplicaStore &) = delete;
+
+    // Adds the entry, or replaces the one with this key
+    void put(const std::string &key, const LdapEntry &entry);
+    bool erase(const std::string &key);
+    bool contains(const std::string &key) const;
+    void clear();
+    // Drops every entry whose key is not in keep; returns how many went
+    size_t retain(const std::unordered_set<std::string> &keep);
+
+    std::optional<LdapEntry> find(const std::string &dn) const;
+    std::vector<LdapEntry> lookup(const std::string &attribute, const std::string &value) const;
+    // Attributes the store does not hold match nothing, so replicate every
+    // attribute the filters name. Throws LdapError for a malformed filter.
+    std::vector<LdapEntry> search(const std::string &filter, FilterStats *stats = nullptr) const;
+    std::vector<LdapEntry> search(const LdapFilter &filter, FilterStats *stats = nullptr) const;
+
+    size_t size() const;
+    size_t bytes() const; // packed entries and DNs, not counting the indexes
+
+    // Where synchronisation resumes; saved with the entries
+    std::string cookie() const;
+    void setCookie(const std::string &cookie);
+
+    // Written to path.tmp and renamed over path, so a crash leaves the old one.
+    // fingerprint names what was replicated; load() ignores a snapshot of
+    // something else and leaves the store as it was.
+    bool save(const std::string &path, const std::string &fingerprint) const;
+    bool load(const std::string &path, const std::string &fingerprint);
+
+  private:
+    struct Slot
+    {
+        std::string key;
+        DnStore::Id dn = DnStore::NONE;
+        std::string packed; // empty when free
+    };
+
+    // Normalised values of one indexed attribute
+    struct Index
+    {
+        std::unordered_multimap<std::string, uint32_t> equal;
+        std::set<std::pair<std::string, uint32_t>> sorted;
+    };
+
+    struct Plan; // a filter compiled against this store
+
+    uint32_t intern(const std::string &name);
+    std::string pack(const LdapEntry &entry);
+    LdapEntry unpack(const Slot &slot) const;
+    // The DN and the values of the indexed attributes
+    void index(uint32_t slot, bool add);
+
+    // Reads the names and indexes, so under the lock
+    Plan compile(const LdapFilter &filter) const;
+    // false when the plan cannot narrow the entries down by index
+    bool candidates(const Plan &plan, std::vector<uint32_t> &slots) const;
+    // scratch holds the normalised value under test, to spare an allocation each
+    bool matches(const Plan &plan, std::string_view packed, std::string &scratch) const;
+
+    std::vector<std::string> mIndexed; // lower-cased
+    mutable std::shared_mutex mMutex;
+    std::vector<std::string> mNames;
+    std::unordered_map<std::string, uint32_t> mNameIds; // lower-cased name to id
+    std::vector<int> mIndexOf;                          // position in mIndexed by name id, -1 for none
+    std::vector<Slot> mSlots;
+    std::vector<uint32_t> mFree;
+    std::unordered_map<std::string, uint32_t> mByKey;
+    DnStore mDns;
+    std::vector<uint32_t> mByDn; // slot by DN id
+    std::vector<Index> mIndexes; // one per mIndexed
+    size_t mBytes = 0;
+    std::string mCookie;
+};
+
+} // namespace ldapclient
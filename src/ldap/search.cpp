@@ -0,0 +1,105 @@
+#include "search.h"
+
+namespace ldapclient
+{
+
+const std::vector<std::string> *LdapEntry::values(const std::string &name) const
+{
+    auto it = attributes.find(name);
+    return it == attributes.end() ? nullptr : &it->second;
+}
+
+std::string LdapEntry::value(const std::string &name) const
+{
+    const std::vector<std::string> *v = values(name);
+    return v && !v->empty() ? v->front() : std::string();
+}
+
+AttributeList::AttributeList(const std::vector<std::string> &names) : mStorage(names)
+{
+    for (auto &name : mStorage)
+    {
+        mNames.push_back(&name[0]);
+    }
+    mNames.push_back(NULL);
+}
+
+std::string escapeFilterValue(const std::string &value)
+{
+    static const char hex[] = "0123456789abcdef";
+    std::string escaped;
+    escaped.reserve(value.size());
+    for (unsigned char c : value)
+    {
+        if (c == '*' || c == '(' || c == ')' || c == '\\' || c == '\0')
+        {
+            escaped += '\\';
+            escaped += hex[c >> 4];
+            escaped += hex[c & 0xf];
+        }
+        else
+        {
+            escaped += char(c);
+        }
+    }
+    return escaped;
+}
+
+LdapEntry decodeEntry(LDAP *ld, LDAPMessage *entry)
+{
+    LdapEntry result;
+    if (char *dn = ldap_get_dn(ld, entry))
+    {
+        result.dn = dn;
+        ldap_memfree(dn);
+    }
+
+    BerElement *ber = NULL;
+    for (char *a = ldap_first_attribute(ld, entry, &ber); a != NULL; a = ldap_next_attribute(ld, entry, ber))
+    {
+        std::vector<std::string> &values = result.attributes[a];
+        if (struct berval **vals = ldap_get_values_len(ld, entry, a))
+        {
+            for (int i = 0; vals[i] != NULL; i++)
+            {
+                values.emplace_back(vals[i]->bv_val, vals[i]->bv_len);
+            }
+            ldap_value_free_len(vals);
+        }
+        ldap_memfree(a);
+    }
+
+    if (ber != NULL)
+    {
+        ber_free(ber, 0);
+    }
+    return result;
+}
+
+void decodeReference(LDAP *ld, LDAPMessage *reference, SearchResult &result)
+{
+    char **referrals = NULL;
+    if (ldap_parse_reference(ld, reference, &referrals, NULL, 0) == LDAP_SUCCESS && referrals != NULL)
+    {
+        for (int i = 0; referrals[i] != NULL; i++)
+        {
+            result.referrals.emplace_back(referrals[i]);
+        }
+        ldap_memvfree((void **)referrals);
+    }
+}
+
+void decodeDone(LDAP *ld, LDAPMessage *done, SearchResult &result)
+{
+    int rc = LDAP_OTHER;
+    char *errorMessage = NULL;
+    int parseRc = ldap_parse_result(ld, done, &rc, NULL, &errorMessage, NULL, NULL, 0);
+    result.rc = parseRc == LDAP_SUCCESS ? rc : parseRc;
+    if (errorMessage != NULL)
+    {
+        result.error = errorMessage;
+        ldap_memfree(errorMessage);
+    }
+}
+
+} // namespace ldapclient
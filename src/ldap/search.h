@@ -0,0 +1,81 @@
+#pragma once
+
+#include <chrono>
+#include <ldap.h>
+#include <map>
+#include <string>
+#include <strings.h>
+#include <vector>
+
+namespace ldapclient
+{
+
+struct SearchRequest
+{
+    std::string base;
+    int scope = LDAP_SCOPE_SUBTREE;
+    std::string filter;
+    std::vector<std::string> attributes; // empty for all user attributes
+    int sizeLimit = LDAP_NO_LIMIT;
+    std::chrono::milliseconds timeout{10000};
+};
+
+// Attribute names compare case-insensitively, as they do on the server
+struct AttributeNameLess
+{
+    bool operator()(const std::string &a, const std::string &b) const { return strcasecmp(a.c_str(), b.c_str()) < 0; }
+};
+
+struct LdapEntry
+{
+    std::string dn;
+    // Values are raw bytes, so binary attributes like thumbnailPhoto survive
+    std::map<std::string, std::vector<std::string>, AttributeNameLess> attributes;
+
+    // nullptr when the entry does not carry the attribute
+    const std::vector<std::string> *values(const std::string &name) const;
+    // The first value, or "" when absent
+    std::string value(const std::string &name) const;
+};
+
+struct SearchResult
+{
+    int rc = LDAP_OTHER;
+    std::string error; // diagnostic message from the server, if any
+    std::vector<LdapEntry> entries;
+    std::vector<std::string> referrals;
+    double seconds = 0;
+    bool fromCache = false;
+
+    bool ok() const { return rc == LDAP_SUCCESS || rc == LDAP_SIZELIMIT_EXCEEDED; }
+};
+
+// NULL-terminated char ** view over attribute names, as the C API expects.
+// Returns NULL from get() when there are none, which asks for all attributes.
+class AttributeList
+{
+  public:
+    explicit AttributeList(const std::vector<std::string> &names);
+    AttributeList(const AttributeList &) = delete;
+    AttributeList &operator=(const AttributeList &) = delete;
+
+    char **get() { return mNames.size() > 1 ? mNames.data() : NULL; }
+
+  private:
+    std::vector<std::string> mStorage;
+    std::vector<char *> mNames;
+};
+
+// Escapes an assertion value for use inside a filter (RFC 4515)
+std::string escapeFilterValue(const std::string &value);
+
+LdapEntry decodeEntry(LDAP *ld, LDAPMessage *entry);
+
+// Parses an LDAP_RES_SEARCH_REFERENCE message into result.referrals
+void decodeReference(LDAP *ld, LDAPMessage *reference, SearchResult &result);
+
+// Parses an LDAP_RES_SEARCH_RESULT message into result.rc and result.error.
+// Does not free the message.
+void decodeDone(LDAP *ld, LDAPMessage *done, SearchResult &result);
+
+} // namespace ldapclient
@@ -0,0 +1,267 @@
+#include "search_cache.h"
+#include <algorithm>
+#include <cctype>
+
+namespace ldapclient
+{
+
+static std::string lower(std::string s)
+{
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return char(std::tolower(c)); });
+    return s;
+}
+
+static size_t estimateBytes(const std::string &key, const SearchResult &result)
+{
+    // Rough, but proportional to what the result really holds
+    size_t bytes = 2 * key.size() + sizeof(SearchResult) + 128 + result.error.size();
+    for (const auto &entry : result.entries)
+    {
+        bytes += sizeof(LdapEntry) + entry.dn.size();
+        for (const auto &attribute : entry.attributes)
+        {
+            bytes += 64 + attribute.first.size();
+            for (const auto &value : attribute.second)
+            {
+                bytes += sizeof(std::string) + value.size();
+            }
+        }
+    }
+    for (const auto &referral : result.referrals)
+    {
+        bytes += sizeof(std::string) + referral.size();
+    }
+    return bytes;
+}
+
+SearchCache::SearchCache(SearchCacheOptions options) : mOptions(options)
+{
+}
+
+std::string SearchCache::normalizeDn(const std::string &dn)
+{
+    std::string out;
+    out.reserve(dn.size());
+    for (size_t i = 0; i < dn.size(); ++i)
+    {
+        char c = dn[i];
+        if (c == '\\' && i + 1 < dn.size())
+        {
+            out += c;
+            out += char(std::tolower((unsigned char)dn[++i]));
+        }
+        else if (c == ' ' && (out.empty() || out.back() == ',' || out.back() == '=' || out.back() == '+'))
+        {
+            // blanks after a separator
+        }
+        else if ((c == ',' || c == '=' || c == '+') && !out.empty() && out.back() == ' ')
+        {
+            while (!out.empty() && out.back() == ' ' && (out.size() < 2 || out[out.size() - 2] != '\\'))
+            {
+                out.pop_back();
+            }
+            out += c;
+        }
+        else
+        {
+            out += char(std::tolower((unsigned char)c));
+        }
+    }
+    while (!out.empty() && out.back() == ' ' && (out.size() < 2 || out[out.size() - 2] != '\\'))
+    {
+        out.pop_back();
+    }
+    return out;
+}
+
+std::string SearchCache::normalizeFilter(const std::string &filter)
+{
+    size_t first = filter.find_first_not_of(" \t");
+    if (first == std::string::npos)
+    {
+        return "(objectclass=*)"; // what the library sends for no filter
+    }
+    // libldap accepts a bare "uid=x" and adds the parentheses itself
+    std::string in = filter[first] == '(' ? filter : "(" + filter.substr(first) + ")";
+
+    std::string out;
+    out.reserve(in.size());
+    size_t i = 0;
+    while (i < in.size())
+    {
+        char c = in[i];
+        if (c == ' ' || c == '\t')
+        {
+            ++i;
+            continue;
+        }
+        out += c;
+        ++i;
+        if (c != '(')
+        {
+            continue;
+        }
+
+        while (i < in.size() && (in[i] == ' ' || in[i] == '\t'))
+        {
+            ++i;
+        }
+        if (i < in.size() && (in[i] == '&' || in[i] == '|' || in[i] == '!'))
+        {
+            continue;
+        }
+
+        // An item: the attribute description up to the match operator, then the
+        // value up to the closing parenthesis, which RFC 4515 requires to be escaped inside it
+        size_t op = in.find_first_of("=~<>:", i);
+        if (op == std::string::npos)
+        {
+            out.append(in, i, std::string::npos);
+            break;
+        }
+        std::string description = in.substr(i, op - i);
+        description.erase(description.find_last_not_of(" \t") + 1);
+        out += lower(description);
+
+        size_t close = in.find(')', op);
+        if (close == std::string::npos)
+        {
+            close = in.size();
+        }
+        out.append(in, op, close - op);
+        i = close;
+    }
+    return out;
+}
+
+std::string SearchCache::key(const std::string &identity, const SearchRequest &request)
+{
+    std::vector<std::string> attributes;
+    for (const auto &attribute : request.attributes)
+    {
+        attributes.push_back(lower(attribute));
+    }
+    std::sort(attributes.begin(), attributes.end());
+    attributes.erase(std::unique(attributes.begin(), attributes.end()), attributes.end());
+
+    std::string key = normalizeDn(identity);
+    key += '\n';
+    key += normalizeDn(request.base);
+    key += '\n';
+    key += std::to_string(request.scope);
+    key += '\n';
+    key += normalizeFilter(request.filter);
+    key += '\n';
+    for (const auto &attribute : attributes)
+    {
+        key += attribute;
+        key += ',';
+    }
+    key += '\n';
+    key += std::to_string(request.sizeLimit);
+    return key;
+}
+
+bool SearchCache::lookup(const std::string &identity, const SearchRequest &request, SearchResult &result)
+{
+    std::string k = key(identity, request);
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mIndex.find(k);
+    if (it == mIndex.end())
+    {
+        ++mStats.misses;
+        return false;
+    }
+
+    if (it->second->expires <= Clock::now())
+    {
+        erase(it->second);
+        ++mStats.expirations;
+        ++mStats.misses;
+        return false;
+    }
+
+    mLru.splice(mLru.begin(), mLru, it->second);
+    result = *it->second->result;
+    ++mStats.hits;
+    if (result.entries.empty())
+    {
+        ++mStats.negativeHits;
+    }
+    return true;
+}
+
+void SearchCache::store(const std::string &identity, const SearchRequest &request, const SearchResult &result,
+                        std::chrono::milliseconds ttl)
+{
+    if (result.rc != LDAP_SUCCESS)
+    {
+        return;
+    }
+    if (ttl.count() <= 0)
+    {
+        ttl = result.entries.empty() ? mOptions.negativeTtl : mOptions.ttl;
+    }
+
+    std::string k = key(identity, request);
+    size_t bytes = estimateBytes(k, result);
+    if (bytes > mOptions.maxBytes)
+    {
+        return;
+    }
+    auto cached = std::make_shared<const SearchResult>(result);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mIndex.find(k);
+    if (it != mIndex.end())
+    {
+        erase(it->second);
+    }
+
+    mLru.push_front(Node{k, std::move(cached), Clock::now() + ttl, bytes});
+    mIndex[k] = mLru.begin();
+    mStats.bytes += bytes;
+    ++mStats.entries;
+
+    while (mStats.bytes > mOptions.maxBytes)
+    {
+        erase(std::prev(mLru.end()));
+        ++mStats.evictions;
+    }
+}
+
+void SearchCache::invalidate(const std::string &identity, const SearchRequest &request)
+{
+    std::string k = key(identity, request);
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mIndex.find(k);
+    if (it != mIndex.end())
+    {
+        erase(it->second);
+    }
+}
+
+void SearchCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mLru.clear();
+    mIndex.clear();
+    mStats.entries = 0;
+    mStats.bytes = 0;
+}
+
+SearchCacheStats SearchCache::stats() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mStats;
+}
+
+void SearchCache::erase(std::list<Node>::iterator it)
+{
+    mStats.bytes -= it->bytes;
+    --mStats.entries;
+    mIndex.erase(it->key);
+    mLru.erase(it);
+}
+
+} // namespace ldapclient
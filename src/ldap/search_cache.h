@@ -0,0 +1,81 @@
+#pragma once
+
+#include "search.h"
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace ldapclient
+{
+
+struct SearchCacheOptions
+{
+    std::chrono::milliseconds ttl{std::chrono::minutes(5)};
+    // Lookups that found nothing, such as an unknown caller's number
+    std::chrono::milliseconds negativeTtl{std::chrono::minutes(1)};
+    size_t maxBytes = 64 * 1024 * 1024;
+};
+
+struct SearchCacheStats
+{
+    uint64_t hits = 0; // including negative hits
+    uint64_t negativeHits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0; // pushed out by maxBytes
+    uint64_t expirations = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+
+    double hitRate() const { return hits + misses ? double(hits) / double(hits + misses) : 0.0; }
+};
+
+// In-memory cache of successful search results, keyed by the normalised
+// (identity, base, scope, filter, attributes) so spelling differences that the
+// server ignores still hit. The identity is the DN the results were read under,
+// "" for anonymous: what a search returns depends on the access of the bind,
+// so clients bound as different users can share a cache without one being
+// served what only the other may read. The least recently used results go
+// first once maxBytes is exceeded. Thread-safe.
+class SearchCache
+{
+  public:
+    explicit SearchCache(SearchCacheOptions options = SearchCacheOptions());
+
+    // Fills result and returns true for a live entry
+    bool lookup(const std::string &identity, const SearchRequest &request, SearchResult &result);
+    // Only results with rc LDAP_SUCCESS are kept. A zero ttl uses the configured one.
+    void store(const std::string &identity, const SearchRequest &request, const SearchResult &result,
+               std::chrono::milliseconds ttl = std::chrono::milliseconds(0));
+    void invalidate(const std::string &identity, const SearchRequest &request);
+    void clear();
+
+    SearchCacheStats stats() const;
+
+    static std::string key(const std::string &identity, const SearchRequest &request);
+    // Lower-cases attribute descriptions and drops the insignificant blanks;
+    // assertion values are kept as they are
+    static std::string normalizeFilter(const std::string &filter);
+    static std::string normalizeDn(const std::string &dn);
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Node
+    {
+        std::string key;
+        std::shared_ptr<const SearchResult> result;
+        Clock::time_point expires;
+        size_t bytes;
+    };
+
+    void erase(std::list<Node>::iterator it);
+
+    SearchCacheOptions mOptions;
+    mutable std::mutex mMutex;
+    std::list<Node> mLru; // most recently used at the front
+    std::unordered_map<std::string, std::list<Node>::iterator> mIndex;
+    SearchCacheStats mStats;
+};
+
+} // namespace ldapclient
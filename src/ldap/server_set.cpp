@@ -0,0 +1,193 @@
+#include "server_set.h"
+#include <algorithm>
+#include <condition_variable>
+#include <thread>
+
+namespace ldapclient
+{
+
+using Clock = std::chrono::steady_clock;
+
+struct LdapServerSet::Scores
+{
+    FailoverOptions options;
+    std::mutex mutex;
+    std::vector<ServerHealth> servers; // in configuration order
+
+    ServerHealth *find(const std::string &server)
+    {
+        for (ServerHealth &health : servers)
+        {
+            if (health.server == server)
+            {
+                return &health;
+            }
+        }
+        return nullptr;
+    }
+
+    void succeeded(const std::string &server, double ms)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (ServerHealth *health = find(server))
+        {
+            double previous = health->latencyMs < 0 ? ms : health->latencyMs;
+            health->latencyMs = options.smoothing * ms + (1 - options.smoothing) * previous;
+            health->failures = 0;
+        }
+    }
+
+    void failed(const std::string &server)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (ServerHealth *health = find(server))
+        {
+            ++health->failures;
+            auto penalty = options.penalty * (1LL << std::min<size_t>(health->failures - 1, 16));
+            health->retryAfter = Clock::now() + std::min<std::chrono::seconds>(penalty, options.maxPenalty);
+        }
+    }
+};
+
+struct LdapServerSet::Race
+{
+    std::mutex mutex;
+    std::condition_variable finished;
+    size_t running = 0;
+    LDAP *winner = nullptr; // stays set once open() has taken it, so late binds are closed
+    std::string server;
+    std::exception_ptr lastError;
+};
+
+LdapServerSet::LdapServerSet(const LdapConfiguration &config, FailoverOptions options)
+    : mConfig(config), mOptions(options), mScores(std::make_shared<Scores>())
+{
+    mScores->options = options;
+    for (const std::string &server : ldapServers(config))
+    {
+        if (!mScores->find(server))
+        {
+            mScores->servers.push_back(ServerHealth{server});
+        }
+    }
+}
+
+std::vector<ServerHealth> LdapServerSet::health() const
+{
+    std::lock_guard<std::mutex> lock(mScores->mutex);
+    return mScores->servers;
+}
+
+std::vector<std::string> LdapServerSet::ranked() const
+{
+    std::vector<ServerHealth> servers = health();
+    Clock::time_point now = Clock::now();
+    std::stable_sort(servers.begin(), servers.end(), [now](const ServerHealth &a, const ServerHealth &b) {
+        if (a.healthy(now) != b.healthy(now))
+        {
+            return a.healthy(now);
+        }
+        if (!a.healthy(now))
+        {
+            return a.retryAfter < b.retryAfter;
+        }
+        // Measured before unmeasured; unmeasured ones keep the configured order
+        bool measuredA = a.latencyMs >= 0;
+        bool measuredB = b.latencyMs >= 0;
+        if (measuredA != measuredB)
+        {
+            return measuredA;
+        }
+        return measuredA && a.latencyMs < b.latencyMs;
+    });
+
+    std::vector<std::string> order;
+    for (const ServerHealth &health : servers)
+    {
+        order.push_back(health.server);
+    }
+    return order;
+}
+
+void LdapServerSet::reportLost(const std::string &server)
+{
+    mScores->failed(server);
+}
+
+void LdapServerSet::attempt(std::shared_ptr<Scores> scores, std::shared_ptr<Race> race, LdapConfiguration config,
+                            std::string server, std::chrono::seconds timeout)
+{
+    auto start = Clock::now();
+    LDAP *ld = nullptr;
+    int rc = LDAP_SUCCESS;
+    std::exception_ptr error;
+    try
+    {
+        ld = bindServer(config, server, timeout);
+    }
+    catch (const LdapError &e)
+    {
+        rc = e.code();
+        error = std::current_exception();
+    }
+
+    // A rejected bind still means the server is up
+    if (ld || !(connectionLost(rc) || rc == LDAP_TIMEOUT))
+    {
+        scores->succeeded(server, std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+    }
+    else
+    {
+        scores->failed(server);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(race->mutex);
+        --race->running;
+        if (ld && !race->winner)
+        {
+            race->winner = ld;
+            race->server = server;
+            ld = nullptr;
+        }
+        else if (!ld)
+        {
+            race->lastError = error;
+        }
+    }
+    race->finished.notify_all();
+
+    if (ld)
+    {
+        ldap_unbind_ext_s(ld, NULL, NULL); // lost the race
+    }
+}
+
+LDAP *LdapServerSet::open(std::string *server)
+{
+    std::vector<std::string> order = ranked();
+    auto race = std::make_shared<Race>();
+
+    std::unique_lock<std::mutex> lock(race->mutex);
+    for (size_t i = 0; i < order.size() && !race->winner; ++i)
+    {
+        ++race->running;
+        std::thread(attempt, mScores, race, mConfig, order[i], mOptions.connectTimeout).detach();
+
+        // Move on at once when everything started so far has failed
+        race->finished.wait_for(lock, mOptions.stagger, [&race] { return race->winner || race->running == 0; });
+    }
+    race->finished.wait(lock, [&race] { return race->winner || race->running == 0; });
+
+    if (!race->winner)
+    {
+        std::rethrow_exception(race->lastError);
+    }
+    if (server)
+    {
+        *server = race->server;
+    }
+    return race->winner;
+}
+
+} // namespace ldapclient
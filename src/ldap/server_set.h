@@ -0,0 +1,74 @@
+#pragma once
+
+#include "ldap_connection.h"
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace ldapclient
+{
+
+struct FailoverOptions
+{
+    // How long an attempt runs alone before the next server is tried alongside it
+    std::chrono::milliseconds stagger{250};
+    std::chrono::seconds connectTimeout{10}; // per attempt
+    // A failed server is tried last for this long, doubling with each failure in a row
+    std::chrono::seconds penalty{10};
+    std::chrono::seconds maxPenalty{300};
+    // Weight of the newest connect time in the smoothed latency
+    double smoothing = 0.3;
+};
+
+struct ServerHealth
+{
+    std::string server;
+    double latencyMs = -1; // smoothed connect-and-bind time, -1 until measured
+    size_t failures = 0;   // in a row
+    std::chrono::steady_clock::time_point retryAfter;
+
+    bool healthy(std::chrono::steady_clock::time_point now) const { return failures == 0 || now >= retryAfter; }
+};
+
+// The servers of one LdapConfiguration with what has been learned about them.
+// open() races staggered connects, happy-eyeballs style: it starts on the best
+// server and, whenever an attempt has neither bound nor failed within the
+// stagger, also starts on the next one. The first bind wins and the others are
+// closed as they finish, so a slow or dead primary costs one stagger rather
+// than a network timeout.
+//
+// Servers are ranked healthy first, then by smoothed latency, then in
+// configuration order. Every attempt, won or lost, updates the scores.
+class LdapServerSet
+{
+  public:
+    explicit LdapServerSet(const LdapConfiguration &config, FailoverOptions options = FailoverOptions());
+    LdapServerSet(const LdapServerSet &) = delete;
+    LdapServerSet &operator=(const LdapServerSet &) = delete;
+
+    // A bound handle; server receives the name of the one that answered.
+    // Throws the last LdapError when every server fails.
+    LDAP *open(std::string *server = nullptr);
+
+    // The order open() tries them in
+    std::vector<std::string> ranked() const;
+    std::vector<ServerHealth> health() const;
+
+    // For a connection lost after it was opened
+    void reportLost(const std::string &server);
+
+  private:
+    struct Scores;
+    struct Race;
+
+    static void attempt(std::shared_ptr<Scores> scores, std::shared_ptr<Race> race, LdapConfiguration config,
+                        std::string server, std::chrono::seconds timeout);
+
+    LdapConfiguration mConfig;
+    FailoverOptions mOptions;
+    // Shared with attempts still running after open() has returned
+    std::shared_ptr<Scores> mScores;
+};
+
+} // namespace ldapclient
@@ -0,0 +1,374 @@
+#include "sorted_search.h"
+#include <algorithm>
+#include <cctype>
+#include <optional>
+#include <sstream>
+
+namespace ldapclient
+{
+
+using Clock = std::chrono::steady_clock;
+
+std::vector<SortKey> parseSortKeys(const std::string &keys)
+{
+    std::vector<SortKey> parsed;
+    std::istringstream in(keys);
+    for (std::string word; in >> word;)
+    {
+        SortKey key;
+        key.reverse = word[0] == '-';
+        key.attribute = word.substr(key.reverse ? 1 : 0);
+        key.attribute = key.attribute.substr(0, key.attribute.find(':')); // no matching rules
+        if (!key.attribute.empty())
+        {
+            parsed.push_back(key);
+        }
+    }
+    return parsed;
+}
+
+SortSupport probeSortSupport(LDAP *ld)
+{
+    char supportedControl[] = "supportedControl";
+    char *attrs[] = {supportedControl, NULL};
+    struct timeval timeOut = {10, 0};
+    LDAPMessage *res = NULL;
+    SortSupport support;
+    if (ldap_search_ext_s(ld, "", LDAP_SCOPE_BASE, "(objectClass=*)", attrs, 0, NULL, NULL, &timeOut, 1, &res) ==
+        LDAP_SUCCESS)
+    {
+        LDAPMessage *entry = ldap_first_entry(ld, res);
+        struct berval **vals = entry ? ldap_get_values_len(ld, entry, supportedControl) : NULL;
+        for (int i = 0; vals != NULL && vals[i] != NULL; i++)
+        {
+            std::string oid(vals[i]->bv_val, vals[i]->bv_len);
+            support.sort = support.sort || oid == LDAP_CONTROL_SORTREQUEST;
+            support.virtualListView = support.virtualListView || oid == LDAP_CONTROL_VLVREQUEST;
+        }
+        if (vals != NULL)
+        {
+            ldap_value_free_len(vals);
+        }
+    }
+    ldap_msgfree(res);
+    return support;
+}
+
+const SortSupport &SortedSearch::support()
+{
+    if (!mProbed)
+    {
+        mSupport = probeSortSupport(mLd);
+        mProbed = true;
+    }
+    return mSupport;
+}
+
+namespace
+{
+
+using Key = std::optional<std::string>; // absent when the entry lacks the attribute
+
+std::string lower(std::string value)
+{
+    for (char &c : value)
+    {
+        c = char(std::tolower((unsigned char)c));
+    }
+    return value;
+}
+
+// Entries missing a key go last in either direction, as RFC 2891 has it
+int compareKeys(const Key &a, const Key &b, bool reverse)
+{
+    if (!a || !b)
+    {
+        return int(!a) - int(!b);
+    }
+    int order = a->compare(*b);
+    return reverse ? -order : order;
+}
+
+struct Candidate
+{
+    LDAPMessage *entry;
+    std::vector<Key> keys;
+};
+
+// Reads just the first value of each key attribute, not the whole entry
+std::vector<Key> extractKeys(LDAP *ld, LDAPMessage *entry, const std::vector<SortKey> &keys)
+{
+    std::vector<Key> extracted;
+    extracted.reserve(keys.size());
+    for (const SortKey &key : keys)
+    {
+        struct berval **vals = ldap_get_values_len(ld, entry, key.attribute.c_str());
+        if (vals != NULL && vals[0] != NULL)
+        {
+            extracted.emplace_back(lower(std::string(vals[0]->bv_val, vals[0]->bv_len)));
+        }
+        else
+        {
+            extracted.emplace_back();
+        }
+        if (vals != NULL)
+        {
+            ldap_value_free_len(vals);
+        }
+    }
+    return extracted;
+}
+
+// Whether the sort response says the server ordered the entries
+bool sortedByServer(LDAP *ld, LDAPControl **responseControls)
+{
+    LDAPControl *response = ldap_control_find(LDAP_CONTROL_SORTRESPONSE, responseControls, NULL);
+    ber_int_t sortResult = LDAP_OTHER;
+    char *attribute = NULL;
+    if (response && ldap_parse_sortresponse_control(ld, response, &sortResult, &attribute) == LDAP_SUCCESS)
+    {
+        ldap_memfree(attribute);
+    }
+    return sortResult == LDAP_SUCCESS;
+}
+
+// From the result message of a search
+bool sortedByServer(LDAP *ld, LDAPMessage *res)
+{
+    LDAPMessage *result = NULL;
+    for (LDAPMessage *msg = ldap_first_message(ld, res); msg != NULL; msg = ldap_next_message(ld, msg))
+    {
+        if (ldap_msgtype(msg) == LDAP_RES_SEARCH_RESULT)
+        {
+            result = msg;
+        }
+    }
+    LDAPControl **responseControls = NULL;
+    if (result == NULL || ldap_parse_result(ld, result, NULL, NULL, NULL, NULL, &responseControls, 0) != LDAP_SUCCESS)
+    {
+        return false;
+    }
+    bool sorted = sortedByServer(ld, responseControls);
+    ldap_controls_free(responseControls);
+    return sorted;
+}
+
+} // namespace
+
+SortedWindow SortedSearch::search(const SearchRequest &request, const std::vector<SortKey> &keys,
+                                  const ListWindow &window)
+{
+    auto start = Clock::now();
+    bool serverSort = !keys.empty() && support().sort;
+    bool vlv = serverSort && mSupport.virtualListView && window.count > 0;
+
+    // The client may have to order the entries itself, so it needs the keys
+    std::vector<std::string> attributes = request.attributes;
+    for (const SortKey &key : keys)
+    {
+        bool listed = std::any_of(attributes.begin(), attributes.end(), [&key](const std::string &name) {
+            return strcasecmp(name.c_str(), key.attribute.c_str()) == 0;
+        });
+        if (!attributes.empty() && !listed)
+        {
+            attributes.push_back(key.attribute);
+        }
+    }
+    AttributeList attrs(attributes);
+
+    // Neither control is critical: a server that ignores them returns the
+    // entries as they are, and they are ordered and cut here instead. A server
+    // that declines the sort fails VLV all the same, and is asked again without
+    // either control.
+    LDAPControl *sortControl = NULL;
+    LDAPControl *vlvControl = NULL;
+    std::vector<LDAPControl *> controls;
+    if (serverSort)
+    {
+        std::vector<LDAPSortKey> sortKeys(keys.size());
+        std::vector<LDAPSortKey *> keyList;
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            sortKeys[i].attributeType = const_cast<char *>(keys[i].attribute.c_str());
+            sortKeys[i].orderingRule = NULL;
+            sortKeys[i].reverseOrder = keys[i].reverse;
+            keyList.push_back(&sortKeys[i]);
+        }
+        keyList.push_back(NULL);
+        if (ldap_create_sort_control(mLd, keyList.data(), 0, &sortControl) == LDAP_SUCCESS)
+        {
+            controls.push_back(sortControl);
+        }
+    }
+    if (vlv && sortControl)
+    {
+        LDAPVLVInfo info = {};
+        info.ldvlv_version = 1;
+        info.ldvlv_before_count = 0;
+        info.ldvlv_after_count = ber_int_t(window.count - 1);
+        struct berval from = {ber_len_t(window.from.size()), const_cast<char *>(window.from.data())};
+        if (window.from.empty())
+        {
+            info.ldvlv_offset = ber_int_t(window.offset + 1);
+            info.ldvlv_count = 0; // let the server use its own count
+        }
+        else
+        {
+            info.ldvlv_attrvalue = &from;
+        }
+        if (ldap_create_vlv_control(mLd, &info, &vlvControl) == LDAP_SUCCESS)
+        {
+            vlvControl->ldctl_iscritical = 0; // libldap makes it critical
+            controls.push_back(vlvControl);
+        }
+    }
+    controls.push_back(NULL);
+
+    // Without VLV a sorting server can still stop after the window
+    int sizeLimit = request.sizeLimit;
+    bool truncated = false;
+    if (sortControl && !vlvControl && window.count > 0 && window.from.empty())
+    {
+        int wanted = int(window.offset + window.count);
+        if (sizeLimit == LDAP_NO_LIMIT || wanted < sizeLimit)
+        {
+            sizeLimit = wanted;
+            truncated = true;
+        }
+    }
+
+    SortedWindow sorted;
+    struct timeval timeOut = {long(request.timeout.count() / 1000), long(request.timeout.count() % 1000) * 1000};
+    LDAPMessage *res = NULL;
+    auto run = [&](int limit, bool withControls) {
+        return ldap_search_ext_s(mLd, request.base.c_str(), request.scope,
+                                 request.filter.empty() ? NULL : request.filter.c_str(), attrs.get(), 0,
+                                 withControls && controls.size() > 1 ? controls.data() : NULL, NULL, &timeOut, limit,
+                                 &res);
+    };
+    int rc = run(sizeLimit, true);
+    // Without the sort a VLV window is an arbitrary slice, when the server
+    // sends one at all rather than failing the search
+    if (vlvControl && (rc == LDAP_SORT_CONTROL_MISSING || rc == LDAP_VLV_ERROR ||
+                       rc == LDAP_UNAVAILABLE_CRITICAL_EXTENSION || (rc == LDAP_SUCCESS && !sortedByServer(mLd, res))))
+    {
+        ldap_msgfree(res);
+        res = NULL;
+        rc = run(request.sizeLimit, false);
+    }
+    // The sort control is not critical, so a server may decline it, as for an
+    // attribute without an ordering rule; the entries it stopped after are then
+    // any of them, and all are fetched again to be ordered here
+    if (truncated && rc == LDAP_SIZELIMIT_EXCEEDED && !sortedByServer(mLd, res))
+    {
+        ldap_msgfree(res);
+        res = NULL;
+        truncated = false;
+        rc = run(request.sizeLimit, true);
+    }
+    for (size_t i = 0; i + 1 < controls.size(); ++i)
+    {
+        ldap_control_free(controls[i]);
+    }
+    sorted.result.rc = truncated && rc == LDAP_SIZELIMIT_EXCEEDED ? LDAP_SUCCESS : rc;
+
+    bool windowed = false;
+    std::vector<Candidate> candidates;
+    for (LDAPMessage *msg = ldap_first_message(mLd, res); msg != NULL; msg = ldap_next_message(mLd, msg))
+    {
+        switch (ldap_msgtype(msg))
+        {
+        case LDAP_RES_SEARCH_ENTRY:
+            candidates.push_back({msg, {}});
+            break;
+        case LDAP_RES_SEARCH_REFERENCE:
+            decodeReference(mLd, msg, sorted.result);
+            break;
+        case LDAP_RES_SEARCH_RESULT:
+        {
+            LDAPControl **responseControls = NULL;
+            char *errorMessage = NULL;
+            ldap_parse_result(mLd, msg, NULL, NULL, &errorMessage, NULL, &responseControls, 0);
+            if (errorMessage)
+            {
+                sorted.result.error = errorMessage;
+                ldap_memfree(errorMessage);
+            }
+
+            sorted.serverSorted = sortedByServer(mLd, responseControls);
+
+            LDAPControl *response = ldap_control_find(LDAP_CONTROL_VLVRESPONSE, responseControls, NULL);
+            ber_int_t target = 0;
+            ber_int_t count = 0;
+            ber_int_t vlvResult = LDAP_OTHER;
+            struct berval *context = NULL;
+            if (response && sorted.serverSorted &&
+                ldap_parse_vlvresponse_control(mLd, response, &target, &count, &context, &vlvResult) == LDAP_SUCCESS)
+            {
+                windowed = vlvResult == LDAP_SUCCESS;
+                sorted.offset = target > 0 ? size_t(target - 1) : 0;
+                sorted.total = size_t(std::max<ber_int_t>(count, 0));
+                ber_bvfree(context);
+            }
+            ldap_controls_free(responseControls);
+            break;
+        }
+        }
+    }
+
+    if (sorted.result.ok() && !windowed)
+    {
+        // Keys are needed to order the entries, or to find where "from" starts
+        bool needKeys = !sorted.serverSorted || !window.from.empty();
+        for (Candidate &candidate : candidates)
+        {
+            candidate.keys = needKeys ? extractKeys(mLd, candidate.entry, keys) : std::vector<Key>();
+        }
+
+        size_t skipped = 0;
+        if (!window.from.empty() && !keys.empty())
+        {
+            // remove_if is stable, so an order from the server survives
+            Key from = lower(window.from);
+            auto end = std::remove_if(candidates.begin(), candidates.end(), [&](const Candidate &candidate) {
+                return compareKeys(candidate.keys[0], from, keys[0].reverse) < 0;
+            });
+            skipped = size_t(candidates.end() - end);
+            candidates.erase(end, candidates.end());
+        }
+
+        size_t matched = skipped + candidates.size();
+        size_t begin = window.from.empty() ? std::min(window.offset, candidates.size()) : 0;
+        size_t end = window.count > 0 ? std::min(candidates.size(), begin + window.count) : candidates.size();
+        if (!sorted.serverSorted && !keys.empty())
+        {
+            // Only the first end entries need to be in order
+            std::partial_sort(candidates.begin(), candidates.begin() + end, candidates.end(),
+                              [&keys](const Candidate &a, const Candidate &b) {
+                                  for (size_t i = 0; i < keys.size(); ++i)
+                                  {
+                                      int order = compareKeys(a.keys[i], b.keys[i], keys[i].reverse);
+                                      if (order != 0)
+                                      {
+                                          return order < 0;
+                                      }
+                                  }
+                                  return false;
+                              });
+        }
+        candidates.erase(candidates.begin() + end, candidates.end());
+        candidates.erase(candidates.begin(), candidates.begin() + begin);
+        sorted.offset = window.from.empty() ? begin : skipped;
+        sorted.total = truncated ? 0 : matched;
+    }
+
+    for (const Candidate &candidate : candidates)
+    {
+        sorted.result.entries.push_back(decodeEntry(mLd, candidate.entry));
+    }
+    ldap_msgfree(res);
+    sorted.result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    return sorted;
+}
+
+} // namespace ldapclient
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "search.h"
+
+namespace ldapclient
+{
+
+struct SortKey
+{
+    std::string attribute;
+    bool reverse = false;
+};
+
+// Keys in the form ldap_create_sort_keylist takes: "sn -givenName"
+std::vector<SortKey> parseSortKeys(const std::string &keys);
+
+// The slice of the ordered list a scrolling view shows
+struct ListWindow
+{
+    size_t offset = 0; // position of the first entry, from 0
+    size_t count = 0;  // 0 for everything after offset
+    // When set, the window starts at the first entry whose first key sorts at
+    // or after this value instead, as when typing ahead in a directory list
+    std::string from;
+};
+
+struct SortedWindow
+{
+    SearchResult result; // entries hold the window in order, plus their sort attributes
+    size_t offset = 0;   // position of the first entry in the whole list
+    size_t total = 0;    // size of the whole list, 0 when the server does not say
+    bool serverSorted = false;
+};
+
+struct SortSupport
+{
+    bool sort = false;            // RFC 2891
+    bool virtualListView = false; // draft-ietf-ldapext-ldapv3-vlv
+};
+
+// Reads the root DSE's supportedControl
+SortSupport probeSortSupport(LDAP *ld);
+
+// Ordered, windowed searches. With server-side sorting the directory orders
+// the matches, and with VLV it sends only the window; a sorting server without
+// VLV is asked for offset + count entries. Otherwise the matches are fetched
+// and only their sort keys are extracted: a partial sort over the keys finds
+// the window, and only the window's entries are decoded.
+//
+// The client orders values like caseIgnoreOrderingMatch, so a fallback lists
+// entries the way a sorting server would.
+class SortedSearch
+{
+  public:
+    // Probes the server on the first search
+    explicit SortedSearch(LDAP *ld) : mLd(ld) {}
+    SortedSearch(LDAP *ld, SortSupport support) : mLd(ld), mSupport(support), mProbed(true) {}
+
+    SortedWindow search(const SearchRequest &request, const std::vector<SortKey> &keys,
+                        const ListWindow &window = ListWindow());
+
+    const SortSupport &support();
+
+  private:
+    LDAP *mLd;
+    SortSupport mSupport;
+    bool mProbed = false;
+};
+
+} // namespace ldapclient
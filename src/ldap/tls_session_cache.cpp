@@ -0,0 +1,258 @@
+#include "tls_session_cache.h"
+#include <ctime>
+#include <dlfcn.h>
+
+struct ssl_st; // OpenSSL's SSL
+
+namespace ldapclient
+{
+
+using Clock = std::chrono::steady_clock;
+
+namespace
+{
+
+using SSL = ssl_st;
+using SSL_SESSION = ssl_session_st;
+
+// The SSL handed out by libldap belongs to the libssl libldap was linked with,
+// not to the OpenSSL built into this program, so every call on it or on its
+// sessions goes through that library: looked up in libldap's own dependencies.
+struct LibSsl
+{
+    int (*SSL_set_session)(SSL *, SSL_SESSION *) = nullptr;
+    SSL_SESSION *(*SSL_get1_session)(SSL *) = nullptr;
+    int (*SSL_session_reused)(const SSL *) = nullptr;
+    int (*SSL_SESSION_is_resumable)(const SSL_SESSION *) = nullptr;
+    long (*SSL_SESSION_get_time)(const SSL_SESSION *) = nullptr;
+    long (*SSL_SESSION_get_timeout)(const SSL_SESSION *) = nullptr;
+    void (*SSL_SESSION_free)(SSL_SESSION *) = nullptr;
+    bool loaded = false;
+
+    LibSsl()
+    {
+        Dl_info info;
+        if (!dladdr(reinterpret_cast<void *>(&ldap_get_option), &info) || !info.dli_fname)
+        {
+            return;
+        }
+        void *libldap = dlopen(info.dli_fname, RTLD_LAZY | RTLD_NOLOAD);
+        if (!libldap)
+        {
+            return;
+        }
+        loaded = resolve(libldap, "SSL_set_session", SSL_set_session) &&
+                 resolve(libldap, "SSL_get1_session", SSL_get1_session) &&
+                 resolve(libldap, "SSL_session_reused", SSL_session_reused) &&
+                 resolve(libldap, "SSL_SESSION_is_resumable", SSL_SESSION_is_resumable) &&
+                 resolve(libldap, "SSL_SESSION_get_time", SSL_SESSION_get_time) &&
+                 resolve(libldap, "SSL_SESSION_get_timeout", SSL_SESSION_get_timeout) &&
+                 resolve(libldap, "SSL_SESSION_free", SSL_SESSION_free);
+        dlclose(libldap); // still loaded: this program links it
+    }
+
+    template <typename F> static bool resolve(void *library, const char *name, F &function)
+    {
+        function = reinterpret_cast<F>(dlsym(library, name));
+        return function != nullptr;
+    }
+};
+
+const LibSsl &libSsl()
+{
+    static const LibSsl ssl;
+    return ssl;
+}
+
+} // namespace
+
+TlsSessionCache &TlsSessionCache::global()
+{
+    static TlsSessionCache cache;
+    return cache;
+}
+
+TlsSessionCache::TlsSessionCache(std::chrono::milliseconds leaderTimeout) : mLeaderTimeout(leaderTimeout)
+{
+}
+
+TlsSessionCache::~TlsSessionCache()
+{
+    for (auto &server : mServers)
+    {
+        if (server.second.session)
+        {
+            libSsl().SSL_SESSION_free(server.second.session);
+        }
+    }
+}
+
+bool TlsSessionCache::openSslBackend()
+{
+    char *package = nullptr;
+    if (ldap_get_option(NULL, LDAP_OPT_X_TLS_PACKAGE, &package) != LDAP_OPT_SUCCESS || !package)
+    {
+        return false;
+    }
+    bool openSsl = std::string(package) == "OpenSSL";
+    ldap_memfree(package);
+    return openSsl && libSsl().loaded;
+}
+
+// libldap calls this with the new SSL before the handshake
+int TlsSessionCache::onConnect(LDAP *, void *ssl, void *, void *arg)
+{
+    Handshake *handshake = static_cast<Handshake *>(arg);
+    TlsSessionCache &cache = handshake->mCache;
+    std::lock_guard<std::mutex> lock(cache.mMutex);
+    SSL_SESSION *session = cache.mServers[handshake->mServer].session;
+    if (session)
+    {
+        libSsl().SSL_set_session(static_cast<SSL *>(ssl), session);
+    }
+    return 0;
+}
+
+TlsSessionCache::Handshake::Handshake(TlsSessionCache &cache, LDAP *ld, const std::string &server)
+    : mCache(cache), mLd(ld), mServer(server), mStart(Clock::now())
+{
+    if (!mCache.mResumes)
+    {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mCache.mMutex);
+    const LibSsl &ssl = libSsl();
+    Server &known = mCache.mServers[mServer];
+    if (known.session && ssl.SSL_SESSION_get_time(known.session) + ssl.SSL_SESSION_get_timeout(known.session) <= time(nullptr))
+    {
+        ssl.SSL_SESSION_free(known.session);
+        known.session = nullptr;
+    }
+    if (!known.session && known.handshaking)
+    {
+        ++mCache.mStats.waits;
+        mCache.mSettled.wait_for(lock, mCache.mLeaderTimeout, [&known] { return known.session || !known.handshaking; });
+        mStart = Clock::now();
+    }
+    if (!known.session && !known.handshaking)
+    {
+        known.handshaking = true;
+        mLeading = true;
+    }
+    lock.unlock();
+
+    ldap_set_option(mLd, LDAP_OPT_X_TLS_CONNECT_CB, reinterpret_cast<void *>(&TlsSessionCache::onConnect));
+    ldap_set_option(mLd, LDAP_OPT_X_TLS_CONNECT_ARG, this);
+}
+
+TlsSessionCache::Handshake::~Handshake()
+{
+    if (mDone)
+    {
+        return;
+    }
+    if (mCache.mResumes)
+    {
+        // The handle may be retried or reused after a failed connect
+        ldap_set_option(mLd, LDAP_OPT_X_TLS_CONNECT_CB, NULL);
+        ldap_set_option(mLd, LDAP_OPT_X_TLS_CONNECT_ARG, NULL);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mCache.mMutex);
+        ++mCache.mStats.handshakes;
+        ++mCache.mStats.failures;
+        if (mLeading)
+        {
+            mCache.mServers[mServer].handshaking = false;
+        }
+    }
+    if (mLeading)
+    {
+        mCache.mSettled.notify_all(); // one of the waiters leads instead
+    }
+}
+
+void TlsSessionCache::Handshake::connected()
+{
+    mElapsed = Clock::now() - mStart;
+}
+
+void TlsSessionCache::Handshake::finished()
+{
+    mDone = true;
+    if (mElapsed == Clock::duration::zero())
+    {
+        connected();
+    }
+
+    const LibSsl &lib = libSsl();
+    SSL *ssl = nullptr;
+    SSL_SESSION *session = nullptr;
+    bool resumed = false;
+    if (mCache.mResumes && ldap_get_option(mLd, LDAP_OPT_X_TLS_SSL_CTX, &ssl) == LDAP_OPT_SUCCESS && ssl)
+    {
+        resumed = lib.SSL_session_reused(ssl) == 1;
+        session = lib.SSL_get1_session(ssl);
+        if (session && !lib.SSL_SESSION_is_resumable(session))
+        {
+            lib.SSL_SESSION_free(session);
+            session = nullptr;
+        }
+    }
+    if (mCache.mResumes)
+    {
+        // this outlives the handle's connect
+        ldap_set_option(mLd, LDAP_OPT_X_TLS_CONNECT_CB, NULL);
+        ldap_set_option(mLd, LDAP_OPT_X_TLS_CONNECT_ARG, NULL);
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(mElapsed);
+    {
+        std::lock_guard<std::mutex> lock(mCache.mMutex);
+        TlsStats &stats = mCache.mStats;
+        ++stats.handshakes;
+        stats.resumed += resumed;
+        (resumed ? stats.resumedTime : stats.fullTime) += elapsed;
+        if (mCache.mResumes)
+        {
+            // The newest session: a server may refuse to resume one twice
+            Server &known = mCache.mServers[mServer];
+            if (session)
+            {
+                if (known.session)
+                {
+                    lib.SSL_SESSION_free(known.session);
+                }
+                known.session = session;
+            }
+            if (mLeading)
+            {
+                known.handshaking = false;
+            }
+        }
+    }
+    if (mLeading)
+    {
+        mCache.mSettled.notify_all();
+    }
+}
+
+size_t TlsSessionCache::size() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    size_t sessions = 0;
+    for (const auto &server : mServers)
+    {
+        sessions += server.second.session != nullptr;
+    }
+    return sessions;
+}
+
+TlsStats TlsSessionCache::stats() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mStats;
+}
+
+} // namespace ldapclient
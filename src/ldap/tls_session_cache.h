@@ -0,0 +1,98 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <ldap.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+struct ssl_session_st; // OpenSSL's SSL_SESSION
+
+namespace ldapclient
+{
+
+struct TlsStats
+{
+    uint64_t handshakes = 0; // ldaps connections attempted
+    uint64_t resumed = 0;    // of those, the ones that resumed a cached session
+    uint64_t failures = 0;
+    uint64_t waits = 0;                       // connects that waited for another's full handshake
+    std::chrono::microseconds fullTime{0};    // connecting with a full handshake, TCP included
+    std::chrono::microseconds resumedTime{0}; // connecting with a resumed one
+};
+
+// Keeps the latest TLS session of every ldaps server, so that a new connection
+// resumes it instead of paying for a full handshake: one round trip less, and
+// no certificate chain or key exchange to compute on either side. After a
+// failover every connection moves to a server with nothing cached; the first
+// one to reach it does the full handshake while the others wait for its
+// session rather than all doing their own at once.
+//
+// bindServer() goes through the process-wide global() for every ldaps URL.
+// Resumption needs libldap built against OpenSSL, and calls into libldap's own
+// libssl rather than the one this program links; with another TLS library the
+// handshakes are only counted.
+class TlsSessionCache
+{
+  public:
+    static TlsSessionCache &global();
+
+    // leaderTimeout bounds how long a connect waits for another's full
+    // handshake to the same server before doing its own
+    explicit TlsSessionCache(std::chrono::milliseconds leaderTimeout = std::chrono::milliseconds(2000));
+    ~TlsSessionCache();
+    TlsSessionCache(const TlsSessionCache &) = delete;
+    TlsSessionCache &operator=(const TlsSessionCache &) = delete;
+
+    // One connect of ld to server (an ldaps URL). Construct it before
+    // ldap_connect(), call connected() once that succeeds and finished() after
+    // the first response, which brings a TLS 1.3 session ticket along. The
+    // destructor counts the connect as failed unless finished() was called.
+    class Handshake
+    {
+      public:
+        Handshake(TlsSessionCache &cache, LDAP *ld, const std::string &server);
+        ~Handshake();
+        Handshake(const Handshake &) = delete;
+        Handshake &operator=(const Handshake &) = delete;
+
+        void connected();
+        // Keeps the session for the next connection
+        void finished();
+
+      private:
+        friend class TlsSessionCache;
+
+        TlsSessionCache &mCache;
+        LDAP *mLd;
+        std::string mServer;
+        bool mLeading = false; // this full handshake is the one others wait for
+        bool mDone = false;
+        std::chrono::steady_clock::time_point mStart;
+        std::chrono::steady_clock::duration mElapsed{0};
+    };
+
+    bool resumes() const { return mResumes; }
+    size_t size() const; // servers with a session
+    TlsStats stats() const;
+
+  private:
+    struct Server
+    {
+        ssl_session_st *session = nullptr;
+        bool handshaking = false; // a full handshake is under way
+    };
+
+    static int onConnect(LDAP *ld, void *ssl, void *ctx, void *arg);
+    static bool openSslBackend();
+
+    const std::chrono::milliseconds mLeaderTimeout;
+    const bool mResumes = openSslBackend();
+    mutable std::mutex mMutex;
+    std::condition_variable mSettled;
+    std::unordered_map<std::string, Server> mServers;
+    TlsStats mStats;
+};
+
+} // namespace ldapclient
@@ -1,9 +1,13 @@
+#include "config/config_store.h"
+#include "ldap/async_client.h"
+#include "ldap/compact_result.h"
+#include "ldap/sorted_search.h"
+#include "ldap/tls_session_cache.h"
 #include <future>
 #include <gtest/gtest.h>
 #include <ldap.h>
 #include <string>
 #include <thread>
-#include <yaml-cpp/yaml.h>
 
 // http://techsmruti.com/online-ldap-test-server/
 // https://github.com/inspircd/inspircd/blob/master/src/modules/extra/m_ldap.cpp
@@ -21,53 +25,39 @@
 #define BINDDN "cn=read-only-admin,dc=example,dc=com"
 #define PASSWORD "password"
 
-static int search_s(LDAP *ld, const char *searchBase, int scope, const char *filter, char **attrs)
+/* search is made once per connection, so the root DSE is probed for sorting once */
+static int search_s(ldapclient::SortedSearch &search, const char *searchBase, int scope, const char *filter,
+                    char **attrs)
 {
-    LDAPMessage *searchResult;
-    struct timeval timeOut = {10, 0}; /* 10 second connection/search timeout */
+    ldapclient::SearchRequest request;
+    request.base = searchBase;
+    request.scope = scope;
+    request.filter = filter;
+    for (char **attr = attrs; attr != NULL && *attr != NULL; ++attr)
+    {
+        request.attributes.push_back(*attr);
+    }
 
     auto start = std::chrono::high_resolution_clock::now();
 
-    int rc = ldap_search_ext_s(ld,             /* LDAP session handle */
-                               searchBase,     /* container to search */
-                               scope,          /* scope to search */
-                               filter,         /* filter */
-                               attrs,          /* attrs, return all attributes */
-                               0,              /* attrsonly, return attributes and values */
-                               NULL,           /* server controls */
-                               NULL,           /* client controls */
-                               &timeOut,       /* search timeout */
-                               LDAP_NO_LIMIT,  /* sizelimit, no size limit */
-                               &searchResult); /* returned results */
-
+    /* Sorted by surname on the server when it can, by a partial sort on the client otherwise */
+    ldapclient::SortedWindow sorted = search.search(request, ldapclient::parseSortKeys("sn"));
+    int rc = sorted.result.rc;
     if (rc != LDAP_SUCCESS && rc != LDAP_SIZELIMIT_EXCEEDED)
     {
-        ldap_msgfree(searchResult);
-        ldap_unbind_s(ld);
-        return rc;
+        return rc; /* the caller owns ld and unbinds it */
     }
 
     auto end = std::chrono::high_resolution_clock::now();
     auto delta = std::chrono::duration_cast<std::chrono::duration<double>>(end - start);
-    std::cout << "seconds = " << delta.count() << '\n';
+    std::cout << "seconds = " << delta.count() << (sorted.serverSorted ? " (sorted by the server)" : "") << '\n';
 
-    const char *sortAttribute = "sn";
-    char *dn;
-    ldap_sort_entries(ld, &searchResult, sortAttribute, strcmp);
-
-    /* Go through the search results by checking entries */
-    for (LDAPMessage *entry = ldap_first_entry(ld, searchResult); entry != NULL; entry = ldap_next_entry(ld, entry))
+    for (const auto &entry : sorted.result.entries)
     {
-        if ((dn = ldap_get_dn(ld, entry)) != NULL)
-        {
-            printf("\tdn: %s\n", dn);
-            ldap_memfree(dn);
-        }
+        printf("\tdn: %s\n", entry.dn.c_str());
     }
 
-    int entryCount = ldap_count_entries(ld, searchResult);
-    printf("\n  Search completed successfully.\n  Entries  returned: %d\n", entryCount);
-    ldap_msgfree(searchResult);
+    printf("\n  Search completed successfully.\n  Entries  returned: %zu\n", sorted.result.entries.size());
     return LDAP_SUCCESS;
 }
 
@@ -97,7 +87,8 @@ TEST(ldap, synchronous)
     }
 
     printf("bind successful\n");
-    rc = search_s(ld, BASEDN, SCOPE, FILTER, NULL);
+    ldapclient::SortedSearch search(ld);
+    rc = search_s(search, BASEDN, SCOPE, FILTER, NULL);
     if (rc != LDAP_SUCCESS)
     {
         ldap_unbind_ext_s(ld, NULL, NULL);
@@ -115,15 +106,15 @@ static int result(LDAP *ld, int msgid)
         the entries one at a time, as they come in. If the next
         entry that you retrieve is NULL, there are no more entries. */
     bool finished = false;
-    struct timeval zerotime = {0, 0};
+    /* Block in ldap_result until something arrives rather than spinning on a zero timeout */
+    struct timeval waittime = {10, 0};
     int num_entries = 0;
     int num_refs = 0;
     while (!finished)
     {
         LDAPMessage *res = NULL;
-        BerElement *ber = NULL;
 
-        int rc = ldap_result(ld, msgid, LDAP_MSG_ONE, &zerotime, &res);
+        int rc = ldap_result(ld, msgid, LDAP_MSG_ONE, &waittime, &res);
         /* The server can return three types of results back to the client,
            and the return value of ldap_result() indicates the result type:
            LDAP_RES_SEARCH_ENTRY identifies an entry found by the search,
@@ -141,12 +132,11 @@ static int result(LDAP *ld, int msgid)
             return 1;
 
         case 0:
-            /* The timeout period specified by zerotime was exceeded.
-               This means that the server has still not yet sent the
-               results of the search operation back to your client.
-               Break out of this switch statement, and continue calling
-               ldap_result() to poll for results. */
-            break;
+            /* Nothing arrived within waittime. The server has stopped
+               answering, so give up on the operation. */
+            fprintf(stderr, "ldap_result: timed out\n");
+            ldap_abandon_ext(ld, msgid, NULL, NULL);
+            return 1;
 
         case LDAP_RES_SEARCH_ENTRY:
         {
@@ -154,40 +144,24 @@ static int result(LDAP *ld, int msgid)
              * attributes, and values of the entry. */
             /* Keep track of the number of entries found. */
             num_entries++;
-            char *dn = NULL;
-
-            /* Get and print the DN of the entry. */
-            if ((dn = ldap_get_dn(ld, res)) != NULL)
-            {
-                printf("dn: %s\n", dn);
-                ldap_memfree(dn);
-            }
 
-            /* Iterate through each attribute in the entry. */
-            for (char *a = ldap_first_attribute(ld, res, &ber); a != NULL; a = ldap_next_attribute(ld, res, ber))
+            /* Decode in place; the views stay valid while entry owns res. */
+            ldapclient::CompactResult entry(ld, res);
+            for (size_t e = 0; e < entry.size(); ++e)
             {
-                /* Get and print all values for each attribute. */
-                char **vals = NULL;
-                if ((vals = ldap_get_values(ld, res, a)) != NULL)
+                std::string_view dn = entry[e].dn();
+                printf("dn: %.*s\n", int(dn.size()), dn.data());
+                for (size_t a = 0; a < entry[e].size(); ++a)
                 {
-                    for (int i = 0; vals[i] != NULL; i++)
+                    std::string_view name = entry[e].name(a);
+                    for (std::string_view value : entry[e].values(a))
                     {
-                        printf("%s: %s\n", a, vals[i]);
+                        printf("%.*s: %.*s\n", int(name.size()), name.data(), int(value.size()), value.data());
                     }
-
-                    ldap_value_free(vals);
                 }
-
-                ldap_memfree(a);
-            }
-
-            if (ber != NULL)
-            {
-                ber_free(ber, 0);
             }
 
             printf("\n");
-            ldap_msgfree(res);
             break;
         }
 
@@ -345,7 +319,8 @@ TEST(ldap, annonymous)
     }
 
     printf("bind successful\n");
-    rc = search_s(ld, "dc=andrew,dc=cmu,dc=edu", SCOPE, "(cmuSpamFlag=FALSE)", NULL);
+    ldapclient::SortedSearch search(ld);
+    rc = search_s(search, "dc=andrew,dc=cmu,dc=edu", SCOPE, "(cmuSpamFlag=FALSE)", NULL);
     if (rc != LDAP_SUCCESS)
     {
         ldap_unbind_ext_s(ld, NULL, NULL);
@@ -359,112 +334,41 @@ TEST(ldap, annonymous)
 // https://www.ibm.com/support/knowledgecenter/en/SSLTBW_2.1.0/com.ibm.zos.v2r1.glpa100/createpagec.htm
 // ldap_create_page_control
 
-struct LdapConfiguration
-{
-    std::string mPrimaryServer;
-    std::string mSearchBase;
-    std::string mUsername;
-    std::string mPassword;
-    std::string mFilter;
-    std::vector<std::string> mAttributes;
-    bool mUseSSL;
-};
-
-namespace YAML
-{
-template <> struct convert<LdapConfiguration>
-{
-    static bool decode(const Node &node, LdapConfiguration &rhs)
-    {
-        rhs.mPrimaryServer = node["PrimaryServerName"].as<std::string>();
-        rhs.mSearchBase = node["SearchBase"].as<std::string>();
-        rhs.mUsername = node["Username"].as<std::string>();
-        rhs.mPassword = node["Password"].as<std::string>();
-        rhs.mFilter = node["Filter"].as<std::string>();
-        rhs.mUseSSL = node["UseSSL"].as<bool>();
-        rhs.mAttributes = node["Attributes"].as<std::vector<std::string>>();
-        return true;
-    }
-};
-} // namespace YAML
-
-int findNode(const YAML::Node &doc)
+// The entry of hunter.yaml named after the running test
+static std::optional<config::ServiceConfig> findConfig()
 {
     std::string case_name = ::testing::UnitTest::GetInstance()->current_test_info()->test_case_name();
     std::string test_name = case_name + "." + ::testing::UnitTest::GetInstance()->current_test_info()->name();
-
-    for (unsigned i = 0; i < doc.size(); i++)
-    {
-        if (doc[i]["id"].as<std::string>() == test_name)
-        {
-            return i;
-        }
-    }
-
-    return -1;
-}
-
-char **getAttributes(const std::vector<std::string> &v)
-{
-    char **attrs = (char **)malloc((v.size() + 1) * sizeof(char *)); // the last slot for NULL
-    int index = 0;
-    for (size_t i = 0; i < v.size(); ++i)
-    {
-        size_t len = v[i].length();
-        attrs[i] = (char *)malloc(len + 1);
-        strncpy(attrs[i], v[i].c_str(), len);
-        attrs[i][len] = '\0';
-    }
-    attrs[v.size()] = NULL;
-    return attrs;
+    return config::ConfigStore::open("./data/hunter.yaml")->find(test_name);
 }
 
 TEST(ldap, config)
 {
-    YAML::Node doc = YAML::LoadFile("./data/hunter.yaml");
-    int index = findNode(doc);
-    if (-1 == index)
+    std::optional<config::ServiceConfig> service = findConfig();
+    if (!service)
     {
         FAIL() << "config for the test is not found";
     }
-    LdapConfiguration config = doc[index].as<LdapConfiguration>();
+    LdapConfiguration config = service->ldap;
 
-    int version = LDAP_VERSION3;
-    struct timeval timeOut = {10, 0}; /* 10 second connection timeout */
-    ldap_set_option(NULL, LDAP_OPT_PROTOCOL_VERSION, &version);
-    ldap_set_option(NULL, LDAP_OPT_NETWORK_TIMEOUT, &timeOut);
-
-    std::string url;
-    if (config.mUseSSL)
+    // bindServer resumes the TLS session of an earlier ldaps connection
+    std::unique_ptr<ldapclient::LdapConnection> connection;
+    try
     {
-        url = "ldaps://" + config.mPrimaryServer;
+        connection.reset(new ldapclient::LdapConnection(config));
     }
-    else
-    {
-        url = "ldap://" + config.mPrimaryServer;
-    }
-
-    LDAP *ld;
-    ldap_initialize(&ld, url.c_str());
-
-    const char *binddn = config.mUsername.c_str();
-    struct berval cred;
-    char *password = const_cast<char *>(config.mPassword.c_str());
-    cred.bv_val = password;
-    cred.bv_len = config.mPassword.length();
-
-    int rc = ldap_sasl_bind_s(ld, binddn, LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL);
-    if (rc != LDAP_SUCCESS)
+    catch (const ldapclient::LdapError &e)
     {
-        printf("ldap_sasl_bind_s: %s\n", ldap_err2string(rc));
-        ldap_unbind_ext_s(ld, NULL, NULL);
+        printf("%s\n", e.what());
         return;
     }
+    LDAP *ld = connection->get();
 
     printf("bind successful\n");
-    char **attrs = getAttributes(config.mAttributes);
+    ldapclient::AttributeList attrs(config.mAttributes);
 
-    rc = search_s(ld, config.mSearchBase.c_str(), LDAP_SCOPE_SUBTREE, config.mFilter.c_str(), attrs);
+    ldapclient::SortedSearch search(ld);
+    search_s(search, config.mSearchBase.c_str(), LDAP_SCOPE_SUBTREE, config.mFilter.c_str(), attrs.get());
 
     // int msgid;
     // rc = search(ld, config.mSearchBase.c_str(), LDAP_SCOPE_SUBTREE, config.mFilter.c_str(), attrs,
@@ -472,61 +376,68 @@ TEST(ldap, config)
     // // https://eli.thegreenplace.net/2016/the-promises-and-challenges-of-stdasync-task-based-parallelism-in-c11/
     // std::future<int> res = std::async(std::launch::async, result, ld, msgid);
     // ASSERT_EQ(0, res.get());
-
-    ldap_unbind_ext_s(ld, NULL, NULL);
 }
 
 TEST(ldap, performance)
 {
-    YAML::Node doc = YAML::LoadFile("./data/hunter.yaml");
-    int index = findNode(doc);
-    if (-1 == index)
+    std::optional<config::ServiceConfig> service = findConfig();
+    if (!service)
     {
         FAIL() << "config for the test is not found";
     }
-    LdapConfiguration config = doc[index].as<LdapConfiguration>();
-    std::vector<std::string> filters = doc[index]["Filters"].as<std::vector<std::string>>();
-
-    int version = LDAP_VERSION3;
-    struct timeval timeOut = {10, 0}; /* 10 second connection timeout */
-    ldap_set_option(NULL, LDAP_OPT_PROTOCOL_VERSION, &version);
-    ldap_set_option(NULL, LDAP_OPT_NETWORK_TIMEOUT, &timeOut);
+    LdapConfiguration config = service->ldap;
+    std::vector<std::string> filters = service->filters;
 
-    std::string url;
-    if (config.mUseSSL)
+    // bindServer resumes the TLS session of an earlier ldaps connection
+    std::unique_ptr<ldapclient::LdapConnection> connection;
+    try
     {
-        url = "ldaps://" + config.mPrimaryServer;
+        connection.reset(new ldapclient::LdapConnection(config));
     }
-    else
+    catch (const ldapclient::LdapError &e)
     {
-        url = "ldap://" + config.mPrimaryServer;
+        printf("%s\n", e.what());
+        return;
     }
+    LDAP *ld = connection->get();
 
-    LDAP *ld;
-    ldap_initialize(&ld, url.c_str());
-
-    const char *binddn = config.mUsername.c_str();
-    struct berval cred;
-    char *password = const_cast<char *>(config.mPassword.c_str());
-    cred.bv_val = password;
-    cred.bv_len = config.mPassword.length();
+    printf("bind successful\n");
+    ldapclient::AttributeList attrs(config.mAttributes);
+    ldapclient::SortedSearch search(ld);
+    search.support(); // probed before the clock starts, as the pipelined client does not probe
 
-    int rc = ldap_sasl_bind_s(ld, binddn, LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL);
-    if (rc != LDAP_SUCCESS)
+    auto start = std::chrono::high_resolution_clock::now();
+    for (const auto &filter : filters)
     {
-        printf("ldap_sasl_bind_s: %s\n", ldap_err2string(rc));
-        ldap_unbind_ext_s(ld, NULL, NULL);
-        return;
+        std::cout << filter << '\n';
+        search_s(search, config.mSearchBase.c_str(), LDAP_SCOPE_SUBTREE, filter.c_str(), attrs.get());
     }
+    auto delta = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start);
+    std::cout << "serial: " << delta.count() << " seconds\n";
 
-    printf("bind successful\n");
-    char **attrs = getAttributes(config.mAttributes);
+    connection.reset();
 
+    // The same filters pipelined on one connection
+    std::vector<ldapclient::SearchRequest> requests;
     for (const auto &filter : filters)
     {
-        std::cout << filter << '\n';
-        search_s(ld, config.mSearchBase.c_str(), LDAP_SCOPE_SUBTREE, filter.c_str(), attrs);
+        ldapclient::SearchRequest request;
+        request.base = config.mSearchBase;
+        request.filter = filter;
+        request.attributes = config.mAttributes;
+        requests.push_back(request);
     }
 
-    ldap_unbind_ext_s(ld, NULL, NULL);
+    ldapclient::AsyncLdapClient client(config);
+    start = std::chrono::high_resolution_clock::now();
+    for (const auto &result : client.searchAll(requests))
+    {
+        EXPECT_TRUE(result.ok()) << ldap_err2string(result.rc);
+    }
+    delta = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start);
+    std::cout << "pipelined: " << delta.count() << " seconds\n";
+
+    ldapclient::TlsStats tls = ldapclient::TlsSessionCache::global().stats();
+    std::cout << "tls: " << tls.handshakes << " handshakes, " << tls.resumed << " resumed, " << tls.fullTime.count()
+              << " us full, " << tls.resumedTime.count() << " us resumed\n";
 }
@@ -0,0 +1,192 @@
+#include "avatar_job.h"
+#include "../avatar.h"
+#include "../ldap/paged_search.h"
+#include "photo_resolver.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace photo
+{
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+struct Item
+{
+    std::shared_ptr<const ldapclient::CompactResult> page;
+    size_t index;
+};
+
+// The entries waiting for a worker, and how many pages are held for them
+class Pipeline
+{
+  public:
+    explicit Pipeline(size_t maxPages) : mMaxPages(std::max<size_t>(1, maxPages)) {}
+
+    void waitForRoom()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mRoom.wait(lock, [this] { return mPages < mMaxPages; });
+    }
+
+    // The page comes back through released() once its last entry is done
+    std::shared_ptr<const ldapclient::CompactResult> hold(std::unique_ptr<ldapclient::CompactResult> page)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mPeak = std::max(mPeak, ++mPages);
+        }
+        return std::shared_ptr<const ldapclient::CompactResult>(page.release(),
+                                                                [this](const ldapclient::CompactResult *done) {
+                                                                    delete done;
+                                                                    released();
+                                                                });
+    }
+
+    void add(const std::shared_ptr<const ldapclient::CompactResult> &page)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            for (size_t i = 0; i < page->size(); ++i)
+            {
+                mItems.push_back(Item{page, i});
+            }
+        }
+        mWork.notify_all();
+    }
+
+    // False once finish() was called and nothing is left
+    bool take(Item &item)
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mWork.wait(lock, [this] { return !mItems.empty() || mFinished; });
+        if (mItems.empty())
+        {
+            return false;
+        }
+        item = std::move(mItems.front());
+        mItems.pop_front();
+        return true;
+    }
+
+    void finish()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mFinished = true;
+        }
+        mWork.notify_all();
+    }
+
+    size_t peak() const
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mPeak;
+    }
+
+  private:
+    void released()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            --mPages;
+        }
+        mRoom.notify_one();
+    }
+
+    const size_t mMaxPages;
+    mutable std::mutex mMutex;
+    std::condition_variable mWork;
+    std::condition_variable mRoom;
+    std::deque<Item> mItems;
+    size_t mPages = 0;
+    size_t mPeak = 0;
+    bool mFinished = false;
+};
+
+} // namespace
+
+int renderAvatars(LDAP *ld, ldapclient::SearchRequest request, const AvatarJobOptions &options,
+                  const AvatarSink &sink, AvatarJobStats *stats)
+{
+    auto start = Clock::now();
+    std::atomic<uint64_t> entries{0};
+    std::atomic<uint64_t> photos{0};
+    std::atomic<uint64_t> avatars{0};
+    std::atomic<uint64_t> undecodable{0};
+    Pipeline pipeline(options.maxPages);
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < std::max<size_t>(1, options.workers); ++i)
+    {
+        workers.emplace_back([&] {
+            Item item;
+            while (pipeline.take(item))
+            {
+                ++entries;
+                ldapclient::CompactResult::Entry entry = (*item.page)[item.index];
+                std::string_view photo = entry.value(options.photoAttribute);
+                cv::Mat image = photo.empty() ? cv::Mat() : decodePhoto(photo);
+                photos += !photo.empty();
+                undecodable += !photo.empty() && image.empty();
+                for (size_t s = 0; s < options.sizes.size() && !image.empty(); ++s)
+                {
+                    try
+                    {
+                        avatar::AvatarGenerator generator(image);
+                        sink(entry.dn(), options.sizes[s], generator.transformImage(options.sizes[s]));
+                        ++avatars;
+                    }
+                    catch (const cv::Exception &)
+                    {
+                        ++undecodable;
+                        break;
+                    }
+                }
+                item.page.reset(); // the last entry of a page makes room for the next
+            }
+        });
+    }
+
+    // Only the photo; the DN comes anyway
+    request.attributes = {options.photoAttribute};
+    ldapclient::PagedSearch search(ld, request, options.pageSize);
+    Clock::duration searching{0};
+    for (;;)
+    {
+        pipeline.waitForRoom();
+        auto page = std::make_unique<ldapclient::CompactResult>();
+        auto asked = Clock::now();
+        bool more = search.next(*page);
+        searching += Clock::now() - asked;
+        if (!more)
+        {
+            break;
+        }
+        pipeline.add(pipeline.hold(std::move(page)));
+    }
+    pipeline.finish();
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+
+    if (stats)
+    {
+        stats->entries = entries;
+        stats->photos = photos;
+        stats->avatars = avatars;
+        stats->undecodable = undecodable;
+        stats->pages = search.pages();
+        stats->peakPages = pipeline.peak();
+        stats->seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        stats->searchSeconds = std::chrono::duration<double>(searching).count();
+    }
+    return search.rc();
+}
+
+} // namespace photo
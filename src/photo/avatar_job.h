@@ -0,0 +1,48 @@
+#pragma once
+
+#include "../ldap/search.h"
+#include <algorithm>
+#include <functional>
+#include <opencv2/core.hpp>
+#include <string_view>
+#include <thread>
+
+namespace photo
+{
+
+struct AvatarJobOptions
+{
+    std::vector<int> sizes{32, 64, 128};
+    std::string photoAttribute = "thumbnailPhoto";
+    int pageSize = 200;
+    size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    // Pages fetched but not yet rendered; with pageSize this bounds the memory
+    // the job holds, and the search waits for the workers once it is reached
+    size_t maxPages = 4;
+};
+
+struct AvatarJobStats
+{
+    uint64_t entries = 0;
+    uint64_t photos = 0;     // entries with a photo
+    uint64_t avatars = 0;    // one per photo and size
+    uint64_t undecodable = 0;
+    uint64_t pages = 0;
+    size_t peakPages = 0;     // the most held at once
+    double seconds = 0;
+    double searchSeconds = 0; // waiting for the directory, the rest of the time overlaps with rendering
+};
+
+// Called on the worker threads, concurrently, for every avatar rendered. dn
+// points into the search result and lives as long as the call.
+using AvatarSink = std::function<void(std::string_view dn, int size, const cv::Mat &avatar)>;
+
+// Renders an avatar of every size for each entry request finds, e.g. a whole
+// OU. The calling thread pages through the search while a pool of workers
+// decodes and renders what has arrived, so the directory and the CPUs are busy
+// at the same time. Photos stay in the BER buffers of their page, which is
+// released once its last entry is done. Returns the search's result code.
+int renderAvatars(LDAP *ld, ldapclient::SearchRequest request, const AvatarJobOptions &options,
+                  const AvatarSink &sink, AvatarJobStats *stats = nullptr);
+
+} // namespace photo
@@ -0,0 +1,206 @@
+#include "photo_resolver.h"
+#include "../avatar.h"
+#include "../http/http_engine.h"
+#include "../ldap/connection_pool.h"
+#include "../ldap/search.h"
+#include <cctype>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <stdexcept>
+
+namespace photo
+{
+
+PhotoSource ldapPhotoSource(std::shared_ptr<ldapclient::LdapConnectionPool> pool, std::string userAttribute,
+                            std::string photoAttribute)
+{
+    auto fetch = [pool, userAttribute, photoAttribute](const std::string &user) -> std::optional<std::string> {
+        const LdapConfiguration &config = pool->config();
+        std::string filter = "(" + userAttribute + "=" + ldapclient::escapeFilterValue(user) + ")";
+        ldapclient::AttributeList attrs({photoAttribute});
+        std::optional<std::string> photo;
+        int result = pool->run([&](LDAP *ld) {
+            struct timeval timeOut = {10, 0};
+            LDAPMessage *res = NULL;
+            int rc = ldap_search_ext_s(ld, config.mSearchBase.c_str(), LDAP_SCOPE_SUBTREE, filter.c_str(), attrs.get(),
+                                       0, NULL, NULL, &timeOut, 1, &res);
+            LDAPMessage *entry = rc == LDAP_SUCCESS ? ldap_first_entry(ld, res) : NULL;
+            if (entry)
+            {
+                std::string value = ldapclient::decodeEntry(ld, entry).value(photoAttribute);
+                if (!value.empty())
+                {
+                    photo = std::move(value);
+                }
+            }
+            ldap_msgfree(res);
+            return rc;
+        });
+        if (result != LDAP_SUCCESS && result != LDAP_SIZELIMIT_EXCEEDED)
+        {
+            throw ldapclient::LdapError(result, "search " + filter);
+        }
+        return photo;
+    };
+    return PhotoSource{"ldap", fetch};
+}
+
+// Percent-encodes all but the unreserved characters of RFC 3986
+static std::string escapeUrlPath(const std::string &value)
+{
+    static const char HEX[] = "0123456789ABCDEF";
+    std::string escaped;
+    for (unsigned char c : value)
+    {
+        if (std::isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~')
+        {
+            escaped += char(c);
+        }
+        else
+        {
+            escaped += '%';
+            escaped += HEX[c >> 4];
+            escaped += HEX[c & 0xf];
+        }
+    }
+    return escaped;
+}
+
+PhotoSource httpPhotoSource(std::shared_ptr<http::HttpEngine> engine, std::string urlPattern)
+{
+    auto fetch = [engine, urlPattern](const std::string &user) -> std::optional<std::string> {
+        std::string url = urlPattern;
+        size_t placeholder = url.find("%s");
+        if (placeholder != std::string::npos)
+        {
+            url.replace(placeholder, 2, escapeUrlPath(user));
+        }
+        http::HttpResponse response = engine->submit(http::HttpRequest{url}).get();
+        if (response.ok())
+        {
+            return std::move(response.body);
+        }
+        if (response.curlCode == CURLE_OK && (response.status == 404 || response.status == 410))
+        {
+            return std::nullopt;
+        }
+        throw std::runtime_error("GET " + url + ": " +
+                                 (response.curlCode != CURLE_OK ? curl_easy_strerror(response.curlCode)
+                                                                : "status " + std::to_string(response.status)));
+    };
+    return PhotoSource{"http", fetch};
+}
+
+cv::Mat decodePhoto(std::string_view encoded)
+{
+    // imdecode only reads the buffer, so it needs no copy
+    cv::Mat buffer(1, int(encoded.size()), CV_8UC1, const_cast<char *>(encoded.data()));
+    cv::Mat image = encoded.empty() ? cv::Mat() : cv::imdecode(buffer, cv::IMREAD_UNCHANGED);
+    if (image.empty() || image.depth() != CV_8U)
+    {
+        return cv::Mat();
+    }
+    if (image.channels() == 1)
+    {
+        cv::cvtColor(image, image, cv::COLOR_GRAY2BGR);
+    }
+    return image;
+}
+
+PhotoResolver::PhotoResolver(std::vector<PhotoSource> sources, PhotoResolverOptions options)
+    : mSources(std::move(sources)), mOptions(options)
+{
+}
+
+PhotoResolver::Result PhotoResolver::resolve(const std::string &user)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    ++mStats.requests;
+    auto it = mInFlight.find(user);
+    if (it != mInFlight.end())
+    {
+        ++mStats.coalesced;
+        std::shared_future<Result> pending = it->second;
+        lock.unlock();
+        return pending.get();
+    }
+
+    ++mStats.fetches;
+    std::promise<Result> promise;
+    mInFlight.emplace(user, promise.get_future().share());
+    lock.unlock();
+
+    // fetch() only throws on something like bad_alloc, but the waiters must not hang
+    Result result;
+    std::exception_ptr error;
+    try
+    {
+        result = fetch(user);
+        promise.set_value(result);
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+        promise.set_exception(error);
+    }
+    lock.lock();
+    mInFlight.erase(user);
+    lock.unlock();
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+    return result;
+}
+
+PhotoResolver::Result PhotoResolver::fetch(const std::string &user) const
+{
+    auto resolved = std::make_shared<ResolvedPhoto>();
+    resolved->user = user;
+    for (const PhotoSource &source : mSources)
+    {
+        try
+        {
+            std::optional<std::string> photo = source.fetch(user);
+            if (photo)
+            {
+                resolved->source = source.name;
+                resolved->encoded = std::move(*photo);
+                break;
+            }
+        }
+        catch (const std::exception &e)
+        {
+            resolved->errors.push_back(source.name + ": " + e.what());
+        }
+    }
+    if (resolved->encoded.empty() || mOptions.avatarSize <= 0)
+    {
+        return resolved;
+    }
+
+    try
+    {
+        cv::Mat image = decodePhoto(resolved->encoded);
+        if (image.empty())
+        {
+            resolved->errors.push_back(resolved->source + ": not an 8-bit image");
+            return resolved;
+        }
+        avatar::AvatarGenerator generator(image);
+        resolved->avatar = generator.transformImage(mOptions.avatarSize);
+    }
+    catch (const cv::Exception &e)
+    {
+        resolved->errors.push_back(resolved->source + ": " + e.what());
+    }
+    return resolved;
+}
+
+PhotoResolverStats PhotoResolver::stats() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mStats;
+}
+
+} // namespace photo
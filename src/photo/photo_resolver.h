@@ -0,0 +1,104 @@
+#pragma once
+
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace http
+{
+class HttpEngine;
+}
+
+namespace ldapclient
+{
+class LdapConnectionPool;
+}
+
+namespace photo
+{
+
+// One place a user's photo can come from. fetch() returns the encoded image,
+// or nothing when this source has no photo of the user, and throws when it
+// cannot tell.
+struct PhotoSource
+{
+    std::string name;
+    std::function<std::optional<std::string>(const std::string &user)> fetch;
+};
+
+// The photo attribute of the entry whose userAttribute equals the user, under
+// the pool's search base
+PhotoSource ldapPhotoSource(std::shared_ptr<ldapclient::LdapConnectionPool> pool,
+                            std::string userAttribute = "uid", std::string photoAttribute = "thumbnailPhoto");
+// A GET of urlPattern with the user in place of its %s, e.g.
+// "http://cmbu-ad.cisco.com/photo/%s.jpg". 404 and 410 mean no photo.
+PhotoSource httpPhotoSource(std::shared_ptr<http::HttpEngine> engine, std::string urlPattern);
+
+// Decodes an encoded photo in place into what AvatarGenerator takes: 8-bit with
+// 3 or 4 channels, gray ones expanded. Empty when it does not decode.
+cv::Mat decodePhoto(std::string_view encoded);
+
+struct ResolvedPhoto
+{
+    std::string user;
+    std::string source;  // the one that had a photo; empty when none did
+    std::string encoded; // as fetched
+    cv::Mat avatar;      // from AvatarGenerator; empty when not asked for or not decodable
+    std::vector<std::string> errors; // "source: what" for every source that failed
+};
+
+struct PhotoResolverOptions
+{
+    // Side of the avatar made from the photo; 0 for none
+    int avatarSize = 64;
+};
+
+struct PhotoResolverStats
+{
+    uint64_t requests = 0;
+    uint64_t fetches = 0;   // resolutions that went to the sources
+    uint64_t coalesced = 0; // requests that joined one already under way
+};
+
+// Finds user photos, trying the sources in order of preference until one has
+// a photo, and makes an avatar of it. Requests for a user whose photo is being
+// resolved already wait for that resolution instead of starting their own, so
+// a crowd asking for one popular user costs a single fetch. Nothing is kept
+// once a resolution finishes; put an HttpCache behind the HTTP source for that.
+//
+//     PhotoResolver resolver({ldapPhotoSource(pool), httpPhotoSource(engine, url)});
+//     cv::Mat avatar = resolver.resolve("huiluo")->avatar;
+class PhotoResolver
+{
+  public:
+    using Result = std::shared_ptr<const ResolvedPhoto>;
+
+    explicit PhotoResolver(std::vector<PhotoSource> sources, PhotoResolverOptions options = PhotoResolverOptions());
+    PhotoResolver(const PhotoResolver &) = delete;
+    PhotoResolver &operator=(const PhotoResolver &) = delete;
+
+    // Thread-safe; blocks until the photo is resolved. Sources that fail end
+    // up in errors rather than thrown.
+    Result resolve(const std::string &user);
+
+    PhotoResolverStats stats() const;
+
+  private:
+    Result fetch(const std::string &user) const;
+
+    std::vector<PhotoSource> mSources;
+    PhotoResolverOptions mOptions;
+
+    mutable std::mutex mMutex;
+    std::unordered_map<std::string, std::shared_future<Result>> mInFlight;
+    PhotoResolverStats mStats;
+};
+
+} // namespace photo
@@ -0,0 +1,194 @@
+#include "avatar_job.h"
+#include "photo_resolver.h"
+#include "../ldap/connection_pool.h"
+#include "../ldap/fake_server.h"
+#include "../ldap/ldap_connection.h"
+#include "gtest/gtest.h"
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <opencv2/imgcodecs.hpp>
+#include <thread>
+
+namespace photo
+{
+
+static PhotoResolverOptions withoutAvatars()
+{
+    PhotoResolverOptions options;
+    options.avatarSize = 0;
+    return options;
+}
+
+TEST(photo, single_flight)
+{
+    std::mutex mutex;
+    std::condition_variable released;
+    bool open = false;
+    std::atomic<int> fetches{0};
+    PhotoSource slow{"slow", [&](const std::string &user) -> std::optional<std::string> {
+                         ++fetches;
+                         std::unique_lock<std::mutex> lock(mutex);
+                         released.wait(lock, [&open] { return open; });
+                         return "photo of " + user;
+                     }};
+    PhotoResolver resolver({slow}, withoutAvatars());
+
+    // Everyone asks while the first fetch is still under way
+    std::vector<PhotoResolver::Result> results(8);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        threads.emplace_back([&resolver, &results, i] { results[i] = resolver.resolve("presenter"); });
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (resolver.stats().requests < results.size() && std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        open = true;
+    }
+    released.notify_all();
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+
+    EXPECT_EQ(1, fetches.load());
+    ASSERT_TRUE(results[0]);
+    EXPECT_EQ("photo of presenter", results[0]->encoded);
+    for (const PhotoResolver::Result &result : results)
+    {
+        EXPECT_EQ(results[0], result);
+    }
+    PhotoResolverStats stats = resolver.stats();
+    EXPECT_EQ(8u, stats.requests);
+    EXPECT_EQ(1u, stats.fetches);
+    EXPECT_EQ(7u, stats.coalesced);
+
+    // Nothing is kept once it is done
+    resolver.resolve("presenter");
+    EXPECT_EQ(2, fetches.load());
+}
+
+TEST(photo, source_fallback)
+{
+    PhotoSource broken{"ldap", [](const std::string &) -> std::optional<std::string> {
+                           throw std::runtime_error("server down");
+                       }};
+    PhotoSource partial{"http", [](const std::string &user) -> std::optional<std::string> {
+                            if (user == "ada")
+                            {
+                                return std::string("ada.jpg");
+                            }
+                            return std::nullopt;
+                        }};
+    PhotoResolver resolver({broken, partial}, withoutAvatars());
+
+    PhotoResolver::Result ada = resolver.resolve("ada");
+    EXPECT_EQ("http", ada->source);
+    EXPECT_EQ("ada.jpg", ada->encoded);
+    EXPECT_EQ(std::vector<std::string>{"ldap: server down"}, ada->errors);
+
+    PhotoResolver::Result nobody = resolver.resolve("nobody");
+    EXPECT_EQ("", nobody->source);
+    EXPECT_EQ("", nobody->encoded);
+}
+
+TEST(photo, ldap_source)
+{
+    ldapclient::FakeDirectoryOptions directory;
+    directory.people = 10;
+    directory.photoBytes = 300;
+    ldapclient::FakeLdapServer server(ldapclient::generateDirectory(directory));
+    PhotoSource source = ldapPhotoSource(std::make_shared<ldapclient::LdapConnectionPool>(server.config()));
+
+    std::optional<std::string> photo = source.fetch("user3");
+    ASSERT_TRUE(photo);
+    EXPECT_EQ(300u, photo->size());
+    EXPECT_EQ('\xff', photo->at(0));
+    EXPECT_FALSE(source.fetch("nobody"));
+    EXPECT_FALSE(source.fetch("*")); // an assertion value, not a wildcard
+}
+
+TEST(photo, avatar)
+{
+    cv::Mat portrait(120, 80, CV_8UC3, cv::Scalar(40, 120, 200));
+    std::vector<uchar> png;
+    ASSERT_TRUE(cv::imencode(".png", portrait, png));
+    PhotoSource source{"http", [&png](const std::string &) -> std::optional<std::string> {
+                           return std::string(png.begin(), png.end());
+                       }};
+    PhotoResolverOptions options;
+    options.avatarSize = 32;
+    PhotoResolver::Result result = PhotoResolver({source}, options).resolve("ada");
+    EXPECT_TRUE(result->errors.empty());
+    EXPECT_EQ(32, result->avatar.rows);
+    EXPECT_EQ(32, result->avatar.cols);
+    EXPECT_EQ(CV_8UC4, result->avatar.type());
+
+    // A photo that does not decode is still returned, without an avatar
+    PhotoSource garbage{"ldap", [](const std::string &) -> std::optional<std::string> { return "not an image"; }};
+    PhotoResolver::Result broken = PhotoResolver({garbage}, options).resolve("ada");
+    EXPECT_EQ("not an image", broken->encoded);
+    EXPECT_TRUE(broken->avatar.empty());
+    EXPECT_EQ(1u, broken->errors.size());
+}
+
+TEST(photo, avatar_job)
+{
+    cv::Mat portrait(120, 80, CV_8UC3, cv::Scalar(40, 120, 200));
+    std::vector<uchar> png;
+    ASSERT_TRUE(cv::imencode(".png", portrait, png));
+
+    // user0 has no photo and user1 one that does not decode
+    ldapclient::FakeDirectoryOptions people;
+    people.people = 25;
+    std::vector<ldapclient::FakeEntry> entries = ldapclient::generateDirectory(people);
+    for (ldapclient::FakeEntry &entry : entries)
+    {
+        if (entry.dn.compare(0, 4, "uid=") == 0 && entry.dn.compare(0, 10, "uid=user0,") != 0)
+        {
+            std::string photo = entry.dn.compare(0, 10, "uid=user1,") == 0 ? "garbage" : std::string(png.begin(), png.end());
+            entry.attributes.push_back({"thumbnailPhoto", {photo}});
+        }
+    }
+    ldapclient::FakeLdapServer server(entries);
+    ldapclient::LdapConnection connection(server.config());
+
+    ldapclient::SearchRequest request;
+    request.base = "ou=people,dc=example,dc=com";
+    request.scope = LDAP_SCOPE_ONELEVEL;
+    request.filter = "(objectClass=person)";
+    AvatarJobOptions options;
+    options.sizes = {16, 32};
+    options.pageSize = 2;
+    options.workers = 3;
+    options.maxPages = 2;
+
+    std::mutex mutex;
+    std::map<std::string, std::vector<int>> rendered;
+    AvatarSink sink = [&](std::string_view dn, int size, const cv::Mat &avatar) {
+        EXPECT_EQ(size, avatar.rows);
+        EXPECT_EQ(CV_8UC4, avatar.type());
+        std::lock_guard<std::mutex> lock(mutex);
+        rendered[std::string(dn)].push_back(size);
+    };
+    AvatarJobStats stats;
+    ASSERT_EQ(LDAP_SUCCESS, renderAvatars(connection.get(), request, options, sink, &stats));
+
+    EXPECT_EQ(25u, stats.entries);
+    EXPECT_EQ(24u, stats.photos);
+    EXPECT_EQ(1u, stats.undecodable);
+    EXPECT_EQ(46u, stats.avatars);
+    EXPECT_EQ(13u, stats.pages);
+    EXPECT_LE(stats.peakPages, options.maxPages);
+    EXPECT_EQ(23u, rendered.size());
+    EXPECT_EQ(0u, rendered.count("uid=user1,ou=people,dc=example,dc=com"));
+    EXPECT_EQ(2u, rendered["uid=user24,ou=people,dc=example,dc=com"].size());
+    EXPECT_TRUE(connection.healthy());
+}
+
+} // namespace photo
@@ -0,0 +1,162 @@
+#include "yaml_stream.h"
+#include "yaml-cpp/eventhandler.h"
+#include <map>
+#include <vector>
+
+namespace
+{
+
+// Builds the element being read from the events of the parser. Levels are the
+// collections open around the current event; the first is the top-level
+// sequence, which is never built.
+class ElementBuilder : public YAML::EventHandler
+{
+  public:
+    explicit ElementBuilder(const std::function<void(const YAML::Node &)> &visit) : mVisit(visit) {}
+
+    size_t elements() const { return mElements; }
+
+    void OnDocumentStart(const YAML::Mark &) override {}
+    void OnDocumentEnd() override {}
+
+    void OnNull(const YAML::Mark &mark, YAML::anchor_t anchor) override
+    {
+        if (mLevels.empty())
+        {
+            return; // an empty document
+        }
+        add(YAML::Node(YAML::NodeType::Null), anchor, mark);
+    }
+
+    // Aliases are copies of what they refer to, which decodes the same
+    void OnAlias(const YAML::Mark &mark, YAML::anchor_t anchor) override
+    {
+        auto found = mAnchors.find(anchor);
+        if (found == mAnchors.end())
+        {
+            throw YAML::ParserException(mark, "unknown anchor");
+        }
+        add(YAML::Clone(found->second), YAML::NullAnchor, mark);
+    }
+
+    void OnScalar(const YAML::Mark &mark, const std::string &tag, YAML::anchor_t anchor,
+                  const std::string &value) override
+    {
+        YAML::Node node(value);
+        node.SetTag(tag);
+        add(node, anchor, mark);
+    }
+
+    void OnSequenceStart(const YAML::Mark &mark, const std::string &tag, YAML::anchor_t anchor,
+                         YAML::EmitterStyle::value) override
+    {
+        open(YAML::NodeType::Sequence, tag, anchor, mark);
+    }
+
+    void OnSequenceEnd() override { close(); }
+
+    void OnMapStart(const YAML::Mark &mark, const std::string &tag, YAML::anchor_t anchor,
+                    YAML::EmitterStyle::value) override
+    {
+        open(YAML::NodeType::Map, tag, anchor, mark);
+    }
+
+    void OnMapEnd() override { close(); }
+
+  private:
+    struct Level
+    {
+        YAML::Node node;
+        YAML::anchor_t anchor;
+        YAML::Mark mark;
+        YAML::Node key; // of a map, while its value is read
+        bool keyed = false;
+    };
+
+    void open(YAML::NodeType::value type, const std::string &tag, YAML::anchor_t anchor, const YAML::Mark &mark)
+    {
+        if (mLevels.empty() && type != YAML::NodeType::Sequence)
+        {
+            throw YAML::ParserException(mark, "expected a sequence at the top level");
+        }
+        YAML::Node node(type);
+        node.SetTag(tag);
+        mLevels.push_back(Level{node, anchor, mark, YAML::Node(), false});
+    }
+
+    void close()
+    {
+        Level level = std::move(mLevels.back());
+        mLevels.pop_back();
+        if (!mLevels.empty())
+        {
+            add(level.node, level.anchor, level.mark);
+        }
+    }
+
+    void add(const YAML::Node &node, YAML::anchor_t anchor, const YAML::Mark &mark)
+    {
+        if (mLevels.empty())
+        {
+            throw YAML::ParserException(mark, "expected a sequence at the top level");
+        }
+        if (anchor != YAML::NullAnchor)
+        {
+            // A copy, as the node itself would keep its whole element alive
+            mAnchors[anchor].reset(YAML::Clone(node));
+        }
+        Level &parent = mLevels.back();
+        if (mLevels.size() == 1)
+        {
+            visit(node, mark);
+        }
+        else if (parent.node.IsSequence())
+        {
+            parent.node.push_back(node);
+        }
+        else if (!parent.keyed)
+        {
+            parent.key.reset(node);
+            parent.keyed = true;
+        }
+        else
+        {
+            parent.node.force_insert(parent.key, node);
+            parent.key.reset();
+            parent.keyed = false;
+        }
+    }
+
+    void visit(const YAML::Node &element, const YAML::Mark &mark)
+    {
+        try
+        {
+            mVisit(element);
+        }
+        catch (const YAML::BadConversion &e)
+        {
+            // Built nodes carry no mark, so point at where the element started
+            if (!e.mark.is_null())
+            {
+                throw;
+            }
+            throw YAML::BadConversion(mark);
+        }
+        ++mElements;
+    }
+
+    const std::function<void(const YAML::Node &)> &mVisit;
+    std::vector<Level> mLevels;
+    std::map<YAML::anchor_t, YAML::Node> mAnchors;
+    size_t mElements = 0;
+};
+
+} // namespace
+
+size_t forEachYamlElement(std::istream &in, const std::function<void(const YAML::Node &element)> &visit)
+{
+    YAML::Parser parser(in);
+    ElementBuilder builder(visit);
+    parser.HandleNextDocument(builder);
+    return builder.elements();
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "yaml-cpp/yaml.h"
+#include <functional>
+#include <istream>
+#include <utility>
+
+// Reads a YAML document whose top level is a sequence one element at a time.
+// YAML::Load() builds the node tree of the whole document before anything can
+// be decoded, so a large inventory costs its whole tree in memory; here the
+// events of yaml-cpp's parser are assembled into a Node for the element being
+// read, which is handed to visit and dropped before the next is read. Memory
+// stays at one element, and at copies of the anchored nodes aliases may refer to.
+// An empty or null document has no elements; any other top level than a
+// sequence throws YAML::ParserException. Returns how many elements there were.
+size_t forEachYamlElement(std::istream &in, const std::function<void(const YAML::Node &element)> &visit);
+
+// Decodes each element with YAML::convert<T> as it is read:
+//
+//     std::ifstream in("./data/monsters.yaml");
+//     loadYamlSequence<Monster>(in, [&](Monster &&monster) { ... });
+//
+// An element that does not convert throws YAML::BadConversion at its line.
+template <typename T, typename Visit> size_t loadYamlSequence(std::istream &in, Visit &&visit)
+{
+    return forEachYamlElement(in, [&visit](const YAML::Node &element) { visit(element.as<T>()); });
+}
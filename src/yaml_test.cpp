@@ -1,6 +1,10 @@
 #include "rang.hpp"
+#include "yaml_stream.h"
 #include "yaml-cpp/yaml.h"
 #include "gtest/gtest.h"
+#include <chrono>
+#include <fstream>
+#include <sstream>
 
 TEST(yaml, simple)
 {
@@ -71,9 +75,10 @@ template <> struct convert<Monster>
         rhs.position = node["position"].as<Vec3>();
         rhs.name = node["name"].as<std::string>();
         const YAML::Node &powers = node["powers"];
-        for (unsigned i = 0; i < powers.size(); i++)
+        rhs.powers.reserve(powers.size());
+        for (const YAML::Node &power : powers)
         {
-            rhs.powers.emplace_back(powers[i].as<Power>());
+            rhs.powers.emplace_back(power.as<Power>());
         }
         return true;
     }
@@ -94,3 +99,94 @@ TEST(yaml, read_config_file)
                   << rang::style::reset << '\n';
     }
 }
+
+TEST(yaml, stream_sequence)
+{
+    std::vector<Monster> loaded = YAML::LoadFile("./data/monsters.yaml").as<std::vector<Monster>>();
+    std::ifstream in("./data/monsters.yaml");
+    std::vector<Monster> streamed;
+    EXPECT_EQ(loaded.size(), loadYamlSequence<Monster>(in, [&](Monster &&monster) {
+                  streamed.push_back(std::move(monster));
+              }));
+    ASSERT_EQ(loaded.size(), streamed.size());
+    for (size_t i = 0; i < loaded.size(); ++i)
+    {
+        EXPECT_EQ(loaded[i].name, streamed[i].name);
+        EXPECT_EQ(loaded[i].position.z, streamed[i].position.z);
+        ASSERT_EQ(loaded[i].powers.size(), streamed[i].powers.size());
+        for (size_t j = 0; j < loaded[i].powers.size(); ++j)
+        {
+            EXPECT_EQ(loaded[i].powers[j].name, streamed[i].powers[j].name);
+            EXPECT_EQ(loaded[i].powers[j].damage, streamed[i].powers[j].damage);
+        }
+    }
+
+    // Anchors hold across elements, and flow collections read like block ones
+    std::istringstream aliased("- &ogre {name: Ogre, position: [0, 5, 0], powers: &club [{name: Club, damage: 10}]}\n"
+                               "- name: Ogre Mage\n"
+                               "  position: [1, 2, 3]\n"
+                               "  powers: *club\n");
+    streamed.clear();
+    EXPECT_EQ(2u, loadYamlSequence<Monster>(aliased, [&](Monster &&monster) { streamed.push_back(std::move(monster)); }));
+    ASSERT_EQ(2u, streamed.size());
+    EXPECT_EQ("Ogre Mage", streamed[1].name);
+    ASSERT_EQ(1u, streamed[1].powers.size());
+    EXPECT_EQ("Club", streamed[1].powers[0].name);
+    EXPECT_EQ(10, streamed[1].powers[0].damage);
+
+    // A bad element is reported at its line, after the ones before it
+    std::istringstream bad("- {name: Ogre, position: [0, 5, 0], powers: []}\n"
+                           "- {name: Dragon, position: [1, 2], powers: []}\n");
+    streamed.clear();
+    try
+    {
+        loadYamlSequence<Monster>(bad, [&](Monster &&monster) { streamed.push_back(std::move(monster)); });
+        FAIL();
+    }
+    catch (const YAML::BadConversion &e)
+    {
+        EXPECT_EQ(1, e.mark.line);
+    }
+    EXPECT_EQ(1u, streamed.size());
+
+    std::istringstream empty("");
+    EXPECT_EQ(0u, forEachYamlElement(empty, [](const YAML::Node &) { FAIL(); }));
+    std::istringstream map("name: Ogre\n");
+    EXPECT_THROW(forEachYamlElement(map, [](const YAML::Node &) {}), YAML::ParserException);
+}
+
+TEST(yaml, stream_large)
+{
+    std::string yaml;
+    for (int i = 0; i < 20000; ++i)
+    {
+        yaml += "- name: Monster" + std::to_string(i) + "\n"
+                "  position: [" + std::to_string(i) + ", 1.5, -2]\n"
+                "  powers:\n"
+                "    - name: Claw\n"
+                "      damage: " + std::to_string(i % 100) + "\n"
+                "    - name: Bite\n"
+                "      damage: 7\n";
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Monster> loaded = YAML::Load(yaml).as<std::vector<Monster>>();
+    auto loading = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+
+    start = std::chrono::steady_clock::now();
+    std::istringstream in(yaml);
+    size_t damage = 0;
+    Monster last;
+    size_t count = loadYamlSequence<Monster>(in, [&](Monster &&monster) {
+        damage += monster.powers[0].damage;
+        last = std::move(monster);
+    });
+    auto streaming = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+    std::cout << "20000 monsters: " << loading.count() << " seconds loaded, " << streaming.count() << " streamed\n";
+
+    EXPECT_EQ(loaded.size(), count);
+    EXPECT_EQ(20000u * 99 / 2, damage);
+    EXPECT_EQ("Monster19999", last.name);
+    EXPECT_EQ(19999, last.position.x);
+    EXPECT_EQ(2u, last.powers.size());
+}